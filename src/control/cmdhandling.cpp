@@ -29,6 +29,7 @@
 #include "mediarecv.h"
 #include "config.h"
 #include "main.h"
+#include "orders.h"
 
 static std::map<StatusCode, VLString> TickerStatusCodeText =
 														{
@@ -48,6 +49,8 @@ static void ProcessNodeChange(Conation::ConationStream *Stream);
 static void AddNodeCommandStatusReport(Conation::ConationStream *Stream);
 static void AddServerCommandStatusReport(Conation::ConationStream *Stream);
 static void ProcessJobsList(Conation::ConationStream *Stream);
+static void ProcessVaultChunk(Conation::ConationStream *Stream);
+static void ProcessFetchChunk(Conation::ConationStream *Stream);
 
 void CmdHandling::HandleReport(Conation::ConationStream *Stream)
 {
@@ -73,12 +76,12 @@ void CmdHandling::HandleReport(Conation::ConationStream *Stream)
 		case CMDCODE_A2C_KILLPROCESS:
 		case CMDCODE_A2C_SLEEP:
 		case CMDCODE_A2C_MOD_EXECFUNC:
-		case CMDCODE_A2C_MOD_LOADSCRIPT:
 		case CMDCODE_A2C_MOD_UNLOADSCRIPT:
 		case CMDCODE_A2C_MOD_GENRESP:
 		case CMDCODE_B2C_KILLJOBBYCMDCODE:
 		case CMDCODE_B2C_KILLJOBID:
 		case CMDCODE_A2C_LISTDIRECTORY:
+		case CMDCODE_A2C_FILES_HASHTREE:
 		{
 #ifdef DEBUG
 			puts(VLString("CmdHandling::HandleReport(): Processing node report with command code ") + CommandCodeToString(Hdr.CmdCode)
@@ -87,6 +90,10 @@ void CmdHandling::HandleReport(Conation::ConationStream *Stream)
 			AddNodeCommandStatusReport(Stream);
 			break;
 		}
+		case CMDCODE_A2C_MOD_LOADSCRIPT:
+			if (Orders::ResendMissingScript(Stream)) break;
+			AddNodeCommandStatusReport(Stream);
+			break;
 		case CMDCODE_B2C_USEUPDATE:
 		case CMDCODE_A2S_FORGETNODE:
 		case CMDCODE_A2S_PROVIDEUPDATE:
@@ -108,6 +115,8 @@ void CmdHandling::HandleReport(Conation::ConationStream *Stream)
 		case CMDCODE_A2S_SRVLOG_SIZE:
 		case CMDCODE_A2S_SRVLOG_TAIL:
 		case CMDCODE_A2S_SRVLOG_WIPE:
+		case CMDCODE_A2S_SRVLOG_QUERY:
+		case CMDCODE_A2S_TELEMETRY:
 		case CMDCODE_A2S_ROUTINE_ADD:
 		case CMDCODE_A2S_ROUTINE_DEL:
 		case CMDCODE_A2S_ROUTINE_LIST:
@@ -119,6 +128,24 @@ void CmdHandling::HandleReport(Conation::ConationStream *Stream)
 		case CMDCODE_B2C_GETJOBSLIST:
 			ProcessJobsList(Stream);
 			break;
+		case CMDCODE_B2S_VAULT_GETCHUNK:
+			ProcessVaultChunk(Stream);
+			break;
+		case CMDCODE_B2S_VAULT_PUTCHUNK:
+			if (Orders::ContinueVaultUpload(Stream)) break;
+			AddServerCommandStatusReport(Stream);
+			break;
+		case CMDCODE_A2C_FILES_FETCHCHUNK:
+			ProcessFetchChunk(Stream);
+			break;
+		case CMDCODE_A2C_FILES_PLACECHUNK:
+			if (Orders::ContinueChunkedUpload(Stream)) break;
+			AddNodeCommandStatusReport(Stream);
+			break;
+		case CMDCODE_A2C_FILES_SYNC:
+			if (Orders::ContinueDirectorySync(Stream)) break;
+			AddNodeCommandStatusReport(Stream);
+			break;
 		default:
 			break;
 	}
@@ -160,7 +187,12 @@ static void ProcessJobsList(Conation::ConationStream *Stream)
 	
 	const Conation::ConationStream::ODHeader &ODObj = Stream->Pop_ODHeader();
 	
-	const size_t NumArgs = Stream->CountArguments() - 1; //Minus 1 for the ODHeader.
+	VLScopedPtr<std::vector<Conation::ArgType>* > ArgTypes { Stream->GetArgTypes() };
+	
+	//Newer nodes tack their worker pool counters on the end as a string.
+	const bool HasPoolStats = ArgTypes && !ArgTypes->empty() && ArgTypes->back() == Conation::ARGTYPE_STRING;
+	
+	const size_t NumArgs = Stream->CountArguments() - 1 - HasPoolStats; //Minus 1 for the ODHeader.
 	
 	const size_t NumPieces = 3;
 	
@@ -186,11 +218,106 @@ static void ProcessJobsList(Conation::ConationStream *Stream)
 						+ ", flags: " + Utils::ToBinaryString(Conation::GetIdentFlags(Ident)) + '\n';
 		Msg += "----\n";
 	}
+	
+	if (HasPoolStats) Msg += Stream->Pop_String();
 
 	Ticker::AddNodeMessage(ODObj.Origin, Hdr.CmdCode, Hdr.CmdIdent, 
 							VLString("Received jobs report from node. ") + VLString::UintToString(NumArgs / NumPieces) + " running.", Msg);
 }
 
+static void ProcessVaultChunk(Conation::ConationStream *Stream)
+{ //Writes the chunk where it belongs and asks for the next one, so a whole download only needs the one order.
+	if (!Stream->VerifyArgTypes({Conation::ARGTYPE_FILE, Conation::ARGTYPE_UINT64, Conation::ARGTYPE_UINT64}))
+	{ //Probably a failure status, let the generic handler display it.
+		AddServerCommandStatusReport(Stream);
+		return;
+	}
+	
+	const Conation::ConationStream::FileArg &File = Stream->Pop_File();
+	const uint64_t Offset = Stream->Pop_Uint64();
+	const uint64_t TotalSize = Stream->Pop_Uint64();
+	
+	if (!MediaRecv::ReceiveFileChunk(File.Filename, File.Data, File.DataSize, Offset))
+	{
+		Ticker::AddServerMessage(VLString("Failed to save chunk of vault item \"") + File.Filename + "\" at offset " + VLString::UintToString(Offset) + '.',
+								VLString("Resume the download from offset ") + VLString::UintToString(Offset) + " once the problem is fixed.");
+		return;
+	}
+	
+	const uint64_t Received = Offset + File.DataSize;
+	
+	if (Received >= TotalSize || !File.DataSize)
+	{
+		Ticker::AddServerMessage(VLString("Received vault item \"") + File.Filename + "\" from server, saved locally.",
+								VLString("File saved to directory ") + Config::GetKey("DownloadDirectory"));
+		return;
+	}
+	
+	Conation::ConationStream *Next = new Conation::ConationStream(CMDCODE_B2S_VAULT_GETCHUNK, 0, Stream->GetCmdIdentOnly());
+	
+	Next->Push_String(File.Filename);
+	Next->Push_Uint64(Received);
+	Next->Push_Uint32(File.DataSize);
+	
+	Main::GetWriteQueue().Push(Next);
+}
+
+static void ProcessFetchChunk(Conation::ConationStream *Stream)
+{ //The node pushes chunks at us on its own, we just put them where they go and check the hash at the end.
+	if (Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER, Conation::ARGTYPE_FILE, Conation::ARGTYPE_UINT64, Conation::ARGTYPE_UINT64}))
+	{
+		const Conation::ConationStream::ODHeader &Hdr = Stream->Pop_ODHeader();
+		const Conation::ConationStream::FileArg &File = Stream->Pop_File();
+		const uint64_t Offset = Stream->Pop_Uint64();
+		
+		if (!MediaRecv::ReceiveFileChunk(File.Filename, File.Data, File.DataSize, Offset))
+		{
+			Ticker::AddNodeMessage(Hdr.Origin, Stream->GetCommandCode(), Stream->GetCmdIdentOnly(),
+									VLString("Failed to save chunk of \"") + File.Filename + "\" at offset " + VLString::UintToString(Offset) + '.',
+									VLString("Resume the download from offset ") + VLString::UintToString(Offset) + " once the problem is fixed.");
+		}
+		return;
+	}
+	
+	if (!Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER, Conation::ARGTYPE_FILEPATH, Conation::ARGTYPE_UINT64, Conation::ARGTYPE_STRING, Conation::ARGTYPE_NETCMDSTATUS}))
+	{ //Failure status, with or without the path.
+		AddNodeCommandStatusReport(Stream);
+		return;
+	}
+	
+	const Conation::ConationStream::ODHeader &Hdr = Stream->Pop_ODHeader();
+	const VLString &Path = Stream->Pop_FilePath();
+	const uint64_t TotalSize = Stream->Pop_Uint64();
+	const VLString &RemoteHash = Stream->Pop_String();
+	
+	const VLString &Filename = Utils::StripPathFromFilename(Path);
+	const VLString &LocalPath = Config::GetKey("DownloadDirectory") + PATH_DIVIDER + Filename;
+	
+	if (!TotalSize)
+	{ //No chunks came for an empty file, so make it ourselves.
+		MediaRecv::ReceiveFileChunk(Filename, "", 0, 0);
+		
+		Ticker::AddNodeMessage(Hdr.Origin, Stream->GetCommandCode(), Stream->GetCmdIdentOnly(),
+								VLString("Received empty file \"") + Filename + "\" from node, saved locally.", LocalPath);
+		return;
+	}
+	
+	uint64_t LocalSize = 0;
+	
+	if (!Utils::GetFileSize(LocalPath, &LocalSize) || LocalSize != TotalSize || Utils::GetFileSha512(LocalPath) != RemoteHash)
+	{
+		Ticker::AddNodeMessage(Hdr.Origin, Stream->GetCommandCode(), Stream->GetCmdIdentOnly(),
+								VLString("<span foreground=\"#dd0000\">Download of \"") + Filename + "\" failed verification.</span>",
+								VLString("Local copy at ") + LocalPath + " doesn't match the node's SHA-512 of " + RemoteHash
+								+ "\nExpected " + VLString::UintToString(TotalSize) + " bytes, have " + VLString::UintToString(LocalSize) + ". Fetch it again from offset zero.");
+		return;
+	}
+	
+	Ticker::AddNodeMessage(Hdr.Origin, Stream->GetCommandCode(), Stream->GetCmdIdentOnly(),
+							VLString("Received file \"") + Filename + "\" from node in chunks, SHA-512 verified.",
+							VLString("File saved to directory ") + Config::GetKey("DownloadDirectory") + "\nSHA-512: " + RemoteHash);
+}
+
 static void ProcessNodeChange(Conation::ConationStream *Stream)
 {
 #ifdef DEBUG
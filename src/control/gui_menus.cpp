@@ -61,8 +61,12 @@ NodeMenuSpecsStruct NodeMenuSpecs[] =
 		{ "Copy files on host", CMDCODE_A2C_FILES_COPY },
 		{ "Move files on host", CMDCODE_A2C_FILES_MOVE },
 		{ "Upload files to host", CMDCODE_A2C_FILES_PLACE },
+		{ "Upload files to host in chunks", CMDCODE_A2C_FILES_PLACECHUNK },
 		{ "Download files from host", CMDCODE_A2C_FILES_FETCH },
+		{ "Download file from host in chunks", CMDCODE_A2C_FILES_FETCHCHUNK },
 		{ "List directory on host", CMDCODE_A2C_LISTDIRECTORY },
+		{ "Hash directory tree on host", CMDCODE_A2C_FILES_HASHTREE },
+		{ "Sync directory to host", CMDCODE_A2C_FILES_SYNC },
 		{ },
 		{ "~Jobs" },
 		{ "Get running jobs", CMDCODE_B2C_GETJOBSLIST },
@@ -87,7 +91,9 @@ ServerMenuSpecsStruct ServerMenuSpecs[] =
 		{ },
 		{ "~Vault" },
 		{ "Download from vault", CMDCODE_B2S_VAULT_FETCH },
+		{ "Download from vault in chunks", CMDCODE_B2S_VAULT_GETCHUNK },
 		{ "Add new item to vault", CMDCODE_B2S_VAULT_ADD },
+		{ "Add or update vault item in chunks", CMDCODE_B2S_VAULT_PUTCHUNK },
 		{ "Update item in vault", CMDCODE_B2S_VAULT_UPDATE },
 		{ "Delete item from vault", CMDCODE_B2S_VAULT_DROP },
 		{ "List vault contents", CMDCODE_A2S_VAULT_LIST },
@@ -106,9 +112,13 @@ ServerMenuSpecsStruct ServerMenuSpecs[] =
 		{ },
 		{ "~Logs" },
 		{ "Tail log", CMDCODE_A2S_SRVLOG_TAIL },
+		{ "Query log", CMDCODE_A2S_SRVLOG_QUERY },
 		{ "Get log size", CMDCODE_A2S_SRVLOG_SIZE },
 		{ "Delete log", CMDCODE_A2S_SRVLOG_WIPE },
 		{ },
+		{ "~Telemetry" },
+		{ "Node health summary", CMDCODE_A2S_TELEMETRY },
+		{ },
 		{ "~Routines" },
 		{ "Create routine", CMDCODE_A2S_ROUTINE_ADD, true },
 		{ "Delete routine", CMDCODE_A2S_ROUTINE_DEL },
@@ -268,7 +278,7 @@ static bool PopulateMWScriptSubmenu(GtkWidget *Menu)
 	{
 		ScriptScanner::ScriptInfo *Info = Iter->second;
 		
-		GtkWidget *TopItem = gtk_menu_item_new_with_label(VLString("Script ") + Info->ScriptName + ", \"" + Info->ScriptDescription + "\"");
+		GtkWidget *TopItem = gtk_menu_item_new_with_label(VLString("Script ") + Info->ScriptName + ", \"" + Info->ScriptDescription + "\"" + (Info->Resident ? " (resident)" : ""));
 		
 		GtkWidget *Submenu = gtk_menu_new();
 		
@@ -28,3 +28,16 @@ bool MediaRecv::ReceiveFile(const char *Filename, const void *Data, const size_t
 
 	return Utils::WriteFile(OutPath, Data, DataSize);
 }
+
+bool MediaRecv::ReceiveFileChunk(const char *Filename, const void *Data, const size_t DataSize, const uint64_t Offset)
+{ //Offset zero truncates, anything else gets written in place so interrupted downloads can pick back up.
+	VLString OutPath = Config::GetKey("DownloadDirectory") + PATH_DIVIDER + Filename;
+	
+	VLScopedPtr<FILE*, int(*)(FILE*)> Desc { fopen(OutPath, Offset ? "r+b" : "wb"), fclose };
+	
+	if (!Desc) return false;
+	
+	if (fseeko(Desc, Offset, SEEK_SET) != 0) return false;
+	
+	return fwrite(Data, 1, DataSize, Desc) == DataSize;
+}
@@ -23,5 +23,6 @@
 namespace MediaRecv
 {
 	bool ReceiveFile(const char *Filename, const void *Data, const size_t DataSize);
+	bool ReceiveFileChunk(const char *Filename, const void *Data, const size_t DataSize, const uint64_t Offset);
 }
 #endif //VL_CTL_MEDIARECV_H
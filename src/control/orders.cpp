@@ -19,6 +19,7 @@
 #include "../libvolition/include/common.h"
 #include "../libvolition/include/conation.h"
 #include "../libvolition/include/utils.h"
+#include "../libvolition/include/vlthreads.h"
 #include "orders.h"
 #include "gui_dialogs.h"
 #include "gui_base.h"
@@ -28,8 +29,57 @@
 #include "ticker.h"
 #include "scriptscanner.h"
 
+#include <map>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define PLACECHUNK_DEFAULT_SIZE (1024 * 1024)
+
 //Types
 
+struct ChunkedUpload
+{ //We feed the node one chunk at a time, going by the missing ranges it reports back.
+	VLString LocalPath;
+	uint64_t TotalSize;
+	VLString Hash;
+	size_t ChunkSize;
+};
+
+struct VaultUpload
+{ //Same idea for the server's vault, except it tells us how much it's got instead of what's missing.
+	VLString Key;
+	VLString LocalPath;
+	uint64_t TotalSize;
+	size_t ChunkSize;
+	bool Started; //False while we're still asking whether there's an earlier attempt to pick up from.
+};
+
+struct PendingSync
+{ //Waiting on the node to tell us which files it needs.
+	VLString LocalDir;
+	size_t ChunkSize;
+};
+
+struct LocalHash
+{ //Syncing the same tree to a few hundred nodes shouldn't mean hashing it a few hundred times.
+	uint64_t Size;
+	int64_t ModTime;
+	VLString Digest;
+};
+
+struct ManifestJob
+{ //Walking and hashing a big tree takes a while, so it's done off the GTK thread.
+	VLString NodeID;
+	uint64_t Ident;
+	VLString LocalDir;
+	VLString DestDir;
+	bool DeleteExtras;
+	VLString Manifest;
+	bool Built;
+	VLScopedPtr<VLThreads::Thread*> Worker;
+};
+
 struct DialogEntry
 {
 	GuiDialogs::DialogType DialogType;
@@ -80,19 +130,43 @@ const DialogSpecStruct DialogCommandMap[] =
 	{ //At the time of writing this, I have no idea how C++11's std::vector initializer lists work. :^S
 		{ CMDCODE_INVALID, DialogSpecStruct::FLAG_NONE,					{ DialogEntry(GuiDialogs::DIALOG_ARGSELECTOR, Conation::ARGTYPE_ANY, "Build stream", "Specify the arguments for the stream.", ADF_CHG_CMDCODE | ADF_WIPE_ARGS) } },
 		{ CMDCODE_A2C_CHDIR, DialogSpecStruct::FLAG_NONE,				{ DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_FILEPATH, "Enter new working directory", "Enter new working directory path.") } },
-		{ CMDCODE_A2C_EXECCMD, DialogSpecStruct::FLAG_NONE,				{ DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_STRING, "Specify command", "Specify the command for node execution.") } },
+		{ CMDCODE_A2C_EXECCMD, DialogSpecStruct::FLAG_NONE,				{ DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_STRING, "Specify command", "Specify the command for node execution."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_UINT32, "Enter timeout", "Enter a timeout in seconds, after which the command is killed.\nZero waits forever."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_UINT64, "Enter output limit", "Enter the most output to keep, in bytes. Zero uses the node's default.") } },
 		{ CMDCODE_A2C_FILES_COPY, DialogSpecStruct::FLAG_NONE,			{ DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_FILEPATH, "Specify source", "Specify source for copy operation."),
 																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_FILEPATH, "Specify destination", "Specify destination for copy operation.") } },
 		{ CMDCODE_A2C_FILES_MOVE,DialogSpecStruct::FLAG_NONE,			{ DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_FILEPATH, "Specify source", "Specify source for move operation."),
 																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_FILEPATH, "Specify destination", "Specify destination for move operation.") } },
 		{ CMDCODE_A2C_FILES_DEL,DialogSpecStruct::FLAG_NONE,			{ DialogEntry(GuiDialogs::DIALOG_LARGETEXT, Conation::ARGTYPE_FILEPATH, "Specify files to delete", "Enter a newline delimited list of file paths to delete.", true) } },
 		{ CMDCODE_A2C_FILES_FETCH,DialogSpecStruct::FLAG_NONE,			{ DialogEntry(GuiDialogs::DIALOG_LARGETEXT, Conation::ARGTYPE_FILEPATH, "Specify files to fetch", "Enter a newline delimited list of file paths to download.", true) } },
+		{ CMDCODE_A2C_FILES_PLACECHUNK,DialogSpecStruct::FLAG_NONE,		{ DialogEntry(GuiDialogs::DIALOG_FILECHOOSER, Conation::ARGTYPE_FILEPATH, "Select files", "Select files to upload in chunks.\nThey're read a chunk at a time, so size doesn't matter."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_FILEPATH, "Specify destination", "Specify the destination directory on the node.\nSending the same files again resumes an interrupted upload."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_UINT32, "Enter chunk size", "Enter the chunk size in bytes. Zero uses the default.") } },
+		{ CMDCODE_A2C_FILES_FETCHCHUNK,DialogSpecStruct::FLAG_NONE,		{ DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_FILEPATH, "Specify file to fetch", "Enter the path of the file to download."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_UINT64, "Enter offset", "Enter the offset to start from. Zero starts over, otherwise resumes an interrupted download."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_UINT32, "Enter chunk size", "Enter the chunk size in bytes. Zero uses the node's default.") } },
 		{ CMDCODE_A2C_FILES_PLACE,DialogSpecStruct::FLAG_NONE,			{ DialogEntry(GuiDialogs::DIALOG_FILECHOOSER, Conation::ARGTYPE_FILE, "Select files", "Select files to upload.", true),
 																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_FILEPATH, "Enter destination directory", "Enter a destination directory for the selected files.") } },
-		{ CMDCODE_A2C_LISTDIRECTORY,DialogSpecStruct::FLAG_NONE,		{ DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_FILEPATH, "Enter path", "Enter the path of a directory on the host system to list.") } },
+		{ CMDCODE_A2C_FILES_SYNC,DialogSpecStruct::FLAG_NONE,			{ DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_FILEPATH, "Enter local directory", "Enter the path of the directory on this machine to sync from."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_FILEPATH, "Enter destination", "Enter the directory on the host to sync to. It's created if it doesn't exist.\nOnly files that are missing or differ get sent."),
+																		  DialogEntry(GuiDialogs::DIALOG_YESNODIALOG, Conation::ARGTYPE_BOOL, "Input needed", "Delete files on the host that aren't in the local directory?") } },
+		{ CMDCODE_A2C_FILES_HASHTREE,DialogSpecStruct::FLAG_NONE,		{ DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_FILEPATH, "Enter path", "Enter the path of a directory on the host system to hash."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_STRING, "Enter hash algorithm", "Enter sha512 or xxh64. xxh64 is much faster but only good for spotting changes.\nLeave empty for sha512.") } },
+		{ CMDCODE_A2C_LISTDIRECTORY,DialogSpecStruct::FLAG_NONE,		{ DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_FILEPATH, "Enter path", "Enter the path of a directory on the host system to list."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_STRING, "Enter name pattern", "Enter a pattern for names to list, using * and ?.\nLeave empty to list everything."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_UINT32, "Enter types", "Enter the types to list, OR'd together:\n1 files, 2 directories, 4 symlinks, 8 anything else.\nZero lists all types."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_UINT64, "Enter minimum size", "Enter the minimum size in bytes. Zero for no minimum."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_UINT64, "Enter maximum age", "Only list entries modified within this many seconds. Zero for any age."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_STRING, "Enter sort order", "Enter name, size or mtime, prefixed with - for descending.\nLeave empty for directory order, which is fastest."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_STRING, "Enter cursor", "Enter the cursor from the previous page to continue a listing.\nLeave empty to start from the beginning."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_UINT32, "Enter page size", "Enter the maximum number of entries to return. Zero uses the node's default.") } },
 		{ CMDCODE_A2C_EXECSNIPPET,DialogSpecStruct::FLAG_NONE,			{ DialogEntry(GuiDialogs::DIALOG_LARGETEXT, Conation::ARGTYPE_STRING, "Enter Lua snippet", "Type or paste Lua code to execute on node.") } },
 		{ CMDCODE_A2C_KILLPROCESS,DialogSpecStruct::FLAG_NONE,			{ DialogEntry(GuiDialogs::DIALOG_LARGETEXT, Conation::ARGTYPE_STRING, "Enter process names or PIDs", "Enter a newline delimited list of process names and/or PIDs to kill.", true) } },
-		{ CMDCODE_A2C_GETPROCESSES,DialogSpecStruct::FLAG_NONE,			{ DialogEntry(GuiDialogs::DIALOG_YESNODIALOG, Conation::ARGTYPE_BOOL, "Input needed", "Show kernel processes if present?") } },
+		{ CMDCODE_A2C_GETPROCESSES,DialogSpecStruct::FLAG_NONE,			{ DialogEntry(GuiDialogs::DIALOG_YESNODIALOG, Conation::ARGTYPE_BOOL, "Input needed", "Show kernel processes if present?"),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_STRING, "Enter name filter", "Only show processes with this in their name.\nLeave empty to show all."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_STRING, "Enter user filter", "Only show processes owned by this user.\nLeave empty to show all."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_UINT32, "Enter minimum CPU", "Only show processes using at least this much CPU, in percent."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_UINT32, "Enter sample time", "Enter how long to measure CPU usage for, in milliseconds, up to 2000.\nZero gives the average over each process's lifetime.") } },
 		{ CMDCODE_A2C_GETCWD,DialogSpecStruct::FLAG_NONE,				{ } },
 		{ CMDCODE_A2C_SLEEP, DialogSpecStruct::FLAG_NONE,				{ } },
 		{ CMDCODE_A2S_PROVIDEUPDATE,DialogSpecStruct::FLAG_NONE,		{ DialogEntry(GuiDialogs::DIALOG_FILECHOOSER, Conation::ARGTYPE_FILE, "Select new binary", "Select a new node binary.\nThe platform string and revision\nwill be read from branding by the server.") } },
@@ -104,6 +178,12 @@ const DialogSpecStruct DialogCommandMap[] =
 		{ CMDCODE_B2S_VAULT_ADD,DialogSpecStruct::FLAG_NONE,		 	{ DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_STRING, "Enter vault key", "Enter new vault item's key"),
 																		  DialogEntry(GuiDialogs::DIALOG_FILECHOOSER, Conation::ARGTYPE_FILE, "Select file", "Select file to upload to vault") } },
 		{ CMDCODE_B2S_VAULT_FETCH,DialogSpecStruct::FLAG_NONE,			{ DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_STRING, "Enter vault key", "Enter vault item's key for download") } },
+		{ CMDCODE_B2S_VAULT_GETCHUNK,DialogSpecStruct::FLAG_NONE,		{ DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_STRING, "Enter vault key", "Enter vault item's key for download"),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_UINT64, "Enter offset", "Enter the offset to start from. Zero starts over, otherwise resumes an interrupted download."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_UINT32, "Enter chunk size", "Enter the chunk size in bytes. Zero uses the server's default.") } },
+		{ CMDCODE_B2S_VAULT_PUTCHUNK,DialogSpecStruct::FLAG_NONE,		{ DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_STRING, "Enter vault key", "Enter the vault item's key. An existing item gets replaced."),
+																		  DialogEntry(GuiDialogs::DIALOG_FILECHOOSER, Conation::ARGTYPE_FILEPATH, "Select file", "Select file to upload to vault in chunks.\nSending the same file again resumes an interrupted upload."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_UINT32, "Enter chunk size", "Enter the chunk size in bytes. Zero uses the default.") } },
 		{ CMDCODE_B2S_VAULT_UPDATE,DialogSpecStruct::FLAG_NONE,			{ DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_STRING, "Enter vault key", "Enter vault item's key for update"),
 																		  DialogEntry(GuiDialogs::DIALOG_FILECHOOSER, Conation::ARGTYPE_FILE, "Select file", "Select file to upload to vault") } },
 		{ CMDCODE_B2S_VAULT_DROP,DialogSpecStruct::FLAG_NONE,			{ DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_STRING, "Enter vault key", "Enter the key of the vault item to delete.") } },
@@ -125,6 +205,12 @@ const DialogSpecStruct DialogCommandMap[] =
 		{ CMDCODE_A2S_SRVLOG_TAIL,DialogSpecStruct::FLAG_NONE,			{ DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_UINT32, "Enter number of lines", "Enter the number of lines to fetch from the log.") } },
 		{ CMDCODE_A2S_SRVLOG_SIZE,DialogSpecStruct::FLAG_NONE,			{ } },
 		{ CMDCODE_A2S_SRVLOG_WIPE,DialogSpecStruct::FLAG_NONE,			{ } },
+		{ CMDCODE_A2S_SRVLOG_QUERY,DialogSpecStruct::FLAG_NONE,			{ DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_STRING, "Enter event type", "Enter the event type to search for, e.g. PERMS or CONNECTIONS. Leave empty for any."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_STRING, "Enter node ID", "Enter the ID of the node to search for. Leave empty for any."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_UINT32, "Enter time range", "Enter how many seconds back to search. Zero searches everything."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_UINT32, "Enter number of lines", "Enter the maximum number of lines to fetch. Zero uses the server's limit.") } },
+		{ CMDCODE_A2S_TELEMETRY,DialogSpecStruct::FLAG_NONE,			{ DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_STRING, "Enter node ID", "Enter the ID of the node to summarize. Leave empty for every node."),
+																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_UINT32, "Enter time range", "Enter how many seconds back to summarize. Zero uses everything the server kept.") } },
 		{ CMDCODE_A2S_ROUTINE_ADD,DialogSpecStruct::FLAG_CONCATNT_COMMA,{ DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_STRING, "Enter name for routine", "Enter a name for this routine."),
 																		  DialogEntry(GuiDialogs::DIALOG_SIMPLETEXT, Conation::ARGTYPE_STRING, "Enter timing format.", "Enter pseudo-cron timing formatting for routine."),
 																		  DialogEntry(GuiDialogs::DIALOG_BINARYFLAGS, Conation::ARGTYPE_UINT32, "Select flags", "Select the flags to apply to this routine.", 0, new std::vector<std::tuple<VLString, uint64_t, bool> > { std::tuple<VLString, uint64_t, bool>{ "Run once", 1, false }, std::tuple<VLString, uint64_t, bool>{ "On node connect", 1 << 1, false }, std::tuple<VLString, uint64_t, bool>{ "Disabled", 1 << 2, false } }),
@@ -148,6 +234,23 @@ Orders::CurrentOrderStruct Orders::CurrentOrder;
 static const DialogSpecStruct *LookupCmdCodeDialogs(const CommandCode CmdCode);
 static Conation::ArgType GetDialogArgType(const CommandCode CmdCode, const size_t DialogNumber);
 static void GenericDialogCallback(const void *Dialog);
+static void StartChunkedUploads(Conation::ConationStream *Stream);
+static void QueueChunkedUpload(const VLString &NodeID, const uint64_t Ident, const VLString &LocalPath, const VLString &Destination, const size_t ChunkSize);
+static void StartVaultUpload(Conation::ConationStream *Stream);
+static void SendVaultChunk(const uint64_t Ident, const VaultUpload &Upload, const uint64_t Offset);
+static bool ReadLocalChunk(const VLString &Path, const uint64_t Offset, const size_t Size, std::vector<uint8_t> &Out);
+static VLString GetLocalHash(const VLString &Path, const uint64_t Size, const int64_t ModTime);
+static bool BuildLocalManifest(const VLString &Root, const VLString &Relative, VLString &Out);
+static void StartDirectorySync(Conation::ConationStream *Stream);
+static void *ManifestThreadFunc(ManifestJob *Job);
+static gboolean FinishDirectorySync(ManifestJob *Job);
+
+//Globals
+static std::map<std::pair<VLString, VLString>, ChunkedUpload> ChunkedUploads; //Node ID and destination path.
+static std::map<uint64_t, VaultUpload> VaultUploads; //The server doesn't send the key back, so by order ident.
+static std::map<std::pair<VLString, VLString>, PendingSync> PendingSyncs; //Node ID and destination directory.
+static std::map<VLString, LocalHash> LocalHashes; //Keyed by local path.
+static VLThreads::Mutex LocalHashesLock; //Manifests get built on their own threads.
 
 //Functions
 
@@ -251,11 +354,20 @@ static bool CompileCurrentOrderToStreams(const char *NodeID, Conation::ConationS
 			}
 			case GuiDialogs::DIALOG_FILECHOOSER:
 			{
-				if (GetDialogArgType(Orders::CurrentOrder.CmdCode, Inc) != Conation::ARGTYPE_FILE) break; //WTF else could we even do with this?
-				
 				GuiDialogs::FileSelectionDialog *Selector = static_cast<GuiDialogs::FileSelectionDialog*>(Dialog);
 
 				const std::vector<VLString> &Paths = Selector->GetPaths();
+				
+				if (GetDialogArgType(Orders::CurrentOrder.CmdCode, Inc) == Conation::ARGTYPE_FILEPATH)
+				{ //Just the local paths, for orders that read the files themselves later.
+					for (size_t Inc = 0u; Inc < Paths.size(); ++Inc)
+					{
+						Stream->Push_FilePath(Paths[Inc]);
+					}
+					break;
+				}
+				
+				if (GetDialogArgType(Orders::CurrentOrder.CmdCode, Inc) != Conation::ARGTYPE_FILE) break; //WTF else could we even do with this?
 
 				for (size_t Inc = 0u; Inc < Paths.size(); ++Inc)
 				{
@@ -451,6 +563,27 @@ bool Orders::CurrentOrderStruct::Finalize(void)
 #ifdef DEBUG
 		printf("Orders::CurrentOrderStruct::Finalize(): Transmitting output stream %llu\n", (unsigned long long)Inc);
 #endif
+		if (RealCmdCode == CMDCODE_A2C_FILES_PLACECHUNK)
+		{ //These go out as a series of chunk orders instead.
+			StartChunkedUploads(Outputs[Inc]);
+			delete Outputs[Inc];
+			continue;
+		}
+		
+		if (RealCmdCode == CMDCODE_B2S_VAULT_PUTCHUNK)
+		{ //Same, just to the server.
+			StartVaultUpload(Outputs[Inc]);
+			delete Outputs[Inc];
+			continue;
+		}
+		
+		if (RealCmdCode == CMDCODE_A2C_FILES_SYNC)
+		{ //The local directory gets swapped for its manifest.
+			StartDirectorySync(Outputs[Inc]);
+			delete Outputs[Inc];
+			continue;
+		}
+		
 		Main::GetWriteQueue().Push(Outputs[Inc]);
 	}
 
@@ -646,6 +779,9 @@ bool Orders::SendNodeScriptLoadOrder(const char *ScriptName, const std::set<VLSt
 		return false;
 	}
 	
+	//Nodes that already have this exact script compiled skip the upload. The rest tell us, and ResendMissingScript() sends the text.
+	const VLString &ScriptHash { Utils::GetSha512(ScriptText) };
+	
 	const uint64_t Ident = Ticker::NewNodeMsgIdent();
 	
 	for (const VLString &Value : *DestinationNodes)
@@ -654,7 +790,7 @@ bool Orders::SendNodeScriptLoadOrder(const char *ScriptName, const std::set<VLSt
 		
 		Output->Push_ODHeader("ADMIN", Value);
 		Output->Push_String(ScriptName);
-		Output->Push_Script(ScriptText);
+		Output->Push_String(ScriptHash);
 		Output->Push_Bool(false);
 				
 		VLString Summary = VLString("Sent order of ") + CommandCodeToString(Output->GetCommandCode()) + ", awaiting response.";
@@ -711,6 +847,9 @@ bool Orders::SendNodeScriptReloadOrder(const char *ScriptName, const std::set<VL
 	}
 	
 	
+	//Nodes that already have this exact script compiled skip the upload. The rest tell us, and ResendMissingScript() sends the text.
+	const VLString &ScriptHash { Utils::GetSha512(ScriptText) };
+	
 	const uint64_t Ident = Ticker::NewNodeMsgIdent();
 	
 	for (const VLString &Value : *DestinationNodes)
@@ -719,7 +858,7 @@ bool Orders::SendNodeScriptReloadOrder(const char *ScriptName, const std::set<VL
 		
 		Output->Push_ODHeader("ADMIN", Value);
 		Output->Push_String(ScriptName);
-		Output->Push_Script(ScriptText);
+		Output->Push_String(ScriptHash);
 		Output->Push_Bool(true);
 		
 		VLString Summary = VLString("Sent order of ") + CommandCodeToString(Output->GetCommandCode()) + ", awaiting response.";
@@ -732,6 +871,462 @@ bool Orders::SendNodeScriptReloadOrder(const char *ScriptName, const std::set<VL
 	return true;
 }
 
+bool Orders::ResendMissingScript(Conation::ConationStream *Stream)
+{ //A MOD_LOADSCRIPT report from a node that didn't have the script we sent by hash. Returns false if that's not what this is.
+	if (!Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER, Conation::ARGTYPE_NETCMDSTATUS, Conation::ARGTYPE_STRING, Conation::ARGTYPE_BOOL}))
+	{
+		return false;
+	}
+	
+	const Conation::ConationStream::ODHeader &Hdr = Stream->Pop_ODHeader();
+	const NetCmdStatus &Status = Stream->Pop_NetCmdStatus();
+	const VLString &ScriptName = Stream->Pop_String();
+	const bool Overwrite = Stream->Pop_Bool();
+	
+	if (Status.Status != STATUS_MISSING)
+	{
+		Stream->Rewind();
+		return false;
+	}
+	
+	auto Iter = ScriptScanner::GetKnownScripts().find(ScriptName);
+	
+	VLString ScriptText;
+	
+	if (Iter == ScriptScanner::GetKnownScripts().end() || !SlurpyScripty(Iter->second->ScriptPath, &ScriptText))
+	{
+		Ticker::AddNodeMessage(Hdr.Origin, Stream->GetCommandCode(), Stream->GetCmdIdentOnly(), VLString("Node needs script \"") + ScriptName + "\", but we can't read it anymore.");
+		return true;
+	}
+	
+	Conation::ConationStream *Output = new Conation::ConationStream(CMDCODE_A2C_MOD_LOADSCRIPT, 0, Stream->GetCmdIdentOnly());
+	
+	Output->Push_ODHeader("ADMIN", Hdr.Origin);
+	Output->Push_String(ScriptName);
+	Output->Push_Script(ScriptText);
+	Output->Push_Bool(Overwrite);
+	
+	Ticker::AddNodeMessage(Hdr.Origin, Output->GetCommandCode(), Output->GetCmdIdentOnly(), "Node didn't have script cached, sent full text, awaiting response.");
+	
+	Main::GetWriteQueue().Push(Output);
+	
+	return true;
+}
+
+static bool ReadLocalChunk(const VLString &Path, const uint64_t Offset, const size_t Size, std::vector<uint8_t> &Out)
+{
+	VLScopedPtr<FILE*, int(*)(FILE*)> Desc { fopen(Path, "rb"), fclose };
+	
+	if (!Desc || fseeko(Desc, Offset, SEEK_SET) != 0) return false;
+	
+	Out.resize(Size);
+	
+	return fread(Out.data(), 1, Size, Desc) == Size;
+}
+
+static void StartChunkedUploads(Conation::ConationStream *Stream)
+{ //Turns the compiled {local paths..., destination directory, chunk size} order into an opening query per file.
+	VLScopedPtr<std::vector<Conation::ArgType>* > ArgTypes { Stream->GetArgTypes() };
+	
+	if (!ArgTypes || ArgTypes->size() < 4 || ArgTypes->back() != Conation::ARGTYPE_UINT32) return;
+	
+	const Conation::ConationStream::ODHeader &Hdr = Stream->Pop_ODHeader();
+	
+	std::vector<VLString> LocalPaths;
+	
+	for (size_t Inc = 0; Inc < ArgTypes->size() - 3; ++Inc)
+	{
+		LocalPaths.push_back(Stream->Pop_FilePath());
+	}
+	
+	const VLString &DestDir = Stream->Pop_FilePath();
+	size_t ChunkSize = Stream->Pop_Uint32();
+	
+	if (!ChunkSize) ChunkSize = PLACECHUNK_DEFAULT_SIZE;
+	
+	//Leave room for the header and the other arguments.
+	if (ChunkSize > Conation::ConationStream::GetMaxStreamArgsSize() / 2) ChunkSize = Conation::ConationStream::GetMaxStreamArgsSize() / 2;
+	
+	for (const VLString &LocalPath : LocalPaths)
+	{
+		QueueChunkedUpload(Hdr.Destination, Stream->GetCmdIdentOnly(), LocalPath, DestDir + Utils::StripPathFromFilename(LocalPath), ChunkSize);
+	}
+}
+
+static void QueueChunkedUpload(const VLString &NodeID, const uint64_t Ident, const VLString &LocalPath, const VLString &Destination, const size_t ChunkSize)
+{
+	struct stat FileStat{};
+	
+	if (stat(LocalPath, &FileStat) != 0 || !S_ISREG(FileStat.st_mode))
+	{
+		Ticker::AddNodeMessage(NodeID, CMDCODE_A2C_FILES_PLACECHUNK, Ident, VLString("Can't read local file \"") + LocalPath + "\", not uploading it.");
+		return;
+	}
+	
+	const uint64_t Size = FileStat.st_size;
+	
+	//For syncs this was already hashed building the manifest, so a few hundred nodes don't mean a few hundred hashes.
+	const VLString &Hash = GetLocalHash(LocalPath, Size, FileStat.st_mtime);
+	
+	if (!Hash)
+	{
+		Ticker::AddNodeMessage(NodeID, CMDCODE_A2C_FILES_PLACECHUNK, Ident, VLString("Can't hash local file \"") + LocalPath + "\", not uploading it.");
+		return;
+	}
+	
+	ChunkedUploads[std::make_pair(NodeID, Destination)] = ChunkedUpload{ LocalPath, Size, Hash, ChunkSize };
+	
+	//Empty chunk, so the node tells us what it's still missing if this is a resume.
+	Conation::ConationStream *Query = new Conation::ConationStream(CMDCODE_A2C_FILES_PLACECHUNK, 0, Ident);
+	
+	Query->Push_ODHeader("ADMIN", NodeID);
+	Query->Push_FilePath(Destination);
+	Query->Push_Uint64(Size);
+	Query->Push_String(Hash);
+	Query->Push_Uint64(0);
+	Query->Push_BinStream("", 0);
+	
+	Main::GetWriteQueue().Push(Query);
+}
+
+static void StartVaultUpload(Conation::ConationStream *Stream)
+{ //Compiled as {key, local path, chunk size}.
+	if (!Stream->VerifyArgTypes({Conation::ARGTYPE_STRING, Conation::ARGTYPE_FILEPATH, Conation::ARGTYPE_UINT32})) return;
+	
+	VaultUpload Upload{};
+	
+	Upload.Key = Stream->Pop_String();
+	Upload.LocalPath = Stream->Pop_FilePath();
+	Upload.ChunkSize = Stream->Pop_Uint32();
+	
+	if (!Upload.ChunkSize) Upload.ChunkSize = PLACECHUNK_DEFAULT_SIZE;
+	
+	if (Upload.ChunkSize > Conation::ConationStream::GetMaxStreamArgsSize() / 2) Upload.ChunkSize = Conation::ConationStream::GetMaxStreamArgsSize() / 2;
+	
+	if (!Utils::GetFileSize(Upload.LocalPath, &Upload.TotalSize))
+	{
+		Ticker::AddServerMessage(VLString("Can't read local file \"") + Upload.LocalPath + "\", not uploading it to the vault.");
+		return;
+	}
+	
+	const uint64_t Ident = Stream->GetCmdIdentOnly();
+	
+	/*An empty chunk at the very end can't be right, so if there's an earlier attempt the server
+	* tells us where it got to, and if there isn't we start from zero. Nothing to resume if it's empty.*/
+	Upload.Started = !Upload.TotalSize;
+	
+	VaultUploads[Ident] = Upload;
+	
+	SendVaultChunk(Ident, Upload, Upload.Started ? 0 : Upload.TotalSize);
+}
+
+static void SendVaultChunk(const uint64_t Ident, const VaultUpload &Upload, const uint64_t Offset)
+{
+	const size_t Size = Upload.TotalSize - Offset < Upload.ChunkSize ? Upload.TotalSize - Offset : Upload.ChunkSize;
+	
+	std::vector<uint8_t> Chunk;
+	
+	if (Size && !ReadLocalChunk(Upload.LocalPath, Offset, Size, Chunk))
+	{
+		Ticker::AddServerMessage(VLString("Failed to read \"") + Upload.LocalPath + "\" at offset " + VLString::UintToString(Offset) + ", vault upload paused.",
+								"Send the same order again to resume.");
+		VaultUploads.erase(Ident);
+		return;
+	}
+	
+	Conation::ConationStream *Next = new Conation::ConationStream(CMDCODE_B2S_VAULT_PUTCHUNK, 0, Ident);
+	
+	Next->Push_String(Upload.Key);
+	Next->Push_Uint64(Upload.TotalSize);
+	Next->Push_Uint64(Offset);
+	Next->Push_BinStream(Chunk.data(), Chunk.size());
+	
+	Main::GetWriteQueue().Push(Next);
+}
+
+bool Orders::ContinueVaultUpload(Conation::ConationStream *Stream)
+{ //Returns false if it's not a chunk report of ours, so the generic handler can have it.
+	if (!Stream->VerifyArgTypes({Conation::ARGTYPE_NETCMDSTATUS, Conation::ARGTYPE_UINT64}))
+	{
+		return false;
+	}
+	
+	auto Lookup = VaultUploads.find(Stream->GetCmdIdentOnly());
+	
+	if (Lookup == VaultUploads.end()) return false;
+	
+	const NetCmdStatus &Status = Stream->Pop_NetCmdStatus();
+	const uint64_t Received = Stream->Pop_Uint64();
+	
+	VaultUpload &Upload = Lookup->second;
+	
+	if (Received > Upload.TotalSize)
+	{
+		Ticker::AddServerMessage(VLString("Server sent a bad offset for vault item \"") + Upload.Key + "\", upload stopped.");
+		VaultUploads.erase(Lookup);
+		return true;
+	}
+	
+	if (!Upload.Started)
+	{ //Answer to our opening question. Zero either means there's nothing to resume or that it never got anywhere.
+		Upload.Started = true;
+		SendVaultChunk(Lookup->first, Upload, Received);
+		return true;
+	}
+	
+	if (!Status || Received == Upload.TotalSize)
+	{ //Done one way or the other. Failures stop here, sending the same order again resumes.
+		Ticker::AddServerMessage(Status ? VLString("Uploaded vault item \"") + Upload.Key + "\" in chunks."
+										: VLString("Chunked upload of vault item \"") + Upload.Key + "\" failed at offset " + VLString::UintToString(Received) + ": " + Status.Msg,
+								VLString("Local file: ") + Upload.LocalPath);
+		VaultUploads.erase(Lookup);
+		return true;
+	}
+	
+	SendVaultChunk(Lookup->first, Upload, Received);
+	
+	return true;
+}
+
+static VLString GetLocalHash(const VLString &Path, const uint64_t Size, const int64_t ModTime)
+{ //Empty if it can't be read. The lock isn't held while hashing, so the GTK thread never waits on a manifest thread's disk.
+	VLThreads::MutexKeeper Keeper { &LocalHashesLock };
+	
+	auto Lookup = LocalHashes.find(Path);
+	
+	if (Lookup != LocalHashes.end() && Lookup->second.Size == Size && Lookup->second.ModTime == ModTime)
+	{
+		return Lookup->second.Digest;
+	}
+	
+	Keeper.Unlock();
+	
+	const VLString &Digest = Size ? Utils::GetFileSha512(Path) : Utils::GetSha512("", 0);
+	
+	if (!Digest) return Digest;
+	
+	Keeper.Lock();
+	
+	LocalHashes[Path] = LocalHash{ Size, ModTime, Digest };
+	
+	return Digest;
+}
+
+static bool BuildLocalManifest(const VLString &Root, const VLString &Relative, VLString &Out)
+{ //Same line format as the node's Files::ManifestToText(), always with forward slashes.
+	const VLString &DirPath = Relative ? Root + "/" + Relative : Root;
+	
+	VLScopedPtr<DIR*, decltype(&closedir)> Dir { opendir(DirPath), closedir };
+	
+	if (!Dir) return false;
+	
+	struct dirent *Ent = nullptr;
+	
+	while ((Ent = readdir(Dir)))
+	{
+		if (!strcmp(Ent->d_name, ".") || !strcmp(Ent->d_name, "..") || strchr(Ent->d_name, '\n')) continue;
+		
+		const VLString &EntRelative = Relative ? Relative + "/" + (const char*)Ent->d_name : VLString(Ent->d_name);
+		const VLString &EntPath = Root + "/" + EntRelative;
+		
+		struct stat EntStat{};
+#ifndef WIN32
+		if (lstat(EntPath, &EntStat) != 0) return false; //Symlinks are left out, same as on the node.
+#else
+		if (stat(EntPath, &EntStat) != 0) return false;
+#endif //WIN32
+		
+		if (S_ISDIR(EntStat.st_mode))
+		{
+			if (!BuildLocalManifest(Root, EntRelative, Out)) return false;
+			continue;
+		}
+		
+		if (!S_ISREG(EntStat.st_mode)) continue;
+		
+		const uint64_t Size = EntStat.st_size;
+		const int64_t ModTime = EntStat.st_mtime;
+		const VLString &Digest = GetLocalHash(EntPath, Size, ModTime);
+		
+		if (!Digest) return false;
+		
+		Out += Digest + '\t' + VLString::UintToString(Size) + '\t' + VLString::IntToString(ModTime) + '\t' + EntRelative + '\n';
+	}
+	
+	return true;
+}
+
+static void StartDirectorySync(Conation::ConationStream *Stream)
+{ //Compiled as {local directory, destination directory, delete extras}. The node gets our manifest instead of the local path.
+	if (!Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER, Conation::ARGTYPE_FILEPATH, Conation::ARGTYPE_FILEPATH, Conation::ARGTYPE_BOOL})) return;
+	
+	const Conation::ConationStream::ODHeader &Hdr = Stream->Pop_ODHeader();
+	
+	ManifestJob *Job = new ManifestJob{};
+	
+	Job->NodeID = Hdr.Destination;
+	Job->Ident = Stream->GetCmdIdentOnly();
+	Job->LocalDir = Stream->Pop_FilePath();
+	Job->DestDir = Stream->Pop_FilePath();
+	Job->DeleteExtras = Stream->Pop_Bool();
+	
+	Job->LocalDir.StripTrailing("/");
+	Job->DestDir.StripTrailing("/");
+	
+	//The plan goes out from FinishDirectorySync() once it's built.
+	Job->Worker = new VLThreads::Thread((VLThreads::Thread::EntryFunc)ManifestThreadFunc, Job);
+	Job->Worker->Start();
+}
+
+static void *ManifestThreadFunc(ManifestJob *Job)
+{
+	Job->Manifest = VLString(1024 * 64);
+	Job->Built = BuildLocalManifest(Job->LocalDir, "", Job->Manifest);
+	
+	//Back to the GTK thread for the rest, the ticker and PendingSyncs live there.
+	g_idle_add((GSourceFunc)FinishDirectorySync, Job);
+	
+	return nullptr;
+}
+
+static gboolean FinishDirectorySync(ManifestJob *Job)
+{
+	Job->Worker->Join();
+	
+	VLScopedPtr<ManifestJob*> Deleter { Job };
+	
+	if (!Job->Built)
+	{
+		Ticker::AddNodeMessage(Job->NodeID, CMDCODE_A2C_FILES_SYNC, Job->Ident, VLString("Can't read local directory \"") + Job->LocalDir + "\", not syncing it.");
+		return false;
+	}
+	
+	size_t ChunkSize = PLACECHUNK_DEFAULT_SIZE;
+	
+	if (ChunkSize > Conation::ConationStream::GetMaxStreamArgsSize() / 2) ChunkSize = Conation::ConationStream::GetMaxStreamArgsSize() / 2;
+	
+	PendingSyncs[std::make_pair(Job->NodeID, Job->DestDir)] = PendingSync{ Job->LocalDir, ChunkSize };
+	
+	Conation::ConationStream *Plan = new Conation::ConationStream(CMDCODE_A2C_FILES_SYNC, 0, Job->Ident);
+	
+	Plan->Push_ODHeader("ADMIN", Job->NodeID);
+	Plan->Push_FilePath(Job->DestDir);
+	Plan->Push_String(Job->Manifest);
+	Plan->Push_Bool(Job->DeleteExtras);
+	
+	Main::GetWriteQueue().Push(Plan);
+	
+	return false; //Just the once.
+}
+
+bool Orders::ContinueDirectorySync(Conation::ConationStream *Stream)
+{ //Returns false if it's not a sync we started, so the generic handler can have it.
+	if (!Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER, Conation::ARGTYPE_NETCMDSTATUS, Conation::ARGTYPE_FILEPATH, Conation::ARGTYPE_STRING}))
+	{
+		return false;
+	}
+	
+	const Conation::ConationStream::ODHeader &Hdr = Stream->Pop_ODHeader();
+	const NetCmdStatus &Status = Stream->Pop_NetCmdStatus();
+	const VLString &DestDir = Stream->Pop_FilePath();
+	const VLString &Needed = Stream->Pop_String();
+	
+	auto Lookup = PendingSyncs.find(std::make_pair(Hdr.Origin, DestDir));
+	
+	if (Lookup == PendingSyncs.end())
+	{
+		Stream->Rewind();
+		return false;
+	}
+	
+	const PendingSync Sync = Lookup->second;
+	
+	PendingSyncs.erase(Lookup);
+	
+	Ticker::AddNodeMessage(Hdr.Origin, Stream->GetCommandCode(), Stream->GetCmdIdentOnly(), VLString("Sync of \"") + DestDir + "\": " + Status.Msg,
+							VLString("Local directory: ") + Sync.LocalDir);
+	
+	VLScopedPtr<std::vector<VLString>*> Paths { Utils::SplitTextByCharacter(Needed, '\n') };
+	
+	for (const VLString &Path : *Paths)
+	{
+		QueueChunkedUpload(Hdr.Origin, Stream->GetCmdIdentOnly(), Sync.LocalDir + "/" + Path, DestDir + "/" + Path, Sync.ChunkSize);
+	}
+	
+	return true;
+}
+
+bool Orders::ContinueChunkedUpload(Conation::ConationStream *Stream)
+{ //Returns false if it's not a chunk report of ours, so the generic handler can have it.
+	if (!Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER, Conation::ARGTYPE_NETCMDSTATUS, Conation::ARGTYPE_FILEPATH, Conation::ARGTYPE_STRING}))
+	{
+		return false;
+	}
+	
+	const Conation::ConationStream::ODHeader &Hdr = Stream->Pop_ODHeader();
+	const NetCmdStatus &Status = Stream->Pop_NetCmdStatus();
+	const VLString &Destination = Stream->Pop_FilePath();
+	const VLString &Missing = Stream->Pop_String();
+	
+	auto Lookup = ChunkedUploads.find(std::make_pair(Hdr.Origin, Destination));
+	
+	if (Lookup == ChunkedUploads.end())
+	{
+		Stream->Rewind();
+		return false;
+	}
+	
+	if (!Status || !Missing)
+	{ //Done one way or the other. Failures stop here, sending the same order again resumes.
+		Ticker::AddNodeMessage(Hdr.Origin, Stream->GetCommandCode(), Stream->GetCmdIdentOnly(),
+								Status ? VLString("Uploaded \"") + Destination + "\" in chunks, SHA-512 verified by node."
+										: VLString("Chunked upload of \"") + Destination + "\" failed: " + Status.Msg,
+								VLString("Local file: ") + Lookup->second.LocalPath + "\nSHA-512: " + Lookup->second.Hash);
+		ChunkedUploads.erase(Lookup);
+		return true;
+	}
+	
+	const ChunkedUpload &Upload = Lookup->second;
+	
+	//We just fill in the first hole each time.
+	const char *Dash = strchr(Missing, '-');
+	const uint64_t Start = VLString::StringToUint(Missing);
+	const uint64_t End = Dash ? VLString::StringToUint(Dash + 1) : 0;
+	
+	if (End <= Start || End > Upload.TotalSize)
+	{
+		Ticker::AddNodeMessage(Hdr.Origin, Stream->GetCommandCode(), Stream->GetCmdIdentOnly(), VLString("Node sent garbage missing ranges for \"") + Destination + "\", upload stopped.");
+		ChunkedUploads.erase(Lookup);
+		return true;
+	}
+	
+	const size_t Size = End - Start < Upload.ChunkSize ? End - Start : Upload.ChunkSize;
+	
+	std::vector<uint8_t> Chunk;
+	
+	if (!ReadLocalChunk(Upload.LocalPath, Start, Size, Chunk))
+	{
+		Ticker::AddNodeMessage(Hdr.Origin, Stream->GetCommandCode(), Stream->GetCmdIdentOnly(),
+								VLString("Failed to read \"") + Upload.LocalPath + "\" at offset " + VLString::UintToString(Start) + ", upload paused.",
+								"Send the same order again to resume.");
+		ChunkedUploads.erase(Lookup);
+		return true;
+	}
+	
+	Conation::ConationStream *Next = new Conation::ConationStream(CMDCODE_A2C_FILES_PLACECHUNK, 0, Stream->GetCmdIdentOnly());
+	
+	Next->Push_ODHeader("ADMIN", Hdr.Origin);
+	Next->Push_FilePath(Destination);
+	Next->Push_Uint64(Upload.TotalSize);
+	Next->Push_String(Upload.Hash);
+	Next->Push_Uint64(Start);
+	Next->Push_BinStream(Chunk.data(), Chunk.size());
+	
+	Main::GetWriteQueue().Push(Next);
+	
+	return true;
+}
+
 static void ScriptDialogDoneCallback(void **Stuff, const GuiDialogs::ArgSelectorDialog *Dialog)
 {
 	Conation::ConationStream::StreamHeader &&Hdr = Dialog->GetHeader();
@@ -96,6 +96,10 @@ namespace Orders
 	bool SendNodeScriptLoadOrder(const char *ScriptName, const std::set<VLString> *DestinationNodes);
 	bool SendNodeScriptUnloadOrder(const char *ScriptName, const std::set<VLString> *DestinationNodes);
 	bool SendNodeScriptReloadOrder(const char *ScriptName, const std::set<VLString> *DestinationNodes);
+	bool ResendMissingScript(Conation::ConationStream *Stream);
+	bool ContinueChunkedUpload(Conation::ConationStream *Stream);
+	bool ContinueVaultUpload(Conation::ConationStream *Stream);
+	bool ContinueDirectorySync(Conation::ConationStream *Stream);
 	bool SendNodeScriptFuncOrder(ScriptScanner::ScriptInfo::ScriptFunctionInfo *FuncInfo, const std::set<VLString> *DestinationNodes);
 	
 	extern CurrentOrderStruct CurrentOrder;
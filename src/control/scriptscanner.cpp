@@ -35,6 +35,7 @@
 #define SCRIPTNAME_SPECIFIER "scriptname::"
 #define SCRIPTVER_SPECIFIER "scriptversion::"
 #define SCRIPTDESC_SPECIFIER "scriptdescription::"
+#define SCRIPTRESIDENT_SPECIFIER "scriptresident::"
 
 static std::map<VLString, ScriptScanner::ScriptInfo*> KnownScripts;
 
@@ -169,7 +170,7 @@ static ScriptScanner::ScriptInfo *ScanFile(const char *Path)
 	
 	*End = '\0';
 	
-	ScriptScanner::ScriptInfo *RetVal = new ScriptScanner::ScriptInfo;
+	ScriptScanner::ScriptInfo *RetVal = new ScriptScanner::ScriptInfo(); //Parens so Resident starts out false.
 	
 	RetVal->ScriptPath = Path;
 	
@@ -232,6 +233,15 @@ static ScriptScanner::ScriptInfo *ScanFile(const char *Path)
 			RetVal->ScriptVersion = +Line;
 #ifdef DEBUG
 			puts(VLString("ScriptScanner::ScanFile(): Loaded script version as ") + RetVal->ScriptVersion);
+#endif
+		}
+		else if (Line.StartsWith(SCRIPTRESIDENT_SPECIFIER))
+		{ //The node parses this one too, it's what makes it keep an instance running.
+			Line += sizeof SCRIPTRESIDENT_SPECIFIER - 1;
+			
+			RetVal->Resident = Line == "true";
+#ifdef DEBUG
+			puts(VLString("ScriptScanner::ScanFile(): Script resident: ") + (RetVal->Resident ? "true" : "false"));
 #endif
 		}
 		else
@@ -41,6 +41,7 @@ namespace ScriptScanner
 		VLString ScriptDescription;
 		VLString ScriptVersion;
 		VLString ScriptPath;
+		bool Resident; //Node keeps one instance alive and feeds it events instead of running a fresh job per call.
 		
 		std::map<VLString, ScriptFunctionInfo*> Functions; //First is function name, second is the struct with other stuff.]
 	};
@@ -0,0 +1,301 @@
+/**
+* This file is part of Volition.
+
+* Volition is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+
+* Volition is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+
+* You should have received a copy of the GNU General Public License
+* along with Volition.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include "include/common.h"
+#include "include/bindelta.h"
+
+#include <string.h>
+#include <algorithm>
+
+#define BINDELTA_MAGIC "VLBD"
+#define BINDELTA_VERSION 1
+#define BINDELTA_BLOCK 16 //Old file gets indexed every this many bytes, so any shared run of twice this gets found.
+#define BINDELTA_REPEAT_MIN 8 //Matches at the last copy's displacement cost a couple bytes to encode, so shorter ones still pay.
+#define BINDELTA_MAX_OUTPUT (1024ull * 1024ull * 1024ull) //So a corrupt patch can't make us allocate the world.
+#define BINDELTA_EMPTY_SLOT UINT32_MAX
+
+//Op token layout: three bits of literal length, a flag for a nonzero displacement, four bits of copy length. Maxed out fields continue in a varint.
+#define BINDELTA_TOKEN_LITERAL_MAX 7
+#define BINDELTA_TOKEN_DISPLACED 0x10
+#define BINDELTA_TOKEN_COPY_MAX 15
+
+static void PutVarint(std::vector<uint8_t> &Out, uint64_t Value);
+static bool GetVarint(const uint8_t *&Data, const uint8_t *End, uint64_t &Out);
+static inline uint64_t HashBlock(const uint8_t *Data);
+static inline size_t MatchLength(const uint8_t *A, const uint8_t *B, const size_t Max);
+static void EmitOp(std::vector<uint8_t> &Out, const uint8_t *Literal, const size_t LiteralSize, const uint64_t CopyFrom, const uint64_t CopyLength, uint64_t &LastCopyEnd);
+
+static void PutVarint(std::vector<uint8_t> &Out, uint64_t Value)
+{
+	while (Value >= 0x80)
+	{
+		Out.push_back((Value & 0x7F) | 0x80);
+		Value >>= 7;
+	}
+	
+	Out.push_back(Value);
+}
+
+static bool GetVarint(const uint8_t *&Data, const uint8_t *End, uint64_t &Out)
+{
+	Out = 0;
+	
+	for (unsigned Shift = 0; Data < End && Shift < 64; Shift += 7)
+	{
+		const uint8_t Byte = *Data++;
+		
+		Out |= (uint64_t)(Byte & 0x7F) << Shift;
+		
+		if (!(Byte & 0x80)) return true;
+	}
+	
+	return false;
+}
+
+static inline uint64_t HashBlock(const uint8_t *Data)
+{
+	uint64_t First, Second;
+	
+	memcpy(&First, Data, sizeof First);
+	memcpy(&Second, Data + sizeof First, sizeof Second);
+	
+	uint64_t Hash = First * 0x9E3779B185EBCA87ull ^ Second * 0xC2B2AE3D27D4EB4Full;
+	
+	Hash ^= Hash >> 29;
+	Hash *= 0x165667B19E3779F9ull;
+	Hash ^= Hash >> 32;
+	
+	return Hash;
+}
+
+static inline size_t MatchLength(const uint8_t *A, const uint8_t *B, const size_t Max)
+{
+	size_t Length = 0;
+	
+	while (Length + sizeof(uint64_t) <= Max)
+	{
+		uint64_t First, Second;
+		
+		memcpy(&First, A + Length, sizeof First);
+		memcpy(&Second, B + Length, sizeof Second);
+		
+		if (First != Second) break;
+		
+		Length += sizeof First;
+	}
+	
+	while (Length < Max && A[Length] == B[Length]) ++Length;
+	
+	return Length;
+}
+
+static void EmitOp(std::vector<uint8_t> &Out, const uint8_t *Literal, const size_t LiteralSize, const uint64_t CopyFrom, const uint64_t CopyLength, uint64_t &LastCopyEnd)
+{ //Most ops in a recompiled binary are a byte or two of changed address and then a copy at the same displacement, so short lengths go in the token.
+	//Zero displacement means the copy picks up right where the last one left off, plus the literal.
+	const int64_t Displacement = CopyLength ? (int64_t)(CopyFrom - (LastCopyEnd + LiteralSize)) : 0;
+	
+	const uint8_t Token = 	std::min<uint64_t>(LiteralSize, BINDELTA_TOKEN_LITERAL_MAX) << 5 |
+							(Displacement ? BINDELTA_TOKEN_DISPLACED : 0) |
+							std::min<uint64_t>(CopyLength, BINDELTA_TOKEN_COPY_MAX);
+	Out.push_back(Token);
+	
+	if (LiteralSize >= BINDELTA_TOKEN_LITERAL_MAX) PutVarint(Out, LiteralSize - BINDELTA_TOKEN_LITERAL_MAX);
+	
+	Out.insert(Out.end(), Literal, Literal + LiteralSize);
+	
+	if (CopyLength >= BINDELTA_TOKEN_COPY_MAX) PutVarint(Out, CopyLength - BINDELTA_TOKEN_COPY_MAX);
+	
+	if (Displacement) PutVarint(Out, ((uint64_t)Displacement << 1) ^ (uint64_t)(Displacement >> 63));
+	
+	if (CopyLength) LastCopyEnd = CopyFrom + CopyLength;
+}
+
+bool BinDelta::Create(const void *Old_, const size_t OldSize, const void *New_, const size_t NewSize, std::vector<uint8_t> &PatchOut)
+{
+	const uint8_t *const Old = static_cast<const uint8_t*>(Old_);
+	const uint8_t *const New = static_cast<const uint8_t*>(New_);
+	
+	if (OldSize >= BINDELTA_EMPTY_SLOT || NewSize > BINDELTA_MAX_OUTPUT) return false;
+	
+	PatchOut.assign(BINDELTA_MAGIC, BINDELTA_MAGIC + sizeof BINDELTA_MAGIC - 1);
+	PatchOut.push_back(BINDELTA_VERSION);
+	PutVarint(PatchOut, OldSize);
+	PutVarint(PatchOut, NewSize);
+	
+	//Index every block of the old file. Later blocks win on collisions, which is fine.
+	size_t TableSize = 1024;
+	
+	while (TableSize < (OldSize / BINDELTA_BLOCK) * 2) TableSize <<= 1;
+	
+	std::vector<uint32_t> Table(TableSize, BINDELTA_EMPTY_SLOT);
+	
+	for (size_t Offset = 0; Offset + BINDELTA_BLOCK <= OldSize; Offset += BINDELTA_BLOCK)
+	{
+		Table[HashBlock(Old + Offset) & (TableSize - 1)] = Offset;
+	}
+	
+	size_t Pos = 0;
+	size_t LiteralStart = 0;
+	uint64_t LastCopyEnd = 0;
+	
+	while (Pos + BINDELTA_BLOCK <= NewSize)
+	{
+		uint64_t MatchFrom = 0;
+		size_t MatchSize = 0;
+		
+		//Same displacement as the last copy first. Catches the rest of a region after a changed address or two.
+		const uint64_t Repeat = LastCopyEnd + (Pos - LiteralStart);
+		
+		if (Repeat < OldSize)
+		{
+			const size_t Length = MatchLength(Old + Repeat, New + Pos, std::min<uint64_t>(OldSize - Repeat, NewSize - Pos));
+			
+			if (Length >= BINDELTA_REPEAT_MIN)
+			{
+				MatchFrom = Repeat;
+				MatchSize = Length;
+			}
+		}
+		
+		if (!MatchSize)
+		{
+			const uint32_t Candidate = Table[HashBlock(New + Pos) & (TableSize - 1)];
+			
+			if (Candidate != BINDELTA_EMPTY_SLOT)
+			{
+				const size_t Length = MatchLength(Old + Candidate, New + Pos, std::min<uint64_t>(OldSize - Candidate, NewSize - Pos));
+				
+				if (Length >= BINDELTA_BLOCK)
+				{
+					MatchFrom = Candidate;
+					MatchSize = Length;
+				}
+			}
+		}
+		
+		if (!MatchSize)
+		{
+			++Pos;
+			continue;
+		}
+		
+		//Stretch it backwards over whatever literal bytes also match.
+		while (Pos > LiteralStart && MatchFrom > 0 && Old[MatchFrom - 1] == New[Pos - 1])
+		{
+			--Pos;
+			--MatchFrom;
+			++MatchSize;
+		}
+		
+		EmitOp(PatchOut, New + LiteralStart, Pos - LiteralStart, MatchFrom, MatchSize, LastCopyEnd);
+		
+		Pos += MatchSize;
+		LiteralStart = Pos;
+	}
+	
+	if (LiteralStart < NewSize) EmitOp(PatchOut, New + LiteralStart, NewSize - LiteralStart, 0, 0, LastCopyEnd);
+	
+	return true;
+}
+
+bool BinDelta::Apply(const void *Old_, const size_t OldSize, const void *Patch, const size_t PatchSize, std::vector<uint8_t> &NewOut)
+{
+	const uint8_t *const Old = static_cast<const uint8_t*>(Old_);
+	const uint8_t *Data = static_cast<const uint8_t*>(Patch);
+	const uint8_t *const End = Data + PatchSize;
+	
+	NewOut.clear();
+	
+	if (PatchSize < sizeof BINDELTA_MAGIC || memcmp(Data, BINDELTA_MAGIC, sizeof BINDELTA_MAGIC - 1) != 0) return false;
+	
+	Data += sizeof BINDELTA_MAGIC - 1;
+	
+	if (*Data++ != BINDELTA_VERSION) return false;
+	
+	uint64_t ExpectedOldSize = 0, NewSize = 0;
+	
+	if (!GetVarint(Data, End, ExpectedOldSize) || !GetVarint(Data, End, NewSize)) return false;
+	
+	//Wrong base, no sense even trying.
+	if (ExpectedOldSize != OldSize || NewSize > BINDELTA_MAX_OUTPUT) return false;
+	
+	NewOut.reserve(NewSize);
+	
+	uint64_t LastCopyEnd = 0;
+	
+	while (NewOut.size() < NewSize)
+	{
+		if (Data >= End) goto Corrupt;
+		
+		const uint8_t Token = *Data++;
+		uint64_t LiteralSize = Token >> 5;
+		uint64_t CopyLength = Token & BINDELTA_TOKEN_COPY_MAX;
+		uint64_t Extra = 0;
+		
+		if (LiteralSize == BINDELTA_TOKEN_LITERAL_MAX)
+		{
+			if (!GetVarint(Data, End, Extra) || Extra > BINDELTA_MAX_OUTPUT) goto Corrupt;
+			LiteralSize += Extra;
+		}
+		
+		if (LiteralSize > (uint64_t)(End - Data) || LiteralSize > NewSize - NewOut.size()) goto Corrupt;
+		
+		NewOut.insert(NewOut.end(), Data, Data + LiteralSize);
+		Data += LiteralSize;
+		
+		if (CopyLength == BINDELTA_TOKEN_COPY_MAX)
+		{
+			if (!GetVarint(Data, End, Extra) || Extra > BINDELTA_MAX_OUTPUT) goto Corrupt;
+			CopyLength += Extra;
+		}
+		
+		if (CopyLength > NewSize - NewOut.size()) goto Corrupt;
+		
+		if (!CopyLength)
+		{
+			if (NewOut.size() < NewSize && !LiteralSize) goto Corrupt; //Would loop forever.
+			continue;
+		}
+		
+		int64_t Displacement = 0;
+		
+		if (Token & BINDELTA_TOKEN_DISPLACED)
+		{
+			uint64_t Zigzag = 0;
+			
+			if (!GetVarint(Data, End, Zigzag)) goto Corrupt;
+			
+			Displacement = (int64_t)(Zigzag >> 1) ^ -(int64_t)(Zigzag & 1);
+		}
+		
+		const uint64_t CopyFrom = LastCopyEnd + LiteralSize + Displacement;
+		
+		if (CopyFrom > OldSize || CopyLength > OldSize - CopyFrom) goto Corrupt;
+		
+		NewOut.insert(NewOut.end(), Old + CopyFrom, Old + CopyFrom + CopyLength);
+		
+		LastCopyEnd = CopyFrom + CopyLength;
+	}
+	
+	if (Data != End) goto Corrupt; //Trailing junk means something's off.
+	
+	return true;
+	
+Corrupt:
+	NewOut.clear();
+	return false;
+}
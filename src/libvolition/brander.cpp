@@ -187,3 +187,11 @@ Brander::AttrValue *Brander::ReadBrandedBinaryViaBuffer(const void *Buf, const s
 	return RetVal;
 }
 
+bool Brander::UnbrandPerNodeAttributes(void *Buf, const size_t BufSize)
+{ //Branding with an empty string zeroes the whole field, so this doesn't care what was there before.
+	std::map<AttributeTypes, AttrValue> Values;
+	Values.emplace(AttributeTypes::IDENTITY, VLString());
+	Values.emplace(AttributeTypes::AUTHTOKEN, VLString());
+	
+	return BrandBinaryViaBuffer(Buf, BufSize, Values);
+}
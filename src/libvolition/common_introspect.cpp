@@ -85,6 +85,14 @@ static struct
 							{ TOKEN_KEYVALPAIR(CMDCODE_A2C_LISTDIRECTORY) },
 							{ TOKEN_KEYVALPAIR(CMDCODE_N2N_GENERIC) },
 							{ TOKEN_KEYVALPAIR(CMDCODE_A2C_EXECSNIPPET) },
+							{ TOKEN_KEYVALPAIR(CMDCODE_A2S_SRVLOG_QUERY) },
+							{ TOKEN_KEYVALPAIR(CMDCODE_B2S_VAULT_PUTCHUNK) },
+							{ TOKEN_KEYVALPAIR(CMDCODE_B2S_VAULT_GETCHUNK) },
+							{ TOKEN_KEYVALPAIR(CMDCODE_A2C_FILES_FETCHCHUNK) },
+							{ TOKEN_KEYVALPAIR(CMDCODE_A2C_FILES_PLACECHUNK) },
+							{ TOKEN_KEYVALPAIR(CMDCODE_A2S_TELEMETRY) },
+							{ TOKEN_KEYVALPAIR(CMDCODE_A2C_FILES_HASHTREE) },
+							{ TOKEN_KEYVALPAIR(CMDCODE_A2C_FILES_SYNC) },
 						};
 
 static struct
@@ -0,0 +1,35 @@
+/**
+* This file is part of Volition.
+
+* Volition is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+
+* Volition is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+
+* You should have received a copy of the GNU General Public License
+* along with Volition.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#ifndef _VL_BINDELTA_H_
+#define _VL_BINDELTA_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+namespace BinDelta
+{ //Binary patches between two versions of a file, for sending node updates as just what changed.
+
+	/*A patch is a run of literal bytes, then a copy out of the old file, over and over.
+	* Copy offsets are relative to where the last copy ended, since recompiled binaries
+	* tend to shift a whole region at once and then match at the same displacement for a while.*/
+	bool Create(const void *Old, const size_t OldSize, const void *New, const size_t NewSize, std::vector<uint8_t> &PatchOut);
+	bool Apply(const void *Old, const size_t OldSize, const void *Patch, const size_t PatchSize, std::vector<uint8_t> &NewOut);
+}
+
+#endif //_VL_BINDELTA_H_
@@ -72,6 +72,7 @@ namespace Brander
 	bool BrandBinaryViaFile(const char *Path, std::map<AttributeTypes, AttrValue> &Values);
 	AttrValue *ReadBrandedBinaryViaBuffer(const void *Buf, const size_t BufSize, const AttributeTypes Attribute);
 	AttrValue *ReadBrandedBinaryViaFile(const char *Path, const AttributeTypes Attribute);
+	bool UnbrandPerNodeAttributes(void *Buf, const size_t BufSize); //Blanks identity and auth token, so every node's copy of a binary is byte for byte the same.
 
 }
 #endif //__VL_BRANDER_H__
@@ -104,6 +104,14 @@ enum CommandCode : CommandCodeUint //Keep this 8-bit unsigned, or the gerbocalyp
 	CMDCODE_A2C_LISTDIRECTORY	= 58, //List the contents of a directory on the node's host system
 	CMDCODE_N2N_GENERIC			= 59, //Filler command code for node to node communications, provided the right authentication tokens are in use.
 	CMDCODE_A2C_EXECSNIPPET		= 60, //Execute a typed in or copy pasted chunk of Lua code
+	CMDCODE_A2S_SRVLOG_QUERY	= 61, //Get server log lines filtered by event type, node ID and age, via the log's index
+	CMDCODE_B2S_VAULT_PUTCHUNK	= 62, //Upload a vault item in resumable chunks
+	CMDCODE_B2S_VAULT_GETCHUNK	= 63, //Download a vault item in resumable chunks
+	CMDCODE_A2C_FILES_FETCHCHUNK= 64, //Download a file from host's drive(s) in resumable chunks, streamed as it's read.
+	CMDCODE_A2C_FILES_PLACECHUNK= 65, //Upload a file to host's drive(s) in resumable chunks, committed atomically once verified.
+	CMDCODE_A2S_TELEMETRY		= 66, //Get a summary of recent host health samples the server has collected from nodes.
+	CMDCODE_A2C_FILES_HASHTREE	= 67, //Hash every file under a directory on the host, in parallel, and return the manifest.
+	CMDCODE_A2C_FILES_SYNC		= 68, //Compare a directory on the host with a sender's manifest and report which files need sending, optionally deleting extras.
 	CMDCODE_MAX
 };
 
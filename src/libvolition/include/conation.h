@@ -355,6 +355,13 @@ namespace Conation
 			return Result;
 		}
 		
+		inline bool HasItems(void)
+		{
+			VLThreads::MutexKeeper Keeper { &this->Mutex };
+			
+			return !this->Queue.empty();
+		}
+		
 		inline ConationStream *WaitPop(void)
 		{
 			this->PushEvent.Wait();
@@ -105,6 +105,7 @@ namespace NetScheduler
 		virtual bool HasError(void);
 		virtual bool ClearError(void);
 		virtual void SetStatusObj(SchedulerStatusObj *StatusObj);
+		virtual size_t GetQueueSize(void);
 	};
 	
 	class WriteQueue : public QueueBase
@@ -0,0 +1,64 @@
+/**
+* This file is part of Volition.
+
+* Volition is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+
+* Volition is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+
+* You should have received a copy of the GNU General Public License
+* along with Volition.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+
+#ifndef _VL_TELEMETRY_H_
+#define _VL_TELEMETRY_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+namespace Telemetry
+{ //Host health samples, gathered by nodes and sent along with ping replies in delta encoded batches.
+
+	/*IMPORTANT!!!! Same as command codes, only add fields at the end.
+	* Decoders skip fields they don't know about and zero the ones they don't get.*/
+	enum Field : uint8_t
+	{
+		FIELD_TIME, //Unix time.
+		FIELD_CPU_BUSY, //Permille over all CPUs, since the previous sample.
+		FIELD_LOAD1, //Load averages, times 100.
+		FIELD_LOAD5,
+		FIELD_LOAD15,
+		FIELD_MEM_TOTAL, //KiB
+		FIELD_MEM_AVAILABLE,
+		FIELD_SWAP_TOTAL,
+		FIELD_SWAP_FREE,
+		FIELD_DISK_READ, //Bytes since boot, over whole disks.
+		FIELD_DISK_WRITTEN,
+		FIELD_NET_RX, //Bytes since boot, over everything but loopback.
+		FIELD_NET_TX,
+		FIELD_PROCS_RUNNING,
+		FIELD_MAX
+	};
+	
+	struct Sample
+	{
+		int64_t Values[FIELD_MAX];
+		
+		Sample(void) : Values() {}
+	};
+	
+	const char *FieldName(const Field Which);
+	
+	//Each field of each sample is a zigzag varint of the difference from the sample before it, so slow moving counters cost a byte or two.
+	std::vector<uint8_t> EncodeBatch(const std::vector<Sample> &Samples);
+	bool DecodeBatch(const uint8_t *Data, const size_t Length, std::vector<Sample> &Out);
+}
+
+#endif //_VL_TELEMETRY_H_
@@ -34,6 +34,7 @@ namespace Utils
 	uint64_t vl_htonll(const uint64_t Original);
 	uint64_t vl_ntohll(const uint64_t Original);
 	void vl_sleep(uint64_t Milliseconds);
+	uint64_t GetMonotonicMs(void);
 	bool FileExists(const char *Path);
 	bool GetFileSize(const char *Path, uint64_t *Output);
 	VLString StripPathFromFilename(const char *FilePath);
@@ -53,6 +54,35 @@ namespace Utils
 	
 	VLString GetFileSha512(const VLString &Path);
 	
+	class Sha512Hasher
+	{ //For data that arrives a piece at a time and shouldn't all be in memory at once.
+	private:
+		void *Context; //So we don't drag OpenSSL's headers into everything that includes us.
+		
+		Sha512Hasher(const Sha512Hasher&);
+		Sha512Hasher &operator=(const Sha512Hasher&);
+	public:
+		Sha512Hasher(void);
+		~Sha512Hasher(void);
+		
+		void Update(const void *Buffer, const uint64_t Length);
+		VLString Finish(void);
+	};
+	
+	class Xxh64Hasher
+	{ //XXH64. Not even slightly cryptographic, but several times faster than SHA-512, for when we just want to know if something changed.
+	private:
+		uint64_t Acc[4];
+		uint64_t TotalLength;
+		uint8_t Pending[32];
+		size_t PendingSize;
+	public:
+		Xxh64Hasher(void);
+		
+		void Update(const void *Buffer, const uint64_t Length);
+		VLString Finish(void); //Sixteen hex digits, same as xxhsum prints. Resets afterwards like Sha512Hasher.
+	};
+	
 	inline VLString TimeToString(const time_t Time)
 	{
 		struct tm TimeStruct = *localtime(&Time);
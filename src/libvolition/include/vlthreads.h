@@ -126,6 +126,7 @@ namespace VLThreads
 		Semaphore(const size_t InitialCount = 0);
 		~Semaphore(void);
 		void Wait(void);
+		bool TimedWait(const uint64_t Milliseconds); //Returns false if we timed out.
 		void Post(void);
 	};
 	
@@ -127,6 +127,13 @@ bool NetScheduler::QueueBase::HasError(void)
 	return Value;
 }
 
+size_t NetScheduler::QueueBase::GetQueueSize(void)
+{
+	VLThreads::MutexKeeper Keeper { &this->Mutex };
+	
+	return this->Queue.size();
+}
+
 void NetScheduler::QueueBase::SetStatusObj(SchedulerStatusObj *const StatusObj)
 {
 	VLThreads::MutexKeeper Keeper { &this->Mutex };
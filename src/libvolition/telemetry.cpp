@@ -0,0 +1,145 @@
+/**
+* This file is part of Volition.
+
+* Volition is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+
+* Volition is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+
+* You should have received a copy of the GNU General Public License
+* along with Volition.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+
+#include "include/common.h"
+#include "include/telemetry.h"
+
+#define TELEMETRY_BATCH_VERSION 1
+#define TELEMETRY_MAX_BATCH_SAMPLES (1024 * 64) //Way more than anyone sends, just so garbage can't make us allocate the world.
+
+static void PutVarint(std::vector<uint8_t> &Out, uint64_t Value);
+static bool GetVarint(const uint8_t *&Data, const uint8_t *End, uint64_t &Out);
+
+static const char *const FieldNames[Telemetry::FIELD_MAX] =
+{
+	"Time",
+	"CPUBusy",
+	"Load1",
+	"Load5",
+	"Load15",
+	"MemTotal",
+	"MemAvailable",
+	"SwapTotal",
+	"SwapFree",
+	"DiskRead",
+	"DiskWritten",
+	"NetRX",
+	"NetTX",
+	"ProcsRunning",
+};
+
+const char *Telemetry::FieldName(const Field Which)
+{
+	return Which < FIELD_MAX ? FieldNames[Which] : "Unknown";
+}
+
+static void PutVarint(std::vector<uint8_t> &Out, uint64_t Value)
+{
+	while (Value >= 0x80)
+	{
+		Out.push_back((Value & 0x7F) | 0x80);
+		Value >>= 7;
+	}
+	
+	Out.push_back(Value);
+}
+
+static bool GetVarint(const uint8_t *&Data, const uint8_t *End, uint64_t &Out)
+{
+	Out = 0;
+	
+	for (unsigned Shift = 0; Shift < 64 && Data < End; Shift += 7)
+	{
+		const uint8_t Byte = *Data++;
+		
+		Out |= (uint64_t)(Byte & 0x7F) << Shift;
+		
+		if (!(Byte & 0x80)) return true;
+	}
+	
+	return false; //Ran off the end or it's too long to be real.
+}
+
+std::vector<uint8_t> Telemetry::EncodeBatch(const std::vector<Sample> &Samples)
+{
+	std::vector<uint8_t> RetVal;
+	
+	RetVal.reserve(8 + Samples.size() * FIELD_MAX * 2);
+	
+	RetVal.push_back(TELEMETRY_BATCH_VERSION);
+	PutVarint(RetVal, FIELD_MAX);
+	PutVarint(RetVal, Samples.size());
+	
+	Sample Previous;
+	
+	for (const Sample &Current : Samples)
+	{
+		for (size_t Inc = 0; Inc < FIELD_MAX; ++Inc)
+		{
+			const int64_t Delta = (uint64_t)Current.Values[Inc] - (uint64_t)Previous.Values[Inc];
+			
+			PutVarint(RetVal, ((uint64_t)Delta << 1) ^ (uint64_t)(Delta >> 63));
+		}
+		
+		Previous = Current;
+	}
+	
+	return RetVal;
+}
+
+bool Telemetry::DecodeBatch(const uint8_t *Data, const size_t Length, std::vector<Sample> &Out)
+{
+	Out.clear();
+	
+	const uint8_t *const End = Data + Length;
+	uint64_t NumFields = 0, NumSamples = 0;
+	
+	if (!Length || *Data++ != TELEMETRY_BATCH_VERSION) return false;
+	
+	if (!GetVarint(Data, End, NumFields) || !GetVarint(Data, End, NumSamples)) return false;
+	
+	//Every field takes at least a byte, so that's an easy sanity check.
+	if (NumSamples > TELEMETRY_MAX_BATCH_SAMPLES || (NumFields && NumSamples > (uint64_t)(End - Data) / NumFields)) return false;
+	
+	Out.reserve(NumSamples);
+	
+	Sample Previous;
+	
+	for (uint64_t SampleNum = 0; SampleNum < NumSamples; ++SampleNum)
+	{
+		Sample Current = Previous;
+		
+		for (uint64_t Inc = 0; Inc < NumFields; ++Inc)
+		{
+			uint64_t Encoded = 0;
+			
+			if (!GetVarint(Data, End, Encoded)) return false;
+			
+			if (Inc >= FIELD_MAX) continue; //From a newer node.
+			
+			const int64_t Delta = (int64_t)(Encoded >> 1) ^ -(int64_t)(Encoded & 1);
+			
+			Current.Values[Inc] = (uint64_t)Previous.Values[Inc] + (uint64_t)Delta;
+		}
+		
+		Out.push_back(Current);
+		Previous = Current;
+	}
+	
+	return true;
+}
@@ -43,7 +43,37 @@
 #include "include/utils.h"
 #include "include/common.h"
 
+#define XXH64_PRIME1 0x9E3779B185EBCA87ull
+#define XXH64_PRIME2 0xC2B2AE3D27D4EB4Full
+#define XXH64_PRIME3 0x165667B19E3779F9ull
+#define XXH64_PRIME4 0x85EBCA77C2B2AE63ull
+#define XXH64_PRIME5 0x27D4EB2F165667C5ull
+
 static inline uint64_t Swap64bit(const uint64_t Original);
+static VLString Sha512DigestToHex(const uint8_t *Digest);
+static inline uint64_t Xxh64Rotate(const uint64_t Value, const unsigned Bits);
+static inline uint64_t Xxh64Round(uint64_t Acc, const uint64_t Input);
+static inline uint64_t Xxh64Merge(uint64_t Acc, const uint64_t Value);
+static inline uint64_t Xxh64Read64(const uint8_t *Ptr);
+static inline uint32_t Xxh64Read32(const uint8_t *Ptr);
+
+static VLString Sha512DigestToHex(const uint8_t *Digest)
+{
+	VLString RetVal((SHA512_DIGEST_LENGTH * 2) + 1);
+
+	const uint8_t *Worker = Digest, *const Stopper = Digest + SHA512_DIGEST_LENGTH;
+
+	char Tmp[32]{};
+
+	for (; Worker != Stopper; ++Worker)
+	{
+		snprintf(Tmp, sizeof Tmp, "%02x", *Worker);
+
+		RetVal += (const char*)Tmp;
+	}
+	
+	return RetVal;
+}
 
 VLString Utils::GetSha512(const void *Buffer, const uint64_t Length)
 {
@@ -55,21 +85,168 @@ VLString Utils::GetSha512(const void *Buffer, const uint64_t Length)
     SHA512_Update(&Context, Buffer, Length);
     SHA512_Final(BinBuf, &Context);
 
-	VLString RetVal((sizeof BinBuf * 2) + 1);
+	const VLString &RetVal = Sha512DigestToHex(BinBuf);
 
-	uint8_t *Worker = BinBuf, *const Stopper = BinBuf + SHA512_DIGEST_LENGTH;
+	VLDEBUG("Returning SHA512 " + RetVal);
+	return RetVal;
+}
 
-	char Tmp[32]{};
+Utils::Sha512Hasher::Sha512Hasher(void) : Context(new SHA512_CTX{})
+{
+	SHA512_Init(static_cast<SHA512_CTX*>(this->Context));
+}
 
-	for (; Worker != Stopper; ++Worker)
-	{
-		snprintf(Tmp, sizeof Tmp, "%02x", *Worker);
+Utils::Sha512Hasher::~Sha512Hasher(void)
+{
+	delete static_cast<SHA512_CTX*>(this->Context);
+}
 
-		RetVal += (const char*)Tmp;
+void Utils::Sha512Hasher::Update(const void *Buffer, const uint64_t Length)
+{
+	SHA512_Update(static_cast<SHA512_CTX*>(this->Context), Buffer, Length);
+}
+
+VLString Utils::Sha512Hasher::Finish(void)
+{ //Resets afterwards, so the object can be reused for another stream.
+	uint8_t BinBuf[SHA512_DIGEST_LENGTH + 1] {};
+	
+	SHA512_Final(BinBuf, static_cast<SHA512_CTX*>(this->Context));
+	SHA512_Init(static_cast<SHA512_CTX*>(this->Context));
+	
+	return Sha512DigestToHex(BinBuf);
+}
+
+static inline uint64_t Xxh64Rotate(const uint64_t Value, const unsigned Bits)
+{
+	return (Value << Bits) | (Value >> (64 - Bits));
+}
+
+static inline uint64_t Xxh64Round(uint64_t Acc, const uint64_t Input)
+{
+	Acc += Input * XXH64_PRIME2;
+	Acc = Xxh64Rotate(Acc, 31);
+	
+	return Acc * XXH64_PRIME1;
+}
+
+static inline uint64_t Xxh64Merge(uint64_t Acc, const uint64_t Value)
+{
+	Acc ^= Xxh64Round(0, Value);
+	
+	return Acc * XXH64_PRIME1 + XXH64_PRIME4;
+}
+
+static inline uint64_t Xxh64Read64(const uint8_t *Ptr)
+{ //The spec is little endian no matter what we're running on.
+	uint64_t Value;
+	memcpy(&Value, Ptr, sizeof Value);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	Value = __builtin_bswap64(Value);
+#endif
+	return Value;
+}
+
+static inline uint32_t Xxh64Read32(const uint8_t *Ptr)
+{
+	uint32_t Value;
+	memcpy(&Value, Ptr, sizeof Value);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	Value = __builtin_bswap32(Value);
+#endif
+	return Value;
+}
+
+Utils::Xxh64Hasher::Xxh64Hasher(void)
+	: Acc { XXH64_PRIME1 + XXH64_PRIME2, XXH64_PRIME2, 0, 0 - XXH64_PRIME1 }, TotalLength(), Pending(), PendingSize()
+{
+}
+
+void Utils::Xxh64Hasher::Update(const void *Buffer, const uint64_t Length)
+{
+	const uint8_t *Ptr = static_cast<const uint8_t*>(Buffer);
+	const uint8_t *const End = Ptr + Length;
+	
+	this->TotalLength += Length;
+	
+	if (this->PendingSize + Length < sizeof this->Pending)
+	{ //Not enough for a whole stripe yet.
+		memcpy(this->Pending + this->PendingSize, Ptr, Length);
+		this->PendingSize += Length;
+		return;
 	}
+	
+	if (this->PendingSize)
+	{
+		const size_t Needed = sizeof this->Pending - this->PendingSize;
+		
+		memcpy(this->Pending + this->PendingSize, Ptr, Needed);
+		Ptr += Needed;
+		
+		for (size_t Inc = 0; Inc < 4; ++Inc) this->Acc[Inc] = Xxh64Round(this->Acc[Inc], Xxh64Read64(this->Pending + Inc * 8));
+		
+		this->PendingSize = 0;
+	}
+	
+	for (; End - Ptr >= 32; Ptr += 32)
+	{
+		this->Acc[0] = Xxh64Round(this->Acc[0], Xxh64Read64(Ptr));
+		this->Acc[1] = Xxh64Round(this->Acc[1], Xxh64Read64(Ptr + 8));
+		this->Acc[2] = Xxh64Round(this->Acc[2], Xxh64Read64(Ptr + 16));
+		this->Acc[3] = Xxh64Round(this->Acc[3], Xxh64Read64(Ptr + 24));
+	}
+	
+	memcpy(this->Pending, Ptr, End - Ptr);
+	this->PendingSize = End - Ptr;
+}
 
-	VLDEBUG("Returning SHA512 " + RetVal);
-	return RetVal;
+VLString Utils::Xxh64Hasher::Finish(void)
+{
+	uint64_t Hash = 0;
+	
+	if (this->TotalLength >= 32)
+	{
+		Hash = Xxh64Rotate(this->Acc[0], 1) + Xxh64Rotate(this->Acc[1], 7) + Xxh64Rotate(this->Acc[2], 12) + Xxh64Rotate(this->Acc[3], 18);
+		
+		for (size_t Inc = 0; Inc < 4; ++Inc) Hash = Xxh64Merge(Hash, this->Acc[Inc]);
+	}
+	else Hash = XXH64_PRIME5; //Seed's always zero.
+	
+	Hash += this->TotalLength;
+	
+	const uint8_t *Ptr = this->Pending;
+	const uint8_t *const End = Ptr + this->PendingSize;
+	
+	for (; End - Ptr >= 8; Ptr += 8)
+	{
+		Hash ^= Xxh64Round(0, Xxh64Read64(Ptr));
+		Hash = Xxh64Rotate(Hash, 27) * XXH64_PRIME1 + XXH64_PRIME4;
+	}
+	
+	if (End - Ptr >= 4)
+	{
+		Hash ^= (uint64_t)Xxh64Read32(Ptr) * XXH64_PRIME1;
+		Hash = Xxh64Rotate(Hash, 23) * XXH64_PRIME2 + XXH64_PRIME3;
+		Ptr += 4;
+	}
+	
+	for (; Ptr < End; ++Ptr)
+	{
+		Hash ^= *Ptr * XXH64_PRIME5;
+		Hash = Xxh64Rotate(Hash, 11) * XXH64_PRIME1;
+	}
+	
+	Hash ^= Hash >> 33;
+	Hash *= XXH64_PRIME2;
+	Hash ^= Hash >> 29;
+	Hash *= XXH64_PRIME3;
+	Hash ^= Hash >> 32;
+	
+	*this = Xxh64Hasher();
+	
+	char Buf[32];
+	snprintf(Buf, sizeof Buf, "%016llx", (unsigned long long)Hash);
+	
+	return Buf;
 }
 
 VLString Utils::GetFileSha512(const VLString &Path)
@@ -121,18 +298,7 @@ VLString Utils::GetFileSha512(const VLString &Path)
 
 	SHA512_Final(BinBuf, &Context);
 
-	VLString RetVal((sizeof BinBuf * 2) + 1);
-
-	uint8_t *Worker = BinBuf, *const Stopper = BinBuf + SHA512_DIGEST_LENGTH;
-
-	char Tmp[32]{};
-
-	for (; Worker != Stopper; ++Worker)
-	{
-		snprintf(Tmp, sizeof Tmp, "%02x", *Worker);
-
-		RetVal += (const char*)Tmp;
-	}
+	const VLString &RetVal = Sha512DigestToHex(BinBuf);
 
 	VLDEBUG("Returning SHA512 " + RetVal);
 	return RetVal;
@@ -286,6 +452,19 @@ void Utils::vl_sleep(uint64_t Milliseconds)
 #endif //WIN32
 }
 
+uint64_t Utils::GetMonotonicMs(void)
+{ //Milliseconds from some arbitrary point, unaffected by the wall clock being changed. Only good for measuring intervals.
+#ifdef WIN32
+	return GetTickCount64();
+#else
+	struct timespec Now{};
+	
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	
+	return (uint64_t)Now.tv_sec * 1000 + Now.tv_nsec / 1000000;
+#endif //WIN32
+}
+
 bool Utils::WriteFile(const char *OutPath, const void *Buffer, const size_t FileSize)
 {
 	VLScopedPtr<FILE*, int(*)(FILE*)> Descriptor { fopen(OutPath, "wb"), fclose };
@@ -34,6 +34,8 @@ extern "C"
 
 #endif //WIN32
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
 
 #include "include/vlthreads.h"
 VLThreads::Mutex::Mutex(void)
@@ -99,6 +101,34 @@ void VLThreads::Semaphore::Wait(void)
 #endif
 }
 
+bool VLThreads::Semaphore::TimedWait(const uint64_t Milliseconds)
+{
+#ifdef WIN32
+	return WaitForSingleObject((HANDLE)this->Resource, Milliseconds) == WAIT_OBJECT_0;
+#elif defined(MACOSX)
+	return dispatch_semaphore_wait(*(dispatch_semaphore_t*)this->Resource, dispatch_time(DISPATCH_TIME_NOW, Milliseconds * NSEC_PER_MSEC)) == 0;
+#else
+	struct timespec Deadline{};
+	
+	clock_gettime(CLOCK_REALTIME, &Deadline); //sem_timedwait() only takes the realtime clock.
+	
+	Deadline.tv_sec += Milliseconds / 1000;
+	Deadline.tv_nsec += (Milliseconds % 1000) * 1000000;
+	
+	if (Deadline.tv_nsec >= 1000000000)
+	{
+		++Deadline.tv_sec;
+		Deadline.tv_nsec -= 1000000000;
+	}
+	
+	int Result = 0;
+	
+	while ((Result = sem_timedwait((sem_t*)this->Resource, &Deadline)) != 0 && errno == EINTR); //Signals again.
+	
+	return Result == 0;
+#endif
+}
+
 void VLThreads::Semaphore::Post(void)
 {
 #ifdef WIN32
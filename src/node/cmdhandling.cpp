@@ -26,6 +26,7 @@
 #include "identity_module.h"
 #include "updates.h"
 #include "main.h"
+#include "sampler.h"
 
 #define ADMIN_STR "ADMIN"
 
@@ -42,8 +43,25 @@ void CmdHandling::HandleRequest(Conation::ConationStream *Stream)
 	switch (Hdr.CmdCode)
 	{
 		case CMDCODE_ANY_PING:
+		{
 			Main::PingTrack.RegisterPing();
-			//Fall through
+			
+			//Servers that want telemetry tell us how often to sample, and we send back what we've got since last time.
+			if (Stream->VerifyArgTypes({Conation::ARGTYPE_UINT32})) Sampler::SetInterval(Stream->Pop_Uint32());
+			
+			Conation::ConationStream::StreamHeader NewHeader = Hdr;
+			NewHeader.CmdIdentFlags |= Conation::IDENT_ISREPORT_BIT;
+			
+			Conation::ConationStream *Response = new Conation::ConationStream(NewHeader, Stream->GetArgData());
+			
+			std::vector<uint8_t> Batch;
+			
+			if (Sampler::TakeBatch(Batch)) Response->Push_BinStream(Batch.data(), Batch.size());
+
+			Main::PushStreamToWriteQueue(Response);
+			
+			break;
+		}
 		case CMDCODE_ANY_ECHO:
 		{
 			Conation::ConationStream::StreamHeader NewHeader = Hdr;
@@ -85,12 +103,36 @@ void CmdHandling::HandleRequest(Conation::ConationStream *Stream)
 		}
 		case CMDCODE_B2C_USEUPDATE:
 		{ //Server's ordering us to self-update.
-			if (!Stream->VerifyArgTypes({Conation::ARGTYPE_FILE}))
-			{ //corrupted, I guess just ignore it.
-				break;
+			Conation::ConationStream::FileArg File;
+			std::vector<uint8_t> Rebuilt;
+			
+			if (Stream->VerifyArgTypes({Conation::ARGTYPE_BINSTREAM, Conation::ARGTYPE_STRING}))
+			{ //A patch against what we're running now.
+				const Conation::ConationStream::BinStreamArg Patch = Stream->Pop_BinStream();
+				const VLString &Sha512 = Stream->Pop_String();
+				
+				const NetCmdStatus PatchStatus = Updates::RebuildFromPatch(Patch, Sha512, Rebuilt);
+				
+				if (!PatchStatus)
+				{ //Nothing's been torn down yet, so just tell the server, and it'll send the whole binary.
+					VLWARN(PatchStatus.Msg);
+					
+					Conation::ConationStream FailResponse(CMDCODE_B2C_USEUPDATE, true, 0u);
+					
+					FailResponse.Push_NetCmdStatus(PatchStatus);
+					
+					Main::PushStreamToWriteQueue(FailResponse);
+					break;
+				}
+				
+				File.Data = Rebuilt.data();
+				File.DataSize = Rebuilt.size();
 			}
-			
-			Conation::ConationStream::FileArg File = Stream->Pop_File();
+			else if (Stream->VerifyArgTypes({Conation::ARGTYPE_FILE}))
+			{
+				File = Stream->Pop_File();
+			}
+			else break; //corrupted, I guess just ignore it.
 
 			//THIS SHOULD NEVER RETURN!!!
 			const NetCmdStatus WhatFailed = Updates::AttemptUpdate(File);
@@ -114,7 +156,9 @@ void CmdHandling::HandleRequest(Conation::ConationStream *Stream)
 		case CMDCODE_A2C_FILES_MOVE:
 		case CMDCODE_A2C_FILES_DEL:
 		case CMDCODE_A2C_FILES_PLACE:
+		case CMDCODE_A2C_FILES_PLACECHUNK:
 		case CMDCODE_A2C_FILES_FETCH:
+		case CMDCODE_A2C_FILES_FETCHCHUNK:
 		case CMDCODE_A2C_GETPROCESSES:
 		case CMDCODE_A2C_KILLPROCESS:
 		case CMDCODE_A2C_MOD_EXECFUNC:
@@ -122,6 +166,8 @@ void CmdHandling::HandleRequest(Conation::ConationStream *Stream)
 		case CMDCODE_A2C_MOD_UNLOADSCRIPT:
 		case CMDCODE_A2C_HOSTREPORT:
 		case CMDCODE_A2C_LISTDIRECTORY:
+		case CMDCODE_A2C_FILES_HASHTREE:
+		case CMDCODE_A2C_FILES_SYNC:
 		{
 			VLDEBUG("Spawning" + ((Stream->GetCmdIdentFlags() & Conation::IDENT_ISROUTINE_BIT) ? "routine" : "admin ordered") + " job " + CommandCodeToString(Hdr.CmdCode));
 			Jobs::StartJob(Hdr.CmdCode, Stream);
@@ -25,294 +25,2050 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stddef.h>
+#include <map>
+#include <atomic>
+#include <queue>
+#include <vector>
+#include <algorithm>
+#include <tuple>
+#include <memory>
 
+#include "../libvolition/include/vlthreads.h"
 #include "files.h"
 
 #ifndef WIN32
 #include <pwd.h>
 #include <grp.h>
+#include <pthread.h>
+#else
+#include <utime.h>
 #endif //WIN32
 
-NetCmdStatus Files::Delete(const char *Path)
-{ //Try to do as much of our needed allocation on the heap as possible to allow lots of recursion.
-	VLScopedPtr<struct stat*> FileStat = new struct stat();
+#ifdef LINUX
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif //LINUX
+
+//Chunked uploads. Sessions nobody's touched in this long get thrown out along with their temp file.
+#define PLACE_SESSION_EXPIRY_MS (1000ull * 60 * 60 * 24)
+#define PLACE_TEMP_SUFFIX ".vlpart"
+#define PLACE_MAX_REPORTED_RANGES 64
+
+struct PlaceSession
+{
+	uint64_t TotalSize;
+	VLString Hash;
+	std::map<uint64_t, uint64_t> Ranges; //Start -> end of what we've got on disk, kept merged.
+	uint64_t LastTouched;
+	bool Committing;
+};
+
+static struct
+{ //Keyed by destination path. Chunks for one file can arrive on several workers at once.
+	VLThreads::Mutex Mutex;
+	std::map<VLString, PlaceSession> Sessions;
+} PlaceSessions;
+
+//Directory listings.
+#define LIST_GETDENTS_BUFFER_SIZE (1024 * 64)
+#define LIST_NSS_BUFFER_SIZE (1024 * 16)
+#define LIST_NAME_CACHE_MAX 4096
+
+struct ListCandidate
+{ //The bits of an entry we need for filtering and sorting. Only the ones that make the page become DirectoryEntry's.
+	VLString Name;
+	uint64_t Size;
+	int64_t ModTime;
+	int64_t CreateTime;
+	uint64_t Mode;
+	uint32_t Uid;
+	uint32_t Gid;
+	uint64_t Offset; //Where to pick back up after this one, for unsorted listings.
+	uint8_t Type; //Files::LIST_TYPE_*, zero if we don't know yet.
+	bool Stated;
+};
+
+#ifdef LINUX
+struct LinuxDirent64
+{ //glibc doesn't give us a declaration for this.
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1]; //Really d_reclen - offsetof(LinuxDirent64, d_name) long, NUL terminated.
+};
+#endif //LINUX
+
+#ifndef WIN32
+static struct
+{ //getpwuid() and friends can go out to LDAP, and a directory's usually owned by the same handful of people.
+	VLThreads::Mutex Mutex;
+	std::map<uint32_t, VLString> Users;
+	std::map<uint32_t, VLString> Groups;
+} NameCache;
+
+//Tree walks for copy, delete and hashing.
+#define WALK_WORKERS 8 //Counting the calling thread.
+#define WALK_MAX_QUEUED 256 //Past this, subdirectories get done inline so we don't hog file descriptors.
+#define WALK_POLL_MS 250
+#define WALK_PROGRESS_INTERVAL_MS 5000
+
+enum WalkOp : uint8_t
+{
+	WALK_DELETE,
+	WALK_COPY,
+	WALK_HASH, //Only collects paths of regular files. The hashing happens afterwards.
+};
+
+struct CancelShield
+{ /*Holds off pthread_cancel() for a moment. Older glibc can act on a cancel just after open() made a descriptor but before
+	* it's been handed back to us, and then nobody ever closes it. Same goes for close() and knowing whether it happened.*/
+	int OldState;
+	
+	CancelShield(void) : OldState() { pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &this->OldState); }
+	~CancelShield(void) { pthread_setcancelstate(this->OldState, nullptr); }
+};
+
+class ScopedDesc
+{ //Closes the descriptor however we leave, so a walk that's cancelled or throws partway through doesn't leak any.
+private:
+	int Desc;
 	
-	if (stat(Path, FileStat) != 0)
+	ScopedDesc(const ScopedDesc&);
+	ScopedDesc &operator=(const ScopedDesc&);
+public:
+	ScopedDesc(const int DescIn = -1) : Desc(DescIn) {}
+	~ScopedDesc(void) { this->Close(); }
+	
+	ScopedDesc &operator=(const int DescIn)
 	{
-		return NetCmdStatus(false, STATUS_MISSING);
+		this->Close();
+		this->Desc = DescIn;
+		return *this;
 	}
 	
-
-	//Just a file.
-	if (!S_ISDIR(FileStat->st_mode))
+	operator int(void) const { return this->Desc; }
+	
+	int Close(void)
 	{
-		return !unlink(Path);
+		if (this->Desc == -1) return 0;
+		
+		const CancelShield Shield;
+		const int RetVal = close(this->Desc);
+		this->Desc = -1;
+		return RetVal;
 	}
+};
+
+struct WalkDir
+{
+	ScopedDesc Fd;
+	ScopedDesc DestFd; //Copies only.
+	VLString Name; //Our name in the parent directory. The full path for the root.
+	WalkDir *Parent;
+	std::atomic<size_t> Pending; //One for our own listing, plus one for each subdirectory that isn't finished yet.
+	struct stat Stat;
 	
+	WalkDir(void) : Fd(), DestFd(), Name(), Parent(), Pending(1), Stat() {}
+};
+
+struct WalkContext
+{ //Shared with the workers, so it's still around for them even if the walk's caller goes away first.
+	const WalkOp Op;
+	const bool PreserveMetadata;
+	VLThreads::Mutex Mutex;
+	VLThreads::Semaphore Semaphore;
+	std::list<WalkDir*> Queue;
+	std::atomic<bool> Done;
+	std::atomic<bool> Cancelled; //Directories still get listed and finished, just with nothing done for their entries, so everything drains out and closes.
+	std::atomic<uint64_t> Entries, Bytes, Failures;
+	std::vector<VLString> HashPaths; //Relative to the root. Guarded by Mutex.
 	
-	//Directory.
-	DIR *CurDir = opendir(Path);
+	WalkContext(const WalkOp InOp, const bool InPreserve) : Op(InOp), PreserveMetadata(InPreserve), Done(), Cancelled(), Entries(), Bytes(), Failures() {}
+};
+
+struct WalkDirKeeper
+{ //Releases a directory on the way out of processing it, even if our thread's being cancelled, so the walk can still finish.
+	WalkContext *const Ctx;
+	WalkDir *const Dir;
 	
-	if (!CurDir)
+	~WalkDirKeeper(void);
+};
+
+struct WalkCrew
+{ //The worker threads. Joins them however we leave WalkTree, telling them to wrap up if the walk isn't finished.
+	std::shared_ptr<WalkContext> Ctx;
+	std::list<VLThreads::Thread> Workers;
+	
+	void Join(void);
+	~WalkCrew(void);
+};
+
+//Tree hashing.
+#define HASH_MAX_WORKERS 16 //Counting the calling thread.
+#define HASH_READ_BLOCK_SIZE (1024 * 1024)
+#define HASH_READ_ALIGNMENT 4096
+#define HASH_CACHE_MAX (1024 * 128)
+
+struct HashCacheKey
+{ //If none of this changed, neither did the contents, short of somebody going out of their way to fake it.
+	uint64_t Device, Inode, Size;
+	int64_t ModNs, ChangeNs;
+	uint8_t Algo;
+	
+	bool operator<(const HashCacheKey &Other) const
 	{
-		return false;
+		return std::tie(Inode, Device, Size, ModNs, ChangeNs, Algo) < std::tie(Other.Inode, Other.Device, Other.Size, Other.ModNs, Other.ChangeNs, Other.Algo);
 	}
-	struct dirent *DirPtr = nullptr;
-	bool AllSucceeded = true;
+};
+
+static struct
+{ //Lives as long as we do, so re-checking a tree that hasn't changed is just a stat per file.
+	VLThreads::Mutex Mutex;
+	std::map<HashCacheKey, VLString> Digests;
+} HashCache;
+
+struct HashContext
+{ //Owns everything the workers touch, so it's still there if HashTree() gets unwound out from under them.
+	const VLString Root;
+	const Files::HashAlgo Algo;
+	const std::atomic_bool *const Cancel; //The caller's, and it outlives the workers since HashCrew joins them.
+	std::vector<Files::ManifestEntry> Manifest;
+	std::atomic<size_t> Next;
+	std::atomic<uint64_t> Hashed, Bytes, Failures;
+	std::atomic<bool> Cancelled;
 	
-	while ((DirPtr = readdir(CurDir)))
+	HashContext(const char *InRoot, const Files::HashAlgo InAlgo, const std::atomic_bool *const InCancel)
+		: Root(InRoot), Algo(InAlgo), Cancel(InCancel), Next(), Hashed(), Bytes(), Failures(), Cancelled() {}
+	
+	bool Stopping(void) const { return this->Cancelled || (this->Cancel && *this->Cancel); }
+};
+
+struct HashCrew
+{ //Same deal as WalkCrew.
+	std::shared_ptr<HashContext> Ctx;
+	std::list<VLThreads::Thread> Workers;
+	
+	void Join(void);
+	~HashCrew(void);
+};
+
+static void WalkProcessDir(WalkContext *Ctx, WalkDir *Dir);
+static void WalkEntry(WalkContext *Ctx, WalkDir *Dir, const char *Name, const unsigned char Type);
+static void WalkDescend(WalkContext *Ctx, WalkDir *Dir, const char *Name);
+static void WalkReleaseDir(WalkContext *Ctx, WalkDir *Dir);
+static void WalkFinishDir(WalkContext *Ctx, WalkDir *Dir);
+static void WalkRunOne(WalkContext *Ctx, const uint64_t WaitMs);
+static void *WalkWorkerFunc(std::shared_ptr<WalkContext> *CtxRef);
+static VLString WalkRelativePath(const WalkDir *Dir, const char *Name);
+static bool WalkTree(const WalkOp Op, const char *Source, const char *Destination, const bool PreserveMetadata, const Files::WalkProgressFunc Progress, void *const UserData,
+					const std::atomic_bool *const Cancel, std::vector<VLString> *const HashPathsOut = nullptr, uint64_t *const FailuresOut = nullptr);
+static bool HashOneFile(HashContext *Ctx, Files::ManifestEntry &Entry, uint8_t *Buffer);
+static void HashWorkLoop(HashContext *Ctx, const Files::WalkProgressFunc Progress, void *const UserData);
+static void *HashWorkerFunc(std::shared_ptr<HashContext> *CtxRef);
+#endif //WIN32
+
+#define CHUNK_SIZE (1024*1024*4) //4MB
+
+#ifdef LINUX
+static uint64_t KernelCopy(const int InDesc, const int OutDesc, const uint64_t Size)
+{ /*Best first: reflink shares the extents outright on btrfs/XFS, copy_file_range() stays in the kernel
+	* (and can do server-side copies on NFS), sendfile() at least skips the trip through userspace.
+	* Returns how far we got, and the caller does the rest with read/write if that's short.*/
+#ifdef FICLONE
+	if (ioctl(OutDesc, FICLONE, InDesc) == 0) return Size;
+#endif //FICLONE
+
+	loff_t InOffset = 0, OutOffset = 0;
+	
+#ifdef SYS_copy_file_range
+	while ((uint64_t)InOffset < Size)
 	{
-		const VLString &NewPath = VLString(Path) + PATHSEP + (const char*)DirPtr->d_name;
+		const ssize_t Copied = syscall(SYS_copy_file_range, InDesc, &InOffset, OutDesc, &OutOffset, Size - InOffset, 0u);
 		
-		if (!Files::Delete(NewPath)) AllSucceeded = false;
+		if (Copied == -1 && errno == EINTR) continue;
 		
+		if (Copied <= 0) break; //ENOSYS, EXDEV on older kernels, or a filesystem that doesn't support it.
 	}
 	
-	closedir(CurDir);
+	if ((uint64_t)InOffset >= Size) return Size;
+#endif //SYS_copy_file_range
+
+	//sendfile() writes at the output's file position, which copy_file_range() never moved.
+	if (lseek(OutDesc, InOffset, SEEK_SET) == -1) return 0;
+	
+	off_t SendOffset = InOffset;
 	
-	return AllSucceeded && !rmdir(Path);
+	while ((uint64_t)SendOffset < Size)
+	{
+		const ssize_t Copied = sendfile(OutDesc, InDesc, &SendOffset, Size - SendOffset);
+		
+		if (Copied == -1 && errno == EINTR) continue;
+		
+		if (Copied <= 0) break;
+	}
+	
+	return SendOffset;
 }
+#endif //LINUX
 
-#define CHUNK_SIZE (1024*1024*4) //4MB
+#ifndef WIN32
+static bool CopyDescriptors(ScopedDesc &InDesc, ScopedDesc &OutDesc, const struct stat &SourceStat, const bool PreserveMetadata, const std::atomic_bool *const Cancel)
+{ //Closes both descriptors no matter what, so callers can just open and hand them over.
+	if (InDesc == -1 || OutDesc == -1) return false;
+	
+	const uint64_t Size = SourceStat.st_size;
+	uint64_t Done = 0;
+	bool Success = true;
+	
+#ifdef LINUX
+	//Zero could just mean /proc or sysfs, which have plenty in them but don't say so. The kernel paths trust the size, so don't bother.
+	if (Size) Done = KernelCopy(InDesc, OutDesc, Size);
+#endif //LINUX
+
+	if (!Size || Done < Size)
+	{ //Plain old read/write until EOF, from wherever the kernel paths left off.
+		VLScopedPtr<uint8_t*> Buffer { new uint8_t[CHUNK_SIZE], VL_ALLOCTYPE_ARRAYNEW };
+		
+		if (lseek(InDesc, Done, SEEK_SET) == -1 || lseek(OutDesc, Done, SEEK_SET) == -1) return false;
+		
+		ssize_t Read = 0;
+		
+		while ((Read = read(InDesc, Buffer, CHUNK_SIZE)) != 0)
+		{
+			if (Cancel && *Cancel)
+			{
+				Success = false;
+				break;
+			}
+			
+			if (Read == -1 && errno == EINTR) continue;
+			
+			if (Read == -1)
+			{
+				VLDEBUG("read() failed on source");
+				Success = false;
+				break;
+			}
+			
+			ssize_t Written = 0;
+			
+			while (Written < Read)
+			{
+				const ssize_t Result = write(OutDesc, Buffer + Written, Read - Written);
+				
+				if (Result == -1 && errno == EINTR) continue;
+				
+				if (Result <= 0) break;
+				
+				Written += Result;
+			}
+			
+			if (Written < Read)
+			{
+				VLDEBUG("write() failed on destination");
+				Success = false;
+				break;
+			}
+		}
+	}
+	
+	if (Success && PreserveMetadata)
+	{
+		if (fchown(OutDesc, SourceStat.st_uid, SourceStat.st_gid) != 0) {} //Only works as root, and that's fine.
+		
+		fchmod(OutDesc, SourceStat.st_mode & 07777); //Again, since chown can clear setuid and umask got a say at open().
+		
+		const struct timespec Times[2] = { SourceStat.st_atim, SourceStat.st_mtim };
+		futimens(OutDesc, Times);
+	}
+	
+	InDesc.Close();
+	
+	return OutDesc.Close() == 0 && Success;
+}
 
-static bool CopyFileSub(const char *Source, const char *Destination)
+static bool CopyFileSub(const char *Source, const char *Destination, const struct stat &SourceStat, const bool PreserveMetadata, const std::atomic_bool *const Cancel)
 {
-	VLScopedPtr<struct stat*> FileStat = new struct stat();
+	ScopedDesc InDesc, OutDesc;
+	
+	{
+		const CancelShield Shield;
+		
+		InDesc = open(Source, O_RDONLY | O_CLOEXEC);
+		if (InDesc != -1) OutDesc = open(Destination, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, PreserveMetadata ? (SourceStat.st_mode & 07777) : 0666);
+	}
 	
-	if (stat(Source, FileStat) != 0 ||
-		S_ISDIR(FileStat->st_mode))
+	if (InDesc == -1)
 	{
-		VLDEBUG("stat() of source failed.");
+		VLDEBUG("Failed to open source \"" + Source + "\"");
 		return false;
 	}
 	
-	const size_t Size = FileStat->st_size;
+	if (OutDesc == -1)
+	{
+		VLDEBUG("Failed to open destination \"" + Destination + "\"");
+	}
 	
+	return CopyDescriptors(InDesc, OutDesc, SourceStat, PreserveMetadata, Cancel);
+}
+#else
+static bool CopyFileSub(const char *Source, const char *Destination, const struct stat &SourceStat, const bool PreserveMetadata, const std::atomic_bool *const Cancel)
+{
+	const uint64_t Size = SourceStat.st_size;
 	
 	VLScopedPtr<FILE*, int(*)(FILE*)> InDesc { fopen(Source, "rb"), fclose };
 	VLScopedPtr<FILE*, int(*)(FILE*)> OutDesc { fopen(Destination, "wb"), fclose };
 	
 	if (!InDesc || !OutDesc)
 	{
-		VLDEBUG("Failed to open a descriptor. InDesc open: " + VLString::IntToString((bool)InDesc) + " OutDesc open: " + VLString::IntToString((bool)InDesc));
+		VLDEBUG("Failed to open a descriptor. InDesc open: " + VLString::IntToString((bool)InDesc) + " OutDesc open: " + VLString::IntToString((bool)OutDesc));
 		return false;
 	}
 	
-	size_t TotalRead = 0;
+	uint64_t TotalRead = 0;
 	size_t Read = 0;
 	
 	VLScopedPtr<uint8_t*> Buffer { new uint8_t[CHUNK_SIZE], VL_ALLOCTYPE_ARRAYNEW };
 	
 	for (; TotalRead < Size; TotalRead += Read)
 	{
+		if (Cancel && *Cancel) return false;
+		
 		Read = fread(Buffer, 1, CHUNK_SIZE, InDesc);
 		
-		if (ferror(InDesc))
+		if (ferror(InDesc) || !Read || fwrite(Buffer, 1, Read, OutDesc) != Read)
 		{
-	LoopFailed:
-
-			VLDEBUG("InDesc tripped ferror()");
+			VLDEBUG("Copy loop failed");
 			return false;
 		}
+	}
+	
+	if (PreserveMetadata)
+	{ //Has to be closed first or the timestamp gets bumped when it's flushed.
+		fclose(OutDesc.Forget());
 		
-		if (!Read) goto LoopFailed; //We're using the loop condition to test this, we shouldn't get here!
-		
-		if (fwrite(Buffer, 1, Read, OutDesc) < 0) goto LoopFailed;
-		
-		if (ferror(OutDesc))
-		{
-			VLDEBUG("OutDesc tripped ferror()");
-			goto LoopFailed;
-		}
+		struct utimbuf Times { SourceStat.st_atime, SourceStat.st_mtime };
 		
+		chmod(Destination, SourceStat.st_mode);
+		utime(Destination, &Times);
 	}
-		
-	return true;
 	
+	return true;
 }
+#endif //WIN32
 
-
-bool Files::Copy(const char *Source, const char *Destination)
+#ifndef WIN32
+///Parallel tree walker for copies and deletes.
+/*Everything is done relative to open directory descriptors with the *at() calls, so we never build or resolve
+* full paths, and the kernel doesn't have to walk them again for every single entry.
+* Subdirectories go on a shared queue for a small pool of threads. A directory is finished (removed, or has its
+* metadata applied) once its own listing and every subdirectory under it is done.*/
+static void WalkProcessDir(WalkContext *Ctx, WalkDir *Dir)
 {
+	const WalkDirKeeper Keeper { Ctx, Dir };
 	
-	VLDEBUG("Source: \"" + Source + "\", Destination: \"" + Destination + "\"");
+	if (Ctx->Cancelled) return;
 	
-	VLScopedPtr<struct stat *> FileStat { new struct stat() };
+	VLScopedPtr<DIR*, int(*)(DIR*)> Listing { nullptr, closedir };
 	
-	if (stat(Source, FileStat) != 0)
 	{
-		return false;
+		const CancelShield Shield;
+		const int ListDesc = dup(Dir->Fd); //fdopendir() takes ownership, and we still need Dir->Fd for the *at() calls.
+		
+		Listing.Encase(ListDesc != -1 ? fdopendir(ListDesc) : nullptr, closedir);
+		
+		if (!Listing && ListDesc != -1) close(ListDesc);
 	}
 	
-	if (!S_ISDIR(FileStat->st_mode))
-	{ //Regular file.
-		VLDEBUG("Copying regular file \"" + Source + "\" to \"" + Destination + "\".");
-		return CopyFileSub(Source, Destination);
+	if (!Listing)
+	{
+		++Ctx->Failures;
+		return;
 	}
 	
-	//Directory
+	struct dirent *Ent = nullptr;
 	
-	//Create destination directory.
-#ifdef WIN32
-	if (mkdir(Destination) != 0)
-#else
-	if (mkdir(Destination, 0755) != 0)
-#endif //WIN32
+	while (!Ctx->Cancelled && (Ent = readdir(Listing)))
 	{
-		return false;
+		if (!strcmp(Ent->d_name, ".") || !strcmp(Ent->d_name, "..")) continue;
+		
+		WalkEntry(Ctx, Dir, Ent->d_name, Ent->d_type);
 	}
+}
+
+WalkDirKeeper::~WalkDirKeeper(void)
+{
+	WalkReleaseDir(this->Ctx, this->Dir);
+}
+
+static void WalkEntry(WalkContext *Ctx, WalkDir *Dir, const char *Name, const unsigned char Type)
+{
+	struct stat EntStat{};
+	bool HaveStat = false;
+	mode_t Kind = 0;
 	
-	VLScopedPtr<DIR*, decltype(&closedir)> CurDir { opendir(Source), closedir };
-	
-	if (!CurDir) return false;
+	//d_type saves us a stat per entry on filesystems that fill it in.
+	switch (Type)
+	{
+		case DT_DIR:
+			Kind = S_IFDIR;
+			break;
+		case DT_LNK:
+			Kind = S_IFLNK;
+			break;
+		case DT_REG:
+			Kind = S_IFREG;
+			break;
+		default:
+			if (fstatat(Dir->Fd, Name, &EntStat, AT_SYMLINK_NOFOLLOW) != 0)
+			{
+				++Ctx->Failures;
+				return;
+			}
+			
+			Kind = EntStat.st_mode & S_IFMT;
+			HaveStat = true;
+			break;
+	}
 	
-	struct dirent *DirPtr = nullptr;
+	++Ctx->Entries;
 	
-	while ((DirPtr = readdir(CurDir)))
+	if (Kind == S_IFDIR)
 	{
-		const VLString &NewOldPath { VLString(Source) + PATHSEP + (const char*)DirPtr->d_name };
-		const VLString &NewNewPath { VLString(Destination) + PATHSEP + (const char*)DirPtr->d_name };
+		WalkDescend(Ctx, Dir, Name);
+		return;
+	}
+	
+	if (Ctx->Op == WALK_DELETE)
+	{ //Symlinks get unlinked themselves, never followed.
+		if (unlinkat(Dir->Fd, Name, 0) != 0) ++Ctx->Failures;
+		return;
+	}
+	
+	if (Ctx->Op == WALK_HASH)
+	{ //Links and special files have no contents worth hashing. Regular files get stat'd when they're hashed, so don't bother now.
+		if (Kind != S_IFREG) return;
+		
+		if (strchr(Name, '\n'))
+		{ //Would break the manifest's line format.
+			++Ctx->Failures;
+			return;
+		}
 		
-		//Reuse the pointer declared in the outer scope.
-		VLScopedPtr<struct stat*> FileStat { new struct stat() };
+		const VLString &Path = WalkRelativePath(Dir, Name);
 		
-		//Get file type.
-		if (stat(NewOldPath, FileStat) != 0)
+		Ctx->Mutex.Lock();
+		Ctx->HashPaths.push_back(Path);
+		Ctx->Mutex.Unlock();
+		return;
+	}
+	
+	//Copying from here on, and we need the real stat for sizes and modes.
+	if (!HaveStat && fstatat(Dir->Fd, Name, &EntStat, AT_SYMLINK_NOFOLLOW) != 0)
+	{
+		++Ctx->Failures;
+		return;
+	}
+	
+	if (S_ISLNK(EntStat.st_mode))
+	{ //Recreated as a link like 'cp -r' does, rather than followed off to who knows where.
+		VLString Target { 4096 };
+		
+		if (readlinkat(Dir->Fd, Name, Target.GetBuffer(), Target.GetCapacity() - 1) == -1 || symlinkat(Target, Dir->DestFd, Name) != 0)
 		{
-			return false;
+			++Ctx->Failures;
+			return;
 		}
 		
-		if (S_ISDIR(FileStat->st_mode))
-		{ //Directory
-			if (!Files::Copy(NewOldPath, NewNewPath))
-			{
-				return false;
-			}
-		}
-		else
+		if (Ctx->PreserveMetadata)
 		{
-			if (!CopyFileSub(NewOldPath, NewNewPath))
-			{
-				return false;
-			}
+			if (fchownat(Dir->DestFd, Name, EntStat.st_uid, EntStat.st_gid, AT_SYMLINK_NOFOLLOW) != 0) {} //Root only.
+			
+			const struct timespec Times[2] = { EntStat.st_atim, EntStat.st_mtim };
+			utimensat(Dir->DestFd, Name, Times, AT_SYMLINK_NOFOLLOW);
 		}
+		return;
 	}
-
-	return true;	
-}
-
-bool Files::Move(const char *Source, const char *Destination)
-{
-	int Status = rename(Source, Destination); //Try an easy rename.
 	
-	if (Status == 0) return true; //Worked.
+	if (!S_ISREG(EntStat.st_mode))
+	{ //FIFOs, sockets and device nodes. Opening a FIFO would just hang us.
+		++Ctx->Failures;
+		return;
+	}
 	
-	//Something went wrong.
+	ScopedDesc InDesc, OutDesc;
 	
-	if (errno == EXDEV) //Target isn't on the same filesystem.
 	{
-		if (!Files::Copy(Source, Destination)) return false; //Can't do it.
-		
-		if (!Files::Delete(Source)) return false;
+		const CancelShield Shield;
 		
-		return true;
+		InDesc = openat(Dir->Fd, Name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		if (InDesc != -1) OutDesc = openat(Dir->DestFd, Name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, Ctx->PreserveMetadata ? (EntStat.st_mode & 07777) : 0666);
 	}
 	
-	//Another error occurred.
-	return false;
-
+	if (!CopyDescriptors(InDesc, OutDesc, EntStat, Ctx->PreserveMetadata, &Ctx->Cancelled))
+	{
+		++Ctx->Failures;
+		return;
+	}
+	
+	Ctx->Bytes += EntStat.st_size;
 }
 
-bool Files::Chdir(const char *NewWD)
+static void WalkDescend(WalkContext *Ctx, WalkDir *Dir, const char *Name)
 {
-	return !chdir(NewWD);
+	VLScopedPtr<WalkDir*> Child { new WalkDir };
+	
+	Child->Name = Name;
+	Child->Parent = Dir;
+	
+	{
+		const CancelShield Shield;
+		
+		Child->Fd = openat(Dir->Fd, Name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		
+		//Kept writable for us until it's finished, then it gets its real mode.
+		if (Child->Fd != -1 && Ctx->Op == WALK_COPY && mkdirat(Dir->DestFd, Name, Ctx->PreserveMetadata ? 0700 : 0755) == 0)
+		{
+			Child->DestFd = openat(Dir->DestFd, Name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		}
+	}
+	
+	if (Child->Fd == -1 || fstat(Child->Fd, &Child->Stat) != 0 || (Ctx->Op == WALK_COPY && Child->DestFd == -1))
+	{
+		++Ctx->Failures;
+		return;
+	}
+	
+	++Dir->Pending;
+	
+	Ctx->Mutex.Lock();
+	
+	if (Ctx->Queue.size() < WALK_MAX_QUEUED)
+	{
+		Ctx->Queue.push_back(Child.Forget());
+		Ctx->Mutex.Unlock();
+		
+		Ctx->Semaphore.Post();
+		return;
+	}
+	
+	Ctx->Mutex.Unlock();
+	
+	//Queue's full, so do it ourselves rather than pile up more open descriptors.
+	WalkProcessDir(Ctx, Child.Forget());
 }
 
-VLString Files::GetWorkingDirectory(void)
-{
-	VLString CWD { 4096 };
-	getcwd(CWD.GetBuffer(), CWD.GetCapacity());
-
-	return CWD;
+static void WalkReleaseDir(WalkContext *Ctx, WalkDir *Dir)
+{ //The last one out finishes the directory, and maybe its parent after it.
+	while (Dir && Dir->Pending.fetch_sub(1) == 1)
+	{
+		WalkDir *const Parent = Dir->Parent;
+		
+		WalkFinishDir(Ctx, Dir);
+		
+		Dir = Parent;
+	}
 }
 
-static bool GetDirectoryEntry(const VLString &Path, Files::DirectoryEntry &Out)
+static void WalkFinishDir(WalkContext *Ctx, WalkDir *Dir)
 {
-	struct stat FileStat{};
-	
-#ifndef WIN32
-	if (lstat(+Path, &FileStat) != 0)
-#else
-	if (stat(+Path, &FileStat) != 0)
-#endif //WIN32
+	if (Ctx->Op == WALK_COPY && Ctx->PreserveMetadata)
 	{
-		VLWARN("Unable to stat path at " + Path);
-		return false;
+		if (fchown(Dir->DestFd, Dir->Stat.st_uid, Dir->Stat.st_gid) != 0) {} //Root only.
+		
+		const struct timespec Times[2] = { Dir->Stat.st_atim, Dir->Stat.st_mtim };
+		
+		if (fchmod(Dir->DestFd, Dir->Stat.st_mode & 07777) != 0 || futimens(Dir->DestFd, Times) != 0) ++Ctx->Failures;
 	}
 	
-	Out.Path = Path;
-	Out.Size = FileStat.st_size;
-	Out.ModTime = FileStat.st_mtime;
-	Out.CreateTime = FileStat.st_ctime;
-#ifndef WIN32 //I could probably fix group and owner, but Win32 API is torture and I don't feel like dealing with it.
-	Out.Permissions = FileStat.st_mode;
-
-	if (S_ISLNK(FileStat.st_mode))
+	Dir->DestFd.Close();
+	Dir->Fd.Close();
+	
+	//Our parent is still open, since we're one of the things it's waiting on.
+	if (Ctx->Op == WALK_DELETE && unlinkat(Dir->Parent ? (int)Dir->Parent->Fd : AT_FDCWD, Dir->Name, AT_REMOVEDIR) != 0)
 	{
-		VLString Buf { 4096 } ; //Make sure it's zero initialized, readlink doesn't null terminate.
+		++Ctx->Failures;
+	}
+	
+	if (!Dir->Parent)
+	{ //That was the root, so we're all done. Wake everybody up so they can leave.
+		Ctx->Done = true;
 		
-		if (readlink(+Path, Buf.GetBuffer(), Buf.GetCapacity() - 1) == -1)
-		{
-			VLWARN("Unable to read target for symlink " + Path);
-		}
-		else Out.Symlink = std::move(Buf);
+		for (size_t Inc = 0; Inc < WALK_WORKERS; ++Inc) Ctx->Semaphore.Post();
 	}
 	
-	struct group *const GroupStruct = getgrgid(FileStat.st_gid);
+	delete Dir;
+}
+
+static void WalkRunOne(WalkContext *Ctx, const uint64_t WaitMs)
+{
+	if (!Ctx->Semaphore.TimedWait(WaitMs)) return;
+	
+	Ctx->Mutex.Lock();
 	
-	if (!GroupStruct)
+	if (Ctx->Queue.empty())
 	{
-		VLWARN("Unable to lookup group for GID " + VLString::UintToString(FileStat.st_gid) + " for path " + Path);
+		Ctx->Mutex.Unlock();
+		return;
 	}
-	else Out.Group = GroupStruct->gr_name;
 	
-	struct passwd *const UserStruct = getpwuid(FileStat.st_uid);
+	WalkDir *const Dir = Ctx->Queue.front();
+	Ctx->Queue.pop_front();
 	
-	if (!UserStruct)
-	{
-		VLWARN("Unable to lookup user for UID " + VLString::UintToString(FileStat.st_uid) + " for path " + Path);
-	}
-	else Out.Owner = UserStruct->pw_name;
-
-#endif //WIN32
-	Out.IsDirectory = S_ISDIR(FileStat.st_mode);
+	Ctx->Mutex.Unlock();
 	
-	return true;
+	WalkProcessDir(Ctx, Dir);
 }
 
+static void *WalkWorkerFunc(std::shared_ptr<WalkContext> *CtxRef)
+{
+	const std::shared_ptr<WalkContext> Ctx { *CtxRef };
+	
+	delete CtxRef;
+	
+	while (!Ctx->Done) WalkRunOne(Ctx.get(), WALK_POLL_MS);
+	
+	return nullptr;
+}
 
-std::list<Files::DirectoryEntry> *Files::ListDirectory(const char *Path)
+void WalkCrew::Join(void)
 {
-	if (!Utils::IsDirectory(Path)) return nullptr; //Not a directory, so wtf are you doing
+	for (VLThreads::Thread &Worker : this->Workers) Worker.Join();
 	
-	VLScopedPtr<DIR*, decltype(&closedir)> Dir { opendir(Path), closedir };
+	this->Workers.clear();
+}
 
-	if (!Dir) return nullptr;
+WalkCrew::~WalkCrew(void)
+{ //Only has anybody left to join if we're being unwound, e.g. our thread was cancelled. They drain what's left of the walk without doing any of it.
+	if (this->Workers.empty()) return;
 	
-	struct dirent *Ptr = nullptr;
+	this->Ctx->Cancelled = true;
+	this->Join();
+}
 
-	std::list<Files::DirectoryEntry> *RetVal = new std::list<Files::DirectoryEntry>;
+static VLString WalkRelativePath(const WalkDir *Dir, const char *Name)
+{ //Every directory between us and the root is still open, since they're all waiting on us.
+	std::vector<const char*> Parts { Name };
 	
-	while ((Ptr = readdir(Dir)))
+	for (; Dir && Dir->Parent; Dir = Dir->Parent) Parts.push_back(Dir->Name);
+	
+	VLString RetVal(256);
+	
+	for (auto Iter = Parts.rbegin(); Iter != Parts.rend(); ++Iter)
 	{
-		const VLString &FullPath = VLString(Path) + PATHSEP + (const char*)Ptr->d_name;
-		
-		Files::DirectoryEntry Entry{};
-		
-		GetDirectoryEntry(FullPath, Entry);
-		
-		RetVal->push_back(Entry);
+		if (Iter != Parts.rbegin()) RetVal += PATHSEP;
+		RetVal += *Iter;
 	}
-
+	
 	return RetVal;
 }
+
+static bool WalkTree(const WalkOp Op, const char *Source, const char *Destination, const bool PreserveMetadata, const Files::WalkProgressFunc Progress, void *const UserData,
+					const std::atomic_bool *const Cancel, std::vector<VLString> *const HashPathsOut, uint64_t *const FailuresOut)
+{
+	WalkCrew Crew { std::make_shared<WalkContext>(Op, PreserveMetadata) };
+	WalkContext *const Ctx = Crew.Ctx.get();
+	
+	VLScopedPtr<WalkDir*> Root { new WalkDir };
+	
+	Root->Name = Source; //Only used to remove it when deleting.
+	
+	{
+		const CancelShield Shield;
+		
+		Root->Fd = open(Source, O_RDONLY | O_DIRECTORY | O_CLOEXEC | (Op == WALK_DELETE ? O_NOFOLLOW : 0));
+		
+		if (Root->Fd != -1 && Op == WALK_COPY && mkdir(Destination, PreserveMetadata ? 0700 : 0755) == 0)
+		{
+			Root->DestFd = open(Destination, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		}
+	}
+	
+	if (Root->Fd == -1 || fstat(Root->Fd, &Root->Stat) != 0 || (Op == WALK_COPY && Root->DestFd == -1)) return false;
+	
+	Ctx->Queue.push_back(Root.Forget());
+	Ctx->Semaphore.Post();
+	
+	for (size_t Inc = 1; Inc < WALK_WORKERS; ++Inc)
+	{
+		Crew.Workers.emplace_back((VLThreads::Thread::EntryFunc)WalkWorkerFunc, new std::shared_ptr<WalkContext>(Crew.Ctx));
+		Crew.Workers.back().Start();
+	}
+	
+	uint64_t LastProgress = Utils::GetMonotonicMs();
+	
+	while (!Ctx->Done)
+	{ //We pitch in too, and we're the one that reports progress, so the callback only ever runs on the caller's thread.
+		if (Cancel && *Cancel) Ctx->Cancelled = true;
+		
+		WalkRunOne(Ctx, WALK_POLL_MS);
+		
+		if (Progress && Utils::GetMonotonicMs() - LastProgress >= WALK_PROGRESS_INTERVAL_MS)
+		{
+			Progress({ Ctx->Entries, Ctx->Bytes, Ctx->Failures }, UserData);
+			LastProgress = Utils::GetMonotonicMs();
+		}
+	}
+	
+	Crew.Join();
+	
+	VLDEBUG("Walked " + VLString::UintToString(Ctx->Entries) + " entries, " + VLString::UintToString(Ctx->Failures) + " failures");
+	
+	if (Ctx->Cancelled) return false;
+	
+	if (HashPathsOut) HashPathsOut->swap(Ctx->HashPaths);
+	if (FailuresOut) *FailuresOut = Ctx->Failures;
+	
+	return !Ctx->Failures;
+}
+
+static bool HashOneFile(HashContext *Ctx, Files::ManifestEntry &Entry, uint8_t *Buffer)
+{
+	const VLString &FullPath = Ctx->Root + PATHSEP + Entry.Path;
+	
+	struct stat FileStat{};
+	
+	if (lstat(FullPath, &FileStat) != 0 || !S_ISREG(FileStat.st_mode)) return false;
+	
+	HashCacheKey Key { (uint64_t)FileStat.st_dev, (uint64_t)FileStat.st_ino, (uint64_t)FileStat.st_size,
+						FileStat.st_mtim.tv_sec * 1000000000ll + FileStat.st_mtim.tv_nsec,
+						FileStat.st_ctim.tv_sec * 1000000000ll + FileStat.st_ctim.tv_nsec, Ctx->Algo };
+	
+	Entry.Size = FileStat.st_size;
+	Entry.ModTime = FileStat.st_mtime;
+	
+	HashCache.Mutex.Lock();
+	
+	auto Iter = HashCache.Digests.find(Key);
+	
+	if (Iter != HashCache.Digests.end())
+	{
+		Entry.Digest = Iter->second;
+		HashCache.Mutex.Unlock();
+		return true;
+	}
+	
+	HashCache.Mutex.Unlock();
+	
+	ScopedDesc Desc;
+	
+	{
+		const CancelShield Shield;
+		
+		Desc = open(FullPath, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	}
+	
+	if (Desc == -1) return false;
+	
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(Desc, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif //POSIX_FADV_SEQUENTIAL
+	
+	const bool Fast = Ctx->Algo == Files::HASH_XXH64;
+	Utils::Sha512Hasher Sha;
+	Utils::Xxh64Hasher Xxh;
+	
+	ssize_t Read = 0;
+	uint64_t Total = 0;
+	
+	while ((Read = read(Desc, Buffer, HASH_READ_BLOCK_SIZE)) != 0)
+	{
+		if (Read == -1)
+		{
+			if (errno == EINTR) continue;
+			
+			return false;
+		}
+		
+		if (Ctx->Stopping()) return false;
+		
+		if (Fast) Xxh.Update(Buffer, Read);
+		else Sha.Update(Buffer, Read);
+		
+		Total += Read;
+	}
+	
+	//If it changed while we were reading, what we've got is probably a mix of both, so it's not going in the cache.
+	struct stat AfterStat{};
+	const bool Stable = fstat(Desc, &AfterStat) == 0 && AfterStat.st_ino == FileStat.st_ino && (uint64_t)AfterStat.st_size == Total &&
+						AfterStat.st_mtim.tv_sec == FileStat.st_mtim.tv_sec && AfterStat.st_mtim.tv_nsec == FileStat.st_mtim.tv_nsec;
+	
+	Desc.Close();
+	
+	Entry.Size = Total;
+	Entry.Digest = Fast ? Xxh.Finish() : Sha.Finish();
+	
+	Ctx->Bytes += Total;
+	
+	if (!Stable) return true;
+	
+	HashCache.Mutex.Lock();
+	
+	if (HashCache.Digests.size() >= HASH_CACHE_MAX) HashCache.Digests.erase(HashCache.Digests.begin());
+	
+	HashCache.Digests[Key] = Entry.Digest;
+	
+	HashCache.Mutex.Unlock();
+	
+	return true;
+}
+
+static void HashWorkLoop(HashContext *Ctx, const Files::WalkProgressFunc Progress, void *const UserData)
+{
+	void *Block = nullptr;
+	
+	if (posix_memalign(&Block, HASH_READ_ALIGNMENT, HASH_READ_BLOCK_SIZE) != 0) return; //Somebody else will pick up the slack.
+	
+	VLScopedPtr<uint8_t*, void(*)(void*)> Buffer { static_cast<uint8_t*>(Block), free };
+	
+	uint64_t LastProgress = Utils::GetMonotonicMs();
+	size_t Index = 0;
+	
+	while (!Ctx->Stopping() && (Index = Ctx->Next++) < Ctx->Manifest.size())
+	{
+		Files::ManifestEntry &Entry = Ctx->Manifest[Index];
+		
+		if (!HashOneFile(Ctx, Entry, Buffer)) ++Ctx->Failures;
+		
+		++Ctx->Hashed;
+		
+		if (Progress && Utils::GetMonotonicMs() - LastProgress >= WALK_PROGRESS_INTERVAL_MS)
+		{
+			Progress({ Ctx->Hashed, Ctx->Bytes, Ctx->Failures }, UserData);
+			LastProgress = Utils::GetMonotonicMs();
+		}
+	}
+}
+
+static void *HashWorkerFunc(std::shared_ptr<HashContext> *CtxRef)
+{
+	const std::shared_ptr<HashContext> Ctx { *CtxRef };
+	
+	delete CtxRef;
+	
+	HashWorkLoop(Ctx.get(), nullptr, nullptr);
+	
+	return nullptr;
+}
+
+void HashCrew::Join(void)
+{
+	for (VLThreads::Thread &Worker : this->Workers) Worker.Join();
+	
+	this->Workers.clear();
+}
+
+HashCrew::~HashCrew(void)
+{
+	if (this->Workers.empty()) return;
+	
+	this->Ctx->Cancelled = true;
+	this->Join();
+}
+#endif //WIN32
+
+NetCmdStatus Files::Delete(const char *Path, const WalkProgressFunc Progress, void *const UserData, const std::atomic_bool *const Cancel)
+{
+#ifndef WIN32
+	struct stat FileStat{};
+	
+	if (lstat(Path, &FileStat) != 0)
+	{
+		return NetCmdStatus(false, STATUS_MISSING);
+	}
+	
+	//Just a file, or a symlink, which we never follow.
+	if (!S_ISDIR(FileStat.st_mode))
+	{
+		return !unlink(Path);
+	}
+	
+	return WalkTree(WALK_DELETE, Path, nullptr, false, Progress, UserData, Cancel);
+#else
+	struct stat FileStat{};
+	
+	if (stat(Path, &FileStat) != 0)
+	{
+		return NetCmdStatus(false, STATUS_MISSING);
+	}
+	
+	//Just a file.
+	if (!S_ISDIR(FileStat.st_mode))
+	{
+		return !unlink(Path);
+	}
+	
+	//Directory.
+	VLScopedPtr<DIR*, decltype(&closedir)> CurDir { opendir(Path), closedir };
+	
+	if (!CurDir)
+	{
+		return false;
+	}
+	struct dirent *DirPtr = nullptr;
+	bool AllSucceeded = true;
+	
+	while ((DirPtr = readdir(CurDir)))
+	{
+		if (Cancel && *Cancel) return false;
+		
+		if (!strcmp(DirPtr->d_name, ".") || !strcmp(DirPtr->d_name, "..")) continue;
+		
+		const VLString &NewPath = VLString(Path) + PATHSEP + (const char*)DirPtr->d_name;
+		
+		if (!Files::Delete(NewPath, nullptr, nullptr, Cancel)) AllSucceeded = false;
+	}
+	
+	closedir(CurDir.Forget()); //Windows won't remove it while it's open.
+	
+	return AllSucceeded && !rmdir(Path);
+#endif //WIN32
+}
+
+#ifdef WIN32
+static bool CopyDirMetadata(const char *Destination, const struct stat &SourceStat)
+{ //Done after the contents, or copying them in would bump the timestamps right back.
+	struct utimbuf Times { SourceStat.st_atime, SourceStat.st_mtime };
+	
+	return !utime(Destination, &Times);
+}
+#endif //WIN32
+
+bool Files::Copy(const char *Source, const char *Destination, const bool PreserveMetadata, const WalkProgressFunc Progress, void *const UserData, const std::atomic_bool *const Cancel)
+{
+	
+	VLDEBUG("Source: \"" + Source + "\", Destination: \"" + Destination + "\"");
+	
+	struct stat FileStat{};
+	
+	if (stat(Source, &FileStat) != 0)
+	{
+		return false;
+	}
+	
+	if (!S_ISDIR(FileStat.st_mode))
+	{ //Regular file.
+		VLDEBUG("Copying regular file \"" + Source + "\" to \"" + Destination + "\".");
+		return CopyFileSub(Source, Destination, FileStat, PreserveMetadata, Cancel);
+	}
+	
+	//Directory
+#ifndef WIN32
+	return WalkTree(WALK_COPY, Source, Destination, PreserveMetadata, Progress, UserData, Cancel);
+#else
+	//Create destination directory.
+	if (mkdir(Destination) != 0)
+	{
+		return false;
+	}
+	
+	VLScopedPtr<DIR*, decltype(&closedir)> CurDir { opendir(Source), closedir };
+	
+	if (!CurDir) return false;
+	
+	struct dirent *DirPtr = nullptr;
+	
+	while ((DirPtr = readdir(CurDir)))
+	{
+		if (!strcmp(DirPtr->d_name, ".") || !strcmp(DirPtr->d_name, "..")) continue;
+		
+		const VLString &NewOldPath { VLString(Source) + PATHSEP + (const char*)DirPtr->d_name };
+		const VLString &NewNewPath { VLString(Destination) + PATHSEP + (const char*)DirPtr->d_name };
+		
+		struct stat EntryStat{};
+		
+		//Get file type.
+		if (stat(NewOldPath, &EntryStat) != 0)
+		{
+			return false;
+		}
+		
+		if (S_ISDIR(EntryStat.st_mode))
+		{ //Directory
+			if (!Files::Copy(NewOldPath, NewNewPath, PreserveMetadata, nullptr, nullptr, Cancel))
+			{
+				return false;
+			}
+		}
+		else
+		{
+			if (!CopyFileSub(NewOldPath, NewNewPath, EntryStat, PreserveMetadata, Cancel))
+			{
+				return false;
+			}
+		}
+	}
+	
+	if (PreserveMetadata) return CopyDirMetadata(Destination, FileStat);
+	
+	return true;
+#endif //WIN32
+}
+
+bool Files::Move(const char *Source, const char *Destination, const WalkProgressFunc Progress, void *const UserData, const std::atomic_bool *const Cancel)
+{
+	int Status = rename(Source, Destination); //Try an easy rename.
+	
+	if (Status == 0) return true; //Worked.
+	
+	//Something went wrong.
+	
+	if (errno == EXDEV) //Target isn't on the same filesystem.
+	{
+		//A move should look like a move, so keep the metadata.
+		if (!Files::Copy(Source, Destination, true, Progress, UserData, Cancel)) return false; //Can't do it, or we were cancelled partway.
+		
+		if (!Files::Delete(Source, Progress, UserData, Cancel)) return false;
+		
+		return true;
+	}
+	
+	//Another error occurred.
+	return false;
+
+}
+
+bool Files::Chdir(const char *NewWD)
+{
+	return !chdir(NewWD);
+}
+
+VLString Files::GetWorkingDirectory(void)
+{
+	VLString CWD { 4096 };
+	getcwd(CWD.GetBuffer(), CWD.GetCapacity());
+
+	return CWD;
+}
+
+static bool GlobMatch(const char *Pattern, const char *Name)
+{ //Just * and ?, which is all anybody uses, and it works the same on Windows.
+	const char *StarPattern = nullptr, *StarName = nullptr;
+	
+	while (*Name)
+	{
+		if (*Pattern == '*')
+		{
+			StarPattern = ++Pattern;
+			StarName = Name;
+			continue;
+		}
+		
+		if (*Pattern == '?' || *Pattern == *Name)
+		{
+			++Pattern;
+			++Name;
+			continue;
+		}
+		
+		if (!StarPattern) return false;
+		
+		//Let the last star eat one more character and try again.
+		Pattern = StarPattern;
+		Name = ++StarName;
+	}
+	
+	while (*Pattern == '*') ++Pattern;
+	
+	return !*Pattern;
+}
+
+#ifndef WIN32
+VLString Files::GetUserName(const uint32_t Uid)
+{ //Cached, so it's fine to call for every file or process.
+	VLThreads::MutexKeeper Keeper { &NameCache.Mutex };
+	
+	auto Lookup = NameCache.Users.find(Uid);
+	
+	if (Lookup != NameCache.Users.end()) return Lookup->second;
+	
+	Keeper.Unlock(); //NSS can take its sweet time if it's LDAP or something.
+	
+	struct passwd Entry{}, *Result = nullptr;
+	std::vector<char> Buf(LIST_NSS_BUFFER_SIZE);
+	
+	//Remember failures too, as the number, or we'd ask again for every file they own.
+	const VLString &Name = !getpwuid_r(Uid, &Entry, Buf.data(), Buf.size(), &Result) && Result ? VLString(Result->pw_name) : VLString::UintToString(Uid);
+	
+	Keeper.Lock();
+	
+	if (NameCache.Users.size() >= LIST_NAME_CACHE_MAX) NameCache.Users.clear();
+	
+	NameCache.Users[Uid] = Name;
+	
+	return Name;
+}
+
+VLString Files::GetGroupName(const uint32_t Gid)
+{
+	VLThreads::MutexKeeper Keeper { &NameCache.Mutex };
+	
+	auto Lookup = NameCache.Groups.find(Gid);
+	
+	if (Lookup != NameCache.Groups.end()) return Lookup->second;
+	
+	Keeper.Unlock();
+	
+	struct group Entry{}, *Result = nullptr;
+	std::vector<char> Buf(LIST_NSS_BUFFER_SIZE);
+	
+	const VLString &Name = !getgrgid_r(Gid, &Entry, Buf.data(), Buf.size(), &Result) && Result ? VLString(Result->gr_name) : VLString::UintToString(Gid);
+	
+	Keeper.Lock();
+	
+	if (NameCache.Groups.size() >= LIST_NAME_CACHE_MAX) NameCache.Groups.clear();
+	
+	NameCache.Groups[Gid] = Name;
+	
+	return Name;
+}
+#endif //WIN32
+
+static uint8_t ListTypeFromMode(const uint64_t Mode)
+{
+	if (S_ISDIR(Mode)) return Files::LIST_TYPE_DIR;
+	if (S_ISREG(Mode)) return Files::LIST_TYPE_FILE;
+#ifndef WIN32
+	if (S_ISLNK(Mode)) return Files::LIST_TYPE_LINK;
+#endif //WIN32
+	return Files::LIST_TYPE_OTHER;
+}
+
+static bool ListStatCandidate(const int DirFd, const char *Path, ListCandidate &Cand)
+{
+	struct stat FileStat{};
+	
+#ifndef WIN32
+	(void)Path;
+	if (fstatat(DirFd, Cand.Name, &FileStat, AT_SYMLINK_NOFOLLOW) != 0)
+#else
+	(void)DirFd;
+	if (stat(VLString(Path) + PATHSEP + Cand.Name, &FileStat) != 0)
+#endif //WIN32
+	{
+		return false;
+	}
+	
+	Cand.Size = FileStat.st_size;
+	Cand.ModTime = FileStat.st_mtime;
+	Cand.CreateTime = FileStat.st_ctime;
+	Cand.Mode = FileStat.st_mode;
+	Cand.Uid = FileStat.st_uid;
+	Cand.Gid = FileStat.st_gid;
+	Cand.Type = ListTypeFromMode(FileStat.st_mode);
+	Cand.Stated = true;
+	
+	return true;
+}
+
+static bool ListCandidateBefore(const Files::ListOptions &Options, const ListCandidate &A, const ListCandidate &B)
+{ //Sort order, with the name breaking ties so cursors always land somewhere definite.
+	int Result = 0;
+	
+	switch (Options.Sort)
+	{
+		case Files::LIST_SORT_SIZE:
+			Result = A.Size < B.Size ? -1 : A.Size > B.Size;
+			break;
+		case Files::LIST_SORT_MTIME:
+			Result = A.ModTime < B.ModTime ? -1 : A.ModTime > B.ModTime;
+			break;
+		default:
+			break;
+	}
+	
+	if (!Result) Result = strcmp(A.Name, B.Name);
+	
+	return Options.Descending ? Result > 0 : Result < 0;
+}
+
+static VLString EncodeListCursor(const Files::ListOptions &Options, const ListCandidate &Last)
+{
+	switch (Options.Sort)
+	{
+		case Files::LIST_SORT_NAME:
+			return VLString("n:") + Last.Name;
+		case Files::LIST_SORT_SIZE:
+			return VLString("s:") + VLString::UintToString(Last.Size) + ':' + Last.Name;
+		case Files::LIST_SORT_MTIME:
+			return VLString("m:") + VLString::IntToString(Last.ModTime) + ':' + Last.Name;
+		default:
+			return VLString("o:") + VLString::UintToString(Last.Offset);
+	}
+}
+
+static bool DecodeListCursor(const Files::ListOptions &Options, const VLString &Cursor, ListCandidate &Out)
+{ //Cursors from a different sort mode are no good to us.
+	static const char Prefixes[] = { 'o', 'n', 's', 'm' };
+	
+	if (Cursor.Length() < 2 || Options.Sort >= sizeof Prefixes || Cursor[0] != Prefixes[Options.Sort] || Cursor[1] != ':') return false;
+	
+	const char *Worker = +Cursor + 2;
+	
+	switch (Options.Sort)
+	{
+		case Files::LIST_SORT_NAME:
+			Out.Name = Worker;
+			return true;
+		case Files::LIST_SORT_SIZE:
+		case Files::LIST_SORT_MTIME:
+		{
+			const char *Colon = strchr(Worker, ':');
+			
+			if (!Colon) return false;
+			
+			Out.Size = strtoull(Worker, nullptr, 10);
+			Out.ModTime = strtoll(Worker, nullptr, 10);
+			Out.Name = Colon + 1;
+			return true;
+		}
+		default:
+			Out.Offset = strtoull(Worker, nullptr, 10);
+			return true;
+	}
+}
+
+bool Files::ParseListSort(const char *Spec, ListOptions &Out)
+{ //"name", "size" or "mtime", with a leading '-' for descending. Empty means directory order.
+	Out.Descending = *Spec == '-';
+	
+	if (Out.Descending) ++Spec;
+	
+	if (!*Spec) Out.Sort = LIST_SORT_NONE;
+	else if (!strcmp(Spec, "name")) Out.Sort = LIST_SORT_NAME;
+	else if (!strcmp(Spec, "size")) Out.Sort = LIST_SORT_SIZE;
+	else if (!strcmp(Spec, "mtime")) Out.Sort = LIST_SORT_MTIME;
+	else return false;
+	
+	return Out.Sort != LIST_SORT_NONE || !Out.Descending;
+}
+
+std::list<Files::DirectoryEntry> *Files::ListDirectory(const char *Path, const ListOptions &Options, VLString *NextCursor)
+{ /*Only ever holds one page of entries. Sorted listings keep the best PageSize seen so far and the cursor is the last key
+	* handed out, unsorted ones just remember where they were in the directory stream. Nothing gets stat'd unless a filter or
+	* the sort needs it, or it made it onto the page.*/
+	if (NextCursor) *NextCursor = VLString();
+	
+	const size_t PageSize = Options.PageSize ? Options.PageSize : SIZE_MAX;
+	const bool Sorted = Options.Sort != LIST_SORT_NONE;
+	const bool NeedStat = Options.MinSize || Options.ModifiedAfter || Options.Sort == LIST_SORT_SIZE || Options.Sort == LIST_SORT_MTIME;
+	
+	ListCandidate CursorCand{};
+	const bool HaveCursor = Options.Cursor && DecodeListCursor(Options, Options.Cursor, CursorCand);
+	
+	if (Options.Cursor && !HaveCursor) return nullptr; //Garbage cursor, better to say so than start over silently.
+	
+	auto Worse = [&Options](const ListCandidate &A, const ListCandidate &B) { return ListCandidateBefore(Options, A, B); };
+	
+	//Max-heap on sort order, so the top is the one to throw out when we're over.
+	std::priority_queue<ListCandidate, std::vector<ListCandidate>, decltype(Worse)> Best { Worse };
+	std::vector<ListCandidate> Page;
+	bool Truncated = false;
+	uint64_t Index = 0;
+	
+#ifndef WIN32
+	const int DirFd = open(Path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	
+	if (DirFd == -1) return nullptr;
+	
+	VLScopedPtr<int*, void(*)(int*)> DirFdCloser { const_cast<int*>(&DirFd), [] (int *Desc) { close(*Desc); } };
+#else
+	const int DirFd = -1;
+#endif //WIN32
+
+	//Returns false when we've got everything we need and can stop reading.
+	auto Consider = [&] (const char *Name, const unsigned char DType, const uint64_t Offset) -> bool
+	{
+		if (!Options.IncludeDots && (!strcmp(Name, ".") || !strcmp(Name, ".."))) return true;
+		
+		if (Options.Glob && !GlobMatch(Options.Glob, Name)) return true;
+		
+		ListCandidate Cand{};
+		
+		Cand.Name = Name;
+		Cand.Offset = Offset;
+		
+		switch (DType)
+		{
+#ifndef WIN32
+			case DT_DIR:
+				Cand.Type = LIST_TYPE_DIR;
+				break;
+			case DT_REG:
+				Cand.Type = LIST_TYPE_FILE;
+				break;
+			case DT_LNK:
+				Cand.Type = LIST_TYPE_LINK;
+				break;
+			case DT_UNKNOWN:
+				break;
+			default:
+				Cand.Type = LIST_TYPE_OTHER;
+				break;
+#endif //WIN32
+		}
+		
+		if ((NeedStat || !Cand.Type) && !ListStatCandidate(DirFd, Path, Cand)) return true; //Gone already, probably.
+		
+		if (Options.TypeMask && !(Options.TypeMask & Cand.Type)) return true;
+		if (Options.MinSize && Cand.Size < Options.MinSize) return true;
+		if (Options.ModifiedAfter && Cand.ModTime <= Options.ModifiedAfter) return true;
+		
+		if (Sorted)
+		{
+			if (HaveCursor && !ListCandidateBefore(Options, CursorCand, Cand)) return true;
+			
+			Best.push(std::move(Cand));
+			
+			if (Best.size() > PageSize)
+			{
+				Best.pop();
+				Truncated = true;
+			}
+			return true;
+		}
+		
+#ifdef LINUX
+		(void)Index;
+#else
+		//No stable directory offsets to hand out here, so the cursor is how many matches we've been through.
+		Cand.Offset = ++Index;
+		
+		if (HaveCursor && Index <= CursorCand.Offset) return true;
+#endif //LINUX
+
+		if (Page.size() == PageSize)
+		{ //There's at least one more, that's all we wanted to know.
+			Truncated = true;
+			return false;
+		}
+		
+		Page.push_back(std::move(Cand));
+		return true;
+	};
+	
+#ifdef LINUX
+	//Unsorted cursors are directory offsets, so we can jump straight back to where we were.
+	if (!Sorted && HaveCursor && lseek(DirFd, CursorCand.Offset, SEEK_SET) == -1) return nullptr;
+	
+	std::vector<uint8_t> Buf(LIST_GETDENTS_BUFFER_SIZE);
+	bool KeepGoing = true;
+	
+	while (KeepGoing)
+	{
+		const long Read = syscall(SYS_getdents64, DirFd, Buf.data(), Buf.size());
+		
+		if (Read == -1 && errno == EINTR) continue;
+		
+		if (Read == -1) return nullptr;
+		
+		if (Read == 0) break;
+		
+		for (long Pos = 0; Pos < Read && KeepGoing;)
+		{
+			const LinuxDirent64 *Ent = reinterpret_cast<const LinuxDirent64*>(Buf.data() + Pos);
+			
+			//The kernel should never hand us this, but a short record would have us walking off the end.
+			if (Ent->d_reclen <= offsetof(LinuxDirent64, d_name) || Pos + Ent->d_reclen > Read) return nullptr;
+			
+			const char *const Name = reinterpret_cast<const char*>(Buf.data() + Pos + offsetof(LinuxDirent64, d_name));
+			
+			KeepGoing = Consider(Name, Ent->d_type, Ent->d_off);
+			
+			Pos += Ent->d_reclen;
+		}
+	}
+#else
+#ifndef WIN32
+	const int ListFd = dup(DirFd);
+	
+	VLScopedPtr<DIR*, decltype(&closedir)> Dir { ListFd != -1 ? fdopendir(ListFd) : nullptr, closedir };
+	
+	if (!Dir)
+	{
+		if (ListFd != -1) close(ListFd);
+		return nullptr;
+	}
+#else
+	VLScopedPtr<DIR*, decltype(&closedir)> Dir { opendir(Path), closedir };
+
+	if (!Dir) return nullptr;
+#endif //WIN32
+	
+	struct dirent *Ptr = nullptr;
+
+	while ((Ptr = readdir(Dir)))
+	{
+#ifndef WIN32
+		if (!Consider(Ptr->d_name, Ptr->d_type, 0)) break;
+#else
+		if (!Consider(Ptr->d_name, 0, 0)) break;
+#endif //WIN32
+	}
+#endif //LINUX
+
+	if (Sorted)
+	{
+		Page.reserve(Best.size());
+		
+		while (!Best.empty())
+		{
+			Page.push_back(Best.top());
+			Best.pop();
+		}
+		
+		std::reverse(Page.begin(), Page.end());
+	}
+	
+	if (Truncated && NextCursor && !Page.empty()) *NextCursor = EncodeListCursor(Options, Page.back());
+	
+	std::list<Files::DirectoryEntry> *RetVal = new std::list<Files::DirectoryEntry>;
+	
+	for (ListCandidate &Cand : Page)
+	{
+		if (!Cand.Stated && !ListStatCandidate(DirFd, Path, Cand)) continue;
+		
+		Files::DirectoryEntry Entry{};
+		
+		Entry.Path = VLString(Path) + PATHSEP + Cand.Name;
+		Entry.Size = Cand.Size;
+		Entry.ModTime = Cand.ModTime;
+		Entry.CreateTime = Cand.CreateTime;
+		Entry.IsDirectory = Cand.Type == LIST_TYPE_DIR;
+#ifndef WIN32
+		Entry.Permissions = Cand.Mode;
+		Entry.Owner = GetUserName(Cand.Uid);
+		Entry.Group = GetGroupName(Cand.Gid);
+		
+		if (Cand.Type == LIST_TYPE_LINK)
+		{
+			VLString Buf { 4096 } ; //Make sure it's zero initialized, readlink doesn't null terminate.
+			
+			if (readlinkat(DirFd, Cand.Name, Buf.GetBuffer(), Buf.GetCapacity() - 1) == -1)
+			{
+				VLWARN("Unable to read target for symlink " + Entry.Path);
+			}
+			else Entry.Symlink = std::move(Buf);
+		}
+#endif //WIN32
+		RetVal->push_back(std::move(Entry));
+	}
+
+	return RetVal;
+}
+
+static void AddPlaceRange(std::map<uint64_t, uint64_t> &Ranges, uint64_t Start, uint64_t End)
+{
+	auto Iter = Ranges.upper_bound(Start);
+	
+	if (Iter != Ranges.begin())
+	{ //Swallow the one before us if we touch it.
+		auto Prev = std::prev(Iter);
+		
+		if (Prev->second >= Start)
+		{
+			Start = Prev->first;
+			if (Prev->second > End) End = Prev->second;
+			Ranges.erase(Prev);
+		}
+	}
+	
+	while (Iter != Ranges.end() && Iter->first <= End)
+	{
+		if (Iter->second > End) End = Iter->second;
+		Iter = Ranges.erase(Iter);
+	}
+	
+	Ranges[Start] = End;
+}
+
+static VLString GetMissingPlaceRanges(const PlaceSession &Session)
+{ //"start-end,start-end", end exclusive. Empty when we have everything.
+	VLString RetVal(1024);
+	uint64_t Cursor = 0;
+	size_t Count = 0;
+	
+	for (auto Iter = Session.Ranges.begin(); Iter != Session.Ranges.end() && Count < PLACE_MAX_REPORTED_RANGES; ++Iter)
+	{
+		if (Iter->first > Cursor)
+		{
+			RetVal += VLString::UintToString(Cursor) + '-' + VLString::UintToString(Iter->first) + ',';
+			++Count;
+		}
+		
+		Cursor = Iter->second;
+	}
+	
+	if (Cursor < Session.TotalSize && Count < PLACE_MAX_REPORTED_RANGES)
+	{
+		RetVal += VLString::UintToString(Cursor) + '-' + VLString::UintToString(Session.TotalSize) + ',';
+	}
+	
+	RetVal.StripTrailing(",");
+	
+	return RetVal;
+}
+
+static bool ResetPlaceTemp(const VLString &TempPath)
+{ //Empties out whatever an earlier upload left. Only when the session's created, under the lock, so it can't wipe a chunk that's already landed.
+#ifndef WIN32
+	//Same as a plain create, so the umask decides. CommitPlaceSession() copies over an existing file's mode.
+	const int Desc = open(TempPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	
+	return Desc != -1 && close(Desc) == 0;
+#else
+	VLScopedPtr<FILE*, int(*)(FILE*)> Creator { fopen(TempPath, "wb"), fclose };
+	
+	if (!Creator) return false;
+	
+	return true;
+#endif //WIN32
+}
+
+static bool WritePlaceChunk(const VLString &TempPath, const uint64_t Offset, const void *Data, const uint64_t DataSize)
+{
+#ifndef WIN32
+	const int Desc = open(TempPath, O_WRONLY | O_CREAT, 0666);
+	
+	if (Desc == -1) return false;
+	
+	const uint8_t *Worker = static_cast<const uint8_t*>(Data);
+	uint64_t Written = 0;
+	
+	while (Written < DataSize)
+	{
+		const ssize_t Result = pwrite(Desc, Worker + Written, DataSize - Written, Offset + Written);
+		
+		if (Result == -1 && errno == EINTR) continue;
+		
+		if (Result <= 0)
+		{
+			close(Desc);
+			return false;
+		}
+		
+		Written += Result;
+	}
+	
+	return close(Desc) == 0;
+#else //No pwrite here, so we just seek.
+	if (!Utils::FileExists(TempPath))
+	{
+		VLScopedPtr<FILE*, int(*)(FILE*)> Creator { fopen(TempPath, "wb"), fclose };
+		if (!Creator) return false;
+	}
+	
+	VLScopedPtr<FILE*, int(*)(FILE*)> Desc { fopen(TempPath, "r+b"), fclose };
+	
+	if (!Desc || fseeko64(Desc, Offset, SEEK_SET) != 0) return false;
+	
+	return fwrite(Data, 1, DataSize, Desc) == DataSize;
+#endif //WIN32
+}
+
+static NetCmdStatus CommitPlaceSession(const VLString &Destination, const VLString &TempPath, const VLString &Hash)
+{ //Verify the whole thing and swap it in. Called with the session marked as committing, so nobody else is writing.
+	uint64_t Size = 0;
+	
+	//GetFileSha512() doesn't like empty files.
+	const VLString &OurHash = Utils::GetFileSize(TempPath, &Size) && !Size ? Utils::GetSha512("", 0) : Utils::GetFileSha512(TempPath);
+	
+	if (OurHash != Hash)
+	{
+		unlink(TempPath);
+		return NetCmdStatus(false, STATUS_FAILED, "SHA-512 mismatch, upload discarded");
+	}
+	
+#ifndef WIN32
+	const int Desc = open(TempPath, O_RDONLY);
+	
+	if (Desc != -1)
+	{ //Make sure it's actually on disk before it replaces anything.
+		struct stat DestStat{};
+		
+		//Replacing a file shouldn't change who can read it.
+		if (stat(Destination, &DestStat) == 0) fchmod(Desc, DestStat.st_mode & 07777);
+		
+		fsync(Desc);
+		close(Desc);
+	}
+#else
+	unlink(Destination); //rename() won't replace on Windows.
+#endif //WIN32
+
+	if (rename(TempPath, Destination) != 0)
+	{
+		return NetCmdStatus(false, STATUS_IERR, "Verified, but failed to move into place");
+	}
+	
+	return NetCmdStatus(true, STATUS_OK, "Upload complete");
+}
+
+NetCmdStatus Files::PlaceChunk(const char *Destination, const uint64_t TotalSize, const VLString &Hash, const uint64_t Offset, const void *Data, const uint64_t DataSize, VLString *MissingOut)
+{
+	if (Offset > TotalSize || DataSize > TotalSize - Offset || Hash.Length() != 128)
+	{
+		return NetCmdStatus(false, STATUS_MISUSED, "Chunk doesn't fit the file, or bad hash");
+	}
+	
+	const VLString TempPath = VLString(Destination) + PLACE_TEMP_SUFFIX;
+	const uint64_t Now = Utils::GetMonotonicMs();
+	
+	PlaceSessions.Mutex.Lock();
+	
+	for (auto Iter = PlaceSessions.Sessions.begin(); Iter != PlaceSessions.Sessions.end();)
+	{ //Clean out abandoned uploads while we're here.
+		if (!Iter->second.Committing && Now - Iter->second.LastTouched > PLACE_SESSION_EXPIRY_MS)
+		{
+			unlink(Iter->first + PLACE_TEMP_SUFFIX);
+			Iter = PlaceSessions.Sessions.erase(Iter);
+			continue;
+		}
+		++Iter;
+	}
+	
+	auto Lookup = PlaceSessions.Sessions.find(Destination);
+	
+	if (Lookup == PlaceSessions.Sessions.end() || Lookup->second.TotalSize != TotalSize || Lookup->second.Hash != Hash)
+	{ //New upload, or a different file for the same destination. Start over.
+		if (Lookup != PlaceSessions.Sessions.end() && Lookup->second.Committing)
+		{
+			PlaceSessions.Mutex.Unlock();
+			return NetCmdStatus(false, STATUS_FAILED, "Another upload to this destination is being committed");
+		}
+		
+		PlaceSession &New = PlaceSessions.Sessions[Destination];
+		
+		New = PlaceSession{ TotalSize, Hash, {}, Now, false };
+		
+		if (!ResetPlaceTemp(TempPath))
+		{
+			PlaceSessions.Sessions.erase(Destination);
+			PlaceSessions.Mutex.Unlock();
+			return NetCmdStatus(false, STATUS_IERR, "Failed to create temporary file");
+		}
+	}
+	
+	PlaceSession *Session = &PlaceSessions.Sessions[Destination];
+	
+	if (Session->Committing)
+	{
+		PlaceSessions.Mutex.Unlock();
+		return NetCmdStatus(false, STATUS_WARN, "Upload is already being committed");
+	}
+	
+	Session->LastTouched = Now;
+	
+	PlaceSessions.Mutex.Unlock();
+	
+	//Writing happens outside the lock so other chunks can land at the same time.
+	if (DataSize && !WritePlaceChunk(TempPath, Offset, Data, DataSize))
+	{
+		VLThreads::MutexKeeper Keeper { &PlaceSessions.Mutex };
+		
+		auto Iter = PlaceSessions.Sessions.find(Destination);
+		
+		if (MissingOut && Iter != PlaceSessions.Sessions.end()) *MissingOut = GetMissingPlaceRanges(Iter->second);
+		
+		return NetCmdStatus(false, STATUS_IERR, "Failed to write chunk to temporary file");
+	}
+	
+	PlaceSessions.Mutex.Lock();
+	
+	auto Iter = PlaceSessions.Sessions.find(Destination);
+	
+	if (Iter == PlaceSessions.Sessions.end() || Iter->second.Hash != Hash || Iter->second.TotalSize != TotalSize)
+	{ //Somebody restarted it under us.
+		PlaceSessions.Mutex.Unlock();
+		return NetCmdStatus(false, STATUS_FAILED, "Upload was restarted by another order");
+	}
+	
+	Session = &Iter->second;
+	
+	if (DataSize) AddPlaceRange(Session->Ranges, Offset, Offset + DataSize);
+	
+	const VLString &Missing = GetMissingPlaceRanges(*Session);
+	
+	if (MissingOut) *MissingOut = Missing;
+	
+	if (Missing || Session->Committing)
+	{
+		PlaceSessions.Mutex.Unlock();
+		return NetCmdStatus(true, STATUS_OK, "Chunk received");
+	}
+	
+	Session->Committing = true;
+	
+	PlaceSessions.Mutex.Unlock();
+	
+	const NetCmdStatus &Result = CommitPlaceSession(Destination, TempPath, Hash);
+	
+	PlaceSessions.Mutex.Lock();
+	PlaceSessions.Sessions.erase(Destination);
+	PlaceSessions.Mutex.Unlock();
+	
+	if (!Result && MissingOut && Result.Status == STATUS_FAILED)
+	{ //Hash was bad and we threw it all out, so everything's missing again.
+		*MissingOut = VLString("0-") + VLString::UintToString(TotalSize);
+	}
+	
+	return Result;
+}
+
+bool Files::ParseHashAlgo(const char *Name, HashAlgo &Out)
+{
+	if (!*Name || !strcmp(Name, "sha512"))
+	{
+		Out = HASH_SHA512;
+		return true;
+	}
+	
+	if (!strcmp(Name, "xxh64"))
+	{
+		Out = HASH_XXH64;
+		return true;
+	}
+	
+	return false;
+}
+
+NetCmdStatus Files::HashTree(const char *Root, const HashAlgo Algo, std::vector<ManifestEntry> &Out, const WalkProgressFunc Progress, void *const UserData,
+								const std::atomic_bool *const Cancel)
+{
+	Out.clear();
+#ifndef WIN32
+	std::vector<VLString> Paths;
+	uint64_t WalkFailures = 0;
+	
+	//Directories get spread over the workers while we find everything, but a single directory full of big files would pin one thread, so the hashing is split by file.
+	const bool Walked = WalkTree(WALK_HASH, Root, nullptr, false, Progress, UserData, Cancel, &Paths, &WalkFailures);
+	
+	if (Cancel && *Cancel) return NetCmdStatus(false, STATUS_FAILED, "Cancelled");
+	
+	if (!Walked && Paths.empty() && !WalkFailures)
+	{
+		return NetCmdStatus(false, STATUS_MISSING);
+	}
+	
+	std::sort(Paths.begin(), Paths.end(), [] (const VLString &A, const VLString &B) { return strcmp(A, B) < 0; });
+	
+	HashCrew Crew { std::make_shared<HashContext>(Root, Algo, Cancel) };
+	HashContext *const Ctx = Crew.Ctx.get();
+	
+	Ctx->Manifest.resize(Paths.size());
+	
+	for (size_t Inc = 0; Inc < Paths.size(); ++Inc) Ctx->Manifest[Inc].Path = Paths[Inc];
+	
+	const long CPUs = sysconf(_SC_NPROCESSORS_ONLN);
+	const size_t NumWorkers = std::min<size_t>({ (size_t)(CPUs > 0 ? CPUs : 1), HASH_MAX_WORKERS, std::max<size_t>(Paths.size(), 1) });
+	
+	for (size_t Inc = 1; Inc < NumWorkers; ++Inc)
+	{
+		Crew.Workers.emplace_back((VLThreads::Thread::EntryFunc)HashWorkerFunc, new std::shared_ptr<HashContext>(Crew.Ctx));
+		Crew.Workers.back().Start();
+	}
+	
+	HashWorkLoop(Ctx, Progress, UserData);
+	
+	Crew.Join();
+	
+	if (Ctx->Stopping()) return NetCmdStatus(false, STATUS_FAILED, "Cancelled");
+	
+	//Anything that vanished or couldn't be read just isn't in the manifest.
+	Out.swap(Ctx->Manifest);
+	Out.erase(std::remove_if(Out.begin(), Out.end(), [] (const ManifestEntry &Entry) { return Entry.Digest.Empty(); }), Out.end());
+	
+	const uint64_t Failures = WalkFailures + Ctx->Failures;
+	
+	if (Failures)
+	{
+		return NetCmdStatus(true, STATUS_WARN, VLString::UintToString(Failures) + " entries couldn't be read and were left out");
+	}
+	
+	return true;
+#else
+	return NetCmdStatus(false, STATUS_UNSUPPORTED);
+#endif //WIN32
+}
+
+VLString Files::ManifestToText(const std::vector<ManifestEntry> &Manifest)
+{
+	VLString RetVal(Manifest.size() * 192 + 1);
+	
+	for (const ManifestEntry &Entry : Manifest)
+	{
+		RetVal += Entry.Digest + '\t' + VLString::UintToString(Entry.Size) + '\t' + VLString::IntToString(Entry.ModTime) + '\t' + Entry.Path + '\n';
+	}
+	
+	return RetVal;
+}
+
+static bool IsSafeRelativePath(const char *Path)
+{ //Sync manifests come from the other end, and a path like "../../etc/passwd" had better not do what it says.
+	if (!*Path || *Path == '/' || strchr(Path, '\\')) return false;
+	
+	for (const char *Part = Path; Part; )
+	{
+		const char *const Next = strchr(Part, '/');
+		const size_t Length = Next ? Next - Part : strlen(Part);
+		
+		if (!Length || (Length == 1 && *Part == '.') || (Length == 2 && !strncmp(Part, "..", 2))) return false;
+		
+		Part = Next ? Next + 1 : nullptr;
+	}
+	
+	return true;
+}
+
+static bool MakeDirectories(const VLString &Path)
+{ //Like mkdir -p.
+	VLString Partial(Path.Length() + 1);
+	
+	for (const char *Worker = Path; *Worker; ++Worker)
+	{
+		if (*Worker == '/' && Worker != +Path && mkdir(Partial, 0755) != 0 && errno != EEXIST) return false;
+		
+		Partial += *Worker;
+	}
+	
+	if (mkdir(Partial, 0755) != 0 && errno != EEXIST) return false;
+	
+	return Utils::IsDirectory(Partial);
+}
+
+bool Files::ParseManifest(const char *Text, std::vector<ManifestEntry> &Out)
+{
+	Out.clear();
+	
+	while (*Text)
+	{
+		const char *const LineEnd = strchr(Text, '\n');
+		
+		if (!LineEnd) return false; //Every line ends with one, including the last.
+		
+		//The path goes last and gets the rest of the line, tabs and all.
+		const char *Fields[4] = { Text };
+		
+		for (size_t Inc = 1; Inc < 4; ++Inc)
+		{
+			const char *const Tab = (const char*)memchr(Fields[Inc - 1], '\t', LineEnd - Fields[Inc - 1]);
+			
+			if (!Tab) return false;
+			
+			Fields[Inc] = Tab + 1;
+		}
+		
+		ManifestEntry Entry;
+		
+		Entry.Digest = std::string(Fields[0], Fields[1] - 1 - Fields[0]);
+		Entry.Size = VLString::StringToUint(std::string(Fields[1], Fields[2] - 1 - Fields[1]));
+		Entry.ModTime = strtoll(std::string(Fields[2], Fields[3] - 1 - Fields[2]).c_str(), nullptr, 10);
+		Entry.Path = std::string(Fields[3], LineEnd - Fields[3]);
+		
+		Text = LineEnd + 1;
+		
+		if (Entry.Digest.Empty() || !IsSafeRelativePath(Entry.Path)) return false;
+		
+		Out.push_back(std::move(Entry));
+	}
+	
+	return true;
+}
+
+NetCmdStatus Files::PrepareSync(const char *Root, const std::vector<ManifestEntry> &Wanted, const bool DeleteExtras, std::vector<VLString> &NeededOut,
+								const WalkProgressFunc Progress, void *const UserData, const std::atomic_bool *const Cancel)
+{
+	NeededOut.clear();
+#ifndef WIN32
+	const VLString RootPath { Root };
+	
+	if (!MakeDirectories(RootPath)) return NetCmdStatus(false, STATUS_FAILED, "Can't create the destination directory");
+	
+	//The cache means a tree that's already in sync costs us a stat per file, not a read.
+	std::vector<ManifestEntry> Local;
+	
+	const NetCmdStatus &HashResult = HashTree(Root, HASH_SHA512, Local, Progress, UserData, Cancel);
+	
+	if (!HashResult) return HashResult;
+	
+	std::map<VLString, const ManifestEntry*> LocalByPath;
+	
+	for (const ManifestEntry &Entry : Local) LocalByPath[Entry.Path] = &Entry;
+	
+	uint64_t NeededBytes = 0;
+	uint64_t Deleted = 0;
+	uint64_t Failures = 0;
+	
+	for (const ManifestEntry &Entry : Wanted)
+	{
+		auto Iter = LocalByPath.find(Entry.Path);
+		
+		if (Iter != LocalByPath.end())
+		{
+			const ManifestEntry *const Have = Iter->second;
+			
+			LocalByPath.erase(Iter); //Whatever's left over afterwards is extra.
+			
+			if (Have->Size == Entry.Size && !strcasecmp(Have->Digest, Entry.Digest)) continue;
+		}
+		
+		NeededOut.push_back(Entry.Path);
+		NeededBytes += Entry.Size;
+	}
+	
+	if (DeleteExtras)
+	{ //Before making directories, so a file in the way of one we need is already gone.
+		for (auto &Pair : LocalByPath)
+		{
+			VLString Path = RootPath + "/" + Pair.first;
+			
+			if (unlink(Path) != 0)
+			{
+				++Failures;
+				continue;
+			}
+			
+			++Deleted;
+			
+			//Take out any directories that just became empty, stopping at the first one that isn't, and never the root itself.
+			for (const char *Slash = nullptr; (Slash = strrchr(Path, '/')) && (size_t)(Slash - +Path) > RootPath.Length(); )
+			{
+				Path = VLString(std::string(+Path, Slash - +Path));
+				
+				if (rmdir(Path) != 0) break;
+			}
+		}
+	}
+	
+	for (const VLString &Path : NeededOut)
+	{
+		const char *const Slash = strrchr(Path, '/');
+		
+		if (Slash && !MakeDirectories(RootPath + "/" + VLString(std::string(+Path, Slash - +Path)))) ++Failures;
+	}
+	
+	VLString Msg = VLString::UintToString(NeededOut.size()) + " of " + VLString::UintToString(Wanted.size()) + " files need sending, "
+					+ VLString::UintToString(NeededBytes) + " bytes";
+	
+	if (DeleteExtras) Msg += VLString(", ") + VLString::UintToString(Deleted) + " extra files deleted";
+	
+	if (Failures || HashResult.Status == STATUS_WARN)
+	{
+		Msg += VLString(", ") + VLString::UintToString(Failures) + " failures";
+		
+		if (HashResult.Status == STATUS_WARN) Msg += VLString(" (") + HashResult.Msg + ")";
+		
+		return NetCmdStatus(true, STATUS_WARN, Msg);
+	}
+	
+	return NetCmdStatus(true, STATUS_OK, Msg);
+#else
+	return NetCmdStatus(false, STATUS_UNSUPPORTED);
+#endif //WIN32
+}
@@ -22,6 +22,8 @@
 
 #include "../libvolition/include/common.h"
 #include <list>
+#include <vector>
+#include <atomic>
 
 #ifndef WIN32
 #define PATHSEP "/"
@@ -31,10 +33,26 @@
 
 namespace Files
 {
-	NetCmdStatus Delete(const char *Path);
-	bool Copy(const char *Source, const char *Destination);
-	bool Move(const char *Source, const char *Destination);
+	struct WalkStats
+	{
+		uint64_t Entries;
+		uint64_t Bytes; //Copies only.
+		uint64_t Failures;
+	};
+	
+	//Called now and then during big directory copies and deletes, always from the thread that called us.
+	typedef void (*WalkProgressFunc)(const WalkStats &Stats, void *UserData);
+	
+	//Set *Cancel from another thread to make these give up early and return failure. Whatever was already done stays done.
+	NetCmdStatus Delete(const char *Path, const WalkProgressFunc Progress = nullptr, void *const UserData = nullptr, const std::atomic_bool *const Cancel = nullptr);
+	//Metadata being mode, timestamps, and ownership if we're root.
+	bool Copy(const char *Source, const char *Destination, const bool PreserveMetadata = false, const WalkProgressFunc Progress = nullptr, void *const UserData = nullptr, const std::atomic_bool *const Cancel = nullptr);
+	bool Move(const char *Source, const char *Destination, const WalkProgressFunc Progress = nullptr, void *const UserData = nullptr, const std::atomic_bool *const Cancel = nullptr);
 	bool Chdir(const char *NewWD);
+#ifndef WIN32
+	VLString GetUserName(const uint32_t Uid);
+	VLString GetGroupName(const uint32_t Gid);
+#endif //WIN32
 	VLString GetWorkingDirectory(void);
 	
 	struct DirectoryEntry
@@ -50,7 +68,73 @@ namespace Files
 		bool IsDirectory; //Always false if a symlink.
 	};
 
-	std::list<DirectoryEntry> *ListDirectory(const char *Path);
+	enum ListTypeFlags : uint8_t
+	{
+		LIST_TYPE_FILE		= 1 << 0,
+		LIST_TYPE_DIR		= 1 << 1,
+		LIST_TYPE_LINK		= 1 << 2,
+		LIST_TYPE_OTHER		= 1 << 3,
+	};
+	
+	enum ListSortMode : uint8_t
+	{
+		LIST_SORT_NONE, //Directory order, the cheapest.
+		LIST_SORT_NAME,
+		LIST_SORT_SIZE,
+		LIST_SORT_MTIME,
+	};
+	
+	struct ListOptions
+	{
+		VLString Glob; //Only * and ?. Empty matches everything.
+		uint8_t TypeMask; //LIST_TYPE_* flags, zero for all types.
+		uint64_t MinSize;
+		int64_t ModifiedAfter; //Unix time, zero for no filter.
+		ListSortMode Sort;
+		bool Descending;
+		VLString Cursor; //From NextCursor of the previous page, empty to start at the beginning.
+		size_t PageSize; //Zero for no limit.
+		bool IncludeDots; //. and .., which the old unpaged listings always had.
+		
+		ListOptions(void) : Glob(), TypeMask(), MinSize(), ModifiedAfter(), Sort(), Descending(), Cursor(), PageSize(), IncludeDots() {}
+	};
+	
+	bool ParseListSort(const char *Spec, ListOptions &Out);
+	
+	//NextCursor comes back empty once there's nothing left. Returns nullptr for a bad path or cursor.
+	std::list<DirectoryEntry> *ListDirectory(const char *Path, const ListOptions &Options = ListOptions(), VLString *NextCursor = nullptr);
+	
+	enum HashAlgo : uint8_t
+	{
+		HASH_SHA512,
+		HASH_XXH64, //Much faster, but only good for spotting changes, not tampering.
+	};
+	
+	struct ManifestEntry
+	{
+		VLString Path; //Relative to the root we hashed.
+		uint64_t Size;
+		int64_t ModTime;
+		VLString Digest; //Lowercase hex.
+		
+		ManifestEntry(void) : Path(), Size(), ModTime(), Digest() {}
+	};
+	
+	bool ParseHashAlgo(const char *Name, HashAlgo &Out); //"sha512" or "xxh64". Empty means SHA-512.
+	
+	//Regular files under Root only, sorted by path. Symlinks aren't followed. Files that haven't changed since we last hashed them come from a cache.
+	NetCmdStatus HashTree(const char *Root, const HashAlgo Algo, std::vector<ManifestEntry> &Out, const WalkProgressFunc Progress = nullptr, void *const UserData = nullptr,
+							const std::atomic_bool *const Cancel = nullptr);
+	VLString ManifestToText(const std::vector<ManifestEntry> &Manifest); //Digest, size, mtime and path, tab separated, a line each.
+	bool ParseManifest(const char *Text, std::vector<ManifestEntry> &Out); //False if it's malformed or any path tries to leave the root.
+	
+	//Compares Root against what the sender has, deletes what the sender doesn't have if asked, and makes directories for what's coming.
+	//NeededOut gets the relative paths the sender still has to send us. The contents go over with PlaceChunk() afterwards.
+	NetCmdStatus PrepareSync(const char *Root, const std::vector<ManifestEntry> &Wanted, const bool DeleteExtras, std::vector<VLString> &NeededOut,
+							const WalkProgressFunc Progress = nullptr, void *const UserData = nullptr, const std::atomic_bool *const Cancel = nullptr);
+	
+	//One piece of a chunked upload. Written to a temp file next to Destination, verified against Hash and renamed into place once complete.
+	NetCmdStatus PlaceChunk(const char *Destination, const uint64_t TotalSize, const VLString &Hash, const uint64_t Offset, const void *Data, const uint64_t DataSize, VLString *MissingOut);
 }
 
 #endif //__VLNODE_FILES_H__
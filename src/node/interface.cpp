@@ -28,8 +28,54 @@
 #include "jobs.h"
 
 #include <stdio.h>
+#include <time.h>
 
-Net::ClientDescriptor Interface::Establish(const char *Hostname)
+#include <vector>
+#include <random>
+#include <algorithm>
+
+//Reconnect backoff. Each wait is random between the base and three times the last one, up to the cap.
+#define RECONNECT_BASE_MS 500
+#define RECONNECT_CAP_MS (2 * 60 * 1000)
+#define RESUME_TICKET_MAX 256
+
+static std::vector<uint8_t> ResumeTicket; //From the server's last accept. Lets us skip the full login next time.
+static bool ServerIssuesTickets = false; //We've gotten one from it before, so a hangup when asking is just the network.
+static bool SkipTicketRequest = false; //Server hung up on us for asking. Stays that way until a ticket login works or a new binary replaces us.
+
+Net::ClientDescriptor Interface::EstablishWithBackoff(const char *Hostname)
+{ //Keeps trying until we're in. Spread out, so a server restart doesn't get the whole fleet back in the same second.
+	static std::mt19937_64 Random { std::random_device{}() ^ (uint64_t)time(nullptr) };
+	
+	typedef std::uniform_int_distribution<uint64_t> Distribution;
+	
+	//Don't go straight back in either, if the server just restarted everyone else is trying right now too.
+	Utils::vl_sleep(Distribution(0, RECONNECT_BASE_MS)(Random));
+	
+	uint64_t Sleep = RECONNECT_BASE_MS;
+	
+	while (true)
+	{
+		uint32_t RetryAfterMs = 0;
+		
+		const Net::ClientDescriptor Connection = Establish(Hostname, &RetryAfterMs);
+		
+		if (Connection.Internal) return Connection;
+		
+		Sleep = std::min<uint64_t>(RECONNECT_CAP_MS, Distribution(RECONNECT_BASE_MS, Sleep * 3)(Random));
+		
+		if (RetryAfterMs)
+		{ //The server knows better than we do, but we still don't want to land on the exact same millisecond as everybody it told.
+			Sleep = RetryAfterMs + Distribution(0, RetryAfterMs / 4)(Random);
+		}
+		
+		VLDEBUG("Connection failed, retrying in " + VLString::UintToString(Sleep) + " ms");
+		
+		Utils::vl_sleep(Sleep);
+	}
+}
+
+Net::ClientDescriptor Interface::Establish(const char *Hostname, uint32_t *RetryAfterMs)
 { //We know what server we want, now we communicate with it.
 	//Hack to fix ping registration on disconnect
 	Main::PingTrack.RegisterPing();
@@ -45,12 +91,25 @@ Net::ClientDescriptor Interface::Establish(const char *Hostname)
 	VLDEBUG("Network connection open. Prepare to authenticate.");
 	
 	Conation::ConationStream LoginStream(CMDCODE_B2S_AUTH, 0, 0u);
+	
+	const bool Resuming = !ResumeTicket.empty();
+	const bool AskForTicket = !Resuming && !SkipTicketRequest;
 
 	LoginStream.Push_Int32(Conation::PROTOCOL_VERSION);
 	LoginStream.Push_String(IdentityModule::GetNodeIdentity());
-	LoginStream.Push_String(IdentityModule::GetNodeAuthToken());
-	LoginStream.Push_String(IdentityModule::GetNodePlatformString());
-	LoginStream.Push_String(IdentityModule::GetNodeRevision());
+	
+	if (Resuming)
+	{ //The server still has everything else from last time.
+		LoginStream.Push_BinStream(ResumeTicket.data(), ResumeTicket.size());
+	}
+	else
+	{
+		LoginStream.Push_String(IdentityModule::GetNodeAuthToken());
+		LoginStream.Push_String(IdentityModule::GetNodePlatformString());
+		LoginStream.Push_String(IdentityModule::GetNodeRevision());
+		
+		if (AskForTicket) LoginStream.Push_Bool(true); //Asking for a resumption ticket.
+	}
 	
 	//Transmit the login request.
 	if (!LoginStream.Transmit(Connection))
@@ -71,13 +130,23 @@ Net::ClientDescriptor Interface::Establish(const char *Hostname)
 	catch (const Conation::ConationStream::Err_StreamDownloadFailure &)
 	{
 		Net::Close(Connection);
+		
+		/*Servers that know about tickets always answer, older ones just hang up on an argument list they don't recognize.
+		* A dropped connection looks the same though, so if this server has handed us a ticket before, it's the network, not the server.
+		* Otherwise stop asking, or every reconnect to an old server burns an extra attempt on it.*/
+		if (AskForTicket && !ServerIssuesTickets)
+		{
+			VLDEBUG("No response to ticket request, leaving it out of logins from now on.");
+			SkipTicketRequest = true;
+		}
+		
 		return 0;
 	}
 
 	VLDEBUG("Server response downloaded.");
 	
 	//Check if the server likes us.
-	if (!ResponseStream->VerifyArgTypes({Conation::ARGTYPE_NETCMDSTATUS}))
+	if (!ResponseStream->VerifyArgTypesStartWith({Conation::ARGTYPE_NETCMDSTATUS}))
 	{
 		VLDEBUG("Argument is not ARGTYPE_NETCMDSTATUS or argument missing. Aborting.");
 		Net::Close(Connection);
@@ -88,10 +157,40 @@ Net::ClientDescriptor Interface::Establish(const char *Hostname)
 	{
 		VLDEBUG("Server reports our authentication failed.");
 		Net::Close(Connection);
+		
+		if (RetryAfterMs && ResponseStream->VerifyArgTypes({Conation::ARGTYPE_NETCMDSTATUS, Conation::ARGTYPE_UINT32}))
+		{ //It's busy and told us when to come back.
+			*RetryAfterMs = ResponseStream->Pop_Uint32();
+		}
+		
+		if (Resuming)
+		{ //Expired or the server forgot about it. Do the full login, right now unless we were told to wait.
+			ResumeTicket.clear();
+			
+			if (!RetryAfterMs || !*RetryAfterMs) return Establish(Hostname, RetryAfterMs);
+		}
+		
 		return 0;
 	}
 	
-	VLDEBUG("Authentication succeeded.");
+	ResumeTicket.clear();
+	
+	if (ResponseStream->VerifyArgTypes({Conation::ARGTYPE_NETCMDSTATUS, Conation::ARGTYPE_BINSTREAM}))
+	{ //Good for the next reconnect only, we get a new one every time.
+		const Conation::ConationStream::BinStreamArg &Ticket = ResponseStream->Pop_BinStream();
+		
+		if (Ticket.DataSize <= RESUME_TICKET_MAX) ResumeTicket.assign(Ticket.Data, Ticket.Data + Ticket.DataSize);
+		
+		ServerIssuesTickets = true;
+	}
+	
+	if (Resuming)
+	{ //Definitely talking to a server that does tickets.
+		ServerIssuesTickets = true;
+		SkipTicketRequest = false;
+	}
+	
+	VLDEBUG(VLString("Authentication succeeded") + (Resuming ? " by resumption ticket." : "."));
 
 	return Connection;
 }
@@ -112,7 +211,11 @@ bool Interface::HandleServerInterface(Conation::ConationStream *Stream)
 		Jobs::ForwardN2N(Stream);
 		return true; //Don't forward this stream twice, so return early
 	}
-	else if (Flags & Conation::IDENT_ISREPORT_BIT)
+	
+	//Give the scripts whatever they want. Has to happen first, since starting a job takes the stream's buffer.
+	Jobs::ForwardToScriptJobs(Stream);
+	
+	if (Flags & Conation::IDENT_ISREPORT_BIT)
 	{
 		CmdHandling::HandleReport(Stream);
 	}
@@ -120,9 +223,6 @@ bool Interface::HandleServerInterface(Conation::ConationStream *Stream)
 	{
 		CmdHandling::HandleRequest(Stream);
 	}
-	
-	//Give the scripts whatever they want.
-	Jobs::ForwardToScriptJobs(Stream);
 
 	return true;
 }
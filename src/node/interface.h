@@ -24,7 +24,8 @@
 
 namespace Interface
 {
-	Net::ClientDescriptor Establish(const char *Hostname);
+	Net::ClientDescriptor Establish(const char *Hostname, uint32_t *RetryAfterMs = nullptr); //One attempt.
+	Net::ClientDescriptor EstablishWithBackoff(const char *Hostname);
 	bool HandleServerInterface(Conation::ConationStream *Stream);
 }
 
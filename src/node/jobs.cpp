@@ -30,12 +30,72 @@
 #include <list>
 
 #define ADMIN_STR "ADMIN"
+
+//Worker caps per lane. Workers are spawned as needed up to these and then stick around.
+#define JOBS_SHORT_LANE_WORKERS 4
+#define JOBS_LONG_LANE_WORKERS 16
+
+//Job functions return this when they've handed the job off to something else (e.g. the Lua scheduler),
+//which then calls SignalJobCompleted() itself.
+#define JOB_DETACHED ((void*)1)
+
+//Chunked fetches. We only read one chunk ahead and wait on the write queue, so memory stays flat no matter the file size.
+#define FETCHCHUNK_DEFAULT_SIZE (1024 * 1024)
+#define FETCHCHUNK_MAX_SIZE (1024 * 1024 * 16)
+#define FETCHCHUNK_MAX_QUEUED 4
+#define FETCHCHUNK_STALL_MS (1000 * 120)
+
+#define EXECCMD_DEFAULT_OUTPUT_CAP (1024 * 1024 * 64)
+#define EXECCMD_PARTIAL_INTERVAL_MS 2000
+
+#define LISTDIR_DEFAULT_PAGE_SIZE 1000
+#define LISTDIR_MAX_PAGE_SIZE 10000
+
 ///Types
 
 struct JobFuncLookupStruct
 {
 	const CommandCode ID;
 	void *(*const Function)(Jobs::Job*);
+	const Jobs::JobLane Lane;
+	const bool Cooperative; //Watches Job::Cancelled, so killing it waits for it to wrap up rather than cancelling the thread.
+};
+
+struct JobLaneStruct;
+
+struct JobWorker
+{
+	VLScopedPtr<VLThreads::Thread*> WorkerThread;
+	JobLaneStruct *Lane;
+	Jobs::Job *Current; //Protected by the lane's mutex.
+	bool Doomed; //Set when we're killing the job it runs, so it doesn't grab another one on the way out.
+	
+	JobWorker(JobLaneStruct *LaneIn) : WorkerThread(), Lane(LaneIn), Current(), Doomed() {}
+};
+
+struct JobLaneStruct
+{
+	const char *const Name;
+	const size_t MaxWorkers;
+	VLThreads::Mutex Mutex;
+	VLThreads::Semaphore Pending; //Posted once per queued job.
+	std::list<Jobs::Job*> Queue;
+	std::list<JobWorker> Workers;
+	size_t IdleWorkers;
+	
+	struct
+	{
+		uint64_t Started;
+		uint64_t Completed;
+		uint64_t Killed;
+		uint64_t PeakDepth;
+		uint64_t TotalWaitMs;
+		uint64_t MaxWaitMs;
+		uint64_t TotalRunMs;
+		uint64_t MaxRunMs;
+	} Stats;
+	
+	JobLaneStruct(const char *NameIn, const size_t MaxWorkersIn) : Name(NameIn), MaxWorkers(MaxWorkersIn), IdleWorkers(), Stats() {}
 };
 
 static struct JobWorkingDirectoryStruct
@@ -48,14 +108,25 @@ static struct JobWorkingDirectoryStruct
 
 ///Prototypes
 
-static void *(*LookupJobFunction(const CommandCode ID))(void*);
+static const JobFuncLookupStruct *LookupJobFunction(const CommandCode ID);
 static void InitJobEnv(void);
+static void *JobWorkerFunc(JobWorker *Worker);
+static void *DedicatedJobFunc(Jobs::Job *OurJob);
+static void SpawnWorkers(JobLaneStruct &Lane);
+static void SignalJobCompleted(const uint64_t JobID);
+static void RemoveJobFromLane(Jobs::Job *const Target);
+static void ScheduledExecFuncDone(Jobs::Job *OurJob, const NetCmdStatus &Result);
+
+static void PushWalkProgress(const Files::WalkStats &Stats, void *UserData);
+static void PushExecPartial(const char *NewStdout, const size_t StdoutLen, const char *NewStderr, const size_t StderrLen, void *UserData);
 
 static void *StartupScriptFunc(Jobs::Job *OurJob);
 static void *JOB_CHDIR_ThreadFunc(Jobs::Job *OurJob);
 static void *JOB_FILES_MOVE_ThreadFunc(Jobs::Job *OurJob);
 static void *JOB_FILES_PLACE_ThreadFunc(Jobs::Job *OurJob);
+static void *JOB_FILES_PLACECHUNK_ThreadFunc(Jobs::Job *OurJob);
 static void *JOB_FILES_FETCH_ThreadFunc(Jobs::Job *OurJob);
+static void *JOB_FILES_FETCHCHUNK_ThreadFunc(Jobs::Job *OurJob);
 static void *JOB_FILES_COPY_ThreadFunc(Jobs::Job *OurJob);
 static void *JOB_FILES_DEL_ThreadFunc(Jobs::Job *OurJob);
 static void *JOB_EXECCMD_ThreadFunc(Jobs::Job *OurJob);
@@ -67,44 +138,55 @@ static void *JOB_MOD_LOADSCRIPT_ThreadFunc(Jobs::Job *OurJob);
 static void *JOB_MOD_UNLOADSCRIPT_ThreadFunc(Jobs::Job *OurJob);
 static void *JOB_MOD_EXECFUNC_ThreadFunc(Jobs::Job *OurJob);
 static void *JOB_LISTDIRECTORY_ThreadFunc(Jobs::Job *OurJob);
+static void *JOB_FILES_HASHTREE_ThreadFunc(Jobs::Job *OurJob);
+static void *JOB_FILES_SYNC_ThreadFunc(Jobs::Job *OurJob);
 
 ///Globals
 static uint64_t JobIDCounter;
 static std::list<Jobs::Job> JobsList;
-static JobFuncLookupStruct JobFunctions[] = {
-												{ CMDCODE_INVALID, StartupScriptFunc },
-												{ CMDCODE_A2C_CHDIR, JOB_CHDIR_ThreadFunc },
-												{ CMDCODE_A2C_GETCWD, JOB_GETCWD_ThreadFunc},
-												{ CMDCODE_A2C_GETPROCESSES, JOB_GETPROCESSES_ThreadFunc },
-												{ CMDCODE_A2C_KILLPROCESS, JOB_KILLPROCESS_ThreadFunc },
-												{ CMDCODE_A2C_EXECCMD, JOB_EXECCMD_ThreadFunc },
-												{ CMDCODE_A2C_EXECSNIPPET, JOB_EXECSNIPPET_ThreadFunc },
-												{ CMDCODE_A2C_FILES_DEL, JOB_FILES_DEL_ThreadFunc },
-												{ CMDCODE_A2C_FILES_PLACE, JOB_FILES_PLACE_ThreadFunc },
-												{ CMDCODE_A2C_FILES_FETCH, JOB_FILES_FETCH_ThreadFunc },
-												{ CMDCODE_A2C_FILES_COPY, JOB_FILES_COPY_ThreadFunc },
-												{ CMDCODE_A2C_FILES_MOVE, JOB_FILES_MOVE_ThreadFunc },
-												{ CMDCODE_A2C_MOD_EXECFUNC, JOB_MOD_EXECFUNC_ThreadFunc },
-												{ CMDCODE_A2C_MOD_LOADSCRIPT, JOB_MOD_LOADSCRIPT_ThreadFunc },
-												{ CMDCODE_A2C_MOD_UNLOADSCRIPT, JOB_MOD_UNLOADSCRIPT_ThreadFunc },
-												{ CMDCODE_A2C_LISTDIRECTORY, JOB_LISTDIRECTORY_ThreadFunc },
+static JobLaneStruct JobLanes[Jobs::LANE_MAX] = { { "short", JOBS_SHORT_LANE_WORKERS }, { "long", JOBS_LONG_LANE_WORKERS } };
+
+static struct
+{ //Workers drop finished job IDs in here and the main loop reaps them, so we don't have to poll every thread.
+	VLThreads::Mutex Mutex;
+	std::vector<uint64_t> IDs;
+} CompletedJobs;
+static const JobFuncLookupStruct JobFunctions[] = {
+												{ CMDCODE_INVALID, StartupScriptFunc, Jobs::LANE_DEDICATED },
+												{ CMDCODE_A2C_CHDIR, JOB_CHDIR_ThreadFunc, Jobs::LANE_SHORT },
+												{ CMDCODE_A2C_GETCWD, JOB_GETCWD_ThreadFunc, Jobs::LANE_SHORT },
+												{ CMDCODE_A2C_GETPROCESSES, JOB_GETPROCESSES_ThreadFunc, Jobs::LANE_SHORT },
+												{ CMDCODE_A2C_KILLPROCESS, JOB_KILLPROCESS_ThreadFunc, Jobs::LANE_SHORT },
+												{ CMDCODE_A2C_EXECCMD, JOB_EXECCMD_ThreadFunc, Jobs::LANE_LONG, true },
+												{ CMDCODE_A2C_EXECSNIPPET, JOB_EXECSNIPPET_ThreadFunc, Jobs::LANE_LONG },
+												{ CMDCODE_A2C_FILES_DEL, JOB_FILES_DEL_ThreadFunc, Jobs::LANE_LONG, true },
+												{ CMDCODE_A2C_FILES_PLACE, JOB_FILES_PLACE_ThreadFunc, Jobs::LANE_LONG },
+												{ CMDCODE_A2C_FILES_PLACECHUNK, JOB_FILES_PLACECHUNK_ThreadFunc, Jobs::LANE_LONG },
+												{ CMDCODE_A2C_FILES_FETCH, JOB_FILES_FETCH_ThreadFunc, Jobs::LANE_LONG },
+												{ CMDCODE_A2C_FILES_FETCHCHUNK, JOB_FILES_FETCHCHUNK_ThreadFunc, Jobs::LANE_LONG },
+												{ CMDCODE_A2C_FILES_COPY, JOB_FILES_COPY_ThreadFunc, Jobs::LANE_LONG, true },
+												{ CMDCODE_A2C_FILES_MOVE, JOB_FILES_MOVE_ThreadFunc, Jobs::LANE_LONG, true },
+												{ CMDCODE_A2C_MOD_EXECFUNC, JOB_MOD_EXECFUNC_ThreadFunc, Jobs::LANE_LONG },
+												{ CMDCODE_A2C_MOD_LOADSCRIPT, JOB_MOD_LOADSCRIPT_ThreadFunc, Jobs::LANE_SHORT },
+												{ CMDCODE_A2C_MOD_UNLOADSCRIPT, JOB_MOD_UNLOADSCRIPT_ThreadFunc, Jobs::LANE_SHORT },
+												{ CMDCODE_A2C_LISTDIRECTORY, JOB_LISTDIRECTORY_ThreadFunc, Jobs::LANE_SHORT },
+												{ CMDCODE_A2C_FILES_HASHTREE, JOB_FILES_HASHTREE_ThreadFunc, Jobs::LANE_LONG, true },
+												{ CMDCODE_A2C_FILES_SYNC, JOB_FILES_SYNC_ThreadFunc, Jobs::LANE_LONG, true },
 											};
 
 ///Function definitions
 
 JobWorkingDirectoryStruct::JobWorkingDirectoryStruct(void) : Path(Files::GetWorkingDirectory()) {}
 
-static void *(*LookupJobFunction(const CommandCode ID))(void*)
+static const JobFuncLookupStruct *LookupJobFunction(const CommandCode ID)
 {
 	for (size_t Inc = 0; Inc < sizeof JobFunctions / sizeof *JobFunctions; ++Inc)
 	{
-		//Type punning because fuck you.
-		if (JobFunctions[Inc].ID == ID) return (void*(*)(void*))JobFunctions[Inc].Function;
+		if (JobFunctions[Inc].ID == ID) return JobFunctions + Inc;
 	}
 
 	return nullptr;
 }
-
 static void *StartupScriptFunc(Jobs::Job *OurJob)
 { //Special job thread function just for startup scripts.
 	InitJobEnv();
@@ -121,6 +203,34 @@ static void *StartupScriptFunc(Jobs::Job *OurJob)
 	return nullptr;
 }
 
+static void PushWalkProgress(const Files::WalkStats &Stats, void *UserData)
+{ //Interim report for copies, deletes and hashes of big trees, so the admin can tell we're not stuck.
+	const Jobs::Job *const OurJob = static_cast<const Jobs::Job*>(UserData);
+	
+	Conation::ConationStream Report(OurJob->CmdCode, Conation::GetIdentFlags(OurJob->CmdIdent) | Conation::IDENT_ISREPORT_BIT, Conation::GetIdentInteger(OurJob->CmdIdent));
+	
+	Report.Push_ODHeader(IdentityModule::GetNodeIdentity(), ADMIN_STR);
+	Report.Push_String(VLString("In progress: ") + VLString::UintToString(Stats.Entries) + " entries, "
+						+ VLString::UintToString(Stats.Bytes / (1024 * 1024)) + " MiB processed, "
+						+ VLString::UintToString(Stats.Failures) + " failures so far.");
+	
+	Main::PushStreamToWriteQueue(Report);
+}
+
+static void PushExecPartial(const char *NewStdout, const size_t StdoutLen, const char *NewStderr, const size_t StderrLen, void *UserData)
+{ //Live output for EXECCMD, so long running commands aren't a black box until they exit.
+	const Jobs::Job *const OurJob = static_cast<const Jobs::Job*>(UserData);
+	
+	Conation::ConationStream Report(OurJob->CmdCode, Conation::GetIdentFlags(OurJob->CmdIdent) | Conation::IDENT_ISREPORT_BIT, Conation::GetIdentInteger(OurJob->CmdIdent));
+	
+	Report.Push_ODHeader(IdentityModule::GetNodeIdentity(), ADMIN_STR);
+	
+	if (StdoutLen) Report.Push_String(VLString(std::string(NewStdout, StdoutLen)));
+	if (StderrLen) Report.Push_String(VLString("Standard error:\n") + VLString(std::string(NewStderr, StderrLen)));
+	
+	Main::PushStreamToWriteQueue(Report);
+}
+
 static void *JOB_FILES_MOVE_ThreadFunc(Jobs::Job *OurJob)
 {
 	InitJobEnv();
@@ -144,7 +254,7 @@ static void *JOB_FILES_MOVE_ThreadFunc(Jobs::Job *OurJob)
 	const VLString &Source = Stream->Pop_FilePath();
 	const VLString &Destination = Stream->Pop_FilePath();
 	
-	const NetCmdStatus &RetVal = Files::Move(Source, Destination);
+	const NetCmdStatus &RetVal = Files::Move(Source, Destination, PushWalkProgress, OurJob, &OurJob->Cancelled);
 
 	Response->Push_ODHeader(IdentityModule::GetNodeIdentity(), ADMIN_STR);
 	Response->Push_NetCmdStatus(RetVal);
@@ -164,9 +274,13 @@ static void *JOB_LISTDIRECTORY_ThreadFunc(Jobs::Job *OurJob)
 	Conation::ConationStream *Response = new Conation::ConationStream(Stream->GetCommandCode(), Conation::GetIdentFlags(OurJob->CmdIdent) | Conation::IDENT_ISREPORT_BIT, Stream->GetCmdIdentOnly());
 	Response->Push_ODHeader(IdentityModule::GetNodeIdentity(), ADMIN_STR);
 
-	if (!Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER, Conation::ARGTYPE_FILEPATH}))
+	//The bare path form is what older controls send. They get the whole thing, dots and all, same as always.
+	const bool Legacy = Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER, Conation::ARGTYPE_FILEPATH});
+	
+	if (!Legacy && !Stream->VerifyArgTypes({ Conation::ARGTYPE_ODHEADER, Conation::ARGTYPE_FILEPATH, Conation::ARGTYPE_STRING,
+											Conation::ARGTYPE_UINT32, Conation::ARGTYPE_UINT64, Conation::ARGTYPE_UINT64,
+											Conation::ARGTYPE_STRING, Conation::ARGTYPE_STRING, Conation::ARGTYPE_UINT32 }))
 	{
-		Response->Push_ODHeader(IdentityModule::GetNodeIdentity(), ADMIN_STR);
 		Response->Push_NetCmdStatus(NetCmdStatus(false, STATUS_MISUSED));
 		Main::PushStreamToWriteQueue(Response);
 		return nullptr;
@@ -176,7 +290,40 @@ static void *JOB_LISTDIRECTORY_ThreadFunc(Jobs::Job *OurJob)
 
 	const VLString &Path = Stream->Pop_FilePath();
 	
-	VLScopedPtr<std::list<Files::DirectoryEntry>*> Results = Files::ListDirectory(Path);
+	Files::ListOptions Options;
+	
+	Options.IncludeDots = Legacy;
+	
+	if (!Legacy)
+	{
+		Options.Glob = Stream->Pop_String();
+		Options.TypeMask = Stream->Pop_Uint32();
+		Options.MinSize = Stream->Pop_Uint64();
+		
+		//Relative, so the node's clock being off doesn't matter.
+		const uint64_t NewerThan = Stream->Pop_Uint64();
+		
+		if (NewerThan) Options.ModifiedAfter = time(nullptr) - NewerThan;
+		
+		const VLString &Sort = Stream->Pop_String();
+		
+		Options.Cursor = Stream->Pop_String();
+		
+		const uint32_t PageSize = Stream->Pop_Uint32();
+		
+		Options.PageSize = !PageSize ? LISTDIR_DEFAULT_PAGE_SIZE : std::min<uint32_t>(PageSize, LISTDIR_MAX_PAGE_SIZE);
+		
+		if (!Files::ParseListSort(Sort, Options))
+		{
+			Response->Push_NetCmdStatus(NetCmdStatus(false, STATUS_MISUSED, "Sort must be name, size or mtime, optionally prefixed with '-'"));
+			Main::PushStreamToWriteQueue(Response);
+			return nullptr;
+		}
+	}
+	
+	VLString NextCursor;
+	
+	VLScopedPtr<std::list<Files::DirectoryEntry>*> Results = Files::ListDirectory(Path, Options, &NextCursor);
 
 	if (!Results)
 	{
@@ -215,6 +362,8 @@ static void *JOB_LISTDIRECTORY_ThreadFunc(Jobs::Job *OurJob)
 	}
 
 	Response->Push_String(RetVal);
+	
+	if (!Legacy) Response->Push_String(NextCursor);
 
 	Main::PushStreamToWriteQueue(Response);
 	
@@ -270,7 +419,8 @@ static void *JOB_MOD_EXECFUNC_ThreadFunc(Jobs::Job *OurJob)
 {
 	InitJobEnv();
 	
-	Conation::ConationStream *Stream = OurJob->Read_Queue.Pop(false); //Cuz the scripts might want this
+	//The order is ours now, no copy. The script takes its buffer, and VL.RecvStream() hands out that same stream, so scripts that ask for it still get it.
+	VLScopedPtr<Conation::ConationStream*> Stream { OurJob->Read_Queue.Pop() };
 
 	//Make sure nothing's fucky.
 	VLASSERT(Conation::BuildIdentComposite(Conation::GetIdentFlags(Stream->GetCmdIdentComposite()) & ~Conation::IDENT_ISREPORT_BIT, Stream->GetCmdIdentOnly()) == OurJob->CmdIdent && Stream->GetCommandCode() == OurJob->CmdCode);
@@ -296,13 +446,11 @@ static void *JOB_MOD_EXECFUNC_ThreadFunc(Jobs::Job *OurJob)
 	const VLString &ScriptName = Stream->Pop_String();
 	const VLString &FuncName = Stream->Pop_String();
 	
-	bool Result = false;
-
 #ifdef DEBUG
 	printf("JOB_MOD_EXECFUNC_ThreadFunc(): Attempting to execute job %s::%s\n", +ScriptName, +FuncName);
 #endif
 
-	if (!Script::LoadedScripts.count(ScriptName))
+	if (!Script::ScriptIsLoaded(ScriptName))
 	{
 		Response.Push_NetCmdStatus(false, STATUS_MISSING);
 		
@@ -310,9 +458,14 @@ static void *JOB_MOD_EXECFUNC_ThreadFunc(Jobs::Job *OurJob)
 		return nullptr;
 	}
 	
+	if (Script::DispatchToResident(ScriptName, FuncName, Stream, OurJob))
+	{ //The resident's event thread sends the response when it gets around to it.
+		return nullptr;
+	}
+	
 	try
-	{
-		Result = Script::ExecuteScriptFunction(Script::LUAJOB_JOB, Script::LoadedScripts.at(ScriptName), FuncName, Stream, OurJob);
+	{ //Runs as a coroutine from here on, so our worker is free as soon as the script body's done.
+		Script::ScheduleLoadedScriptFunction(ScriptName, FuncName, Stream, OurJob, ScheduledExecFuncDone);
 	}
 	catch (Script::ScriptError &Err)
 	{
@@ -322,11 +475,18 @@ static void *JOB_MOD_EXECFUNC_ThreadFunc(Jobs::Job *OurJob)
 		return nullptr;
 	}
 	
+	return JOB_DETACHED;
+}
+
+static void ScheduledExecFuncDone(Jobs::Job *OurJob, const NetCmdStatus &Result)
+{ //Called from a Lua scheduler thread once the function returns.
+	Conation::ConationStream Response(OurJob->CmdCode, Conation::GetIdentFlags(OurJob->CmdIdent) | Conation::IDENT_ISREPORT_BIT, OurJob->CmdIdent);
+	Response.Push_ODHeader(IdentityModule::GetNodeIdentity(), ADMIN_STR);
 	Response.Push_NetCmdStatus(Result);
 	
 	Main::PushStreamToWriteQueue(Response);
 	
-	return nullptr;
+	SignalJobCompleted(OurJob->JobID);
 }
 
 static void *JOB_MOD_LOADSCRIPT_ThreadFunc(Jobs::Job *OurJob)
@@ -339,7 +499,13 @@ static void *JOB_MOD_LOADSCRIPT_ThreadFunc(Jobs::Job *OurJob)
 	
 	Response.Push_ODHeader(IdentityModule::GetNodeIdentity(), ADMIN_STR);
 	
-	if (!Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER,
+	//Control sends the SHA-512 of the script as a string first, and the full text only if we don't have it compiled already.
+	const bool ByHash = Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER,
+												Conation::ARGTYPE_STRING,
+												Conation::ARGTYPE_STRING,
+												Conation::ARGTYPE_BOOL});
+	
+	if (!ByHash && !Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER,
 								Conation::ARGTYPE_STRING,
 								Conation::ARGTYPE_SCRIPT,
 								Conation::ARGTYPE_BOOL}))
@@ -352,7 +518,7 @@ static void *JOB_MOD_LOADSCRIPT_ThreadFunc(Jobs::Job *OurJob)
 	Stream->Pop_ODHeader(); //Useless to us.
 	
 	const VLString ScriptName = Stream->Pop_String();
-	const VLString ScriptText = Stream->Pop_Script();
+	const VLString ScriptText = ByHash ? Stream->Pop_String() : Stream->Pop_Script();
 	const bool OverwritePermissible = Stream->Pop_Bool();
 	
 	if (!OverwritePermissible && Script::ScriptIsLoaded(ScriptName)) //We're trying to reload it, but it's already loaded!
@@ -365,7 +531,16 @@ static void *JOB_MOD_LOADSCRIPT_ThreadFunc(Jobs::Job *OurJob)
 		return nullptr;
 	}
 	
-	const bool Result = Script::LoadScript(ScriptText, ScriptName, OverwritePermissible);
+	if (ByHash && !Script::HaveCompiledScript(ScriptText))
+	{ //Tell control to send the text. The name and overwrite flag come back so it doesn't have to remember them.
+		Response.Push_NetCmdStatus(NetCmdStatus(false, STATUS_MISSING, "Script not cached on node"));
+		Response.Push_String(ScriptName);
+		Response.Push_Bool(OverwritePermissible);
+		Main::PushStreamToWriteQueue(Response);
+		return nullptr;
+	}
+	
+	const bool Result = ByHash ? Script::LoadCompiledScript(ScriptText, ScriptName, OverwritePermissible) : Script::LoadScript(ScriptText, ScriptName, OverwritePermissible);
 	
 	Response.Push_NetCmdStatus(Result);
 	
@@ -463,6 +638,138 @@ static void *JOB_FILES_FETCH_ThreadFunc(Jobs::Job *OurJob)
 	return nullptr;
 }
 
+static void *JOB_FILES_FETCHCHUNK_ThreadFunc(Jobs::Job *OurJob)
+{ /*Streams one file as a series of chunk reports under our ident, then a final report with the whole file's SHA-512.
+	* Resuming from an offset still reads (but doesn't send) the part before it, so the hash always covers everything.*/
+	InitJobEnv();
+	
+	VLScopedPtr<Conation::ConationStream*> Stream { OurJob->Read_Queue.Pop() };
+
+	VLASSERT(Conation::BuildIdentComposite(Conation::GetIdentFlags(Stream->GetCmdIdentComposite()) & ~Conation::IDENT_ISREPORT_BIT, Stream->GetCmdIdentOnly()) == OurJob->CmdIdent && Stream->GetCommandCode() == OurJob->CmdCode);
+
+	Conation::ConationStream Response(Stream->GetCommandCode(), Conation::GetIdentFlags(OurJob->CmdIdent) | Conation::IDENT_ISREPORT_BIT, Stream->GetCmdIdentOnly());
+	
+	Response.Push_ODHeader(IdentityModule::GetNodeIdentity(), ADMIN_STR);
+
+	if (!Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER, Conation::ARGTYPE_FILEPATH, Conation::ARGTYPE_UINT64, Conation::ARGTYPE_UINT32}))
+	{
+		Response.Push_NetCmdStatus({false, STATUS_MISUSED});
+		Main::PushStreamToWriteQueue(Response);
+		return nullptr;
+	}
+	
+	Stream->Pop_ODHeader();
+	
+	const VLString &Path = Stream->Pop_FilePath();
+	const uint64_t StartOffset = Stream->Pop_Uint64();
+	size_t ChunkSize = Stream->Pop_Uint32();
+	
+	if (!ChunkSize) ChunkSize = FETCHCHUNK_DEFAULT_SIZE;
+	if (ChunkSize > FETCHCHUNK_MAX_SIZE) ChunkSize = FETCHCHUNK_MAX_SIZE;
+	
+	//Leave room for the header and the other arguments.
+	const size_t MaxArgs = Conation::ConationStream::GetMaxStreamArgsSize();
+	
+	if (MaxArgs && ChunkSize > MaxArgs / 2) ChunkSize = MaxArgs / 2;
+	
+	const VLString &Filename = Utils::StripPathFromFilename(Path);
+	uint64_t TotalSize = 0;
+	
+	if (Utils::IsDirectory(Path) || !Utils::GetFileSize(Path, &TotalSize))
+	{
+		Response.Push_FilePath(Path);
+		Response.Push_NetCmdStatus({false, STATUS_MISSING, "File missing or is a directory"});
+		Main::PushStreamToWriteQueue(Response);
+		return nullptr;
+	}
+	
+	if (StartOffset > TotalSize)
+	{
+		Response.Push_FilePath(Path);
+		Response.Push_NetCmdStatus({false, STATUS_MISUSED, "Offset is past the end of the file"});
+		Main::PushStreamToWriteQueue(Response);
+		return nullptr;
+	}
+	
+	VLScopedPtr<FILE*, int(*)(FILE*)> Desc { fopen(Path, "rb"), fclose };
+	
+	if (!Desc)
+	{
+		Response.Push_FilePath(Path);
+		Response.Push_NetCmdStatus({false, STATUS_ACCESSDENIED, "Unable to open file for reading"});
+		Main::PushStreamToWriteQueue(Response);
+		return nullptr;
+	}
+	
+	std::vector<uint8_t> Buf;
+	Buf.resize(ChunkSize);
+	
+	Utils::Sha512Hasher Hasher;
+	uint64_t Position = 0;
+	
+	while (Position < TotalSize)
+	{
+		uint64_t Wanted = TotalSize - Position < ChunkSize ? TotalSize - Position : ChunkSize;
+		
+		//Don't let the prefix we're only hashing spill into the first chunk we actually send.
+		if (Position < StartOffset && StartOffset - Position < Wanted) Wanted = StartOffset - Position;
+		
+		const size_t ActuallyRead = fread(Buf.data(), 1, Wanted, Desc);
+		
+		if (ActuallyRead != Wanted)
+		{ //File shrank or the disk crapped out. Whatever got sent so far is still good for a resume.
+			Response.Push_FilePath(Path);
+			Response.Push_NetCmdStatus({false, STATUS_IERR, VLString("Read failed at offset ") + VLString::UintToString(Position + ActuallyRead)});
+			Main::PushStreamToWriteQueue(Response);
+			return nullptr;
+		}
+		
+		Hasher.Update(Buf.data(), ActuallyRead);
+		
+		if (Position < StartOffset)
+		{
+			Position += ActuallyRead;
+			continue;
+		}
+		
+		//Backpressure. If the link is slow we wait for it instead of piling chunks up in memory.
+		const uint64_t WaitStarted = Utils::GetMonotonicMs();
+		
+		while (Main::GetWriteQueue().GetQueueSize() >= FETCHCHUNK_MAX_QUEUED)
+		{
+			if (Utils::GetMonotonicMs() - WaitStarted > FETCHCHUNK_STALL_MS)
+			{
+				Response.Push_FilePath(Path);
+				Response.Push_NetCmdStatus({false, STATUS_FAILED, VLString("Write queue stalled, resume from offset ") + VLString::UintToString(Position)});
+				Main::PushStreamToWriteQueue(Response);
+				return nullptr;
+			}
+			
+			Utils::vl_sleep(10);
+		}
+		
+		Conation::ConationStream *Chunk = new Conation::ConationStream(Stream->GetCommandCode(), Conation::GetIdentFlags(OurJob->CmdIdent) | Conation::IDENT_ISREPORT_BIT, Stream->GetCmdIdentOnly());
+		
+		Chunk->Push_ODHeader(IdentityModule::GetNodeIdentity(), ADMIN_STR);
+		Chunk->Push_File(Filename, Buf.data(), ActuallyRead);
+		Chunk->Push_Uint64(Position);
+		Chunk->Push_Uint64(TotalSize);
+		
+		Main::PushStreamToWriteQueue(Chunk);
+		
+		Position += ActuallyRead;
+	}
+	
+	Response.Push_FilePath(Path);
+	Response.Push_Uint64(TotalSize);
+	Response.Push_String(Hasher.Finish());
+	Response.Push_NetCmdStatus({true});
+	
+	Main::PushStreamToWriteQueue(Response);
+	
+	return nullptr;
+}
+
 static void *JOB_FILES_PLACE_ThreadFunc(Jobs::Job *OurJob)
 { /*Would it just have been easier to put the file path argument first?
 	* Sure, but it'd make me reorder the dialogs in the control program, so fuck you, have some complicated code.
@@ -549,6 +856,47 @@ Safe:
 
 	return nullptr;
 }
+static void *JOB_FILES_PLACECHUNK_ThreadFunc(Jobs::Job *OurJob)
+{ /*One chunk of an upload per order. We always answer with what's still missing, so the sender knows where to go next,
+	* and an empty chunk works as a query for resuming after the link drops.*/
+	InitJobEnv();
+	
+	VLScopedPtr<Conation::ConationStream*> Stream { OurJob->Read_Queue.Pop() };
+
+	VLASSERT(Conation::BuildIdentComposite(Conation::GetIdentFlags(Stream->GetCmdIdentComposite()) & ~Conation::IDENT_ISREPORT_BIT, Stream->GetCmdIdentOnly()) == OurJob->CmdIdent && Stream->GetCommandCode() == OurJob->CmdCode);
+
+	Conation::ConationStream Response(Stream->GetCommandCode(), Conation::GetIdentFlags(OurJob->CmdIdent) | Conation::IDENT_ISREPORT_BIT, Stream->GetCmdIdentOnly());
+	
+	Response.Push_ODHeader(IdentityModule::GetNodeIdentity(), ADMIN_STR);
+
+	if (!Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER, Conation::ARGTYPE_FILEPATH, Conation::ARGTYPE_UINT64, Conation::ARGTYPE_STRING, Conation::ARGTYPE_UINT64, Conation::ARGTYPE_BINSTREAM}))
+	{
+		Response.Push_NetCmdStatus({false, STATUS_MISUSED, "Takes destination, total size, SHA-512, offset, and chunk data"});
+		Main::PushStreamToWriteQueue(Response);
+		return nullptr;
+	}
+	
+	Stream->Pop_ODHeader();
+	
+	const VLString &Destination = Stream->Pop_FilePath();
+	const uint64_t TotalSize = Stream->Pop_Uint64();
+	const VLString &Hash = Stream->Pop_String();
+	const uint64_t Offset = Stream->Pop_Uint64();
+	const Conation::ConationStream::BinStreamArg &Chunk = Stream->Pop_BinStream(); //Points into Stream, no copy.
+	
+	VLString Missing;
+	
+	const NetCmdStatus &Result = Files::PlaceChunk(Destination, TotalSize, Hash, Offset, Chunk.Data, Chunk.DataSize, &Missing);
+	
+	Response.Push_NetCmdStatus(Result);
+	Response.Push_FilePath(Destination);
+	Response.Push_String(Missing);
+	
+	Main::PushStreamToWriteQueue(Response);
+	
+	return nullptr;
+}
+
 static void *JOB_FILES_COPY_ThreadFunc(Jobs::Job *OurJob)
 {
 	InitJobEnv();
@@ -559,7 +907,10 @@ static void *JOB_FILES_COPY_ThreadFunc(Jobs::Job *OurJob)
 
 	Conation::ConationStream *Response = new Conation::ConationStream(Stream->GetCommandCode(), Conation::GetIdentFlags(OurJob->CmdIdent) | Conation::IDENT_ISREPORT_BIT, Stream->GetCmdIdentOnly());
 
-	if (!Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER, Conation::ARGTYPE_FILEPATH, Conation::ARGTYPE_FILEPATH}))
+	//Trailing bool is optional, for keeping mode and timestamps.
+	const bool HasPreserve = Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER, Conation::ARGTYPE_FILEPATH, Conation::ARGTYPE_FILEPATH, Conation::ARGTYPE_BOOL});
+	
+	if (!HasPreserve && !Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER, Conation::ARGTYPE_FILEPATH, Conation::ARGTYPE_FILEPATH}))
 	{
 		Response->Push_ODHeader(IdentityModule::GetNodeIdentity(), ADMIN_STR);
 		Response->Push_NetCmdStatus(NetCmdStatus(false, STATUS_MISUSED));
@@ -570,15 +921,122 @@ static void *JOB_FILES_COPY_ThreadFunc(Jobs::Job *OurJob)
 
 	const VLString &Source = Stream->Pop_FilePath();
 	const VLString &Destination = Stream->Pop_FilePath();
+	const bool PreserveMetadata = HasPreserve && Stream->Pop_Bool();
+	
+	const NetCmdStatus &Result = Files::Copy(Source, Destination, PreserveMetadata, PushWalkProgress, OurJob, &OurJob->Cancelled);
+
+	Response->Push_ODHeader(IdentityModule::GetNodeIdentity(), ADMIN_STR);
+	Response->Push_NetCmdStatus(Result);
+	Main::PushStreamToWriteQueue(Response);
+	
+	return nullptr;
+}
+static void *JOB_FILES_HASHTREE_ThreadFunc(Jobs::Job *OurJob)
+{
+	InitJobEnv();
+
+	VLScopedPtr<Conation::ConationStream*> Stream { OurJob->Read_Queue.Pop() };
+
+	VLASSERT(Conation::BuildIdentComposite(Conation::GetIdentFlags(Stream->GetCmdIdentComposite()) & ~Conation::IDENT_ISREPORT_BIT, Stream->GetCmdIdentOnly()) == OurJob->CmdIdent && Stream->GetCommandCode() == OurJob->CmdCode);
+
+	Conation::ConationStream *Response = new Conation::ConationStream(Stream->GetCommandCode(), Conation::GetIdentFlags(OurJob->CmdIdent) | Conation::IDENT_ISREPORT_BIT, Stream->GetCmdIdentOnly());
+	Response->Push_ODHeader(IdentityModule::GetNodeIdentity(), ADMIN_STR);
+
+	//Algorithm name is optional, SHA-512 if it's missing or empty.
+	const bool HasAlgo = Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER, Conation::ARGTYPE_FILEPATH, Conation::ARGTYPE_STRING});
+	
+	if (!HasAlgo && !Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER, Conation::ARGTYPE_FILEPATH}))
+	{
+		Response->Push_NetCmdStatus(NetCmdStatus(false, STATUS_MISUSED));
+		Main::PushStreamToWriteQueue(Response);
+		return nullptr;
+	}
+	
+	Stream->Pop_ODHeader();
 	
-	const NetCmdStatus &Result = Files::Copy(Source, Destination);
+	const VLString &Path = Stream->Pop_FilePath();
+	
+	Files::HashAlgo Algo = Files::HASH_SHA512;
+	
+	if (HasAlgo && !Files::ParseHashAlgo(Stream->Pop_String(), Algo))
+	{
+		Response->Push_NetCmdStatus(NetCmdStatus(false, STATUS_MISUSED, "Hash algorithm must be sha512 or xxh64"));
+		Main::PushStreamToWriteQueue(Response);
+		return nullptr;
+	}
+	
+	std::vector<Files::ManifestEntry> Manifest;
+	
+	const NetCmdStatus &Result = Files::HashTree(Path, Algo, Manifest, PushWalkProgress, OurJob, &OurJob->Cancelled);
+	
+	Response->Push_NetCmdStatus(Result);
+	
+	if (Result)
+	{
+		Response->Push_FilePath(Path);
+		Response->Push_String(Files::ManifestToText(Manifest));
+	}
+	
+	Main::PushStreamToWriteQueue(Response);
+	
+	return nullptr;
+}
+
+static void *JOB_FILES_SYNC_ThreadFunc(Jobs::Job *OurJob)
+{ //First half of a sync. The sender uploads whatever we say we need with FILES_PLACECHUNK afterwards.
+	InitJobEnv();
+
+	VLScopedPtr<Conation::ConationStream*> Stream { OurJob->Read_Queue.Pop() };
+
+	VLASSERT(Conation::BuildIdentComposite(Conation::GetIdentFlags(Stream->GetCmdIdentComposite()) & ~Conation::IDENT_ISREPORT_BIT, Stream->GetCmdIdentOnly()) == OurJob->CmdIdent && Stream->GetCommandCode() == OurJob->CmdCode);
 
+	Conation::ConationStream *Response = new Conation::ConationStream(Stream->GetCommandCode(), Conation::GetIdentFlags(OurJob->CmdIdent) | Conation::IDENT_ISREPORT_BIT, Stream->GetCmdIdentOnly());
 	Response->Push_ODHeader(IdentityModule::GetNodeIdentity(), ADMIN_STR);
+
+	//Destination directory, the sender's manifest as made by Files::ManifestToText(), and whether to delete what they don't have.
+	if (!Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER, Conation::ARGTYPE_FILEPATH, Conation::ARGTYPE_STRING, Conation::ARGTYPE_BOOL}))
+	{
+		Response->Push_NetCmdStatus(NetCmdStatus(false, STATUS_MISUSED));
+		Main::PushStreamToWriteQueue(Response);
+		return nullptr;
+	}
+	
+	Stream->Pop_ODHeader();
+	
+	const VLString &Root = Stream->Pop_FilePath();
+	const VLString &ManifestText = Stream->Pop_String();
+	const bool DeleteExtras = Stream->Pop_Bool();
+	
+	std::vector<Files::ManifestEntry> Wanted;
+	
+	if (!Files::ParseManifest(ManifestText, Wanted))
+	{
+		Response->Push_NetCmdStatus(NetCmdStatus(false, STATUS_MISUSED, "Malformed manifest, or a path in it points outside the destination"));
+		Main::PushStreamToWriteQueue(Response);
+		return nullptr;
+	}
+	
+	std::vector<VLString> Needed;
+	
+	const NetCmdStatus &Result = Files::PrepareSync(Root, Wanted, DeleteExtras, Needed, PushWalkProgress, OurJob, &OurJob->Cancelled);
+	
 	Response->Push_NetCmdStatus(Result);
+	
+	if (Result)
+	{
+		VLString NeededText(Needed.size() * 64 + 1);
+		
+		for (const VLString &Path : Needed) NeededText += Path + '\n';
+		
+		Response->Push_FilePath(Root);
+		Response->Push_String(NeededText);
+	}
+	
 	Main::PushStreamToWriteQueue(Response);
 	
 	return nullptr;
 }
+
 static void *JOB_FILES_DEL_ThreadFunc(Jobs::Job *OurJob)
 {
 	InitJobEnv();
@@ -611,7 +1069,7 @@ static void *JOB_FILES_DEL_ThreadFunc(Jobs::Job *OurJob)
 
 	for (size_t Inc = 0; Inc < NumArgs - 1; ++Inc)
 	{
-		if (!Files::Delete(Stream->Pop_FilePath()))
+		if (!Files::Delete(Stream->Pop_FilePath(), PushWalkProgress, OurJob, &OurJob->Cancelled))
 		{
 			SucceededAll = false;
 		}
@@ -636,7 +1094,10 @@ static void *JOB_EXECCMD_ThreadFunc(Jobs::Job *OurJob)
 
 	Conation::ConationStream *Response = new Conation::ConationStream(Stream->GetCommandCode(), Conation::GetIdentFlags(OurJob->CmdIdent) | Conation::IDENT_ISREPORT_BIT, Stream->GetCmdIdentOnly());
 
-	if (!Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER, Conation::ARGTYPE_STRING}))
+	//Timeout in seconds and output cap in bytes are optional, zero meaning forever and the default.
+	const bool HasLimits = Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER, Conation::ARGTYPE_STRING, Conation::ARGTYPE_UINT32, Conation::ARGTYPE_UINT64});
+	
+	if (!HasLimits && !Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER, Conation::ARGTYPE_STRING}))
 	{
 		Response->Push_ODHeader(IdentityModule::GetNodeIdentity(), ADMIN_STR);
 		Response->Push_NetCmdStatus(NetCmdStatus(false, STATUS_MISUSED));
@@ -646,9 +1107,28 @@ static void *JOB_EXECCMD_ThreadFunc(Jobs::Job *OurJob)
 	}
 	Stream->Pop_ODHeader(); //We don't give a fuck.
 
+	const VLString &Command = Stream->Pop_String();
+	
+	Processes::SpawnOptions Options;
+	
+	Options.OutputCap = EXECCMD_DEFAULT_OUTPUT_CAP;
+	Options.PartialIntervalMs = EXECCMD_PARTIAL_INTERVAL_MS;
+	Options.PartialFunc = PushExecPartial;
+	Options.UserData = OurJob;
+	Options.Cancel = &OurJob->Cancelled; //So a kill takes the process group down with us instead of leaving it running.
+	
+	if (HasLimits)
+	{
+		Options.TimeoutMs = std::min<uint64_t>(Stream->Pop_Uint32() * 1000ull, UINT32_MAX);
+		
+		const uint64_t OutputCap = Stream->Pop_Uint64();
+		
+		if (OutputCap) Options.OutputCap = OutputCap;
+	}
+	
 	VLString CmdOutput;
 	
-	const NetCmdStatus &RetVal = Processes::ExecuteCmd(Stream->Pop_String(), CmdOutput);
+	const NetCmdStatus &RetVal = Processes::ExecuteCmd(Command, CmdOutput, Options);
 
 	Response->Push_ODHeader(IdentityModule::GetNodeIdentity(), ADMIN_STR);
 	if (CmdOutput) Response->Push_String(CmdOutput);
@@ -696,7 +1176,11 @@ static void *JOB_GETPROCESSES_ThreadFunc(Jobs::Job *OurJob)
 
 	Conation::ConationStream *Response = new Conation::ConationStream(Stream->GetCommandCode(), Conation::GetIdentFlags(OurJob->CmdIdent) | Conation::IDENT_ISREPORT_BIT, Stream->GetCmdIdentOnly());
 
-	if (!Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER, Conation::ARGTYPE_BOOL}))
+	//Name, user, minimum CPU percent and sample time in milliseconds are optional.
+	const bool HasFilter = Stream->VerifyArgTypes({ Conation::ARGTYPE_ODHEADER, Conation::ARGTYPE_BOOL, Conation::ARGTYPE_STRING,
+													Conation::ARGTYPE_STRING, Conation::ARGTYPE_UINT32, Conation::ARGTYPE_UINT32 });
+	
+	if (!HasFilter && !Stream->VerifyArgTypes({Conation::ARGTYPE_ODHEADER, Conation::ARGTYPE_BOOL}))
 	{
 		Response->Push_ODHeader(IdentityModule::GetNodeIdentity(), ADMIN_STR);
 		Response->Push_NetCmdStatus(NetCmdStatus(false, STATUS_MISUSED));
@@ -708,11 +1192,21 @@ static void *JOB_GETPROCESSES_ThreadFunc(Jobs::Job *OurJob)
 
 	Stream->Pop_ODHeader();
 	
-	const bool FilterKernelProcesses = !Stream->Pop_Bool();
+	Processes::ProcessFilter Filter;
+	
+	Filter.IncludeKernel = Stream->Pop_Bool();
+	
+	if (HasFilter)
+	{
+		Filter.Name = Stream->Pop_String();
+		Filter.User = Stream->Pop_String();
+		Filter.MinCPU = Stream->Pop_Uint32();
+		Filter.SampleMs = std::min<uint32_t>(Stream->Pop_Uint32(), GETPROCESSES_MAX_SAMPLE_MS);
+	}
 	
 	std::list<Processes::ProcessListMember> List;
 
-	const NetCmdStatus &Status = Processes::GetProcessesList(&List);
+	const NetCmdStatus &Status = Processes::GetProcessesList(&List, Filter);
 
 	Response->Push_ODHeader(IdentityModule::GetNodeIdentity(), ADMIN_STR);
 
@@ -724,27 +1218,30 @@ static void *JOB_GETPROCESSES_ThreadFunc(Jobs::Job *OurJob)
 		return nullptr;
 	}
 
-	size_t ToReserve = 0;
-	for (auto Iter = List.begin(); Iter != List.end(); ++Iter)
-	{
-		ToReserve += Iter->ProcessName.size();
-		ToReserve += Iter->User.size();
-		ToReserve += 64;
-	}
-
+	//Busiest first, that's usually what you're looking for.
+	List.sort([] (const Processes::ProcessListMember &Lhs, const Processes::ProcessListMember &Rhs) { return Lhs.CPUPercent > Rhs.CPUPercent; });
+	
 	VLString OutputString;
-	OutputString.reserve(ToReserve);
+	OutputString.reserve(List.size() * 192);
 	
 	for (auto Iter = List.begin(); Iter != List.end(); ++Iter)
 	{
-		if (Iter->KernelProcess && FilterKernelProcesses) continue;
-		
 		char StringPID[128];
 		snprintf(StringPID, sizeof StringPID, "%lld", (long long)Iter->PID);
 		
 		OutputString += VLString("PID: ") + (const char*)StringPID + " || ";
 		OutputString += VLString("Name: ") + (Iter->KernelProcess ? VLString("K:[") + Iter->ProcessName + "]" : Iter->ProcessName) + " || ";
 		OutputString += VLString("User: ") + Iter->User;
+		
+		if (Iter->State)
+		{
+			char Stats[256];
+			snprintf(Stats, sizeof Stats, " || PPID: %lld || State: %c || CPU: %.1f%% || RSS: %.1f MiB || Threads: %u || Started: ",
+					(long long)Iter->ParentPID, Iter->State, Iter->CPUPercent, Iter->RSS / (1024.0 * 1024.0), (unsigned)Iter->Threads);
+			
+			OutputString += (const char*)Stats;
+			OutputString += Utils::TimeToString(Iter->StartTime);
+		}
 		OutputString += "\n";
 	}
 
@@ -867,8 +1364,17 @@ static void *JOB_CHDIR_ThreadFunc(Jobs::Job *OurJob)
 	return nullptr;
 }
 	
-bool Jobs::StartJob(const CommandCode ID, const Conation::ConationStream *Data)
-{
+bool Jobs::StartJob(const CommandCode ID, Conation::ConationStream *Data)
+{ //Takes Data's buffer rather than copying it. Data is left empty, but still needs deleting by whoever owns it.
+	//Get function we use as thread entry point.
+	const JobFuncLookupStruct *const Lookup = LookupJobFunction(ID);
+	
+	if (!Lookup)
+	{
+		VLWARN("No job function for command code " + CommandCodeToString(ID));
+		return false;
+	}
+	
 	//Create job object
 	JobsList.emplace_back();
 
@@ -876,6 +1382,8 @@ bool Jobs::StartJob(const CommandCode ID, const Conation::ConationStream *Data)
 	Job &New = JobsList.back();
 	
 	New.JobID = ++JobIDCounter; //Unsigned, doesn't matter if it overflows. First is one.
+	New.Lane = Lookup->Lane;
+	New.QueuedAt = Utils::GetMonotonicMs();
 
 	if (ID != CMDCODE_INVALID && Data != nullptr)
 	{ //If these arguments aren't specified, we're firing a raw init script.
@@ -887,40 +1395,215 @@ bool Jobs::StartJob(const CommandCode ID, const Conation::ConationStream *Data)
 		New.CmdIdent = Conation::BuildIdentComposite(Hdr.CmdIdentFlags, Hdr.CmdIdent);
 		
 		New.CmdCode = Hdr.CmdCode;
-		New.Read_Queue.Push(*Data); //Copy it.
+		New.Read_Queue.Push(new Conation::ConationStream(std::move(*Data))); //Steal it, these can be huge.
 	}
 
-	//Get function we use as thread entry point.
-	auto FuncPtr = LookupJobFunction(ID);
-
-	//Begin execution.
-	New.JobThread = new VLThreads::Thread(FuncPtr, &New);
-	New.JobThread->Start();
+	if (New.Lane == LANE_DEDICATED)
+	{
+		New.JobThread = new VLThreads::Thread((VLThreads::Thread::EntryFunc)DedicatedJobFunc, &New);
+		New.JobThread->Start();
+		return true;
+	}
 	
-	return true;
+	//Queue it up for the pool.
+	JobLaneStruct &Lane = JobLanes[New.Lane];
 	
+	VLThreads::MutexKeeper Keeper { &Lane.Mutex };
+	
+	Lane.Queue.push_back(&New);
+	
+	if (Lane.Queue.size() > Lane.Stats.PeakDepth) Lane.Stats.PeakDepth = Lane.Queue.size();
+	
+	SpawnWorkers(Lane);
+	
+	Keeper.Unlock();
+	
+	Lane.Pending.Post();
+	
+	return true;
 }
 
-void Jobs::ProcessCompletedJobs(void)
-{
-	std::list<Job>::iterator Iter = JobsList.begin();
+static void SpawnWorkers(JobLaneStruct &Lane)
+{ //Lane mutex must be held.
+	while (Lane.Queue.size() > Lane.IdleWorkers && Lane.Workers.size() < Lane.MaxWorkers)
+	{
+		Lane.Workers.emplace_back(&Lane);
+		
+		JobWorker &Worker = Lane.Workers.back();
+		
+		++Lane.IdleWorkers;
+		
+		Worker.WorkerThread = new VLThreads::Thread((VLThreads::Thread::EntryFunc)JobWorkerFunc, &Worker);
+		Worker.WorkerThread->Start();
+		
+		VLDEBUG(VLString("Spawned worker for ") + Lane.Name + " job lane, now have " + VLString::UintToString(Lane.Workers.size()));
+	}
+}
 
-	for (; Iter != JobsList.end(); ++Iter)
+static void *JobWorkerFunc(JobWorker *Worker)
+{
+	JobLaneStruct &Lane = *Worker->Lane;
+	
+	while (true)
 	{
-		Job *CurJob = &*Iter;
+		Lane.Pending.Wait();
+		
+		VLThreads::MutexKeeper Keeper { &Lane.Mutex };
+		
+		if (Worker->Doomed)
+		{ //Give the wakeup back so a healthy worker can have it.
+			Keeper.Unlock();
+			Lane.Pending.Post();
+			return nullptr;
+		}
+		
+		if (Lane.Queue.empty()) continue; //Job was killed while it was still queued.
+		
+		Jobs::Job *const OurJob = Lane.Queue.front();
+		Lane.Queue.pop_front();
+		
+		Worker->Current = OurJob;
+		--Lane.IdleWorkers;
+		
+		const uint64_t StartedAt = Utils::GetMonotonicMs();
+		const uint64_t WaitMs = StartedAt - OurJob->QueuedAt;
+		const uint64_t JobID = OurJob->JobID;
+		const JobFuncLookupStruct *const Lookup = LookupJobFunction(OurJob->CmdCode);
+		
+		++Lane.Stats.Started;
+		Lane.Stats.TotalWaitMs += WaitMs;
+		if (WaitMs > Lane.Stats.MaxWaitMs) Lane.Stats.MaxWaitMs = WaitMs;
+		
+		Keeper.Unlock();
+		
+		const bool Detached = Lookup->Function(OurJob) == JOB_DETACHED; //If so, OurJob might already be gone.
+		
+		const uint64_t RunMs = Utils::GetMonotonicMs() - StartedAt;
+		
+		Keeper.Lock();
+		
+		if (Worker->Doomed)
+		{ //Our job was killed and we got to finish it up. The main thread already dealt with it and the worker count, and it's waiting on us.
+			Keeper.Unlock();
+			return nullptr;
+		}
+		
+		Worker->Current = nullptr;
+		++Lane.IdleWorkers;
+		
+		++Lane.Stats.Completed;
+		Lane.Stats.TotalRunMs += RunMs;
+		if (RunMs > Lane.Stats.MaxRunMs) Lane.Stats.MaxRunMs = RunMs;
+		
+		Keeper.Unlock();
+		
+		if (!Detached) SignalJobCompleted(JobID);
+	}
+	
+	return nullptr;
+}
 
-		if (CurJob->JobThread->Alive()) continue; ///Still alive, do nothing.
+static void *DedicatedJobFunc(Jobs::Job *OurJob)
+{
+	const uint64_t JobID = OurJob->JobID;
+	
+	LookupJobFunction(OurJob->CmdCode)->Function(OurJob);
+	
+	SignalJobCompleted(JobID);
+	
+	return nullptr;
+}
 
-		//Job's dead. Deal with it.
+static void SignalJobCompleted(const uint64_t JobID)
+{
+	const VLThreads::MutexKeeper Keeper { &CompletedJobs.Mutex };
+	
+	CompletedJobs.IDs.push_back(JobID);
+}
 
-		//Get rid of this job now that we're done with it.
-		auto IterNext = Iter;
-		++IterNext;
-		JobsList.erase(Iter);
-		Iter = IterNext;
+void Jobs::ProcessCompletedJobs(void)
+{
+	std::vector<uint64_t> Finished;
+	
+	{
+		const VLThreads::MutexKeeper Keeper { &CompletedJobs.Mutex };
+		
+		if (CompletedJobs.IDs.empty()) return;
+		
+		Finished.swap(CompletedJobs.IDs);
+	}
+	
+	for (const uint64_t JobID : Finished)
+	{
+		for (auto Iter = JobsList.begin(); Iter != JobsList.end(); ++Iter)
+		{
+			if (Iter->JobID != JobID) continue;
+			
+			//Dedicated threads are on their way out once they signal, so this won't block for long.
+			if (Iter->JobThread) Iter->JobThread->Join();
+			
+			//Get rid of this job now that we're done with it.
+			JobsList.erase(Iter);
+			
+			VLDEBUG("Job completed.");
+			break;
+		}
+	}
+}
 
-		VLDEBUG("Job completed.");
+static void RemoveJobFromLane(Jobs::Job *const Target)
+{ //Pulls a job out of its lane's queue, or kills the worker running it and gets a new one going.
+	const bool Cooperative = LookupJobFunction(Target->CmdCode)->Cooperative;
+	
+	Target->Cancelled = true;
+	
+	if (Target->Lane == Jobs::LANE_DEDICATED)
+	{
+		if (!Cooperative) Target->JobThread->Kill();
+		Target->JobThread->Join();
+		return;
+	}
+	
+	JobLaneStruct &Lane = JobLanes[Target->Lane];
+	
+	VLThreads::MutexKeeper Keeper { &Lane.Mutex };
+	
+	++Lane.Stats.Killed;
+	
+	auto QueueIter = std::find(Lane.Queue.begin(), Lane.Queue.end(), Target);
+	
+	if (QueueIter != Lane.Queue.end())
+	{ //Never started, easy. Its wakeup gets eaten by whichever worker sees an empty queue.
+		Lane.Queue.erase(QueueIter);
+		return;
+	}
+	
+	for (auto Iter = Lane.Workers.begin(); Iter != Lane.Workers.end(); ++Iter)
+	{
+		if (Iter->Current != Target) continue;
+		
+		Iter->Doomed = true;
+		Iter->Current = nullptr;
+		
+		//Can't hold the lock while we join, the worker might be waiting on it.
+		Keeper.Unlock();
+		
+		//A cooperative job sees it's been cancelled and returns, and the worker bails out once it sees it's doomed.
+		if (!Cooperative) Iter->WorkerThread->Kill();
+		Iter->WorkerThread->Join();
+		
+		Keeper.Lock();
+		
+		Lane.Workers.erase(Iter);
+		
+		SpawnWorkers(Lane); //Replace it if there's work waiting.
+		break;
 	}
+	
+	Keeper.Unlock();
+	
+	//Might have been handed off to the Lua scheduler, either before we got here or just before we killed its worker.
+	Script::CancelScheduledJob(Target);
 }
 
 static void InitJobEnv(void)
@@ -959,6 +1642,9 @@ void Jobs::ForwardN2N(Conation::ConationStream *const Stream)
 	
 	Stream->Rewind();
 	
+	//Resident scripts aren't jobs, so they only see the broadcast ones.
+	if (!DestinationJob) Script::ForwardN2NToResidents(Stream);
+	
 	for (Job &Ref : JobsList)
 	{
 		if (DestinationJob && Ref.JobID != DestinationJob) continue;
@@ -967,6 +1653,8 @@ void Jobs::ForwardN2N(Conation::ConationStream *const Stream)
 		
 		Ref.N2N_Queue.Push(*Stream);
 	}
+	
+	Script::WakeScheduler();
 }
 
 void Jobs::ForwardToScriptJobs(Conation::ConationStream *const Stream)
@@ -978,20 +1666,43 @@ void Jobs::ForwardToScriptJobs(Conation::ConationStream *const Stream)
 			Iter->Read_Queue.Push(*Stream);
 		}
 	}
+	
+	Script::WakeScheduler();
 }
 
 void Jobs::KillAllJobs(void)
 {
 	for (auto Iter = JobsList.begin(); Iter != JobsList.end(); ++Iter)
 	{
-		if (Iter->JobThread)
+		if (Iter->JobThread) RemoveJobFromLane(&*Iter);
+		else Script::CancelScheduledJob(&*Iter);
+	}
+	
+	for (JobLaneStruct &Lane : JobLanes)
+	{ //Every pooled worker goes, idle or not, since we might be about to replace our own binary.
+		VLThreads::MutexKeeper Keeper { &Lane.Mutex };
+		
+		for (JobWorker &Worker : Lane.Workers) Worker.Doomed = true;
+		
+		Keeper.Unlock();
+		
+		for (JobWorker &Worker : Lane.Workers)
 		{
-			Iter->JobThread->Kill();
-			Iter->JobThread->Join();
+			Worker.WorkerThread->Kill();
+			Worker.WorkerThread->Join();
 		}
+		
+		Keeper.Lock();
+		
+		Lane.Workers.clear();
+		Lane.Queue.clear();
+		Lane.IdleWorkers = 0;
 	}
 	
 	JobsList.clear();
+	
+	const VLThreads::MutexKeeper Keeper { &CompletedJobs.Mutex };
+	CompletedJobs.IDs.clear();
 }
 
 bool Jobs::KillJobByID(const uint64_t JobID)
@@ -1000,8 +1711,7 @@ bool Jobs::KillJobByID(const uint64_t JobID)
 	{
 		if (Iter->JobID == JobID)
 		{
-			Iter->JobThread->Kill();
-			Iter->JobThread->Join();
+			RemoveJobFromLane(&*Iter);
 			JobsList.erase(Iter);
 			return true;
 		}
@@ -1017,8 +1727,7 @@ ResetLoop:
 	{
 		if (Iter->CmdCode == CmdCode)
 		{
-			Iter->JobThread->Kill();
-			Iter->JobThread->Join();
+			RemoveJobFromLane(&*Iter);
 			JobsList.erase(Iter);
 			FoundOne = true;
 			goto ResetLoop;
@@ -1043,6 +1752,34 @@ Conation::ConationStream *Jobs::BuildRunningJobsReport(const Conation::ConationS
 		RetVal->Push_Uint64(Iter->CmdIdent);
 	}
 	
+	//Pool counters go last as a single string, so older control panels just see an extra argument.
+	VLString Stats(1024);
+	
+	for (JobLaneStruct &Lane : JobLanes)
+	{
+		const VLThreads::MutexKeeper Keeper { &Lane.Mutex };
+		
+		const uint64_t Started = Lane.Stats.Started ? Lane.Stats.Started : 1;
+		const uint64_t Completed = Lane.Stats.Completed ? Lane.Stats.Completed : 1;
+		
+		Stats += VLString("Lane ") + Lane.Name + ": "
+				+ VLString::UintToString(Lane.Workers.size() - Lane.IdleWorkers) + '/' + VLString::UintToString(Lane.Workers.size())
+				+ " workers busy (max " + VLString::UintToString(Lane.MaxWorkers) + "), queue depth "
+				+ VLString::UintToString(Lane.Queue.size()) + " (peak " + VLString::UintToString(Lane.Stats.PeakDepth) + "), "
+				+ VLString::UintToString(Lane.Stats.Completed) + " completed, " + VLString::UintToString(Lane.Stats.Killed) + " killed, "
+				+ "wait avg/max " + VLString::UintToString(Lane.Stats.TotalWaitMs / Started) + '/' + VLString::UintToString(Lane.Stats.MaxWaitMs) + " ms, "
+				+ "run avg/max " + VLString::UintToString(Lane.Stats.TotalRunMs / Completed) + '/' + VLString::UintToString(Lane.Stats.MaxRunMs) + " ms\n";
+	}
+	
+	for (const Job &Item : JobsList)
+	{ //Script jobs only, everything else never touches a Lua state.
+		if (!Item.LuaMemPeak) continue;
+		
+		Stats += VLString("Job ") + VLString::UintToString(Item.JobID) + ": Lua memory " + VLString::UintToString(Item.LuaMemCurrent / 1024)
+				+ " KiB (peak " + VLString::UintToString(Item.LuaMemPeak / 1024) + " KiB)\n";
+	}
+	
+	RetVal->Push_String(Stats);
+	
 	return RetVal;
 }
-
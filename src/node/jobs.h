@@ -23,9 +23,18 @@
 #include "../libvolition/include/conation.h"
 #include "../libvolition/include/vlthreads.h"
 #include <queue>
+#include <atomic>
 
 namespace Jobs
 {
+	enum JobLane : uint8_t
+	{
+		LANE_SHORT, //Quick metadata stuff like CHDIR, GETCWD, LISTDIRECTORY, and script load/unload so a full long lane can't hold those up.
+		LANE_LONG, //Lua and file transfer jobs that can run for ages.
+		LANE_MAX,
+		LANE_DEDICATED = LANE_MAX, //Gets its own thread, e.g. the startup script, which might never exit.
+	};
+	
 	struct Job
 	{
 		uint64_t JobID; //The number of the job according to this node.
@@ -34,15 +43,24 @@ namespace Jobs
 		Conation::ConationQueue Read_Queue, N2N_Queue; //The main thread puts streams intended for a certain job in this queue.
 		bool CaptureIncomingStreams : 1;
 		bool ReceiveN2N : 1;
+		JobLane Lane;
+		uint64_t QueuedAt; //Monotonic milliseconds, for the latency counters.
 		
 		//We don't have a write one cuz we just use Main::PushStreamToWriteQueue() to access the primary one.
 		
-		VLScopedPtr<VLThreads::Thread*> JobThread;
+		VLScopedPtr<VLThreads::Thread*> JobThread; //Only for LANE_DEDICATED jobs, the rest run on the worker pool.
+		
+		//Bytes held by the Lua state running this job, if it's a script job. Kept up to date by the state's allocator.
+		std::atomic<uint64_t> LuaMemCurrent;
+		std::atomic<uint64_t> LuaMemPeak;
+		
+		//Set when the job's killed. Jobs marked cooperative in the lookup table watch this and wrap up, rather than having their thread cancelled.
+		std::atomic_bool Cancelled;
 
-		Job(void) : JobID(), CmdIdent(), CmdCode(), CaptureIncomingStreams(), ReceiveN2N(), JobThread() {}
+		Job(void) : JobID(), CmdIdent(), CmdCode(), CaptureIncomingStreams(), ReceiveN2N(), Lane(), QueuedAt(), JobThread(), LuaMemCurrent(), LuaMemPeak(), Cancelled() {}
 	};
 	
-	bool StartJob(const CommandCode NewJob, const Conation::ConationStream *Data);
+	bool StartJob(const CommandCode NewJob, Conation::ConationStream *Data); //Moves Data's buffer into the job.
 	void ProcessCompletedJobs(void);
 	VLString GetWorkingDirectory(void);
 	void ForwardToScriptJobs(Conation::ConationStream *const Stream);
@@ -27,6 +27,7 @@
 #include "identity_module.h"
 #include "files.h"
 #include "script.h"
+#include "sampler.h"
 
 #include <stdlib.h>
 #include <time.h>
@@ -108,7 +109,7 @@ void Main::Begin(const bool JustUpdated)
 		Jobs::StartJob(CMDCODE_INVALID, nullptr);
 	}
 	
-	while (!(SocketDescriptor = Interface::Establish(IdentityModule::GetServerAddr() ) ).Internal ) Utils::vl_sleep(1000);
+	SocketDescriptor = Interface::EstablishWithBackoff(IdentityModule::GetServerAddr());
 
 	MasterReadQueue.SetStatusObj(&ReadQueueStatus);
 	MasterWriteQueue.SetStatusObj(&WriteQueueStatus);
@@ -116,6 +117,8 @@ void Main::Begin(const bool JustUpdated)
 	MasterReadQueue.Begin(SocketDescriptor);
 	MasterWriteQueue.Begin(SocketDescriptor);
 	
+	Sampler::Start();
+	
 	if (JustUpdated)
 	{
 		//Tell the server we're alright.
@@ -144,6 +147,10 @@ void Main::MurderAllThreads(void)
 	
 	//Job threads will also prevent us from updating on Windows, any thread really.
 	Jobs::KillAllJobs();
+	Script::StopAllResidents();
+	Script::StopScheduler();
+	Script::StopWorkerPool();
+	Sampler::Stop();
 }
 
 static void MasterLoop(Net::ClientDescriptor &Descriptor)
@@ -164,7 +171,7 @@ Restart:
 		
 		Net::Close(Descriptor);
 		
-		while (!(Descriptor = Interface::Establish(IdentityModule::GetServerAddr() ) ).Internal) Utils::vl_sleep(1000);
+		Descriptor = Interface::EstablishWithBackoff(IdentityModule::GetServerAddr());
 
 		VLDEBUG("Reconnect succeeded. Restarting network queues.");
 		//Restart network queues.
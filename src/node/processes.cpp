@@ -27,13 +27,23 @@
 #include <aclapi.h>
 
 #elif defined(FREEBSD)
-
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/wait.h>
 #else
 
 #include <signal.h>
 #include <dirent.h> //We scan /proc
 #include <pwd.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
 
 #endif //WIN32
 
@@ -43,56 +53,297 @@
 #include "../libvolition/include/utils.h"
 
 #include "processes.h"
+#include "files.h"
 
 #include <vector> //Already included from processes.h, but for documentation. You'll see that a lot.
+#include <map>
+#include <atomic>
+#include <algorithm>
 
-NetCmdStatus Processes::ExecuteCmd(const char *Command, VLString &CmdOutput_Out)
-{
+#define SPAWN_READ_BLOCK_SIZE (1024 * 64)
+#define SPAWN_POLL_MS 250
+#define SPAWN_REAP_POLL_MS 10
+#define SPAWN_LINGER_MS 1000 //How long we keep reading after it exits, if its children still have the pipes.
+#define SPAWN_KILL_GRACE_MS 3000 //Between SIGTERM and SIGKILL on a timeout.
 
+#define PROC_READ_BUFFER_SIZE 4096
+#define PROC_PF_KTHREAD 0x00200000 //From the kernel's sched.h, not exported anywhere we can include.
+
+#ifndef WIN32
+extern char **environ;
+#endif //WIN32
+
+NetCmdStatus Processes::ExecuteCmd(const char *Command, VLString &CmdOutput_Out, const SpawnOptions &Options)
+{
 #ifdef WIN32
-#define POPEN_FUNC _popen
-#define PCLOSE_FUNC _pclose
+	const std::vector<VLString> Argv { Command }; //Goes through _popen(), which hands it to cmd.exe already.
 #else
-#define POPEN_FUNC popen
-#define PCLOSE_FUNC pclose
+	const std::vector<VLString> Argv { "/bin/sh", "-c", Command };
 #endif //WIN32
 
-	FILE *CmdStdout = POPEN_FUNC(Command, "r");
+	SpawnResult Result;
+	
+	const NetCmdStatus &Status = Spawn(Argv, Options, Result);
+	
+	if (!Status && Result.ExitCode == -1 && !Result.Signal) return Status; //Never got off the ground.
+	
+	VLString Output = Result.Stdout.empty() ? VLString("Command returned no output.") : VLString(Result.Stdout);
+	
+	if (!Result.Stderr.empty())
+	{
+		Output += "\n\nStandard error:\n";
+		Output += VLString(Result.Stderr);
+	}
+	
+	Output += "\n\n";
+	
+	if (Result.Truncated) Output += VLString("Output was cut off at ") + VLString::UintToString(Options.OutputCap) + " bytes.\n";
+	
+	if (Result.TimedOut) Output += VLString("Process timed out after ") + VLString::UintToString(Options.TimeoutMs / 1000) + " seconds and was killed.\n";
+	else if (Result.Signal) Output += VLString("Process was killed by signal ") + VLString::IntToString(Result.Signal) + '\n';
+	else Output += VLString("Exit code for process was ") + VLString::IntToString(Result.ExitCode) + '\n';
+	
+	CmdOutput_Out = Output;
+	
+	return Status;
+}
 
-	if (!CmdStdout) return { false, STATUS_IERR };
+#ifndef WIN32
+static void ReadSpawnPipe(int &Desc, std::vector<char> &Buf, std::string &Out, uint64_t &Total, const Processes::SpawnOptions &Options, bool &Truncated)
+{ //Keeps reading past the cap and throws it away, so the child never blocks on a full pipe.
+	const ssize_t Read = read(Desc, Buf.data(), Buf.size());
+	
+	if (Read == -1 && (errno == EINTR || errno == EAGAIN)) return;
+	
+	if (Read <= 0)
+	{
+		close(Desc);
+		Desc = -1;
+		return;
+	}
+	
+	size_t Keep = Read;
+	
+	if (Options.OutputCap && Total + Keep > Options.OutputCap)
+	{
+		Keep = Options.OutputCap > Total ? Options.OutputCap - Total : 0;
+		Truncated = true;
+	}
+	
+	Out.append(Buf.data(), Keep);
+	Total += Keep;
+}
+#endif //WIN32
 
-	int Char = 0;
+NetCmdStatus Processes::Spawn(const std::vector<VLString> &Argv, const SpawnOptions &Options, SpawnResult &Out)
+{
+	Out = SpawnResult();
+	
+	if (Argv.empty()) return NetCmdStatus(false, STATUS_MISUSED);
+	
+	size_t StdoutSent = 0, StderrSent = 0;
+	uint64_t Total = 0;
+	uint64_t LastPartial = Utils::GetMonotonicMs();
+	
+	auto SendPartial = [&] (void)
+	{
+		if (!Options.PartialFunc || (Out.Stdout.size() == StdoutSent && Out.Stderr.size() == StderrSent)) return;
+		
+		Options.PartialFunc(Out.Stdout.data() + StdoutSent, Out.Stdout.size() - StdoutSent,
+							Out.Stderr.data() + StderrSent, Out.Stderr.size() - StderrSent, Options.UserData);
+		
+		StdoutSent = Out.Stdout.size();
+		StderrSent = Out.Stderr.size();
+	};
+	
+	std::vector<char> Buf(SPAWN_READ_BLOCK_SIZE);
+	
+#ifdef WIN32
+	//No process groups or separate stderr through _popen(), so timeouts aren't supported here and stderr goes to the console.
+	VLString Command;
+	
+	for (const VLString &Arg : Argv)
+	{
+		if (Command) Command += ' ';
+		
+		if (Argv.size() > 1 && strchr(Arg, ' ')) Command += VLString("\"") + Arg + '"';
+		else Command += Arg;
+	}
+	
+	FILE *CmdStdout = _popen(Command, "rb");
 
-	VLString Output(128);
+	if (!CmdStdout) return NetCmdStatus(false, STATUS_IERR);
 
-	size_t Capacity = Output.GetCapacity();
-	size_t Length = 0;
+	size_t Read = 0;
 	
-	while ((Char = fgetc(CmdStdout)) != EOF)
+	while ((Read = fread(Buf.data(), 1, Buf.size(), CmdStdout)) > 0)
 	{
-		if (Length >= Capacity)
+		size_t Keep = Read;
+		
+		if (Options.OutputCap && Total + Keep > Options.OutputCap)
 		{
-			Output.ChangeCapacity(Capacity * 2);
-			Capacity = Output.GetCapacity();
+			Keep = Options.OutputCap > Total ? Options.OutputCap - Total : 0;
+			Out.Truncated = true;
 		}
 		
-		Output[Length++] = Char;
+		Out.Stdout.append(Buf.data(), Keep);
+		Total += Keep;
+		
+		const uint64_t Now = Utils::GetMonotonicMs();
+		
+		if (Now - LastPartial >= Options.PartialIntervalMs)
+		{
+			SendPartial();
+			LastPartial = Now;
+		}
 	}
-
-	if (!Output)
+	
+	Out.ExitCode = _pclose(CmdStdout);
+#else
+	int StdoutPipe[2] = { -1, -1 }, StderrPipe[2] = { -1, -1 };
+	
+	if (pipe2(StdoutPipe, O_CLOEXEC) != 0) return NetCmdStatus(false, STATUS_IERR);
+	
+	if (pipe2(StderrPipe, O_CLOEXEC) != 0)
 	{
-		Output = "Command returned no output.";
+		close(StdoutPipe[0]);
+		close(StdoutPipe[1]);
+		return NetCmdStatus(false, STATUS_IERR);
 	}
-
-	Output += "\n\n";
 	
-	const int ExitCode = PCLOSE_FUNC(CmdStdout);
-
-	Output += VLString("Exit code for process was ") + VLString::IntToString(ExitCode) + '\n';
+	posix_spawn_file_actions_t Actions;
+	posix_spawnattr_t Attr;
+	
+	posix_spawn_file_actions_init(&Actions);
+	posix_spawn_file_actions_addopen(&Actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_adddup2(&Actions, StdoutPipe[1], STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&Actions, StderrPipe[1], STDERR_FILENO);
+	
+	//Own process group so a timeout takes out everything it started, and don't pass on our signal mask or ignored SIGPIPE.
+	sigset_t EmptySet, DefaultSet;
+	
+	sigemptyset(&EmptySet);
+	sigemptyset(&DefaultSet);
+	sigaddset(&DefaultSet, SIGPIPE);
+	
+	posix_spawnattr_init(&Attr);
+	posix_spawnattr_setflags(&Attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+	posix_spawnattr_setpgroup(&Attr, 0);
+	posix_spawnattr_setsigmask(&Attr, &EmptySet);
+	posix_spawnattr_setsigdefault(&Attr, &DefaultSet);
+	
+	std::vector<char*> ArgvPtrs;
+	
+	ArgvPtrs.reserve(Argv.size() + 1);
+	
+	for (const VLString &Arg : Argv) ArgvPtrs.push_back(const_cast<char*>(+Arg));
+	
+	ArgvPtrs.push_back(nullptr);
+	
+	pid_t PID = 0;
+	
+	const int SpawnErr = posix_spawnp(&PID, Argv[0], &Actions, &Attr, ArgvPtrs.data(), environ);
+	
+	posix_spawn_file_actions_destroy(&Actions);
+	posix_spawnattr_destroy(&Attr);
+	
+	close(StdoutPipe[1]);
+	close(StderrPipe[1]);
+	
+	if (SpawnErr != 0)
+	{
+		close(StdoutPipe[0]);
+		close(StderrPipe[0]);
+		return NetCmdStatus(false, SpawnErr == ENOENT ? STATUS_MISSING : STATUS_FAILED, strerror(SpawnErr));
+	}
+	
+	fcntl(StdoutPipe[0], F_SETFL, fcntl(StdoutPipe[0], F_GETFL) | O_NONBLOCK);
+	fcntl(StderrPipe[0], F_SETFL, fcntl(StderrPipe[0], F_GETFL) | O_NONBLOCK);
+	
+	const uint64_t Start = LastPartial;
+	uint64_t ExitedAt = 0, KillAt = 0;
+	bool Reaped = false, Cancelled = false;
+	int WaitStatus = 0;
+	
+	while (StdoutPipe[0] != -1 || StderrPipe[0] != -1 || !Reaped)
+	{
+		const uint64_t Now = Utils::GetMonotonicMs();
+		
+		if (!Reaped)
+		{
+			const pid_t Result = waitpid(PID, &WaitStatus, WNOHANG);
+			
+			if (Result == PID || (Result == -1 && errno == ECHILD))
+			{
+				Reaped = true;
+				ExitedAt = Now;
+			}
+		}
+		
+		//It's gone, but something it started in the background is still holding the pipes open.
+		if (Reaped && Now - ExitedAt >= SPAWN_LINGER_MS) break;
+		
+		if (Options.TimeoutMs && !Reaped && !Out.TimedOut && Now - Start >= Options.TimeoutMs)
+		{
+			Out.TimedOut = true;
+			kill(-PID, SIGTERM);
+			KillAt = Now + SPAWN_KILL_GRACE_MS;
+		}
+		
+		if (Options.Cancel && *Options.Cancel && !Reaped && !Cancelled)
+		{
+			Cancelled = true;
+			kill(-PID, SIGKILL);
+		}
+		
+		if (KillAt && Now >= KillAt)
+		{ //Didn't take the hint.
+			kill(-PID, SIGKILL);
+			KillAt = 0;
+		}
+		
+		if (Now - LastPartial >= Options.PartialIntervalMs)
+		{
+			SendPartial();
+			LastPartial = Now;
+		}
+		
+		struct pollfd Polls[2]{};
+		nfds_t NumPolls = 0;
+		
+		if (StdoutPipe[0] != -1) Polls[NumPolls++] = { StdoutPipe[0], POLLIN, 0 };
+		if (StderrPipe[0] != -1) Polls[NumPolls++] = { StderrPipe[0], POLLIN, 0 };
+		
+		//Once the pipes are closed we're just waiting to reap it, so check more often.
+		if (poll(Polls, NumPolls, NumPolls ? SPAWN_POLL_MS : SPAWN_REAP_POLL_MS) <= 0) continue;
+		
+		for (nfds_t Inc = 0; Inc < NumPolls; ++Inc)
+		{
+			if (!Polls[Inc].revents) continue;
+			
+			if (Polls[Inc].fd == StdoutPipe[0]) ReadSpawnPipe(StdoutPipe[0], Buf, Out.Stdout, Total, Options, Out.Truncated);
+			else ReadSpawnPipe(StderrPipe[0], Buf, Out.Stderr, Total, Options, Out.Truncated);
+		}
+	}
+	
+	if (StdoutPipe[0] != -1) close(StdoutPipe[0]);
+	if (StderrPipe[0] != -1) close(StderrPipe[0]);
+	
+	if (WIFEXITED(WaitStatus)) Out.ExitCode = WEXITSTATUS(WaitStatus);
+	else if (WIFSIGNALED(WaitStatus)) Out.Signal = WTERMSIG(WaitStatus);
+	
+	if (Cancelled) return NetCmdStatus(false, STATUS_FAILED, "Process cancelled");
+#endif //WIN32
 
-	CmdOutput_Out = Output;
+	SendPartial();
+	
+	if (Out.TimedOut) return NetCmdStatus(false, STATUS_FAILED, "Process timed out");
+	
+	if (Out.Signal) return NetCmdStatus(false, STATUS_FAILED, VLString("Process killed by signal ") + VLString::IntToString(Out.Signal));
+	
+	if (Out.ExitCode) return NetCmdStatus(false, STATUS_FAILED, VLString("Process exited with code ") + VLString::IntToString(Out.ExitCode));
 	
-	return !ExitCode;
+	return NetCmdStatus(true, Out.Truncated ? STATUS_WARN : STATUS_OK, Out.Truncated ? "Output truncated" : nullptr);
 }
 
 NetCmdStatus Processes::KillProcessByName(const char *ProcessName)
@@ -194,7 +445,141 @@ NetCmdStatus Processes::KillProcessByName(const char *ProcessName)
 #endif
 }
 
-NetCmdStatus Processes::GetProcessesList(std::list<Processes::ProcessListMember> *OutList_)
+#ifdef LINUX
+struct ProcStat
+{ //The bits of /proc/<pid>/stat we care about.
+	int64_t PID;
+	int64_t ParentPID;
+	char State;
+	uint64_t Flags;
+	uint64_t CPUTicks; //User plus system.
+	uint32_t Threads;
+	uint64_t StartTicks; //Since boot.
+	uint64_t RSSPages;
+	VLString Comm;
+};
+
+static ssize_t ReadProcFile(const int ProcFd, const char *Path, std::vector<char> &Buf)
+{ //Reuses the caller's buffer, and anything past its size just gets cut off. Always null terminated.
+	const int Desc = openat(ProcFd, Path, O_RDONLY | O_CLOEXEC);
+	
+	if (Desc == -1) return -1;
+	
+	size_t Total = 0;
+	
+	while (Total < Buf.size() - 1)
+	{
+		const ssize_t Read = read(Desc, Buf.data() + Total, Buf.size() - 1 - Total);
+		
+		if (Read == -1 && errno == EINTR) continue;
+		
+		if (Read == -1)
+		{
+			close(Desc);
+			return -1;
+		}
+		
+		if (Read == 0) break;
+		
+		Total += Read;
+	}
+	
+	close(Desc);
+	
+	Buf[Total] = '\0';
+	
+	return Total;
+}
+
+static bool ParseProcStat(const char *Data, ProcStat &Out)
+{ //The name's in parentheses and can have anything in it, including spaces and more parentheses, so go from the last one.
+	const char *const Open = strchr(Data, '(');
+	const char *const Close = strrchr(Data, ')');
+	
+	if (!Open || !Close || Close < Open || !Close[1] || !Close[2]) return false;
+	
+	Out.PID = strtoll(Data, nullptr, 10);
+	Out.Comm = VLString(std::string(Open + 1, Close - Open - 1));
+	Out.State = Close[2];
+	
+	const char *Worker = Close + 3;
+	
+	for (int Field = 4; Field <= 24; ++Field)
+	{
+		char *End = nullptr;
+		
+		const uint64_t Value = strtoll(Worker, &End, 10);
+		
+		if (End == Worker) return false;
+		
+		Worker = End;
+		
+		switch (Field)
+		{
+			case 4:
+				Out.ParentPID = Value;
+				break;
+			case 9:
+				Out.Flags = Value;
+				break;
+			case 14:
+				Out.CPUTicks = Value;
+				break;
+			case 15:
+				Out.CPUTicks += Value;
+				break;
+			case 20:
+				Out.Threads = Value;
+				break;
+			case 22:
+				Out.StartTicks = Value;
+				break;
+			case 24:
+				Out.RSSPages = Value;
+				break;
+			default:
+				break;
+		}
+	}
+	
+	return true;
+}
+
+static int64_t GetBootTime(const int ProcFd, std::vector<char> &Buf)
+{ //Doesn't change, so once is enough.
+	static std::atomic<int64_t> BootTime { 0 };
+	
+	if (BootTime) return BootTime;
+	
+	if (ReadProcFile(ProcFd, "stat", Buf) <= 0) return 0;
+	
+	const char *Search = strstr(Buf.data(), "\nbtime ");
+	
+	if (Search) BootTime = strtoll(Search + sizeof "\nbtime " - 1, nullptr, 10);
+	
+	return BootTime;
+}
+
+static bool ListProcPIDs(std::vector<VLString> &Out)
+{
+	Out.clear();
+	
+	VLScopedPtr<DIR*, decltype(&closedir)> CurDir { opendir("/proc"), closedir };
+	
+	if (!CurDir) return false;
+	
+	struct dirent *DirPtr = nullptr;
+	
+	while ((DirPtr = readdir(CurDir)))
+	{
+		if (Utils::StringAllNumeric(DirPtr->d_name)) Out.push_back(DirPtr->d_name);
+	}
+	
+	return true;
+}
+#endif //LINUX
+
+NetCmdStatus Processes::GetProcessesList(std::list<Processes::ProcessListMember> *OutList_, const ProcessFilter &Filter)
 {
 	std::list<Processes::ProcessListMember> &OutList = *OutList_;
 	
@@ -274,123 +659,113 @@ NetCmdStatus Processes::GetProcessesList(std::list<Processes::ProcessListMember>
 		CantGetUser:
 			Ptr->User = "<unknown>";
 		}
+		
+		//No CPU numbers here, so MinCPU doesn't apply.
+		if ((Filter.Name && !strstr(Ptr->ProcessName, Filter.Name)) || (Filter.User && strcmp(Ptr->User, Filter.User) != 0))
+		{
+			OutList.pop_back();
+		}
 	}
 	
 	return true; //Everything went perfectly.
 #elif defined(LINUX)
-
-	VLScopedPtr<DIR*, decltype(&closedir)> CurDir { opendir("/proc"), closedir }; 
+	/*Two passes over stat, SampleMs apart, to get CPU usage. Only the second pass looks at anything else,
+	* and only for processes that got through the cheaper filters first.*/
+	const int ProcFd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 	
-	if (!CurDir) return NetCmdStatus(false, STATUS_MISSING); // our /proc isn't mounted.
+	if (ProcFd == -1) return NetCmdStatus(false, STATUS_MISSING); // our /proc isn't mounted.
 	
-	struct dirent *DirPtr = nullptr;
+	VLScopedPtr<int*, void(*)(int*)> ProcFdCloser { const_cast<int*>(&ProcFd), [] (int *Desc) { close(*Desc); } };
 	
-	while ((DirPtr = readdir(CurDir)))
+	std::vector<char> Buf(PROC_READ_BUFFER_SIZE);
+	std::vector<VLString> PIDs;
+	std::map<int64_t, std::pair<uint64_t, uint64_t> > FirstSample; //PID to start ticks and CPU ticks.
+	
+	const double TicksPerSec = sysconf(_SC_CLK_TCK);
+	const uint64_t PageSize = sysconf(_SC_PAGESIZE);
+	const int64_t BootTime = GetBootTime(ProcFd, Buf);
+	
+	uint64_t FirstSampleMs = 0;
+	
+	if (Filter.SampleMs)
 	{
-		if (!Utils::StringAllNumeric(DirPtr->d_name)) continue;
-		
-		const VLString &CmdlinePath = VLString("/proc/") + const_cast<const char*>(DirPtr->d_name) + "/cmdline";
+		if (!ListProcPIDs(PIDs)) return NetCmdStatus(false, STATUS_MISSING);
 		
-		VLScopedPtr<std::vector<uint8_t>*> FileBuffer { Utils::Slurp(CmdlinePath) };
-		
-		if (!FileBuffer)
+		for (const VLString &PID : PIDs)
 		{
-			VLWARN("Failed to read " + CmdlinePath);
-			continue;
+			ProcStat Stat{};
+			
+			if (ReadProcFile(ProcFd, PID + "/stat", Buf) <= 0 || !ParseProcStat(Buf.data(), Stat)) continue;
+			
+			FirstSample[Stat.PID] = std::make_pair(Stat.StartTicks, Stat.CPUTicks);
 		}
 		
-		OutList.push_back(ProcessListMember());
-		
-		ProcessListMember *NewMember = &OutList.back();
+		FirstSampleMs = Utils::GetMonotonicMs();
 		
-		NewMember->PID = atol(DirPtr->d_name);
-		NewMember->ProcessName = (const char*)&FileBuffer->at(0);
-		
-		const VLString &StatusPath = VLString("/proc/") + const_cast<const char*>(DirPtr->d_name) + "/status";
+		Utils::vl_sleep(Filter.SampleMs);
+	}
+	
+	if (!ListProcPIDs(PIDs)) return NetCmdStatus(false, STATUS_MISSING);
+	
+	const double Window = Filter.SampleMs ? std::max<uint64_t>(Utils::GetMonotonicMs() - FirstSampleMs, 1) / 1000.0 : 0;
+	const int64_t Now = time(nullptr);
+	
+	for (const VLString &PID : PIDs)
+	{
+		ProcStat Stat{};
 		
-		FileBuffer = Utils::Slurp(StatusPath);
+		//It's normal for processes to disappear while we're looking, so don't complain.
+		if (ReadProcFile(ProcFd, PID + "/stat", Buf) <= 0 || !ParseProcStat(Buf.data(), Stat)) continue;
 		
-		if (!FileBuffer)
-		{
-			VLWARN("Failed to read " + StatusPath);
-			OutList.pop_back();
-			continue;
-		}
+		const bool Kernel = Stat.Flags & PROC_PF_KTHREAD;
 		
-		const VLString &LookFor = VLString("Uid:") + '\t';
+		if (Kernel && !Filter.IncludeKernel) continue;
 		
-		const char *Search = strstr((const char*)&FileBuffer->at(0), LookFor);
+		const int64_t StartTime = BootTime + Stat.StartTicks / TicksPerSec;
+		double CPU = 0.0;
 		
-		if (!Search)
+		if (Filter.SampleMs)
 		{
-			VLWARN("Failed to get Uid from status file for PID " + VLString{DirPtr->d_name});
-			OutList.pop_back();
-			continue;
+			auto Lookup = FirstSample.find(Stat.PID);
+			
+			//New since the first pass, or the PID got reused, so it all happened in our window.
+			const uint64_t Before = Lookup != FirstSample.end() && Lookup->second.first == Stat.StartTicks ? Lookup->second.second : 0;
+			
+			CPU = (Stat.CPUTicks - Before) / TicksPerSec / Window * 100.0;
 		}
+		else CPU = Stat.CPUTicks / TicksPerSec / std::max<int64_t>(Now - StartTime, 1) * 100.0;
 		
-		Search += strlen(LookFor);
+		if (CPU < Filter.MinCPU) continue;
 		
-		while (isblank(*Search)) ++Search;
+		struct stat DirStat{};
 		
-		size_t Inc = 0;
+		if (fstatat(ProcFd, PID, &DirStat, 0) != 0) continue;
 		
-		char UIDBuf[64]{};
+		const VLString &User = Files::GetUserName(DirStat.st_uid);
 		
-		for (; Search[Inc] && isdigit(Search[Inc]) && Inc < sizeof UIDBuf - 1; ++Inc)
-		{
-			UIDBuf[Inc] = Search[Inc];
-		}
-		UIDBuf[Inc] = '\0';
+		if (Filter.User && strcmp(User, Filter.User) != 0) continue;
 		
-		//Get the kernel thread name if our name is empty.
-		if (!NewMember->ProcessName)
-		{
-			const VLString &LookFor_Name = VLString("Name:") + '\t';
-			
-			Search = strstr((const char*)FileBuffer->data(), LookFor_Name);
-			
-			if (!Search)
-			{
-				VLWARN("Failed to get kernel thread name for PID " + VLString{DirPtr->d_name});
-				OutList.pop_back();
-				continue;
-			}
-	
-			Search += strlen(LookFor_Name);
-			
-			while (isblank(*Search)) ++Search;
-			
-			VLString KernelThreadNameBuf(1024);
-			
-			for (Inc = 0; Inc < KernelThreadNameBuf.GetCapacity() - 1 && Search[Inc] && Search[Inc] != '\n'; ++Inc)
-			{
-				*(KernelThreadNameBuf++) = Search[Inc];
-			}
-			*KernelThreadNameBuf = '\0';
-			
-			KernelThreadNameBuf.Rewind();
-			
-			NewMember->ProcessName = KernelThreadNameBuf;
-			NewMember->KernelProcess = true;
-		}
-		else NewMember->KernelProcess = false;
-			
+		//Kernel threads and zombies have an empty command line, so fall back to the short name for those.
+		const ssize_t CmdlineLen = Kernel ? 0 : ReadProcFile(ProcFd, PID + "/cmdline", Buf);
 		
-		if (!*UIDBuf || !Utils::StringAllNumeric(UIDBuf))
-		{
-			VLWARN("Failed to read UIDBuf for PID " + VLString{DirPtr->d_name});
-			OutList.pop_back();
-			continue;
-		}
+		const VLString &Name = CmdlineLen > 0 && *Buf.data() ? VLString(Buf.data()) : Stat.Comm;
 		
-		struct passwd *UserLookup = getpwuid(atol(UIDBuf));
+		if (Filter.Name && !strstr(Name, Filter.Name)) continue;
 		
-		if (!UserLookup)
-		{
-			VLWARN("Failed to find user for PID " + VLString{DirPtr->d_name} + ", appending user ID instead");
-		}
+		OutList.push_back(ProcessListMember());
 		
-		NewMember->User = UserLookup ? VLString{UserLookup->pw_name} : VLString{UIDBuf};
+		ProcessListMember &NewMember = OutList.back();
+		
+		NewMember.ProcessName = Name;
+		NewMember.User = User;
+		NewMember.PID = Stat.PID;
+		NewMember.ParentPID = Stat.ParentPID;
+		NewMember.KernelProcess = Kernel;
+		NewMember.State = Stat.State;
+		NewMember.Threads = Stat.Threads;
+		NewMember.RSS = Stat.RSSPages * PageSize;
+		NewMember.StartTime = StartTime;
+		NewMember.CPUPercent = CPU;
 	}
 	
 	return true;
@@ -398,3 +773,17 @@ NetCmdStatus Processes::GetProcessesList(std::list<Processes::ProcessListMember>
 	return NetCmdStatus(false, STATUS_UNSUPPORTED);
 #endif //defined(WIN32)
 }
+
+bool Processes::ProcessExists(const int64_t PID)
+{ //Doesn't block, the Lua scheduler polls this.
+#ifdef WIN32
+	VLScopedPtr<uint8_t*, decltype(&CloseHandle)> Handle { (uint8_t*)OpenProcess(SYNCHRONIZE, 0, (DWORD)PID), CloseHandle };
+	
+	if (!Handle) return false;
+	
+	return WaitForSingleObject(Handle, 0) == WAIT_TIMEOUT;
+#else
+	//EPERM means it's there, we just aren't allowed to touch it. Zombies still count as existing.
+	return kill((pid_t)PID, 0) == 0 || errno == EPERM;
+#endif //WIN32
+}
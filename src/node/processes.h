@@ -25,19 +25,73 @@
 
 #include <vector>
 #include <list>
+#include <string>
+#include <atomic>
+
+//Longest CPU sample we'll take, for GETPROCESSES orders and VL.GetProcesses() alike. Sampling sleeps on whatever thread asked.
+#define GETPROCESSES_MAX_SAMPLE_MS 2000
+
 namespace Processes
 {
 	struct ProcessListMember
-	{ //Limited information because this must be portable.
+	{ //Limited information because this must be portable. The resource stuff is only filled in on Linux.
 		VLString ProcessName;
 		VLString User;
 		int64_t PID;
+		int64_t ParentPID;
 		bool KernelProcess;
+		char State; //As in /proc/<pid>/stat, e.g. R, S, D, Z. Zero if we don't know.
+		uint32_t Threads;
+		uint64_t RSS; //Bytes.
+		int64_t StartTime; //Unix time.
+		double CPUPercent; //Over the sample window, so it can go over 100 with several threads.
+		
+		ProcessListMember(void) : PID(), ParentPID(), KernelProcess(), State(), Threads(), RSS(), StartTime(), CPUPercent() {}
+	};
+	
+	struct ProcessFilter
+	{ //Applied on the node so we only send back what's interesting.
+		VLString Name; //Substring match, empty for any.
+		VLString User; //Exact match, empty for any.
+		double MinCPU; //Linux only.
+		bool IncludeKernel;
+		uint32_t SampleMs; //How long to watch for CPU usage. Zero gives the average over each process's lifetime instead.
+		
+		ProcessFilter(void) : MinCPU(), IncludeKernel(true), SampleMs(250) {}
+	};
+	
+	struct SpawnResult
+	{
+		std::string Stdout; //Binary safe, unlike VLString.
+		std::string Stderr;
+		int ExitCode; //-1 if it was killed by a signal.
+		int Signal;
+		bool TimedOut;
+		bool Truncated; //Hit the output cap, everything after it got thrown away.
+		
+		SpawnResult(void) : ExitCode(-1), Signal(), TimedOut(), Truncated() {}
+	};
+	
+	//Gets whatever new output showed up since the last call.
+	typedef void (*SpawnPartialFunc)(const char *NewStdout, const size_t StdoutLen, const char *NewStderr, const size_t StderrLen, void *UserData);
+	
+	struct SpawnOptions
+	{
+		uint32_t TimeoutMs; //Zero waits forever. Otherwise the whole process group gets SIGTERM, then SIGKILL.
+		uint64_t OutputCap; //Stdout and stderr together. Zero for no cap.
+		uint32_t PartialIntervalMs;
+		SpawnPartialFunc PartialFunc;
+		void *UserData;
+		const std::atomic_bool *Cancel; //Set it from another thread to SIGKILL the process group and bail out.
+		
+		SpawnOptions(void) : TimeoutMs(), OutputCap(), PartialIntervalMs(2000), PartialFunc(), UserData(), Cancel() {}
 	};
 	
-	NetCmdStatus ExecuteCmd(const char *Command, VLString &CmdOutput_Out);
+	NetCmdStatus Spawn(const std::vector<VLString> &Argv, const SpawnOptions &Options, SpawnResult &Out);
+	NetCmdStatus ExecuteCmd(const char *Command, VLString &CmdOutput_Out, const SpawnOptions &Options = SpawnOptions());
 	NetCmdStatus KillProcessByName(const char *ProcessName);
-	NetCmdStatus GetProcessesList(std::list<ProcessListMember> *OutList);	
+	NetCmdStatus GetProcessesList(std::list<ProcessListMember> *OutList, const ProcessFilter &Filter = ProcessFilter());	
+	bool ProcessExists(const int64_t PID);
 }
 
 
@@ -0,0 +1,307 @@
+/**
+* This file is part of Volition.
+
+* Volition is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+
+* Volition is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+
+* You should have received a copy of the GNU General Public License
+* along with Volition.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+
+#include "../libvolition/include/common.h"
+#include "../libvolition/include/utils.h"
+#include "../libvolition/include/vlthreads.h"
+#include "../libvolition/include/telemetry.h"
+
+#include "sampler.h"
+
+#ifdef LINUX
+#include <unistd.h>
+#include <fcntl.h>
+#endif //LINUX
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <map>
+#include <atomic>
+
+#define SAMPLER_DEFAULT_INTERVAL_SECS 10
+#define SAMPLER_MAX_INTERVAL_SECS 3600
+#define SAMPLER_RING_SIZE 360 //An hour's worth at the default interval, in case the server's away for a while.
+#define SAMPLER_READ_BUFFER_SIZE (1024 * 64)
+#define SAMPLER_IDLE_POLL_MS 5000
+
+#ifdef LINUX
+static void *SamplerThreadFunc(void *);
+static bool TakeSample(Telemetry::Sample &Out);
+static const char *ReadProcFile(const char *Path);
+static int64_t GetMeminfoValue(const char *Data, const char *Key);
+static bool IsPhysicalDisk(const char *Name);
+#endif //LINUX
+
+static struct
+{
+	VLThreads::Mutex Mutex; //For the ring.
+	VLThreads::Semaphore Wake;
+	std::vector<Telemetry::Sample> Ring; //Only what hasn't been sent yet, oldest gets overwritten once it's full.
+	size_t Head; //Oldest unsent sample.
+	size_t Count;
+	std::atomic<uint32_t> IntervalSecs { SAMPLER_DEFAULT_INTERVAL_SECS };
+	std::atomic_bool Stopping { false };
+	VLThreads::Thread *ThreadObj;
+} State;
+
+#ifdef LINUX
+static struct
+{ //Only the sampler thread touches these.
+	std::vector<char> Buf;
+	uint64_t LastCPUTotal, LastCPUBusy;
+	std::map<VLString, bool> DiskCache;
+} Scratch;
+#endif //LINUX
+
+void Sampler::Start(void)
+{
+#ifdef LINUX
+	if (State.ThreadObj) return;
+	
+	State.Ring.resize(SAMPLER_RING_SIZE);
+	State.Stopping = false;
+	
+	State.ThreadObj = new VLThreads::Thread(SamplerThreadFunc, nullptr);
+	State.ThreadObj->Start();
+#endif //LINUX
+}
+
+void Sampler::Stop(void)
+{
+	if (!State.ThreadObj) return;
+	
+	State.Stopping = true;
+	State.Wake.Post();
+	
+	State.ThreadObj->Join();
+	
+	delete State.ThreadObj;
+	State.ThreadObj = nullptr;
+}
+
+void Sampler::SetInterval(const uint32_t Secs)
+{
+	const uint32_t NewInterval = Secs > SAMPLER_MAX_INTERVAL_SECS ? SAMPLER_MAX_INTERVAL_SECS : Secs;
+	
+	if (State.IntervalSecs.exchange(NewInterval) != NewInterval) State.Wake.Post();
+}
+
+bool Sampler::TakeBatch(std::vector<uint8_t> &Out)
+{
+	std::vector<Telemetry::Sample> Pending;
+	
+	VLThreads::MutexKeeper Keeper { &State.Mutex };
+	
+	if (!State.Count) return false;
+	
+	Pending.reserve(State.Count);
+	
+	for (size_t Inc = 0; Inc < State.Count; ++Inc)
+	{
+		Pending.push_back(State.Ring[(State.Head + Inc) % State.Ring.size()]);
+	}
+	
+	State.Head = (State.Head + State.Count) % State.Ring.size();
+	State.Count = 0;
+	
+	Keeper.Unlock();
+	
+	Out = Telemetry::EncodeBatch(Pending);
+	
+	return true;
+}
+
+#ifdef LINUX
+static void *SamplerThreadFunc(void *)
+{
+	Scratch.Buf.resize(SAMPLER_READ_BUFFER_SIZE);
+	
+	while (!State.Stopping)
+	{
+		const uint32_t Interval = State.IntervalSecs;
+		
+		Telemetry::Sample New;
+		
+		if (Interval && TakeSample(New))
+		{
+			VLThreads::MutexKeeper Keeper { &State.Mutex };
+			
+			const size_t Size = State.Ring.size();
+			
+			State.Ring[(State.Head + State.Count) % Size] = New;
+			
+			if (State.Count < Size) ++State.Count;
+			else State.Head = (State.Head + 1) % Size; //Full, drop the oldest.
+		}
+		
+		State.Wake.TimedWait(Interval ? Interval * 1000ull : SAMPLER_IDLE_POLL_MS);
+	}
+	
+	return nullptr;
+}
+
+static const char *ReadProcFile(const char *Path)
+{ //Into the one buffer we keep around, so don't hang onto the result. Nothing in /proc we read gets near 64K, and if it does we just lose the end.
+	const int Desc = open(Path, O_RDONLY | O_CLOEXEC);
+	
+	if (Desc == -1) return nullptr;
+	
+	size_t Total = 0;
+	ssize_t Read = 0;
+	
+	while (Total < Scratch.Buf.size() - 1 && (Read = read(Desc, Scratch.Buf.data() + Total, Scratch.Buf.size() - 1 - Total)) != 0)
+	{
+		if (Read == -1 && errno == EINTR) continue;
+		
+		if (Read == -1)
+		{
+			close(Desc);
+			return nullptr;
+		}
+		
+		Total += Read;
+	}
+	
+	close(Desc);
+	
+	Scratch.Buf[Total] = '\0';
+	
+	return Scratch.Buf.data();
+}
+
+static int64_t GetMeminfoValue(const char *Data, const char *Key)
+{
+	const size_t KeyLen = strlen(Key);
+	
+	for (const char *Line = Data; Line && *Line; Line = strchr(Line, '\n'), Line = Line ? Line + 1 : nullptr)
+	{
+		if (!strncmp(Line, Key, KeyLen) && Line[KeyLen] == ':') return strtoll(Line + KeyLen + 1, nullptr, 10);
+	}
+	
+	return 0;
+}
+
+static bool IsPhysicalDisk(const char *Name)
+{ //Partitions, loop devices, device mapper and md arrays would all count the same I/O twice, and only real disks have a device link.
+	auto Lookup = Scratch.DiskCache.find(Name);
+	
+	if (Lookup != Scratch.DiskCache.end()) return Lookup->second;
+	
+	const bool IsDisk = access(VLString("/sys/block/") + Name + "/device", F_OK) == 0;
+	
+	Scratch.DiskCache[Name] = IsDisk;
+	
+	return IsDisk;
+}
+
+static bool TakeSample(Telemetry::Sample &Out)
+{
+	using namespace Telemetry;
+	
+	Out = Sample();
+	
+	Out.Values[FIELD_TIME] = time(nullptr);
+	
+	const char *Data = ReadProcFile("/proc/stat");
+	
+	if (!Data || strncmp(Data, "cpu ", sizeof "cpu " - 1) != 0) return false;
+	
+	//user nice system idle iowait irq softirq steal, anything after is already counted in user and nice.
+	uint64_t Total = 0, Idle = 0;
+	char *Worker = const_cast<char*>(Data) + sizeof "cpu " - 1;
+	
+	for (int Inc = 0; Inc < 8; ++Inc)
+	{
+		const uint64_t Value = strtoull(Worker, &Worker, 10);
+		
+		Total += Value;
+		
+		if (Inc == 3 || Inc == 4) Idle += Value;
+	}
+	
+	const uint64_t Busy = Total - Idle;
+	
+	//The first one's just since boot, which is still better than nothing.
+	if (Total > Scratch.LastCPUTotal) Out.Values[FIELD_CPU_BUSY] = (Busy - Scratch.LastCPUBusy) * 1000 / (Total - Scratch.LastCPUTotal);
+	
+	Scratch.LastCPUTotal = Total;
+	Scratch.LastCPUBusy = Busy;
+	
+	const char *Search = strstr(Data, "\nprocs_running ");
+	
+	if (Search) Out.Values[FIELD_PROCS_RUNNING] = strtoll(Search + sizeof "\nprocs_running " - 1, nullptr, 10);
+	
+	if ((Data = ReadProcFile("/proc/loadavg")))
+	{
+		Out.Values[FIELD_LOAD1] = strtod(Data, &Worker) * 100;
+		Out.Values[FIELD_LOAD5] = strtod(Worker, &Worker) * 100;
+		Out.Values[FIELD_LOAD15] = strtod(Worker, &Worker) * 100;
+	}
+	
+	if ((Data = ReadProcFile("/proc/meminfo")))
+	{
+		Out.Values[FIELD_MEM_TOTAL] = GetMeminfoValue(Data, "MemTotal");
+		Out.Values[FIELD_MEM_AVAILABLE] = GetMeminfoValue(Data, "MemAvailable");
+		Out.Values[FIELD_SWAP_TOTAL] = GetMeminfoValue(Data, "SwapTotal");
+		Out.Values[FIELD_SWAP_FREE] = GetMeminfoValue(Data, "SwapFree");
+	}
+	
+	if ((Data = ReadProcFile("/proc/diskstats")))
+	{ //major minor name reads merged sectors-read ms writes merged sectors-written ...
+		for (const char *Line = Data; Line && *Line; Line = strchr(Line, '\n'), Line = Line ? Line + 1 : nullptr)
+		{
+			char Name[64]{};
+			unsigned long long SectorsRead = 0, SectorsWritten = 0;
+			
+			if (sscanf(Line, "%*u %*u %63s %*u %*u %llu %*u %*u %*u %llu", Name, &SectorsRead, &SectorsWritten) != 3) continue;
+			
+			if (!IsPhysicalDisk(Name)) continue;
+			
+			//Always 512 byte sectors here, whatever the disk really uses.
+			Out.Values[FIELD_DISK_READ] += SectorsRead * 512;
+			Out.Values[FIELD_DISK_WRITTEN] += SectorsWritten * 512;
+		}
+	}
+	
+	if ((Data = ReadProcFile("/proc/net/dev")))
+	{ //Two header lines, then "iface: rx-bytes packets errs drop fifo frame compressed multicast tx-bytes ..."
+		for (const char *Line = Data; Line && *Line; Line = strchr(Line, '\n'), Line = Line ? Line + 1 : nullptr)
+		{
+			const char *Colon = strchr(Line, ':');
+			const char *LineEnd = strchr(Line, '\n');
+			
+			if (!Colon || (LineEnd && Colon > LineEnd)) continue;
+			
+			while (*Line == ' ') ++Line;
+			
+			if (!strncmp(Line, "lo:", sizeof "lo:" - 1)) continue;
+			
+			unsigned long long RX = 0, TX = 0;
+			
+			if (sscanf(Colon + 1, "%llu %*u %*u %*u %*u %*u %*u %*u %llu", &RX, &TX) != 2) continue;
+			
+			Out.Values[FIELD_NET_RX] += RX;
+			Out.Values[FIELD_NET_TX] += TX;
+		}
+	}
+	
+	return true;
+}
+#endif //LINUX
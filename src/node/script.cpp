@@ -44,20 +44,351 @@ extern "C"
 #ifdef WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <sys/stat.h>
 #else
 #include <arpa/inet.h>
+#include <unistd.h> //For sysconf()
+#include <sys/stat.h>
+#include <utime.h>
 #endif //WIN32
 
 #include <string.h> //For memcpy
+#include <dirent.h>
 #ifndef NO_DLFCN
 #include <dlfcn.h>
 #endif //NO_DLFCN
 #include <map>
+#include <memory>
+#include <list>
+#include <queue>
+#include <atomic>
+#include <algorithm>
+#include <new>
+#include <stdexcept>
 
 #ifndef LUA_OK
 #define LUA_OK 0
 #endif
 
+#if LUA_VERSION_NUM < 502
+#define lua_pushglobaltable(State) lua_pushvalue(State, LUA_GLOBALSINDEX)
+#define lua_rawlen(State, Index) lua_objlen(State, Index)
+#define lua_setuservalue(State, Index) lua_setfenv(State, Index) //We only ever store tables there, so this is fine.
+#define lua_getuservalue(State, Index) lua_getfenv(State, Index)
+#endif
+
+#if LUA_VERSION_NUM >= 504
+static inline int VL_lua_resume(lua_State *Thread, lua_State *From, const int NArgs)
+{
+	int NResults = 0;
+	return lua_resume(Thread, From, NArgs, &NResults);
+}
+#elif LUA_VERSION_NUM >= 502
+#define VL_lua_resume(Thread, From, NArgs) lua_resume(Thread, From, NArgs)
+#else
+#define VL_lua_resume(Thread, From, NArgs) lua_resume(Thread, NArgs)
+#endif
+
+#if LUA_VERSION_NUM >= 503
+#define VL_lua_isyieldable(State) lua_isyieldable(State)
+#else
+#define VL_lua_isyieldable(State) 0 //No way to ask before 5.3, and guessing wrong kills the script, so we just never yield there.
+#endif
+
+#if LUA_VERSION_NUM >= 503
+#define VL_lua_dump(State, Writer, Data, Strip) lua_dump(State, Writer, Data, Strip)
+#else
+#define VL_lua_dump(State, Writer, Data, Strip) lua_dump(State, Writer, Data) //No stripping before 5.3, we just get bigger chunks.
+#endif
+
+//Idle warm states we keep around, and how many jobs one state serves before we throw it out and start fresh.
+#define LUA_WARM_STATES_MAX 8
+#define LUA_WARM_STATE_MAX_USES 256
+#define LUA_BASELINE_DEPTH 4 //How far under _G we snapshot nested tables, so VL.x and friends get put back too.
+
+//Resident scripts opt in with this line in their VLSI spec header.
+#define RESIDENT_SPEC_BEGIN "VLSI_BEGIN_SPEC"
+#define RESIDENT_SPEC_END "VLSI_END_SPEC"
+#define RESIDENT_SPECIFIER "scriptresident::"
+#define RESIDENT_STOP_TIMEOUT_MS 5000 //Past this a stuck call gets its thread killed and its state leaked.
+
+#define ADMIN_STR "ADMIN"
+
+//Cooperative scheduler for script jobs. Busy scripts get preempted via a count hook after their slice is up.
+#define LUA_SCHEDULER_THREADS 4
+#define LUA_SCHEDULER_SLICE_MS 50
+#define LUA_SCHEDULER_HOOK_COUNT 1000
+#define LUA_SCHEDULER_CANCEL_TIMEOUT_MS 3000
+#define LUA_WAIT_POLL_MS 10 //For process waits, and blocking waits outside the scheduler.
+
+//Every state gets its own allocator. Small blocks come out of slabs by 16 byte size class, bigger ones go straight to malloc().
+#define LUA_ARENA_SLAB_SIZE (64 * 1024)
+#define LUA_ARENA_GRANULE 16
+#define LUA_ARENA_MAX_SMALL 512
+#define LUA_ARENA_CLASSES (LUA_ARENA_MAX_SMALL / LUA_ARENA_GRANULE)
+#define LUA_ARENA_KEEP_SLABS 128 //A warm state holding more slab memory than this (8 MiB) gets closed instead of reused.
+#define LUA_MEMORY_LIMIT_DEFAULT (256ull * 1024 * 1024) //Per state, can be changed with VL.SetMemoryLimit().
+#ifndef LUA_MEMORY_LIMIT_MAX //Pass -DLUA_MEMORY_LIMIT_MAX=... to cmake to change it for a node.
+#define LUA_MEMORY_LIMIT_MAX (2048ull * 1024 * 1024) //The most VL.SetMemoryLimit() will let a script have.
+#endif //LUA_MEMORY_LIMIT_MAX
+
+//VL.ParallelMap() pool. One thread per CPU, within reason.
+#define LUA_POOL_THREADS_MAX 16
+#define LUA_MESSAGE_MAX_DEPTH 32 //How deep a table we'll copy between states, which also catches cycles.
+
+//Registry names for the metatables of Stream:PopView() views and VL.Buffer objects.
+#define LUA_STREAMVIEW_METATABLE "VL_StreamView"
+#define LUA_BUFFER_METATABLE "VL_Buffer"
+#define LUA_CHANNEL_METATABLE "VL_Channel"
+#define LUA_COMPILED_METATABLE "VL_CompiledScript"
+
+#define LUA_BUFFER_MAX_SIZE (1024ull * 1024 * 1024) //Any bigger and it's a bug in the script, or somebody's trying to take us down.
+
+//Compiled chunks, keyed by the SHA-512 of their source. The disk copies are what let control skip sending the text again.
+#define LUA_CHUNK_CACHE_MAX 64
+#define LUA_CHUNK_FILE_PREFIX "vlchunk_"
+#define LUA_CHUNK_DISK_MAX_BYTES (1024 * 1024 * 64)
+#define LUA_CHUNK_DISK_MAX_AGE (60 * 60 * 24 * 30) //Seconds since it was last loaded.
+
+struct CompiledScript
+{ //What LoadScript() keeps for each script, so we don't re-parse the source every call.
+	VLString Hash; //SHA-512 of the source, which is also our key in the chunk cache.
+	VLString Source; //Only kept if we couldn't dump bytecode.
+	std::vector<uint8_t> Bytecode;
+	bool Resident; //Gets one long-lived instance with its own event thread.
+};
+
+struct LuaArena
+{ //The allocator behind one lua_State. Only that state's thread touches the free lists, the counters are atomic so reports can read them.
+	void *FreeLists[LUA_ARENA_CLASSES];
+	std::vector<uint8_t*> Slabs; //All freed at once when the state is closed.
+	std::vector<void*> Strays; //Big blocks that shrank into a small class with nothing free there. They end up in the free lists, and go with the slabs.
+	uint8_t *SlabCursor;
+	uint8_t *SlabEnd;
+	std::atomic<uint64_t> Current; //What Lua asked for, not counting slack, plus the contents of our VL.Buffer objects.
+	std::atomic<uint64_t> Peak;
+	uint64_t Limit;
+	std::atomic<Jobs::Job*> Owner; //Whoever we charge usage to right now, if anyone.
+	std::shared_ptr<std::atomic<uint64_t> > Parked; //What we've sent down channels that nobody's received yet. Shared, since the messages can outlive us.
+	
+	LuaArena(void) : FreeLists(), SlabCursor(), SlabEnd(), Current(), Peak(), Limit(LUA_MEMORY_LIMIT_DEFAULT), Owner(), Parked(std::make_shared<std::atomic<uint64_t> >()) {}
+	
+	~LuaArena(void)
+	{
+		for (uint8_t *Slab : this->Slabs) free(Slab);
+		for (void *Stray : this->Strays) free(Stray);
+	}
+};
+
+struct LuaStreamView
+{ //What Stream:PopView() hands out for FILE and BINSTREAM args. The parent stream's userdata is kept in our uservalue.
+	size_t Offset; //From the start of the parent's buffer, since the buffer itself can move if the stream grows.
+	size_t Length;
+};
+
+enum PopArgMode : uint8_t
+{ //What FILE and BINSTREAM data comes back as when popped from a Lua ConationStream.
+	POPARG_STRING,
+	POPARG_VIEW,
+	POPARG_BUFFER,
+};
+
+struct ResidentScript;
+
+#ifndef NOCURL
+struct HTTPRequest
+{ //A VL.GetHTTP() call from a scheduled script, fetched on its own thread so the scheduler doesn't stall.
+	VLString URL;
+	VLString UserAgent;
+	VLString Referrer;
+	int Attempts;
+	bool ReturnBlob;
+	bool ReturnBuffer; //Blob comes back as a VL.Buffer.
+	unsigned Streams; //Parallel range requests, if the server allows them.
+	VLString Sha512; //Expected digest, optional.
+	bool Result;
+	VLString FilePath;
+	std::vector<uint8_t> Blob; //Straight from the wire, no temp file.
+	std::atomic_bool Done;
+	std::atomic_bool Cancel; //Makes the fetch give up, so we never have to kill the thread while it's inside libcurl.
+	VLScopedPtr<VLThreads::Thread*> FetchThread;
+	
+	HTTPRequest(void) : Attempts(3), ReturnBlob(), ReturnBuffer(), Streams(), Result(), Done(), Cancel(), FetchThread() {}
+};
+#endif //NOCURL
+
+struct SpawnRequest
+{ //A VL.Spawn() call, run on its own thread for scheduled scripts just like HTTP fetches.
+	std::vector<VLString> Argv;
+	Processes::SpawnOptions Options;
+	Processes::SpawnResult Result;
+	NetCmdStatus Status;
+	std::atomic_bool Done;
+	std::atomic_bool Cancel; //The task got killed while we were waiting.
+	VLScopedPtr<VLThreads::Thread*> SpawnThread;
+	
+	SpawnRequest(void) : Status(false), Done(), Cancel(), SpawnThread() { Options.Cancel = &Cancel; }
+};
+
+struct HashTreeRequest
+{ //A VL.HashTree() call. Big trees take a while, so scheduled scripts get it done on the side too.
+	VLString Path;
+	Files::HashAlgo Algo;
+	std::vector<Files::ManifestEntry> Manifest;
+	NetCmdStatus Status;
+	std::atomic_bool Done;
+	std::atomic_bool Cancel;
+	VLScopedPtr<VLThreads::Thread*> HashThread;
+	
+	HashTreeRequest(void) : Algo(Files::HASH_SHA512), Status(false), Done(), Cancel(), HashThread() {}
+};
+
+struct LuaChannel;
+
+struct LuaMessageValue
+{ //A Lua value lifted out of one state so it can be rebuilt in another, without going through Conation encoding.
+	enum ValueType : uint8_t
+	{
+		VAL_NIL,
+		VAL_BOOL,
+		VAL_INTEGER,
+		VAL_NUMBER,
+		VAL_STRING,
+		VAL_BUFFER,
+		VAL_TABLE,
+		VAL_CHANNEL,
+	} Type;
+	
+	bool Bool;
+	lua_Integer Integer;
+	lua_Number Number;
+	std::vector<uint8_t> Bytes; //Strings and buffers.
+	std::shared_ptr<std::vector<LuaMessageValue> > Table; //Keys and values, alternating.
+	std::shared_ptr<LuaChannel> Channel;
+	
+	LuaMessageValue(void) : Type(VAL_NIL), Bool(), Integer(), Number() {}
+};
+
+struct LuaChannelMessage
+{ //Charged to the sender's arena until somebody takes it out of the channel.
+	LuaMessageValue Value;
+	std::shared_ptr<std::atomic<uint64_t> > ChargedTo;
+	uint64_t Bytes;
+	
+	LuaChannelMessage(LuaMessageValue &&ValueIn, const std::shared_ptr<std::atomic<uint64_t> > &ChargedToIn, const uint64_t BytesIn)
+		: Value(std::move(ValueIn)), ChargedTo(ChargedToIn), Bytes(BytesIn)
+	{
+		if (this->ChargedTo) *this->ChargedTo += this->Bytes;
+	}
+	
+	LuaChannelMessage(LuaChannelMessage &&Other) : Value(std::move(Other.Value)), ChargedTo(std::move(Other.ChargedTo)), Bytes(Other.Bytes) {}
+	
+	~LuaChannelMessage(void)
+	{
+		if (this->ChargedTo) *this->ChargedTo -= this->Bytes;
+	}
+private:
+	LuaChannelMessage(const LuaChannelMessage&);
+	LuaChannelMessage &operator=(const LuaChannelMessage&);
+};
+
+struct LuaChannel
+{ //VL.Channel(), a queue of Lua values that any number of states can hold handles to.
+	VLThreads::Mutex Mutex;
+	VLThreads::Semaphore Posted; //Once per Send(), and once per sleeper on Close(), for receivers blocking outside the scheduler.
+	std::queue<LuaChannelMessage> Messages;
+	size_t Sleepers; //Receivers sitting on Posted right now.
+	bool Closed;
+	
+	LuaChannel(void) : Sleepers(), Closed() {}
+};
+
+struct LuaParallelJob
+{ //One VL.ParallelMap() call, split up item by item across the pool threads.
+	std::shared_ptr<const CompiledScript> Compiled;
+	VLString FunctionName;
+	std::vector<LuaMessageValue> Items;
+	std::vector<LuaMessageValue> Results;
+	VLThreads::Mutex Mutex; //Just for Error.
+	VLString Error; //The first one we hit.
+	std::atomic_size_t Next;
+	std::atomic_size_t Remaining;
+	
+	LuaParallelJob(void) : Next(), Remaining() {}
+};
+
+struct LuaPoolThread
+{
+	VLScopedPtr<VLThreads::Thread*> ThreadObj;
+	lua_State *State; //Kept warm between jobs, as long as they're from the same script.
+	VLString StateHash;
+	bool Doomed;
+	
+	LuaPoolThread(void) : ThreadObj(), State(), Doomed() {}
+};
+
+struct LuaWait
+{ //What a script is blocked on. Scheduled scripts park this in their task and yield.
+	enum WaitType : uint8_t
+	{
+		WAIT_NONE, //Runnable, e.g. just started or out of timeslice.
+		WAIT_SLEEP,
+		WAIT_STREAM,
+		WAIT_N2N,
+		WAIT_SELECT,
+		WAIT_PROCESS,
+		WAIT_HTTP,
+		WAIT_CHANNEL,
+		WAIT_PARALLEL,
+		WAIT_SPAWN,
+		WAIT_HASHTREE,
+	} Type;
+	
+	enum : uint8_t
+	{ //For WAIT_SELECT.
+		SELECT_STREAM = 1,
+		SELECT_N2N = 1 << 1,
+	};
+	
+	uint64_t Deadline; //Monotonic milliseconds, zero for forever.
+	uint8_t Sources;
+	int64_t PID;
+#ifndef NOCURL
+	std::shared_ptr<HTTPRequest> HTTP;
+#endif //NOCURL
+	std::shared_ptr<LuaChannel> Channel;
+	std::shared_ptr<LuaParallelJob> Parallel;
+	std::shared_ptr<SpawnRequest> Spawn;
+	std::shared_ptr<HashTreeRequest> HashTree;
+
+	LuaWait(const WaitType TypeIn = WAIT_NONE) : Type(TypeIn), Deadline(), Sources(), PID() {}
+};
+
+struct ScheduledTask
+{ //A script function running as a coroutine on the scheduler threads instead of tying up a job worker.
+	Jobs::Job *OurJob;
+	lua_State *State; //From AcquireState(), owns the coroutine.
+	lua_State *Thread; //The coroutine itself.
+	int ThreadRef;
+	int StartArgs; //Function arguments waiting on Thread's stack for the first resume.
+	LuaWait Wait;
+	uint64_t SliceStart;
+	std::atomic_bool Cancelled;
+	Script::ScheduledJobCallback OnFinish;
+	
+	ScheduledTask(Jobs::Job *OurJobIn, lua_State *StateIn, lua_State *ThreadIn, const int ThreadRefIn, Script::ScheduledJobCallback OnFinishIn)
+		: OurJob(OurJobIn), State(StateIn), Thread(ThreadIn), ThreadRef(ThreadRefIn), StartArgs(1), SliceStart(), Cancelled(), OnFinish(OnFinishIn) {}
+};
+
+struct SchedulerThread
+{
+	VLScopedPtr<VLThreads::Thread*> ThreadObj;
+	ScheduledTask *Running; //Protected by the scheduler mutex.
+	bool Doomed; //Set when we give up on what it's running, so it walks away instead of touching the task again.
+	
+	SchedulerThread(void) : ThreadObj(), Running(), Doomed() {}
+};
+
 #ifdef APPENDSCRIPTFUNC
 extern "C"
 {
@@ -108,6 +439,7 @@ static int VLAPI_StripPathFromFilename(lua_State *State);
 static int VLAPI_GetSelfBinaryPath(lua_State *State);
 static int VLAPI_IntegerToByteString(lua_State *State);
 static int VLAPI_ListDirectory(lua_State *State);
+static int VLAPI_HashTree(lua_State *State);
 static int VLAPI_IsDirectory(lua_State *State);
 static int VLAPI_GetCWD(lua_State *State);
 static int VLAPI_Chdir(lua_State *State);
@@ -121,15 +453,54 @@ static int VLAPI_GetCFunction(lua_State *State);
 static int VLAPI_SetN2NState(lua_State *const State);
 static int VLAPI_SetCaptureIncomingStreams(lua_State *const State);
 static int VLAPI_GetJobID(lua_State *const State);
+static int VLAPI_GetMemoryUsage(lua_State *const State);
+static int VLAPI_SetMemoryLimit(lua_State *const State);
 static int VLAPI_GetSha512(lua_State *const State);
 static int VLAPI_GetFileSha512(lua_State *const State);
 static int VLAPI_SpawnWorker(lua_State *const State);
+static int VLAPI_AddTimer(lua_State *const State);
+static int VLAPI_RemoveTimer(lua_State *const State);
+static int VLAPI_WaitStream(lua_State *const State);
+static int VLAPI_WaitProcess(lua_State *const State);
+static int VLAPI_Spawn(lua_State *const State);
+static int VLAPI_Select(lua_State *const State);
+static int VLAPI_NewChannel(lua_State *const State);
+static int VLAPI_ParallelMap(lua_State *const State);
 ///Lua ConationStream helper functions, the ones that don't go in VLAPIFuncs.
 static void InitConationStreamBindings(lua_State *State);
 static int VerifyCSArgsLua(lua_State *State);
 static int VerifyCSArgsLuaStartWith(lua_State *State);
 static int CountCSArgsLua(lua_State *State);
+static int PopArg_Subfunction(lua_State *State, const PopArgMode Mode);
 static int PopArg_LuaConationStream(lua_State *State);
+static int PopArgView_LuaConationStream(lua_State *State);
+static int PopArgBuffer_LuaConationStream(lua_State *State);
+static int PushStreamView(lua_State *State, const int ParentIndex, const size_t Offset, const size_t Length);
+static const uint8_t *GetStreamViewData(lua_State *State, const int Index, size_t *LengthOut);
+static int StreamView_Length(lua_State *State);
+static int StreamView_Slice(lua_State *State);
+static int StreamView_ToString(lua_State *State);
+static int StreamView_Byte(lua_State *State);
+static int StreamView_WriteFile(lua_State *State);
+static int StreamView_ToBuffer(lua_State *State);
+static void InitBufferBindings(lua_State *State);
+static std::vector<uint8_t> *PushLuaBuffer(lua_State *State, std::vector<uint8_t> &&Data);
+static std::vector<uint8_t> *GetLuaBuffer(lua_State *State, const int Index);
+static const uint8_t *GetLuaBytes(lua_State *State, const int Index, size_t *LengthOut);
+static int LuaBufferGCFunc(lua_State *State);
+static bool ResizeLuaBuffer(lua_State *State, std::vector<uint8_t> &Buffer, const uint64_t NewSize);
+static int Buffer_New(lua_State *State);
+static int Buffer_Length(lua_State *State);
+static int Buffer_Sub(lua_State *State);
+static int Buffer_Write(lua_State *State);
+static int Buffer_Append(lua_State *State);
+static int Buffer_Resize(lua_State *State);
+static int Buffer_Find(lua_State *State);
+static int Buffer_Byte(lua_State *State);
+static int Buffer_SetByte(lua_State *State);
+static int Buffer_Pack(lua_State *State);
+static int Buffer_Unpack(lua_State *State);
+static int Buffer_ToString(lua_State *State);
 static int PushArg_LuaConationStream(lua_State *State);
 static int LuaConationStreamGCFunc(lua_State *State);
 static int NewLuaConationStream(lua_State *State);
@@ -141,9 +512,114 @@ static int PopCSJobArgs(lua_State *State);
 
 //Called from C++ only.
 static bool CloneConationStreamToLua(lua_State *State, Conation::ConationStream *Stream);
-static lua_State *InitScript(const Script::LuaJobType Type, const VLString &ScriptData, lua_State *const InState = nullptr);
+static bool AdoptConationStreamToLua(lua_State *State, Conation::ConationStream *Stream);
+static lua_State *InitScript(const Script::LuaJobType Type, const std::shared_ptr<const CompiledScript> &Compiled, lua_State *const InState = nullptr);
+static bool RunScriptFunction(const Script::LuaJobType Type, const std::shared_ptr<const CompiledScript> &Compiled,
+								const char *FunctionName, Conation::ConationStream *Stream, Jobs::Job *OurJob);
+static std::shared_ptr<const CompiledScript> CompileScript(const VLString &Source, const bool Persist, VLString *ErrorOut = nullptr);
+static std::shared_ptr<const CompiledScript> LookupCompiledScript(const VLString &Hash);
+static void CacheCompiledScript(const std::shared_ptr<const CompiledScript> &Compiled);
+static VLString GetChunkCachePath(const VLString &Hash);
+static bool SaveCompiledChunk(const CompiledScript &Compiled);
+static std::shared_ptr<const CompiledScript> LoadCompiledChunk(const VLString &Hash);
+static void PruneChunkDiskCache(void);
+static bool InstallScript(const char *ScriptName, const std::shared_ptr<const CompiledScript> &New, const bool OverwritePermissible);
+static void PushCompiledScript(lua_State *State, const std::shared_ptr<const CompiledScript> &Compiled);
+static std::shared_ptr<const CompiledScript> GetStateScript(lua_State *State);
+static int CompiledScriptGCFunc(lua_State *State);
+static lua_State *AcquireState(void);
+static void ReleaseState(lua_State *State);
+static lua_State *CreateWarmState(void);
+static lua_State *NewArenaState(void);
+static void CloseState(lua_State *State);
+static LuaArena *GetStateArena(lua_State *State);
+static void SetStateJob(lua_State *State, Jobs::Job *OurJob);
+static void *LuaArenaAlloc(void *UserData, void *Ptr, size_t OldSize, size_t NewSize);
+static void *LuaArenaGetBlock(LuaArena *Arena, const size_t Size);
+static void LuaArenaPutBlock(LuaArena *Arena, void *Ptr, const size_t Size);
+static void LuaArenaCharge(LuaArena *Arena, const uint64_t NewCurrent);
+static bool ChargeLuaBuffer(lua_State *State, const uint64_t OldSize, const uint64_t NewSize, const bool Force = false);
+static uint64_t GetMessageValueSize(const LuaMessageValue &Value);
+static int LuaArenaPanic(lua_State *State);
+static void SnapshotTable(lua_State *State, const int Baseline, const int Target);
+static void SnapshotTree(lua_State *State, const int Baseline, const int Target, const int Depth);
+static int RestoreBaseline(lua_State *State);
+static int BytecodeWriter(lua_State *State, const void *Data, size_t Size, void *Out);
+static void CallScriptFunction(lua_State *State, const char *FunctionName, Conation::ConationStream *Stream, const bool Adopt = false, const bool AsOrder = false);
+static void PushScriptFunction(lua_State *State, const char *FunctionName, Conation::ConationStream *Stream, const bool Adopt = false, const bool AsOrder = false);
+static Jobs::Job *GetOurJob(lua_State *State);
+static uint64_t DeadlineFromArg(lua_State *State, const int Index);
+static int SuspendForWait(lua_State *State, const LuaWait &Wait);
+static bool WaitIsReady(const LuaWait &Wait, Jobs::Job *OurJob, const uint64_t Now);
+static int PushWaitResults(lua_State *State, LuaWait &Wait, Jobs::Job *OurJob);
+static ScheduledTask *GetScheduledTask(lua_State *State, const bool AnyThread = false);
+static void SchedulerHook(lua_State *State, lua_Debug *);
+static void *SchedulerThreadFunc(SchedulerThread *Us);
+static void SpawnSchedulerThreads(void);
+static bool RunScheduledTask(ScheduledTask *Task, NetCmdStatus &ResultOut);
+static void DestroyScheduledTask(ScheduledTask *Task, const bool ReuseState);
+static void AbandonWait(LuaWait &Wait);
+#ifndef NOCURL
+static void *HTTPFetchThreadFunc(HTTPRequest *Request);
+static bool PerformHTTPRequest(HTTPRequest &Request);
+static int PushHTTPResult(lua_State *State, HTTPRequest &Request);
+#endif //NOCURL
+static void *SpawnThreadFunc(SpawnRequest *Request);
+static int PushSpawnResult(lua_State *State, SpawnRequest &Request);
+static void *HashTreeThreadFunc(HashTreeRequest *Request);
+static int PushHashTreeResult(lua_State *State, HashTreeRequest &Request);
+static bool ScriptWantsResident(const char *Source);
+static bool CaptureLuaValue(lua_State *State, int Index, LuaMessageValue &Out, const bool MoveBuffers, const int Depth = 0);
+static void PushLuaMessageValue(lua_State *State, LuaMessageValue &&Value);
+static void PushLuaChannel(lua_State *State, const std::shared_ptr<LuaChannel> &Channel);
+static std::shared_ptr<LuaChannel> *GetLuaChannel(lua_State *State, const int Index);
+static int LuaChannelGCFunc(lua_State *State);
+static int Channel_Send(lua_State *State);
+static int Channel_Recv(lua_State *State);
+static int Channel_Close(lua_State *State);
+static int Channel_Count(lua_State *State);
+static bool PopChannelMessage(lua_State *State, LuaChannel &Channel);
+static void *LuaPoolThreadFunc(LuaPoolThread *Us);
+static void RunParallelItems(LuaPoolThread *Us, LuaParallelJob &Job);
+static size_t GetPoolThreadCount(void);
+
 //Globals
-std::map<VLString, VLString> Script::LoadedScripts;
+static struct
+{
+	VLThreads::Mutex Mutex;
+	std::map<VLString, std::shared_ptr<const CompiledScript> > Scripts;
+	std::map<VLString, ResidentScript*> Residents;
+} LoadedScripts;
+
+static struct
+{ //Every chunk we've compiled or pulled off disk lately, whether or not it's loaded under a name.
+	VLThreads::Mutex Mutex;
+	std::map<VLString, std::shared_ptr<const CompiledScript> > Chunks;
+	std::list<VLString> Order; //Oldest first, for eviction.
+} ChunkCache;
+
+static struct
+{
+	VLThreads::Mutex Mutex;
+	std::vector<lua_State*> Idle;
+} WarmStates;
+
+static struct
+{
+	VLThreads::Mutex Mutex;
+	VLThreads::Semaphore Wakeup;
+	std::list<ScheduledTask*> Tasks; //Everything that isn't running right now.
+	std::list<SchedulerThread> Threads;
+	std::atomic_size_t TaskCount;
+} Scheduler;
+
+static struct
+{
+	VLThreads::Mutex Mutex;
+	VLThreads::Semaphore Wakeup;
+	std::list<std::shared_ptr<LuaParallelJob> > Jobs; //Ones with items nobody's picked up yet.
+	std::list<LuaPoolThread> Threads;
+} WorkerPool;
 
 using namespace Script;
 
@@ -184,6 +660,7 @@ static std::map<VLString, lua_CFunction> VLAPIFuncs
 	{ "GetSelfBinaryPath", VLAPI_GetSelfBinaryPath },
 	{ "IntegerToByteString", VLAPI_IntegerToByteString },
 	{ "ListDirectory", VLAPI_ListDirectory },
+	{ "HashTree", VLAPI_HashTree },
 	{ "IsDirectory", VLAPI_IsDirectory },
 	{ "GetCWD", VLAPI_GetCWD },
 	{ "Chdir", VLAPI_Chdir },
@@ -193,7 +670,17 @@ static std::map<VLString, lua_CFunction> VLAPIFuncs
 	{ "SetN2NState", VLAPI_SetN2NState },
 	{ "SetCaptureIncomingStreams", VLAPI_SetCaptureIncomingStreams },
 	{ "GetJobID", VLAPI_GetJobID },
+	{ "GetMemoryUsage", VLAPI_GetMemoryUsage },
+	{ "SetMemoryLimit", VLAPI_SetMemoryLimit },
 	{ "SpawnWorker", VLAPI_SpawnWorker },
+	{ "Channel", VLAPI_NewChannel },
+	{ "ParallelMap", VLAPI_ParallelMap },
+	{ "AddTimer", VLAPI_AddTimer },
+	{ "RemoveTimer", VLAPI_RemoveTimer },
+	{ "WaitStream", VLAPI_WaitStream },
+	{ "WaitProcess", VLAPI_WaitProcess },
+	{ "Spawn", VLAPI_Spawn },
+	{ "Select", VLAPI_Select },
 #ifndef NO_DLFCN
 	{ "GetCFunction", VLAPI_GetCFunction },
 #endif // !NO_DLFCN
@@ -238,6 +725,7 @@ static const std::map<Script::LuaJobType, VLString> JobTypeMap
 	{ TOKEN_KEYVALPAIR(LUAJOB_STARTUP) },
 	{ TOKEN_KEYVALPAIR(LUAJOB_SNIPPET) },
 	{ TOKEN_KEYVALPAIR(LUAJOB_WORKER) },
+	{ TOKEN_KEYVALPAIR(LUAJOB_RESIDENT) },
 	{ TOKEN_KEYVALPAIR(LUAJOB_MAXVALUE) },
 };
 
@@ -321,7 +809,9 @@ struct LuaWorker
 {
 	Conation::ConationQueue ToWorker, FromWorker;
 	VLScopedPtr<VLThreads::Thread*> WorkerThread;
-	VLString ScriptData, FunctionName;
+	std::shared_ptr<const CompiledScript> Compiled; //Same chunk our parent is running, no recompile needed.
+	VLString FunctionName;
+	std::vector<LuaMessageValue> StartArgs; //Extra arguments to the worker function, after the handle.
 	std::atomic_uint32_t RefCount;
 
 	static int LuaStart(lua_State *State)
@@ -467,20 +957,11 @@ struct LuaWorker
 		
 		Conation::ConationQueue *Queue = IsHost ? &This->FromWorker : &This->ToWorker;
 		
-		Conation::ConationStream *RetVal = nullptr;
-		
-		if (Blocking)
-		{
-			RetVal = Queue->WaitPop();
-		}
-		else
-		{
-			RetVal = Queue->Pop();
-		}
+		VLScopedPtr<Conation::ConationStream*> RetVal { Blocking ? Queue->WaitPop() : Queue->Pop() };
 		
 		if (!RetVal) return 0; //nil
 		
-		CloneConationStreamToLua(State, RetVal);
+		AdoptConationStreamToLua(State, RetVal);
 		
 		VLDEBUG("Have new table on stack: " + ((lua_type(State, -1) == LUA_TTABLE) ? "true" : "false"));
 		
@@ -599,9 +1080,9 @@ struct LuaWorker
 
 	static void *LaunchLua(LuaWorker *This)
 	{
-		VLScopedPtr<lua_State*, decltype(&lua_close)> State { luaL_newstate(), &lua_close };
+		VLScopedPtr<lua_State*, void (*)(lua_State*)> State { AcquireState(), ReleaseState };
 
-		lua_State *const RetState = InitScript(LUAJOB_WORKER, This->ScriptData, State);
+		lua_State *const RetState = InitScript(LUAJOB_WORKER, This->Compiled, State);
 
 		if (!RetState)
 		{
@@ -620,8 +1101,14 @@ struct LuaWorker
 
 		This->NewHandle(State, false);
 		
+		const int NumArgs = 1 + This->StartArgs.size();
+		
+		for (LuaMessageValue &Value : This->StartArgs) PushLuaMessageValue(State, std::move(Value));
+		
+		This->StartArgs.clear();
+		
 		//Call the script function.
-		if (lua_pcall(State, 1, 0, 0) != LUA_OK)
+		if (lua_pcall(State, NumArgs, 0, 0) != LUA_OK)
 		{
 			luaL_traceback(State, State, nullptr, 1);
 
@@ -634,159 +1121,542 @@ struct LuaWorker
 	}
 
 	static inline int LuaSpawnWorker(lua_State *State)
-	{
-		if (!VerifyLuaFuncArgs(State, { LUA_TSTRING }))
+	{ //VL.SpawnWorker(FunctionName, ...), anything after the name gets copied over as extra arguments, e.g. channels.
+		if (lua_gettop(State) < 1 || lua_type(State, 1) != LUA_TSTRING)
 		{
 			VLWARN("Bad arguments!");
 			return 0;
 		}
 		
-		const VLString FunctionName { lua_tostring(State, -1) };
+		const VLString FunctionName { lua_tostring(State, 1) };
 		
-		lua_pop(State, 1);
+		std::vector<LuaMessageValue> StartArgs(lua_gettop(State) - 1);
+		
+		for (size_t Inc = 0; Inc < StartArgs.size(); ++Inc)
+		{
+			if (!CaptureLuaValue(State, Inc + 2, StartArgs[Inc], false))
+			{
+				VLWARN("Worker argument #" + VLString::UintToString(Inc + 2) + " can't be passed to another state");
+				return 0;
+			}
+		}
+		
+		lua_settop(State, 0);
 		
-		lua_getglobal(State, "VL_LuaSource");
+		std::shared_ptr<const CompiledScript> Compiled { GetStateScript(State) };
 		
-		if (lua_type(State, -1) != LUA_TSTRING)
+		if (!Compiled)
 		{
-			VLWARN("No self-source set!");
+			VLWARN("No compiled script set!");
 			return 0;
 		}
 		
-		const VLString ScriptData { lua_tostring(State, -1) };
-		
-		lua_pop(State, 1);
+		LuaWorker *This = new LuaWorker(std::move(Compiled), std::move(FunctionName));
 		
-		LuaWorker *This = new LuaWorker(std::move(ScriptData), std::move(FunctionName));
+		This->StartArgs = std::move(StartArgs);
 		
 		This->NewHandle(State, true); //Lua takes ownership of This from here on out.
 		return 1;
 	}
 	
-	LuaWorker(const VLString ScriptData, const VLString FunctionName)
-		: ScriptData(std::move(ScriptData)), FunctionName(std::move(FunctionName)), RefCount(0)
+	LuaWorker(std::shared_ptr<const CompiledScript> Compiled, const VLString FunctionName)
+		: Compiled(std::move(Compiled)), FunctionName(std::move(FunctionName)), RefCount(0)
 	{
 		this->WorkerThread = new VLThreads::Thread((VLThreads::Thread::EntryFunc)&LuaWorker::LaunchLua, this);
 	}
 };
 
-//Function definitions
-
-extern "C" int SelfTestCFunc(lua_State *State)
-{ ///Used to test loading symbols from our own address space from Lua.
-	const VLString Value { lua_tostring(State, -1) };
-
-	std::cout << "Echoing back \"" << +Value << "\"." << std::endl;
-
-	lua_pushstring(State, VLString("You said \"") + Value + "\"");
-
-	return 1;
-}
+struct ResidentEvent
+{
+	enum EventType : uint8_t
+	{
+		EVENT_EXECFUNC,
+		EVENT_N2N,
+		EVENT_STOP,
+	} Type;
+	
+	VLString FunctionName;
+	VLScopedPtr<Conation::ConationStream*> Stream; //What the function gets as its argument, and what VL.RecvStream() hands out for EXECFUNC.
+};
 
-static bool VerifyLuaFuncArgs(lua_State *State, const std::vector<decltype(LUA_TNONE)> &ToCheck)
+struct ResidentTimer
 {
-	const size_t Provided = lua_gettop(State);
+	uint64_t ID;
+	uint64_t Due;
+	uint64_t Interval;
+	bool Repeat;
+};
 
-	if (Provided != ToCheck.size())
+struct ResidentScript
+{ //One long-lived Lua state per resident script, fed events on its own thread.
+	VLString ScriptName;
+	std::shared_ptr<const CompiledScript> Compiled;
+	lua_State *State;
+	Jobs::Job PseudoJob; //So VL.RecvStream(), VL.GetJobID() and friends work the same as in a job.
+	VLScopedPtr<VLThreads::Thread*> EventThread;
+	VLThreads::Mutex EventsLock;
+	VLThreads::Semaphore EventsPending;
+	std::queue<ResidentEvent*> Events;
+	VLThreads::ValueWaiter<bool> Started;
+	std::atomic_bool HandlesN2N;
+	std::atomic_bool Exited;
+	std::atomic_bool InExecFunc; //So Stop() knows if killing the thread cost somebody their response.
+	std::list<ResidentTimer> Timers; //Only ever touched from the event thread.
+	uint64_t TimerIDCounter;
+	
+	ResidentScript(const char *ScriptNameIn, const std::shared_ptr<const CompiledScript> &CompiledIn)
+		: ScriptName(ScriptNameIn), Compiled(CompiledIn), State(), EventThread(), HandlesN2N(), Exited(), InExecFunc(), TimerIDCounter()
 	{
-		return false;
+		this->EventThread = new VLThreads::Thread((VLThreads::Thread::EntryFunc)EventLoop, this);
 	}
-
-	for (size_t Inc = 0; Inc < ToCheck.size(); ++Inc)
+	
+	~ResidentScript(void)
 	{
-		if (lua_type(State, Inc + 1) != ToCheck.at(Inc)) return false;
+		while (!this->Events.empty())
+		{
+			ResidentEvent *const Event = this->Events.front();
+			this->Events.pop();
+			
+			//The job finished when we queued it, so this is the only answer control's ever getting.
+			if (Event->Type == ResidentEvent::EVENT_EXECFUNC)
+			{
+				SendExecFuncFailure(Event->Stream->GetCommandCode(),
+									Conation::BuildIdentComposite(Event->Stream->GetCmdIdentFlags() & ~Conation::IDENT_ISREPORT_BIT, Event->Stream->GetCmdIdentOnly()),
+									"Resident script was stopped before this call ran");
+			}
+			
+			delete Event;
+		}
 	}
-
-	return true;
-}
-
-static int PopCSJobArgs(lua_State *State)
-{
-	if (!VerifyLuaFuncArgs(State, { LUA_TTABLE }))
+	
+	static void SendExecFuncFailure(const CommandCode CmdCode, const uint64_t CmdIdent, const char *Msg)
 	{
-		VLDEBUG("Bad arguments");
-		return 0;
+		Conation::ConationStream Response(CmdCode, Conation::GetIdentFlags(CmdIdent) | Conation::IDENT_ISREPORT_BIT, CmdIdent);
+		Response.Push_ODHeader(IdentityModule::GetNodeIdentity(), ADMIN_STR);
+		Response.Push_NetCmdStatus(NetCmdStatus(false, STATUS_FAILED, Msg));
+		
+		Main::PushStreamToWriteQueue(Response);
 	}
-
-	lua_pushstring(State, "VL_INTRNL");
-	lua_gettable(State, -2);
-
-	if (lua_type(State, -1) != LUA_TUSERDATA)
+	
+	void PushEvent(ResidentEvent *Event)
 	{
-		VLDEBUG("Not a userdata");
-		return 0;
+		VLThreads::MutexKeeper Keeper { &this->EventsLock };
+		
+		this->Events.push(Event);
+		
+		Keeper.Unlock();
+		
+		this->EventsPending.Post();
 	}
-
-	Conation::ConationStream *Stream = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
-
-	if (!Stream)
+	
+	bool Start(void)
 	{
-		VLDEBUG("Null stream pointer after userdata access");
-		return 0;
+		this->EventThread->Start();
+		
+		if (this->Started.Await()) return true;
+		
+		this->EventThread->Join();
+		
+		return false;
 	}
-
-	Stream->Rewind(); //In case you're extra stupid
-
-	lua_newtable(State);
-
-	const Conation::ConationStream::ODHeader ODH { Stream->Pop_ODHeader() };
-
-	lua_pushstring(State, "Origin");
-	lua_pushstring(State, ODH.Origin);
-
-	lua_settable(State, -3);
-
-	lua_pushstring(State, "Destination");
-	lua_pushstring(State, ODH.Destination);
-
-	lua_settable(State, -3);
-
-	lua_pushstring(State, "ScriptName");
-	lua_pushstring(State, Stream->Pop_String());
-
-	lua_settable(State, -3);
-
-	lua_pushstring(State, "FuncName");
-	lua_pushstring(State, Stream->Pop_String());
-
-	lua_settable(State, -3);
-
-	return 1;
-}
-
-static int DoCSIter(lua_State *State)
-{
-	VLDEBUG("Entered");
-	if (lua_type(State, 1) != LUA_TTABLE)
+	
+	void Stop(void)
 	{
-		VLDEBUG("First argument not a table");
-		return 0;
+		this->PushEvent(new ResidentEvent{ ResidentEvent::EVENT_STOP, {}, {} });
+		
+		for (uint64_t Waited = 0; !this->Exited && Waited < RESIDENT_STOP_TIMEOUT_MS; Waited += 10)
+		{
+			Utils::vl_sleep(10);
+		}
+		
+		if (!this->Exited)
+		{ /*Stuck in a function somewhere. Kill it, and leak the state rather than close it from under a half-finished call.
+			* That's the only way a resident call gets interrupted, KILLJOBID can't reach it since its job is long gone.*/
+			VLWARN("Resident script \"" + this->ScriptName + "\" did not stop in time, killing it.");
+			
+			this->EventThread->Kill();
+			this->EventThread->Join();
+			
+			if (this->InExecFunc)
+			{
+				SendExecFuncFailure(this->PseudoJob.CmdCode, this->PseudoJob.CmdIdent, "Resident script was killed during this call");
+			}
+			
+			return;
+		}
+		
+		this->EventThread->Join();
+		
+		if (this->State) CloseState(this->State);
+		
+		this->State = nullptr;
 	}
-
-	//We only want our first argument, make sure there's nothing weird just to be safe.
-	lua_settop(State, 1);
-
-	///Results table that we actually return.
-	lua_newtable(State);
-	const size_t ResultTableIndex = lua_gettop(State);
-
-	VLDEBUG("Now calling PopArg_LuaConationStream()");
-
-	//Call this directly. It puts a possible pile of variables on the stack.
-	lua_pushcfunction(State, PopArg_LuaConationStream);
-	lua_pushvalue(State, 1);
-
-	if (lua_pcall(State, 1, LUA_MULTRET, 0) != LUA_OK)
-	{ //Call NewLuaConationStream() to get a new copy for arguments.
-		VLDEBUG("Call of lua function failed.");
-		return 0;
+	
+	static ResidentScript *GetInstance(lua_State *State)
+	{
+		lua_getfield(State, LUA_REGISTRYINDEX, "VL_ResidentPtr");
+		
+		ResidentScript *const RetVal = static_cast<ResidentScript*>(lua_touserdata(State, -1));
+		
+		lua_pop(State, 1);
+		
+		return RetVal;
 	}
-
-
-	if (lua_type(State, 3) != LUA_TNUMBER)
-	{ //Failure or end of iteration. First argument is always the ARGTYPE
-		VLDEBUG("First result is not a number");
-		lua_settop(State, 0);
+	
+	static int LuaAddTimer(lua_State *State)
+	{ //VL.AddTimer(Milliseconds, Function, Repeat)
+		ResidentScript *const This = GetInstance(State);
+		
+		if (!This || lua_gettop(State) < 2 || lua_type(State, 1) != LUA_TNUMBER || lua_type(State, 2) != LUA_TFUNCTION)
+		{
+			VLWARN("Bad arguments, or not a resident script");
+			lua_pushnil(State);
+			return 1;
+		}
+		
+		const lua_Integer Interval = lua_tointeger(State, 1);
+		const bool Repeat = lua_gettop(State) >= 3 && lua_toboolean(State, 3);
+		
+		if (Repeat && Interval <= 0)
+		{ //It'd be due again the moment it ran, and the event thread would never sleep.
+			VLWARN("Repeating timer needs an interval of at least 1ms");
+			lua_pushnil(State);
+			return 1;
+		}
+		
+		const uint64_t ID = ++This->TimerIDCounter;
+		
+		lua_getfield(State, LUA_REGISTRYINDEX, "VL_ResidentTimers");
+		lua_pushvalue(State, 2);
+		lua_rawseti(State, -2, ID);
+		lua_pop(State, 1);
+		
+		This->Timers.push_back({ ID, Utils::GetMonotonicMs() + (Interval > 0 ? Interval : 0), (uint64_t)(Interval > 0 ? Interval : 0), Repeat });
+		
+		lua_pushinteger(State, ID);
+		return 1;
+	}
+	
+	static int LuaRemoveTimer(lua_State *State)
+	{
+		ResidentScript *const This = GetInstance(State);
+		
+		if (!This || !VerifyLuaFuncArgs(State, { LUA_TNUMBER }))
+		{
+			lua_pushboolean(State, false);
+			return 1;
+		}
+		
+		const uint64_t ID = lua_tointeger(State, 1);
+		
+		lua_pushboolean(State, This->RemoveTimer(ID));
+		return 1;
+	}
+	
+	bool RemoveTimer(const uint64_t ID)
+	{
+		for (auto Iter = this->Timers.begin(); Iter != this->Timers.end(); ++Iter)
+		{
+			if (Iter->ID != ID) continue;
+			
+			this->Timers.erase(Iter);
+			
+			lua_getfield(this->State, LUA_REGISTRYINDEX, "VL_ResidentTimers");
+			lua_pushnil(this->State);
+			lua_rawseti(this->State, -2, ID);
+			lua_pop(this->State, 1);
+			
+			return true;
+		}
+		
+		return false;
+	}
+	
+	uint64_t FireTimers(void)
+	{ //Runs whatever's due. Returns milliseconds until the next timer, or UINT64_MAX if there are none.
+		const uint64_t Now = Utils::GetMonotonicMs();
+		
+		std::vector<uint64_t> Due;
+		
+		for (const ResidentTimer &Timer : this->Timers)
+		{
+			if (Timer.Due <= Now) Due.push_back(Timer.ID);
+		}
+		
+		for (const uint64_t ID : Due)
+		{ //Callbacks can add and remove timers, so look each one up again.
+			auto Iter = std::find_if(this->Timers.begin(), this->Timers.end(), [ID] (const ResidentTimer &Timer) { return Timer.ID == ID; });
+			
+			if (Iter == this->Timers.end()) continue;
+			
+			lua_getfield(this->State, LUA_REGISTRYINDEX, "VL_ResidentTimers");
+			lua_rawgeti(this->State, -1, ID);
+			
+			if (Iter->Repeat)
+			{
+				Iter->Due = Now + Iter->Interval;
+			}
+			else
+			{
+				this->RemoveTimer(ID);
+			}
+			
+			if (lua_pcall(this->State, 0, 0, 0) != LUA_OK)
+			{
+				VLWARN("Timer in resident script \"" + this->ScriptName + "\" failed: " + (const char*)lua_tostring(this->State, -1));
+			}
+			
+			lua_settop(this->State, 0);
+		}
+		
+		uint64_t Next = UINT64_MAX;
+		
+		const uint64_t After = Utils::GetMonotonicMs();
+		
+		for (const ResidentTimer &Timer : this->Timers)
+		{
+			const uint64_t Wait = Timer.Due > After ? Timer.Due - After : 0;
+			
+			if (Wait < Next) Next = Wait;
+		}
+		
+		return Next;
+	}
+	
+	void HandleExecFunc(ResidentEvent *Event)
+	{
+		Conation::ConationStream *const Stream = Event->Stream;
+		
+		this->PseudoJob.CmdCode = Stream->GetCommandCode();
+		this->PseudoJob.CmdIdent = Conation::BuildIdentComposite(Stream->GetCmdIdentFlags() & ~Conation::IDENT_ISREPORT_BIT, Stream->GetCmdIdentOnly());
+		
+		Conation::ConationStream Response(this->PseudoJob.CmdCode, Conation::GetIdentFlags(this->PseudoJob.CmdIdent) | Conation::IDENT_ISREPORT_BIT, this->PseudoJob.CmdIdent);
+		Response.Push_ODHeader(IdentityModule::GetNodeIdentity(), ADMIN_STR);
+		
+		this->InExecFunc = true;
+		
+		try
+		{
+			CallScriptFunction(this->State, Event->FunctionName, Stream, true, true);
+			
+			//If it returns some weird value, I guess just assume it worked.
+			Response.Push_NetCmdStatus(lua_type(this->State, -1) == LUA_TBOOLEAN ? (bool)lua_toboolean(this->State, -1) : true);
+		}
+		catch (Script::ScriptError &Err)
+		{
+			Response.Push_NetCmdStatus(NetCmdStatus(false, STATUS_IERR, Err.Msg));
+		}
+		
+		this->InExecFunc = false;
+		
+		lua_settop(this->State, 0);
+		
+		lua_pushnil(this->State);
+		lua_setfield(this->State, LUA_REGISTRYINDEX, "VL_OrderStream");
+		
+		//Whatever the function didn't pick up is stale now.
+		while (Conation::ConationStream *Leftover = this->PseudoJob.Read_Queue.Pop()) delete Leftover;
+		
+		Main::PushStreamToWriteQueue(Response);
+	}
+	
+	void HandleN2N(ResidentEvent *Event)
+	{
+		try
+		{
+			CallScriptFunction(this->State, "OnN2N", Event->Stream, true);
+		}
+		catch (Script::ScriptError &Err)
+		{
+			VLWARN("OnN2N() in resident script \"" + this->ScriptName + "\" failed: " + Err.Msg);
+		}
+		
+		lua_settop(this->State, 0);
+	}
+	
+	static void *EventLoop(ResidentScript *This)
+	{
+		This->State = CreateWarmState();
+		
+		SetStateJob(This->State, &This->PseudoJob);
+		
+		lua_pushlightuserdata(This->State, This);
+		lua_setfield(This->State, LUA_REGISTRYINDEX, "VL_ResidentPtr");
+		
+		lua_newtable(This->State);
+		lua_setfield(This->State, LUA_REGISTRYINDEX, "VL_ResidentTimers");
+		
+		if (!InitScript(LUAJOB_RESIDENT, This->Compiled, This->State))
+		{
+			CloseState(This->State);
+			This->State = nullptr;
+			This->Exited = true;
+			This->Started.Post(false);
+			return nullptr;
+		}
+		
+		lua_getglobal(This->State, "OnN2N");
+		This->HandlesN2N = lua_type(This->State, -1) == LUA_TFUNCTION;
+		lua_settop(This->State, 0);
+		
+		This->Started.Post(true);
+		
+		while (true)
+		{
+			const uint64_t NextTimer = This->FireTimers();
+			
+			if (NextTimer == UINT64_MAX) This->EventsPending.Wait();
+			else if (NextTimer) This->EventsPending.TimedWait(NextTimer);
+			
+			while (true)
+			{
+				VLThreads::MutexKeeper Keeper { &This->EventsLock };
+				
+				if (This->Events.empty()) break;
+				
+				VLScopedPtr<ResidentEvent*> Event { This->Events.front() };
+				This->Events.pop();
+				
+				Keeper.Unlock();
+				
+				switch (Event->Type)
+				{
+					case ResidentEvent::EVENT_EXECFUNC:
+						This->HandleExecFunc(Event);
+						break;
+					case ResidentEvent::EVENT_N2N:
+						This->HandleN2N(Event);
+						break;
+					case ResidentEvent::EVENT_STOP:
+						This->Exited = true;
+						return nullptr;
+					default:
+						break;
+				}
+			}
+		}
+		
+		return nullptr;
+	}
+};
+
+//Function definitions
+
+extern "C" int SelfTestCFunc(lua_State *State)
+{ ///Used to test loading symbols from our own address space from Lua.
+	const VLString Value { lua_tostring(State, -1) };
+
+	std::cout << "Echoing back \"" << +Value << "\"." << std::endl;
+
+	lua_pushstring(State, VLString("You said \"") + Value + "\"");
+
+	return 1;
+}
+
+static bool VerifyLuaFuncArgs(lua_State *State, const std::vector<decltype(LUA_TNONE)> &ToCheck)
+{
+	const size_t Provided = lua_gettop(State);
+
+	if (Provided != ToCheck.size())
+	{
+		return false;
+	}
+
+	for (size_t Inc = 0; Inc < ToCheck.size(); ++Inc)
+	{
+		if (lua_type(State, Inc + 1) != ToCheck.at(Inc)) return false;
+	}
+
+	return true;
+}
+
+static int PopCSJobArgs(lua_State *State)
+{
+	if (!VerifyLuaFuncArgs(State, { LUA_TTABLE }))
+	{
+		VLDEBUG("Bad arguments");
+		return 0;
+	}
+
+	lua_pushstring(State, "VL_INTRNL");
+	lua_gettable(State, -2);
+
+	if (lua_type(State, -1) != LUA_TUSERDATA)
+	{
+		VLDEBUG("Not a userdata");
+		return 0;
+	}
+
+	Conation::ConationStream *Stream = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
+
+	if (!Stream)
+	{
+		VLDEBUG("Null stream pointer after userdata access");
+		return 0;
+	}
+
+	Stream->Rewind(); //In case you're extra stupid
+
+	lua_newtable(State);
+
+	const Conation::ConationStream::ODHeader ODH { Stream->Pop_ODHeader() };
+
+	lua_pushstring(State, "Origin");
+	lua_pushstring(State, ODH.Origin);
+
+	lua_settable(State, -3);
+
+	lua_pushstring(State, "Destination");
+	lua_pushstring(State, ODH.Destination);
+
+	lua_settable(State, -3);
+
+	lua_pushstring(State, "ScriptName");
+	lua_pushstring(State, Stream->Pop_String());
+
+	lua_settable(State, -3);
+
+	lua_pushstring(State, "FuncName");
+	lua_pushstring(State, Stream->Pop_String());
+
+	lua_settable(State, -3);
+
+	return 1;
+}
+
+static int DoCSIter(lua_State *State)
+{
+	VLDEBUG("Entered");
+	if (lua_type(State, 1) != LUA_TTABLE)
+	{
+		VLDEBUG("First argument not a table");
+		return 0;
+	}
+
+	//We only want our first argument, make sure there's nothing weird just to be safe.
+	lua_settop(State, 1);
+
+	///Results table that we actually return.
+	lua_newtable(State);
+	const size_t ResultTableIndex = lua_gettop(State);
+
+	VLDEBUG("Now calling PopArg_LuaConationStream()");
+
+	//Call this directly. It puts a possible pile of variables on the stack.
+	lua_pushcfunction(State, PopArg_LuaConationStream);
+	lua_pushvalue(State, 1);
+
+	if (lua_pcall(State, 1, LUA_MULTRET, 0) != LUA_OK)
+	{ //Call NewLuaConationStream() to get a new copy for arguments.
+		VLDEBUG("Call of lua function failed.");
+		return 0;
+	}
+
+
+	if (lua_type(State, 3) != LUA_TNUMBER)
+	{ //Failure or end of iteration. First argument is always the ARGTYPE
+		VLDEBUG("First result is not a number");
+		lua_settop(State, 0);
 		return 0;
 	}
 
@@ -1016,8 +1886,8 @@ static int VLAPI_GetFileSha512(lua_State *const State)
 }
 
 static int VLAPI_WriteFile(lua_State *State)
-{
-	if (!VerifyLuaFuncArgs(State, { LUA_TSTRING, LUA_TSTRING }))
+{ //Data can be a string, a VL.Buffer or a view from Stream:PopView().
+	if (lua_gettop(State) != 2 || lua_type(State, 1) != LUA_TSTRING)
 	{
 		lua_pushboolean(State, false);
 		return 1;
@@ -1027,11 +1897,11 @@ static int VLAPI_WriteFile(lua_State *State)
 
 	size_t DataLength = 0;
 
-	const void *const Data = lua_tolstring(State, 2, &DataLength);
+	const void *const Data = GetLuaBytes(State, 2, &DataLength);
 
 	if (!Data || !Utils::WriteFile(Path, Data, DataLength))
 	{
-		VLDEBUG("Failure caused by " + (Data ? "Utils::WriteFile()" : "lua_tolstring()"));
+		VLDEBUG("Failure caused by " + (Data ? "Utils::WriteFile()" : "GetLuaBytes()"));
 		lua_pushboolean(State, false);
 		return 1;
 	}
@@ -1062,8 +1932,10 @@ static int VLAPI_GetCompileTime(lua_State *State)
 }
 
 static int VLAPI_SlurpFile(lua_State *State)
-{
-	if (!VerifyLuaFuncArgs(State, { LUA_TSTRING })) return 0;
+{ //VL.SlurpFile(Path, [AsBuffer]), pass true for a VL.Buffer instead of a string.
+	if (!VerifyLuaFuncArgs(State, { LUA_TSTRING }) && !VerifyLuaFuncArgs(State, { LUA_TSTRING, LUA_TBOOLEAN })) return 0;
+
+	const bool AsBuffer = lua_toboolean(State, 2);
 
 	uint64_t FileSize = 0;
 
@@ -1071,6 +1943,18 @@ static int VLAPI_SlurpFile(lua_State *State)
 
 	if (!Utils::GetFileSize(Path, &FileSize)) return 0;
 
+	if (AsBuffer)
+	{ //Read straight into the buffer's own storage.
+		std::vector<uint8_t> *Buffer = PushLuaBuffer(State, std::vector<uint8_t>(FileSize));
+
+		if (FileSize && !Utils::Slurp(Path, Buffer->data(), FileSize))
+		{
+			lua_settop(State, 0);
+			return 0;
+		}
+
+		return 1;
+	}
 
 	luaL_Buffer Buf{};
 
@@ -1113,32 +1997,69 @@ static int VLAPI_vl_sleep(lua_State *State)
 
 	if (ArgCount != 1 || lua_type(State, 1) != LUA_TNUMBER) return 0;
 
-	Utils::vl_sleep(lua_tointeger(State, 1));
+	LuaWait Wait { LuaWait::WAIT_SLEEP };
+	Wait.Deadline = DeadlineFromArg(State, 1);
 
-	return 0;
+	return SuspendForWait(State, Wait);
 }
 
 static int VLAPI_ListDirectory(lua_State *State)
 {
 	const size_t ArgCount = lua_gettop(State);
 
-	if (ArgCount != 1 || lua_type(State, 1) != LUA_TSTRING)
+	if (ArgCount < 1 || ArgCount > 2 || lua_type(State, 1) != LUA_TSTRING || (ArgCount == 2 && lua_type(State, 2) != LUA_TTABLE))
 	{
 		lua_pushnil(State);
 		return 1;
 	}
 
-	VLScopedPtr<std::list<Files::DirectoryEntry>*> Results = Files::ListDirectory(lua_tostring(State, 1));
-
-	lua_settop(State, 0);
-
-	if (!Results)
+	//No options table means everything in one go, same as it always was.
+	Files::ListOptions Options;
+	
+	Options.IncludeDots = ArgCount == 1;
+	
+	if (ArgCount == 2)
 	{
-		lua_pushnil(State);
-		return 1;
-	}
-
-	lua_newtable(State);
+		lua_getfield(State, 2, "Glob");
+		if (lua_type(State, -1) == LUA_TSTRING) Options.Glob = lua_tostring(State, -1);
+		
+		lua_getfield(State, 2, "Types");
+		if (lua_type(State, -1) == LUA_TNUMBER) Options.TypeMask = lua_tointeger(State, -1);
+		
+		lua_getfield(State, 2, "MinSize");
+		if (lua_type(State, -1) == LUA_TNUMBER) Options.MinSize = lua_tointeger(State, -1);
+		
+		lua_getfield(State, 2, "ModifiedAfter");
+		if (lua_type(State, -1) == LUA_TNUMBER) Options.ModifiedAfter = lua_tointeger(State, -1);
+		
+		lua_getfield(State, 2, "Cursor");
+		if (lua_type(State, -1) == LUA_TSTRING) Options.Cursor = lua_tostring(State, -1);
+		
+		lua_getfield(State, 2, "PageSize");
+		if (lua_type(State, -1) == LUA_TNUMBER && lua_tointeger(State, -1) > 0) Options.PageSize = lua_tointeger(State, -1);
+		
+		lua_getfield(State, 2, "Sort");
+		if (lua_type(State, -1) == LUA_TSTRING && !Files::ParseListSort(lua_tostring(State, -1), Options))
+		{
+			lua_settop(State, 0);
+			lua_pushnil(State);
+			return 1;
+		}
+	}
+	
+	VLString NextCursor;
+	
+	VLScopedPtr<std::list<Files::DirectoryEntry>*> Results = Files::ListDirectory(lua_tostring(State, 1), Options, &NextCursor);
+
+	lua_settop(State, 0);
+
+	if (!Results)
+	{
+		lua_pushnil(State);
+		return 1;
+	}
+
+	lua_newtable(State);
 
 	size_t Inc = 1;
 	for (auto Iter = Results->begin(); Iter != Results->end(); ++Iter, ++Inc)
@@ -1199,7 +2120,106 @@ static int VLAPI_ListDirectory(lua_State *State)
 		lua_settable(State, -3);
 	}
 
-	return 1;
+	if (NextCursor) lua_pushstring(State, NextCursor);
+	else lua_pushnil(State);
+	
+	return 2;
+}
+
+static int VLAPI_HashTree(lua_State *State)
+{ //VL.HashTree(Path[, "sha512"|"xxh64"]) returns a manifest table and a warning if anything got left out, or nil and an error.
+	const size_t ArgCount = lua_gettop(State);
+
+	if (ArgCount < 1 || ArgCount > 2 || lua_type(State, 1) != LUA_TSTRING || (ArgCount == 2 && lua_type(State, 2) != LUA_TSTRING))
+	{
+		lua_settop(State, 0);
+		lua_pushnil(State);
+		lua_pushstring(State, "Expected a path and optionally a hash algorithm");
+		return 2;
+	}
+	
+	Files::HashAlgo Algo = Files::HASH_SHA512;
+	
+	if (ArgCount == 2 && !Files::ParseHashAlgo(lua_tostring(State, 2), Algo))
+	{
+		lua_settop(State, 0);
+		lua_pushnil(State);
+		lua_pushstring(State, "Hash algorithm must be sha512 or xxh64");
+		return 2;
+	}
+	
+	std::shared_ptr<HashTreeRequest> Request { std::make_shared<HashTreeRequest>() };
+	
+	Request->Path = lua_tostring(State, 1);
+	Request->Algo = Algo;
+	
+	lua_settop(State, 0);
+	
+	if (GetScheduledTask(State))
+	{ //Reading a whole tree would stall every other script on this scheduler thread.
+		Request->HashThread = new VLThreads::Thread((VLThreads::Thread::EntryFunc)HashTreeThreadFunc, Request.get());
+		Request->HashThread->Start();
+		
+		LuaWait Wait { LuaWait::WAIT_HASHTREE };
+		Wait.HashTree = Request;
+		
+		return SuspendForWait(State, Wait);
+	}
+	
+	Request->Status = Files::HashTree(Request->Path, Request->Algo, Request->Manifest);
+	
+	return PushHashTreeResult(State, *Request);
+}
+
+static void *HashTreeThreadFunc(HashTreeRequest *Request)
+{
+	Request->Status = Files::HashTree(Request->Path, Request->Algo, Request->Manifest, nullptr, nullptr, &Request->Cancel);
+	Request->Done = true;
+	
+	Script::WakeScheduler();
+	
+	return nullptr;
+}
+
+static int PushHashTreeResult(lua_State *State, HashTreeRequest &Request)
+{
+	const NetCmdStatus &Result = Request.Status;
+	const std::vector<Files::ManifestEntry> &Manifest = Request.Manifest;
+	
+	if (!Result)
+	{
+		lua_pushnil(State);
+		lua_pushstring(State, Result.Msg);
+		return 2;
+	}
+	
+	lua_createtable(State, Manifest.size(), 0);
+	
+	for (size_t Inc = 0; Inc < Manifest.size(); ++Inc)
+	{
+		const Files::ManifestEntry &Entry = Manifest[Inc];
+		
+		lua_createtable(State, 0, 4);
+		
+		lua_pushstring(State, Entry.Path);
+		lua_setfield(State, -2, "Path");
+		
+		lua_pushinteger(State, Entry.Size);
+		lua_setfield(State, -2, "Size");
+		
+		lua_pushinteger(State, Entry.ModTime);
+		lua_setfield(State, -2, "ModTime");
+		
+		lua_pushstring(State, Entry.Digest);
+		lua_setfield(State, -2, "Digest");
+		
+		lua_rawseti(State, -2, Inc + 1);
+	}
+	
+	if (Result.Status == STATUS_WARN) lua_pushstring(State, Result.Msg);
+	else lua_pushnil(State);
+	
+	return 2;
 }
 
 static int VLAPI_IsDirectory(lua_State *State)
@@ -1226,15 +2246,7 @@ static int VLAPI_SetN2NState(lua_State *const State)
 
 	const bool N2NEnabled = lua_toboolean(State, -1);
 
-	lua_getglobal(State, "VL_OurJob_LUSRDTA");
-
-	if (lua_type(State, -1) != LUA_TLIGHTUSERDATA)
-	{
-		VLWARN("Internal userdata is not actually a userdata!");
-		return 0;
-	}
-
-	Jobs::Job *OurJob = static_cast<Jobs::Job*>(lua_touserdata(State, -1));
+	Jobs::Job *OurJob = GetOurJob(State);
 
 	if (!OurJob)
 	{
@@ -1252,1634 +2264,4647 @@ static int VLAPI_SpawnWorker(lua_State *const State)
 	return LuaWorker::LuaSpawnWorker(State);
 }
 
-static int VLAPI_GetJobID(lua_State *const State)
+static int VLAPI_AddTimer(lua_State *const State)
 {
-	lua_getglobal(State, "VL_OurJob_LUSRDTA");
+	return ResidentScript::LuaAddTimer(State);
+}
 
-	if (lua_type(State, -1) != LUA_TLIGHTUSERDATA)
-	{
-		VLWARN("Internal userdata is not actually a userdata!");
-		return 0;
-	}
+static int VLAPI_RemoveTimer(lua_State *const State)
+{
+	return ResidentScript::LuaRemoveTimer(State);
+}
 
-	Jobs::Job *OurJob = static_cast<Jobs::Job*>(lua_touserdata(State, -1));
+static int VLAPI_NewChannel(lua_State *const State)
+{ //VL.Channel(), pass the handle to VL.SpawnWorker() or send it down another channel to share it.
+	PushLuaChannel(State, std::make_shared<LuaChannel>());
+	return 1;
+}
 
-	if (!OurJob)
+static int VLAPI_ParallelMap(lua_State *const State)
+{ /*VL.ParallelMap(FunctionName, Items), calls FunctionName(Item, Index) for every item in the Items array
+	* on the pool threads, and returns a table of the results in the same order.
+	* If anything failed, its result is nil and the first error comes back as a second return value.*/
+	if (!VerifyLuaFuncArgs(State, { LUA_TSTRING, LUA_TTABLE }))
 	{
-		VLWARN("VL_OurJob_LUSRDTA is null!");
+		VLWARN("Bad arguments");
 		return 0;
 	}
 
-	lua_pushinteger(State, OurJob->JobID);
-
-	return 1;
-}
+	lua_getglobal(State, "VL_InWorkerPool");
 
-static int VLAPI_SetCaptureIncomingStreams(lua_State *const State)
-{
-	if (!VerifyLuaFuncArgs(State, { LUA_TBOOLEAN }))
-	{
-		return 0;
+	if (lua_toboolean(State, -1))
+	{ //Every pool thread could end up waiting on every other one.
+		lua_pushnil(State);
+		lua_pushstring(State, "VL.ParallelMap() can't be called from inside VL.ParallelMap()");
+		return 2;
 	}
 
-	const bool CaptureEnabled = lua_toboolean(State, -1);
+	std::shared_ptr<LuaParallelJob> Job { std::make_shared<LuaParallelJob>() };
 
-	lua_getglobal(State, "VL_OurJob_LUSRDTA");
+	Job->Compiled = GetStateScript(State);
 
-	if (lua_type(State, -1) != LUA_TLIGHTUSERDATA)
+	if (!Job->Compiled)
 	{
-		VLWARN("Internal userdata is not actually a userdata!");
+		VLWARN("No compiled script set!");
 		return 0;
 	}
 
-	Jobs::Job *OurJob = static_cast<Jobs::Job*>(lua_touserdata(State, -1));
+	Job->FunctionName = lua_tostring(State, 1);
 
-	if (!OurJob)
+	const size_t NumItems = lua_rawlen(State, 2);
+
+	Job->Items.resize(NumItems);
+	Job->Results.resize(NumItems);
+
+	for (size_t Inc = 0; Inc < NumItems; ++Inc)
 	{
-		VLWARN("VL_OurJob_LUSRDTA is null!");
-		return 0;
-	}
+		lua_rawgeti(State, 2, Inc + 1);
 
-	OurJob->CaptureIncomingStreams = CaptureEnabled;
+		if (!CaptureLuaValue(State, -1, Job->Items[Inc], false))
+		{
+			lua_pushnil(State);
+			lua_pushstring(State, VLString("Item #") + VLString::UintToString(Inc + 1) + " can't be passed to another state");
+			return 2;
+		}
 
-	return 0;
-}
+		lua_pop(State, 1);
+	}
 
-static int VLAPI_FileExists(lua_State *State)
-{
-	const size_t ArgCount = lua_gettop(State);
+	lua_settop(State, 0);
 
-	if (ArgCount != 1 || lua_type(State, 1) != LUA_TSTRING)
+	if (!NumItems)
 	{
-		lua_pushnil(State);
+		lua_newtable(State);
 		return 1;
 	}
 
-	lua_pushboolean(State, Utils::FileExists(lua_tostring(State, 1)));
+	Job->Remaining = NumItems;
 
-	return 1;
-}
+	VLThreads::MutexKeeper Keeper { &WorkerPool.Mutex };
 
-static int VLAPI_GetFileSize(lua_State *State)
-{
-	const size_t ArgCount = lua_gettop(State);
+	const size_t ThreadCount = GetPoolThreadCount();
 
-	if (ArgCount != 1 || lua_type(State, 1) != LUA_TSTRING)
+	while (WorkerPool.Threads.size() < ThreadCount)
 	{
-	EasyFail:
-		lua_pushnil(State);
-		return 1;
+		WorkerPool.Threads.emplace_back();
+
+		LuaPoolThread &New = WorkerPool.Threads.back();
+
+		New.ThreadObj = new VLThreads::Thread((VLThreads::Thread::EntryFunc)LuaPoolThreadFunc, &New);
+		New.ThreadObj->Start();
 	}
 
-	uint64_t Size = 0;
+	WorkerPool.Jobs.push_back(Job);
 
-	if (!Utils::GetFileSize(lua_tostring(State, 1), &Size)) goto EasyFail;
+	Keeper.Unlock();
 
-	lua_pushinteger(State, Size);
-	return 1;
-}
+	//No point waking more threads than we have items.
+	for (size_t Inc = 0; Inc < std::min(NumItems, ThreadCount); ++Inc) WorkerPool.Wakeup.Post();
 
-static int VLAPI_GetCWD(lua_State *State)
-{
-	lua_pushstring(State, Files::GetWorkingDirectory());
-	return 1;
+	LuaWait Wait { LuaWait::WAIT_PARALLEL };
+	Wait.Parallel = Job;
+
+	return SuspendForWait(State, Wait);
 }
 
-static int VLAPI_Chdir(lua_State *State)
+static size_t GetPoolThreadCount(void)
 {
-	if (lua_gettop(State) != 1 || lua_isstring(State, 1))
-	{
-		lua_pushnil(State);
-		return 1;
-	}
+#ifdef WIN32
+	SYSTEM_INFO Info{};
+	GetSystemInfo(&Info);
 
-	lua_pushboolean(State, Files::Chdir(lua_tostring(State, 1)));
+	const long Count = Info.dwNumberOfProcessors;
+#else
+	const long Count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif //WIN32
 
-	return 1;
+	if (Count < 1) return 1;
+
+	return std::min<size_t>(Count, LUA_POOL_THREADS_MAX);
 }
 
-static int VLAPI_StripPathFromFilename(lua_State *State)
+static void *LuaPoolThreadFunc(LuaPoolThread *Us)
 {
-	const size_t ArgCount = lua_gettop(State);
+	VLThreads::MutexKeeper Keeper { &WorkerPool.Mutex };
 
-	if (ArgCount != 1 || lua_type(State, 1) != LUA_TSTRING)
+	while (!Us->Doomed)
 	{
-		lua_pushnil(State);
-		return 1;
+		std::shared_ptr<LuaParallelJob> Job;
+
+		for (auto Iter = WorkerPool.Jobs.begin(); Iter != WorkerPool.Jobs.end();)
+		{
+			if ((*Iter)->Next >= (*Iter)->Items.size())
+			{ //All handed out, whoever's got the last ones will finish it.
+				Iter = WorkerPool.Jobs.erase(Iter);
+				continue;
+			}
+
+			Job = *Iter;
+			break;
+		}
+
+		if (!Job)
+		{
+			Keeper.Unlock();
+			WorkerPool.Wakeup.Wait();
+			Keeper.Lock();
+			continue;
+		}
+
+		Keeper.Unlock();
+
+		RunParallelItems(Us, *Job);
+
+		Keeper.Lock();
 	}
 
-	lua_pushstring(State, Utils::StripPathFromFilename(lua_tostring(State, 1)));
-	return 1;
+	return nullptr;
 }
 
-static int VLAPI_GetSelfBinaryPath(lua_State *State)
-{
-	lua_pushstring(State, Utils::GetSelfBinaryPath());
-	return 1;
-}
+static void RunParallelItems(LuaPoolThread *Us, LuaParallelJob &Job)
+{ //Keeps claiming items from Job until there's none left.
+	VLString Error;
 
-static int VLAPI_IntegerToByteString(lua_State *State)
-{
-	bool HasConvertFlag = false;
-	if (!VerifyLuaFuncArgs(State, { LUA_TNUMBER, LUA_TNUMBER }) &&
-		!(HasConvertFlag = VerifyLuaFuncArgs(State, { LUA_TNUMBER, LUA_TNUMBER, LUA_TBOOLEAN })))
-	{
-	EasyFail:
-		lua_pushnil(State);
-		return 1;
-	}
+	if (!Us->State || Us->StateHash != Job.Compiled->Hash)
+	{ //Different script than last time, so we need a fresh environment.
+		if (Us->State) ReleaseState(Us->State);
 
-	const IntNameMapEnum IntType = static_cast<IntNameMapEnum>(lua_tointeger(State, 1));
-	const uint64_t Integer = lua_tointeger(State, 2);
-	const bool ConvertToNet = HasConvertFlag ? lua_toboolean(State, 3) : false;
+		Us->State = AcquireState();
+		Us->StateHash = VLString();
 
-	switch (IntType)
-	{
-		case INTNAME_INT8:
-		case INTNAME_UINT8:
+		if (!InitScript(LUAJOB_WORKER, Job.Compiled, Us->State))
 		{
-			uint8_t BabyInt = Integer;
+			Error = VLString("Failed to initialize script for pool: ") + lua_tostring(Us->State, -1);
+			lua_settop(Us->State, 0);
 
-			lua_pushlstring(State, (const char*)&BabyInt, 1);
-			return 1;
+			ReleaseState(Us->State);
+			Us->State = nullptr;
 		}
-		case INTNAME_INT16:
-		case INTNAME_UINT16:
+		else
 		{
-			uint16_t Val = Integer;
-
-			if (ConvertToNet) Val = htons(Val);
+			lua_pushboolean(Us->State, true);
+			lua_setglobal(Us->State, "VL_InWorkerPool");
 
-			lua_pushlstring(State, (const char*)&Val, sizeof Val);
-			return 1;
+			Us->StateHash = Job.Compiled->Hash;
 		}
-		case INTNAME_INT32:
-		case INTNAME_UINT32:
-		{
-			uint32_t Val = Integer;
+	}
 
-			if (ConvertToNet) Val = htonl(Val);
+	lua_State *const State = Us->State;
 
-			lua_pushlstring(State, (const char*)&Val, sizeof Val);
-			return 1;
-		}
-		case INTNAME_INT64:
-		case INTNAME_UINT64:
+	size_t Index = 0;
+
+	while ((Index = Job.Next++) < Job.Items.size())
+	{
+		if (State)
 		{
-			uint64_t Val = Integer;
+			lua_getglobal(State, Job.FunctionName);
 
-			if (ConvertToNet) Val = Utils::vl_htonll(Val);
+			if (lua_type(State, -1) != LUA_TFUNCTION)
+			{
+				Error = "Requested Lua script function is not actually a function or does not exist.";
+			}
+			else
+			{
+				PushLuaMessageValue(State, std::move(Job.Items[Index]));
+				lua_pushinteger(State, Index + 1);
+
+				if (lua_pcall(State, 2, 1, 0) != LUA_OK)
+				{
+					Error = lua_tostring(State, -1);
+				}
+				else if (!CaptureLuaValue(State, -1, Job.Results[Index], true))
+				{
+					Error = "Function returned a value that can't be passed to another state";
+				}
+			}
 
-			lua_pushlstring(State, (const char*)&Val, sizeof Val);
-			return 1;
+			lua_settop(State, 0);
 		}
-		default:
-			goto EasyFail;
-	}
 
-	goto EasyFail;
-}
+		if (Error)
+		{
+			const VLThreads::MutexKeeper Keeper { &Job.Mutex };
 
-static int VLAPI_GetProcesses(lua_State *State)
-{
-	std::list<Processes::ProcessListMember> ProcessList;
+			if (!Job.Error) Job.Error = Error;
+		}
 
-	if (!Processes::GetProcessesList(&ProcessList)) //Might as well just call it directly since we need the header anyways.
-	{ //Failed
-		lua_pushnil(State);
-		return 1;
+		if (--Job.Remaining == 0) Script::WakeScheduler();
 	}
+}
 
-	//Wipe the stack in case the retards gave us arguments. I don't care enough to make this throw an error.
-	lua_settop(State, 0);
-
-	//Table that contains process results.
-	lua_newtable(State);
+static bool CaptureLuaValue(lua_State *State, int Index, LuaMessageValue &Out, const bool MoveBuffers, const int Depth)
+{ //Returns false for anything we can't rebuild in another state, e.g. functions, coroutines and tables with metatables.
+	if (Index < 0) Index += lua_gettop(State) + 1; //We push stuff.
 
-	size_t LuaArrayIndex = 1;
-
-	for (auto Iter = ProcessList.begin(); Iter != ProcessList.end(); ++Iter, ++LuaArrayIndex)
+	switch (lua_type(State, Index))
 	{
-		//Push the subtable that will contain our results.
-		lua_pushinteger(State, LuaArrayIndex);
-		lua_newtable(State);
+		case LUA_TNIL:
+			Out.Type = LuaMessageValue::VAL_NIL;
+			return true;
+		case LUA_TBOOLEAN:
+			Out.Type = LuaMessageValue::VAL_BOOL;
+			Out.Bool = lua_toboolean(State, Index);
+			return true;
+		case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+			if (lua_isinteger(State, Index))
+			{
+				Out.Type = LuaMessageValue::VAL_INTEGER;
+				Out.Integer = lua_tointeger(State, Index);
+				return true;
+			}
+#endif
+			Out.Type = LuaMessageValue::VAL_NUMBER;
+			Out.Number = lua_tonumber(State, Index);
+			return true;
+		case LUA_TSTRING:
+		{
+			size_t Length = 0;
+			const uint8_t *Data = reinterpret_cast<const uint8_t*>(lua_tolstring(State, Index, &Length));
 
-		lua_settable(State, -3);
+			Out.Type = LuaMessageValue::VAL_STRING;
+			Out.Bytes.assign(Data, Data + Length);
+			return true;
+		}
+		case LUA_TUSERDATA:
+		{
+			if (std::vector<uint8_t> *Buffer = GetLuaBuffer(State, Index))
+			{ //Moving leaves the sender with an empty buffer, but nothing gets copied.
+				Out.Type = LuaMessageValue::VAL_BUFFER;
+
+				if (MoveBuffers)
+				{ //Whoever ends up with it gets charged for it instead.
+					ChargeLuaBuffer(State, Buffer->size(), 0, true);
+					Out.Bytes = std::move(*Buffer);
+					Buffer->clear();
+				}
+				else Out.Bytes = *Buffer;
+
+				return true;
+			}
 
-		//Now we get the subtable again.
-		lua_pushinteger(State, LuaArrayIndex);
-		lua_gettable(State, -2);
+			if (std::shared_ptr<LuaChannel> *Channel = GetLuaChannel(State, Index))
+			{
+				Out.Type = LuaMessageValue::VAL_CHANNEL;
+				Out.Channel = *Channel;
+				return true;
+			}
 
-		///Populate the subtable.
+			size_t Length = 0;
 
-		//Process name
-		lua_pushstring(State, "Name");
-		lua_pushstring(State, Iter->ProcessName);
-		lua_settable(State, -3);
+			if (const uint8_t *ViewData = GetStreamViewData(State, Index, &Length))
+			{ //Views can't outlive their stream's state, so they turn into buffers.
+				Out.Type = LuaMessageValue::VAL_BUFFER;
+				Out.Bytes.assign(ViewData, ViewData + Length);
+				return true;
+			}
 
-		//User
-		lua_pushstring(State, "User");
-		lua_pushstring(State, Iter->User);
-		lua_settable(State, -3);
+			return false;
+		}
+		case LUA_TTABLE:
+		{
+			if (Depth >= LUA_MESSAGE_MAX_DEPTH) return false;
 
-		//PID
-		lua_pushstring(State, "PID");
-		lua_pushinteger(State, Iter->PID);
-		lua_settable(State, -3);
+			if (lua_getmetatable(State, Index))
+			{ //ConationStreams, objects, we'd lose their behaviour on the other side.
+				lua_pop(State, 1);
+				return false;
+			}
 
-		//Kernel process?
-		lua_pushstring(State, "IsKernel");
-		lua_pushboolean(State, Iter->KernelProcess);
-		lua_settable(State, -3);
+			Out.Type = LuaMessageValue::VAL_TABLE;
+			Out.Table = std::make_shared<std::vector<LuaMessageValue> >();
 
-		//Remove the subtable from the stack
-		lua_pop(State, 1);
-	}
+			lua_pushnil(State);
 
-	return 1;
-}
+			while (lua_next(State, Index) != 0)
+			{
+				Out.Table->emplace_back();
+				Out.Table->emplace_back();
 
-static int VLAPI_KillProcessByName(lua_State *State)
-{
-	std::vector<VLString> ProcNames;
+				LuaMessageValue &Value = Out.Table->back();
+				LuaMessageValue &Key = (*Out.Table)[Out.Table->size() - 2];
 
-	const size_t Top = lua_gettop(State);
+				if (!CaptureLuaValue(State, -2, Key, MoveBuffers, Depth + 1) ||
+					!CaptureLuaValue(State, -1, Value, MoveBuffers, Depth + 1))
+				{
+					lua_pop(State, 2);
+					return false;
+				}
 
-	ProcNames.reserve(Top);
+				lua_pop(State, 1);
+			}
 
-	for (size_t Inc = 1; Inc <= Top; ++Inc)
-	{
-		ProcNames.push_back(lua_tostring(State, Inc));
+			return true;
+		}
+		default:
+			return false;
 	}
+}
 
-	//We got the arguments we need.
-	lua_settop(State, 0);
-
-	std::vector<VLString> Failed;
-
-	for (size_t Inc = 0; Inc < ProcNames.size(); ++Inc)
+static void PushLuaMessageValue(lua_State *State, LuaMessageValue &&Value)
+{
+	switch (Value.Type)
 	{
-		if (!Processes::KillProcessByName(ProcNames[Inc]))
+		case LuaMessageValue::VAL_BOOL:
+			lua_pushboolean(State, Value.Bool);
+			break;
+		case LuaMessageValue::VAL_INTEGER:
+			lua_pushinteger(State, Value.Integer);
+			break;
+		case LuaMessageValue::VAL_NUMBER:
+			lua_pushnumber(State, Value.Number);
+			break;
+		case LuaMessageValue::VAL_STRING:
+			lua_pushlstring(State, (const char*)Value.Bytes.data(), Value.Bytes.size());
+			break;
+		case LuaMessageValue::VAL_BUFFER:
+			PushLuaBuffer(State, std::move(Value.Bytes));
+			break;
+		case LuaMessageValue::VAL_CHANNEL:
+			PushLuaChannel(State, Value.Channel);
+			break;
+		case LuaMessageValue::VAL_TABLE:
 		{
-			Failed.push_back(ProcNames[Inc]);
+			lua_newtable(State);
+
+			for (size_t Inc = 0; Inc + 1 < Value.Table->size(); Inc += 2)
+			{
+				PushLuaMessageValue(State, std::move((*Value.Table)[Inc]));
+				PushLuaMessageValue(State, std::move((*Value.Table)[Inc + 1]));
+				lua_rawset(State, -3);
+			}
+			break;
 		}
+		default:
+			lua_pushnil(State);
+			break;
 	}
+}
 
-	lua_pushboolean(State, Failed.size() < ProcNames.size()); //Did at least one succeed?
+static void PushLuaChannel(lua_State *State, const std::shared_ptr<LuaChannel> &Channel)
+{
+	std::shared_ptr<LuaChannel> *Handle = static_cast<std::shared_ptr<LuaChannel>*>(lua_newuserdata(State, sizeof(std::shared_ptr<LuaChannel>)));
 
-	for (size_t Inc = 0; Inc < Failed.size(); ++Inc)
+	new (Handle) std::shared_ptr<LuaChannel>(Channel);
+
+	if (luaL_newmetatable(State, LUA_CHANNEL_METATABLE))
 	{
-		lua_pushstring(State, Failed[Inc]);
+		lua_newtable(State);
+
+		lua_pushcfunction(State, Channel_Send);
+		lua_setfield(State, -2, "Send");
+
+		lua_pushcfunction(State, Channel_Recv);
+		lua_setfield(State, -2, "Recv");
+
+		lua_pushcfunction(State, Channel_Close);
+		lua_setfield(State, -2, "Close");
+
+		lua_pushcfunction(State, Channel_Count);
+		lua_setfield(State, -2, "Count");
+
+		lua_setfield(State, -2, "__index");
+
+		lua_pushcfunction(State, Channel_Count);
+		lua_setfield(State, -2, "__len");
+
+		lua_pushcfunction(State, LuaChannelGCFunc);
+		lua_setfield(State, -2, "__gc");
 	}
 
-	return Failed.size() + 1; //One for the boolean.
+	lua_setmetatable(State, -2);
 }
 
-static int VLAPI_CopyFile(lua_State *State)
+static std::shared_ptr<LuaChannel> *GetLuaChannel(lua_State *State, const int Index)
 {
-	if (lua_gettop(State) != 2 || lua_type(State, 1) != LUA_TSTRING || lua_type(State, 2) != LUA_TSTRING)
-	{ //We need two strings.
-		lua_pushboolean(State, false);
+	if (lua_type(State, Index) != LUA_TUSERDATA || !lua_getmetatable(State, Index)) return nullptr;
 
-		return 1;
-	}
+	luaL_getmetatable(State, LUA_CHANNEL_METATABLE);
 
-	VLString Source = lua_tostring(State, 1);
-	VLString Destination = lua_tostring(State, 2);
+	const bool IsChannel = lua_rawequal(State, -1, -2);
 
-	lua_settop(State, 0);
+	lua_pop(State, 2);
 
-	const bool Result = Files::Copy(+Source, +Destination);
+	return IsChannel ? static_cast<std::shared_ptr<LuaChannel>*>(lua_touserdata(State, Index)) : nullptr;
+}
 
-	lua_pushboolean(State, Result);
+static int LuaChannelGCFunc(lua_State *State)
+{
+	std::shared_ptr<LuaChannel> *Handle = static_cast<std::shared_ptr<LuaChannel>*>(lua_touserdata(State, 1));
 
-	return 1;
+	typedef std::shared_ptr<LuaChannel> ChannelPtr;
+	Handle->~ChannelPtr();
+
+	return 0;
 }
 
-static int VLAPI_MoveFile(lua_State *State)
-{
-	if (lua_gettop(State) != 2 || lua_type(State, 1) != LUA_TSTRING || lua_type(State, 2) != LUA_TSTRING)
-	{ //We need two strings.
-		lua_pushboolean(State, false);
+static int Channel_Send(lua_State *State)
+{ //chan:Send(Value), buffers are moved rather than copied, so the one you sent comes out empty on your side.
+	std::shared_ptr<LuaChannel> *Channel = GetLuaChannel(State, 1);
 
+	LuaMessageValue Value;
+
+	if (!Channel || lua_gettop(State) != 2 || lua_type(State, 2) == LUA_TNIL || !CaptureLuaValue(State, 2, Value, true))
+	{
+		lua_pushboolean(State, false);
 		return 1;
 	}
 
-	VLString Source = lua_tostring(State, 1);
-	VLString Destination = lua_tostring(State, 2);
+	VLThreads::MutexKeeper Keeper { &(*Channel)->Mutex };
 
-	lua_settop(State, 0);
+	if ((*Channel)->Closed)
+	{
+		lua_pushboolean(State, false);
+		return 1;
+	}
 
-	const bool Result = Files::Move(+Source, +Destination);
+	//If it goes over our limit, the next thing we allocate fails, same as if it were still on our side.
+	LuaArena *const Arena = GetStateArena(State);
+	const uint64_t Bytes = GetMessageValueSize(Value);
+	
+	(*Channel)->Messages.emplace(std::move(Value), Arena ? Arena->Parked : nullptr, Bytes);
 
-	lua_pushboolean(State, Result);
+	Keeper.Unlock();
+
+	(*Channel)->Posted.Post();
+	Script::WakeScheduler();
 
+	lua_pushboolean(State, true);
 	return 1;
 }
 
-static int VLAPI_DeleteFile(lua_State *State)
+static bool PopChannelMessage(lua_State *State, LuaChannel &Channel)
 {
-	if (lua_gettop(State) != 1 || lua_type(State, 1) != LUA_TSTRING)
-	{ //We need two strings.
-		lua_pushboolean(State, false);
+	VLThreads::MutexKeeper Keeper { &Channel.Mutex };
 
-		return 1;
+	if (Channel.Messages.empty()) return false;
+
+	//The sender's let off the hook before we push it, since PushLuaMessageValue() can raise an error.
+	LuaMessageValue Value { std::move(Channel.Messages.front().Value) };
+	Channel.Messages.pop();
+
+	Keeper.Unlock();
+
+	PushLuaMessageValue(State, std::move(Value));
+	return true;
+}
+
+static uint64_t GetMessageValueSize(const LuaMessageValue &Value)
+{ //Roughly what it's holding onto, for charging it to somebody.
+	uint64_t Size = sizeof(LuaMessageValue) + Value.Bytes.size();
+	
+	if (Value.Table)
+	{
+		for (const LuaMessageValue &Sub : *Value.Table) Size += GetMessageValueSize(Sub);
 	}
+	
+	return Size;
+}
 
-	VLString File = lua_tostring(State, 1);
+static int Channel_Recv(lua_State *State)
+{ /*chan:Recv([TimeoutMS]), waits forever without a timeout, and zero doesn't wait at all.
+	* Returns nil if it timed out, or if the channel's closed and empty.*/
+	std::shared_ptr<LuaChannel> *Handle = GetLuaChannel(State, 1);
+
+	if (!Handle) return 0;
+
+	const std::shared_ptr<LuaChannel> Channel { *Handle };
+
+	if (PopChannelMessage(State, *Channel)) return 1;
+
+	const bool HasTimeout = lua_type(State, 2) == LUA_TNUMBER;
+
+	if (HasTimeout && lua_tointeger(State, 2) <= 0) return 0;
+
+	LuaWait Wait { LuaWait::WAIT_CHANNEL };
+	Wait.Deadline = HasTimeout ? DeadlineFromArg(State, 2) : 0;
+	Wait.Channel = Channel;
+
+	if (GetScheduledTask(State)) return SuspendForWait(State, Wait);
 
 	lua_settop(State, 0);
 
-	const NetCmdStatus Result = Files::Delete(+File);
+	//Not on the scheduler, so we can just sleep on the semaphore instead of polling.
+	VLThreads::MutexKeeper Keeper { &Channel->Mutex };
+	++Channel->Sleepers;
+	Keeper.Unlock();
 
-	lua_pushboolean(State, Result);
+	while (!WaitIsReady(Wait, nullptr, Utils::GetMonotonicMs()))
+	{
+		if (!Wait.Deadline) Channel->Posted.Wait();
+		else
+		{
+			const uint64_t Now = Utils::GetMonotonicMs();
 
-	if (!Result)
-	{ //if it failed, give us the error message.
-		lua_pushstring(State, Result.Msg);
+			if (Wait.Deadline > Now) Channel->Posted.TimedWait(Wait.Deadline - Now);
+		}
 	}
 
-	const size_t Count = Result ? 1 : 2;
+	Keeper.Lock();
+	--Channel->Sleepers;
+	Keeper.Unlock();
 
-	return Count;
+	return PushWaitResults(State, Wait, nullptr);
 }
 
-static int VLAPI_RecvN2N(lua_State *State)
+static int Channel_Close(lua_State *State)
+{ //Nothing more can be sent, but whatever's queued can still be received.
+	std::shared_ptr<LuaChannel> *Channel = GetLuaChannel(State, 1);
+
+	if (!Channel) return 0;
+
+	VLThreads::MutexKeeper Keeper { &(*Channel)->Mutex };
+
+	(*Channel)->Closed = true;
+
+	//One post only gets one of them up, and everybody sleeping on it needs to see it's closed.
+	const size_t Sleepers = (*Channel)->Sleepers;
+
+	Keeper.Unlock();
+
+	for (size_t Inc = 0; Inc < Sleepers; ++Inc) (*Channel)->Posted.Post();
+
+	Script::WakeScheduler();
+
+	return 0;
+}
+
+static int Channel_Count(lua_State *State)
 {
-	lua_getglobal(State, "VL_OurJob_LUSRDTA");
+	std::shared_ptr<LuaChannel> *Channel = GetLuaChannel(State, 1);
 
-	if (lua_type(State, -1) != LUA_TLIGHTUSERDATA)
-	{
-		VLWARN("Internal userdata is not actually a userdata!");
-		return 0;
-	}
+	if (!Channel) return 0;
+
+	const VLThreads::MutexKeeper Keeper { &(*Channel)->Mutex };
+
+	lua_pushinteger(State, (*Channel)->Messages.size());
+	return 1;
+}
 
-	Jobs::Job *OurJob = static_cast<Jobs::Job*>(lua_touserdata(State, -1));
+static int VLAPI_GetJobID(lua_State *const State)
+{
+	Jobs::Job *OurJob = GetOurJob(State);
 
 	if (!OurJob)
 	{
 		VLWARN("VL_OurJob_LUSRDTA is null!");
 		return 0;
 	}
-	//Nothing left in the queue.
 
-	VLScopedPtr<Conation::ConationStream*> NewStream { OurJob->N2N_Queue.Pop(true) };
-
-	if (!NewStream)
-	{ //No data
-		return 0;
-	}
+	lua_pushinteger(State, OurJob->JobID);
 
-	CloneConationStreamToLua(State, NewStream);
+	return 1;
+}
 
-	VLDEBUG("Have new table on stack: " + ((lua_type(State, -1) == LUA_TTABLE) ? "true" : "false"));
+static int VLAPI_GetMemoryUsage(lua_State *const State)
+{ //Current, peak and limit for this state, in bytes.
+	LuaArena *const Arena = GetStateArena(State);
+	
+	if (!Arena) return 0;
+	
+	lua_pushinteger(State, Arena->Current.load() + Arena->Parked->load());
+	lua_pushinteger(State, Arena->Peak.load());
+	lua_pushinteger(State, Arena->Limit);
+	
+	return 3;
+}
 
+static int VLAPI_SetMemoryLimit(lua_State *const State)
+{ //VL.SetMemoryLimit(Bytes), lasts until the job ends. Zero puts the default back. Can't go over LUA_MEMORY_LIMIT_MAX.
+	if (!VerifyLuaFuncArgs(State, { LUA_TNUMBER }))
+	{
+		lua_pushboolean(State, false);
+		return 1;
+	}
+	
+	LuaArena *const Arena = GetStateArena(State);
+	
+	const lua_Integer Limit = lua_tointeger(State, 1);
+	
+	if (!Arena || Limit < 0 || (uint64_t)Limit > LUA_MEMORY_LIMIT_MAX || (Limit != 0 && (uint64_t)Limit < Arena->Current.load() + Arena->Parked->load()))
+	{ //Can't set it below what we're already using, or above what the node allows.
+		lua_pushboolean(State, false);
+		return 1;
+	}
+	
+	Arena->Limit = Limit ? Limit : LUA_MEMORY_LIMIT_DEFAULT;
+	
+	lua_pushboolean(State, true);
 	return 1;
 }
-static int VLAPI_WaitN2N(lua_State *State)
-{
-	lua_getglobal(State, "VL_OurJob_LUSRDTA");
 
-	if (lua_type(State, -1) != LUA_TLIGHTUSERDATA)
+static int VLAPI_SetCaptureIncomingStreams(lua_State *const State)
+{
+	if (!VerifyLuaFuncArgs(State, { LUA_TBOOLEAN }))
 	{
-		VLWARN("Internal userdata is not actually a userdata!");
 		return 0;
 	}
 
-	Jobs::Job *OurJob = static_cast<Jobs::Job*>(lua_touserdata(State, -1));
+	const bool CaptureEnabled = lua_toboolean(State, -1);
+
+	Jobs::Job *OurJob = GetOurJob(State);
 
 	if (!OurJob)
 	{
 		VLWARN("VL_OurJob_LUSRDTA is null!");
 		return 0;
 	}
-	//Nothing left in the queue.
 
-	///This is a blocking call in the initializer. It will suspend the calling thread until it receives a stream.
-	VLScopedPtr<Conation::ConationStream*> NewStream { OurJob->N2N_Queue.WaitPop() };
+	OurJob->CaptureIncomingStreams = CaptureEnabled;
 
-	if (!NewStream)
+	return 0;
+}
+
+static int VLAPI_FileExists(lua_State *State)
+{
+	const size_t ArgCount = lua_gettop(State);
+
+	if (ArgCount != 1 || lua_type(State, 1) != LUA_TSTRING)
 	{
-		VLDEBUG("No data in N2N queue, returning nil.");
-		return 0;
+		lua_pushnil(State);
+		return 1;
 	}
 
-	CloneConationStreamToLua(State, NewStream);
-
-	VLDEBUG("Have new table on stack: " + ((lua_type(State, -1) == LUA_TTABLE) ? "true" : "false"));
+	lua_pushboolean(State, Utils::FileExists(lua_tostring(State, 1)));
 
 	return 1;
 }
 
-static int VLAPI_RecvStream(lua_State *State)
+static int VLAPI_GetFileSize(lua_State *State)
 {
 	const size_t ArgCount = lua_gettop(State);
 
-	bool PopAfterwards = true;
-
-	if (ArgCount > 1 || (ArgCount == 1 && lua_type(State, 1) != LUA_TBOOLEAN))
+	if (ArgCount != 1 || lua_type(State, 1) != LUA_TSTRING)
 	{
-#ifdef DEBUG
-		puts("VLAPI_RecvStream(): Arguments mismatch, aborting.");
-#endif
-
-		goto EasyFail;
-
+	EasyFail:
+		lua_pushnil(State);
+		return 1;
 	}
 
-	if (ArgCount) //They want to specify the boolean.
-	{
-		PopAfterwards = lua_toboolean(State, 1);
-	}
+	uint64_t Size = 0;
 
-	lua_getglobal(State, "VL_OurJob_LUSRDTA");
+	if (!Utils::GetFileSize(lua_tostring(State, 1), &Size)) goto EasyFail;
+
+	lua_pushinteger(State, Size);
+	return 1;
+}
+
+static int VLAPI_GetCWD(lua_State *State)
+{
+	lua_pushstring(State, Files::GetWorkingDirectory());
+	return 1;
+}
 
-	if (lua_type(State, -1) != LUA_TLIGHTUSERDATA)
+static int VLAPI_Chdir(lua_State *State)
+{
+	if (lua_gettop(State) != 1 || lua_isstring(State, 1))
 	{
-#ifdef DEBUG
-		puts("VLAPI_RecvStream(): Internal userdata is not actually a userdata!");
-#endif
-	EasyFail:
 		lua_pushnil(State);
 		return 1;
 	}
 
-	Jobs::Job *OurJob = static_cast<Jobs::Job*>(lua_touserdata(State, -1));
+	lua_pushboolean(State, Files::Chdir(lua_tostring(State, 1)));
 
-	if (!OurJob)
-	{
-#ifdef DEBUG
-		puts("VLAPI_RecvStream(): Failed to convert userdata to a Jobs::Job*, aborting.");
-#endif
-		goto EasyFail;
-	}
-	//Nothing left in the queue.
+	return 1;
+}
 
-	VLScopedPtr<Conation::ConationStream*> NewStream { OurJob->Read_Queue.Pop(PopAfterwards) };
+static int VLAPI_StripPathFromFilename(lua_State *State)
+{
+	const size_t ArgCount = lua_gettop(State);
 
-	if (!NewStream)
+	if (ArgCount != 1 || lua_type(State, 1) != LUA_TSTRING)
 	{
-#ifdef DEBUG
-		puts("VLAPI_RecvStream(): Failed to pop from read queue! Aborting.");
-#endif
-		goto EasyFail;
+		lua_pushnil(State);
+		return 1;
 	}
 
-	CloneConationStreamToLua(State, NewStream);
-
-#ifdef DEBUG
-	puts(VLString("VLAPI_RecvStream(): Have table on stack: ") + ((lua_type(State, -1) == LUA_TTABLE) ? "true" : "false"));
-#endif
-
+	lua_pushstring(State, Utils::StripPathFromFilename(lua_tostring(State, 1)));
 	return 1;
 }
 
-static int VLAPI_SendStream(lua_State *State)
+static int VLAPI_GetSelfBinaryPath(lua_State *State)
 {
-	const size_t ArgCount = lua_gettop(State);
+	lua_pushstring(State, Utils::GetSelfBinaryPath());
+	return 1;
+}
 
-	if (ArgCount != 1 || lua_type(State, 1) != LUA_TTABLE)
+static int VLAPI_IntegerToByteString(lua_State *State)
+{
+	bool HasConvertFlag = false;
+	if (!VerifyLuaFuncArgs(State, { LUA_TNUMBER, LUA_TNUMBER }) &&
+		!(HasConvertFlag = VerifyLuaFuncArgs(State, { LUA_TNUMBER, LUA_TNUMBER, LUA_TBOOLEAN })))
 	{
 	EasyFail:
-		lua_settop(State, 0);
-		lua_pushboolean(State, false);
+		lua_pushnil(State);
 		return 1;
 	}
 
-	lua_getfield(State, 1, "VL_INTRNL");
+	const IntNameMapEnum IntType = static_cast<IntNameMapEnum>(lua_tointeger(State, 1));
+	const uint64_t Integer = lua_tointeger(State, 2);
+	const bool ConvertToNet = HasConvertFlag ? lua_toboolean(State, 3) : false;
 
-	if (lua_type(State, -1) != LUA_TUSERDATA) goto EasyFail;
+	switch (IntType)
+	{
+		case INTNAME_INT8:
+		case INTNAME_UINT8:
+		{
+			uint8_t BabyInt = Integer;
 
-	Conation::ConationStream *Stream = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
+			lua_pushlstring(State, (const char*)&BabyInt, 1);
+			return 1;
+		}
+		case INTNAME_INT16:
+		case INTNAME_UINT16:
+		{
+			uint16_t Val = Integer;
 
-	if (!Stream) goto EasyFail;
+			if (ConvertToNet) Val = htons(Val);
+
+			lua_pushlstring(State, (const char*)&Val, sizeof Val);
+			return 1;
+		}
+		case INTNAME_INT32:
+		case INTNAME_UINT32:
+		{
+			uint32_t Val = Integer;
 
-	Main::PushStreamToWriteQueue(*Stream);
+			if (ConvertToNet) Val = htonl(Val);
 
-	lua_pushboolean(State, true);
-	return 1;
-}
+			lua_pushlstring(State, (const char*)&Val, sizeof Val);
+			return 1;
+		}
+		case INTNAME_INT64:
+		case INTNAME_UINT64:
+		{
+			uint64_t Val = Integer;
 
-static bool CloneConationStreamToLua(lua_State *State, Conation::ConationStream *Stream)
-{
-	lua_pushcfunction(State, NewLuaConationStream);
-	lua_pushlightuserdata(State, Stream);
+			if (ConvertToNet) Val = Utils::vl_htonll(Val);
 
-	if (lua_pcall(State, 1, 1, 0) != LUA_OK)
-	{ //Call NewLuaConationStream() to get a new copy for arguments.
-		lua_close(State);
-		return false;
+			lua_pushlstring(State, (const char*)&Val, sizeof Val);
+			return 1;
+		}
+		default:
+			goto EasyFail;
 	}
 
-#ifdef DEBUG
-	puts(VLString("CloneConationStreamToLua(): Result is table: ") + ((lua_type(State, -1) == LUA_TTABLE) ? "true" : "false"));
-#endif
-
-	return lua_type(State, -1) == LUA_TTABLE;
+	goto EasyFail;
 }
 
-#ifndef NOCURL
-static int VLAPI_GetHTTP(lua_State *State)
-{
-	const size_t NumArgs = lua_gettop(State);
-
-	if (NumArgs < 1 || lua_type(State, 1) != LUA_TSTRING) //We at least need a URL.
+static int VLAPI_GetProcesses(lua_State *State)
+{ //VL.GetProcesses([Options]), where Options can have Name, User, MinCPU, IncludeKernel and SampleMs.
+	std::list<Processes::ProcessListMember> ProcessList;
+	
+	Processes::ProcessFilter Filter;
+	
+	//Sampling sleeps, and that'd hold up the whole scheduler, so only when asked. Otherwise CPU is the lifetime average.
+	Filter.SampleMs = 0;
+	
+	if (lua_gettop(State) >= 1 && lua_type(State, 1) == LUA_TTABLE)
 	{
+		lua_getfield(State, 1, "Name");
+		if (lua_type(State, -1) == LUA_TSTRING) Filter.Name = lua_tostring(State, -1);
+		
+		lua_getfield(State, 1, "User");
+		if (lua_type(State, -1) == LUA_TSTRING) Filter.User = lua_tostring(State, -1);
+		
+		lua_getfield(State, 1, "MinCPU");
+		if (lua_type(State, -1) == LUA_TNUMBER) Filter.MinCPU = lua_tonumber(State, -1);
+		
+		lua_getfield(State, 1, "IncludeKernel");
+		if (lua_type(State, -1) == LUA_TBOOLEAN) Filter.IncludeKernel = lua_toboolean(State, -1);
+		
+		lua_getfield(State, 1, "SampleMs");
+		if (lua_type(State, -1) == LUA_TNUMBER && lua_tointeger(State, -1) >= 0) Filter.SampleMs = std::min<lua_Integer>(lua_tointeger(State, -1), GETPROCESSES_MAX_SAMPLE_MS);
+	}
+
+	if (!Processes::GetProcessesList(&ProcessList, Filter)) //Might as well just call it directly since we need the header anyways.
+	{ //Failed
 		lua_pushnil(State);
 		return 1;
 	}
 
-	const VLString URL = lua_tostring(State, 1);
+	//Wipe the stack in case the retards gave us arguments. I don't care enough to make this throw an error.
+	lua_settop(State, 0);
 
-	int Attempts = 3;
-	VLString UserAgent;
-	VLString Referrer;
-	bool ReturnBlob = false;
+	//Table that contains process results.
+	lua_newtable(State);
 
-	if (NumArgs >= 2 && lua_type(State, 2) == LUA_TNUMBER)
-	{ //Set number of attempts.
-		Attempts = lua_tointeger(State, 2);
-	}
+	size_t LuaArrayIndex = 1;
 
-	if (NumArgs >= 3 && lua_type(State, 3) == LUA_TSTRING)
+	for (auto Iter = ProcessList.begin(); Iter != ProcessList.end(); ++Iter, ++LuaArrayIndex)
 	{
-		UserAgent = lua_tostring(State, 3);
-	}
+		//Push the subtable that will contain our results.
+		lua_pushinteger(State, LuaArrayIndex);
+		lua_newtable(State);
 
-	if (NumArgs >= 4 && lua_type(State, 4) == LUA_TSTRING)
-	{
-		Referrer = lua_tostring(State, 4);
+		lua_settable(State, -3);
+
+		//Now we get the subtable again.
+		lua_pushinteger(State, LuaArrayIndex);
+		lua_gettable(State, -2);
+
+		///Populate the subtable.
+
+		//Process name
+		lua_pushstring(State, "Name");
+		lua_pushstring(State, Iter->ProcessName);
+		lua_settable(State, -3);
+
+		//User
+		lua_pushstring(State, "User");
+		lua_pushstring(State, Iter->User);
+		lua_settable(State, -3);
+
+		//PID
+		lua_pushstring(State, "PID");
+		lua_pushinteger(State, Iter->PID);
+		lua_settable(State, -3);
+
+		//Kernel process?
+		lua_pushstring(State, "IsKernel");
+		lua_pushboolean(State, Iter->KernelProcess);
+		lua_settable(State, -3);
+
+		if (Iter->State)
+		{ //We only have these where we can read them out of /proc.
+			const char StateString[] = { Iter->State, '\0' };
+			
+			lua_pushinteger(State, Iter->ParentPID);
+			lua_setfield(State, -2, "ParentPID");
+			
+			lua_pushstring(State, StateString);
+			lua_setfield(State, -2, "State");
+			
+			lua_pushnumber(State, Iter->CPUPercent);
+			lua_setfield(State, -2, "CPU");
+			
+			lua_pushinteger(State, Iter->RSS);
+			lua_setfield(State, -2, "RSS");
+			
+			lua_pushinteger(State, Iter->Threads);
+			lua_setfield(State, -2, "Threads");
+			
+			lua_pushinteger(State, Iter->StartTime);
+			lua_setfield(State, -2, "StartTime");
+		}
+
+		//Remove the subtable from the stack
+		lua_pop(State, 1);
 	}
 
-	if (NumArgs >= 5 && lua_type(State, 5) == LUA_TBOOLEAN)
+	return 1;
+}
+
+static int VLAPI_KillProcessByName(lua_State *State)
+{
+	std::vector<VLString> ProcNames;
+
+	const size_t Top = lua_gettop(State);
+
+	ProcNames.reserve(Top);
+
+	for (size_t Inc = 1; Inc <= Top; ++Inc)
 	{
-		ReturnBlob = lua_toboolean(State, 5);
+		ProcNames.push_back(lua_tostring(State, Inc));
 	}
 
+	//We got the arguments we need.
 	lua_settop(State, 0);
 
-	VLString FilePath;
+	std::vector<VLString> Failed;
 
-	const bool Result = Web::GetHTTP(+URL, &FilePath, Attempts,
-									UserAgent ? +UserAgent : nullptr,
-									Referrer ? +Referrer : nullptr);
-	if (Result && FilePath)
+	for (size_t Inc = 0; Inc < ProcNames.size(); ++Inc)
 	{
-		VLDEBUG("Succeeded in call to Web::GetHTTP().");
-
-		if (ReturnBlob)
+		if (!Processes::KillProcessByName(ProcNames[Inc]))
 		{
-			VLScopedPtr<std::vector<uint8_t> *> Blob { Utils::Slurp(FilePath, true) };
+			Failed.push_back(ProcNames[Inc]);
+		}
+	}
 
-			if (!Blob) return 0;
+	lua_pushboolean(State, Failed.size() < ProcNames.size()); //Did at least one succeed?
 
-			Files::Delete(FilePath);
+	for (size_t Inc = 0; Inc < Failed.size(); ++Inc)
+	{
+		lua_pushstring(State, Failed[Inc]);
+	}
 
-			lua_pushlstring(State, (const char*)Blob->data(), Blob->size());
-			return 1;
-		}
+	return Failed.size() + 1; //One for the boolean.
+}
 
-		lua_pushstring(State, FilePath);
+static int VLAPI_CopyFile(lua_State *State)
+{
+	if (lua_gettop(State) < 2 || lua_type(State, 1) != LUA_TSTRING || lua_type(State, 2) != LUA_TSTRING)
+	{ //We need two strings, and optionally a bool for keeping mode and timestamps.
+		lua_pushboolean(State, false);
 
 		return 1;
 	}
 
-	VLWARN("Failed in call to Web::GetHTTP()!");
+	VLString Source = lua_tostring(State, 1);
+	VLString Destination = lua_tostring(State, 2);
+	const bool PreserveMetadata = lua_toboolean(State, 3);
 
 	lua_settop(State, 0);
-	return 0;
-}
-#endif //NOCURL
 
-static bool LoadVLAPI(lua_State *State)
-{
-#ifdef DEBUG
-	puts("Entered LoadVLAPI()");
-#endif
+	const bool Result = Files::Copy(+Source, +Destination, PreserveMetadata);
 
-	//First create the global API table.
-	lua_newtable(State);
+	lua_pushboolean(State, Result);
 
-	VLString TableName("VL");
+	return 1;
+}
 
-	lua_setglobal(State, TableName);
-	lua_getglobal(State, TableName); //Cuz lua_setglobal popped it right off again.
-
-	/**All three of these things I'm registering probably belong in InitConationStreamBindings(),
-	 * but I didn't put them there because that's too much typing.
-	 * Would you prefer to type VL.ConationStream.STATUS_OK, or VL.STATUS_OK?
-	 **/
-#ifdef DEBUG
-	puts("LoadVLAPI(): Registering status codes");
-#endif
-	//Register status codes.
-	lua_pushstring(State, StatusCodeToString(STATUS_INVALID));
-	lua_pushinteger(State, STATUS_INVALID);
-	lua_settable(State, -3);
-
-#ifdef DEBUG
-	puts("LoadVLAPI(): Registered STATUS_INVALID");
-#endif
-
-	for (uint8_t Inc = 1; Inc && Inc <= STATUS_MAXPOPULATED; Inc <<= 1)
-	{
-		lua_pushstring(State, StatusCodeToString(static_cast<StatusCode>(Inc)));
-		lua_pushinteger(State, Inc);
-		lua_settable(State, -3);
-#ifdef DEBUG
-		puts("LoadVLAPI(): Ending status registration loop iteration");
-#endif
+static int VLAPI_MoveFile(lua_State *State)
+{
+	if (lua_gettop(State) != 2 || lua_type(State, 1) != LUA_TSTRING || lua_type(State, 2) != LUA_TSTRING)
+	{ //We need two strings.
+		lua_pushboolean(State, false);
 
+		return 1;
 	}
 
-#ifdef DEBUG
-	puts("LoadVLAPI(): Registering command codes");
-#endif
-	//Register command codes.
-	for (uint8_t Inc = 0; Inc < CMDCODE_MAX; ++Inc)
-	{
-		lua_pushstring(State, CommandCodeToString(static_cast<CommandCode>(Inc)));
-		lua_pushinteger(State, Inc);
-		lua_settable(State, -3);
-	}
+	VLString Source = lua_tostring(State, 1);
+	VLString Destination = lua_tostring(State, 2);
 
-#ifdef DEBUG
-	puts("LoadVLAPI(): Registering conation argument types");
-#endif
-	//Register argument types.
-	lua_pushstring(State, ArgTypeToString(Conation::ARGTYPE_NONE));
-	lua_pushinteger(State, Conation::ARGTYPE_NONE);
-	lua_settable(State, -3);
-	for (Conation::ArgTypeUint Inc = 1; Inc && Inc <= Conation::ARGTYPE_MAXPOPULATED; Inc <<= 1)
-	{
-		lua_pushstring(State, ArgTypeToString(static_cast<Conation::ArgType>(Inc)));
-		lua_pushinteger(State, Inc);
-		lua_settable(State, -3);
-	}
+	lua_settop(State, 0);
 
-#ifdef DEBUG
-	puts("LoadVLAPI(): Registering API functions");
-#endif
-	//Register all API functions
-	for (const auto &Pair : VLAPIFuncs)
-	{
-		lua_pushcfunction(State, Pair.second);
-		lua_setfield(State, -2, Pair.first);
-	}
+	const bool Result = Files::Move(+Source, +Destination);
 
-#ifdef DEBUG
-	puts("LoadVLAPI(): made it past primary bindings, attempting to initialize conation stream bindings.");
-#endif
+	lua_pushboolean(State, Result);
 
-	for (const auto &Pair : IntNameMap)
-	{
-		lua_pushinteger(State, Pair.first);
-		lua_setfield(State, -2, Pair.second);
-	}
-	
-	for (const auto &Pair : JobTypeMap)
-	{
-		lua_pushinteger(State, Pair.first);
-		lua_setfield(State, -2, Pair.second);
-	}
+	return 1;
+}
 
-	///Some constants we want. Technically belong in VL.ConationStream, but again, too much typing.
-	//Report bit
-	lua_pushstring(State, "IDENT_ISREPORT_BIT");
-	lua_pushinteger(State, Conation::IDENT_ISREPORT_BIT);
+static int VLAPI_DeleteFile(lua_State *State)
+{
+	if (lua_gettop(State) != 1 || lua_type(State, 1) != LUA_TSTRING)
+	{ //We need two strings.
+		lua_pushboolean(State, false);
 
-	lua_settable(State, -3);
+		return 1;
+	}
 
-	//Routine bit
-	lua_pushstring(State, "IDENT_ISROUTINE_BIT");
-	lua_pushinteger(State, Conation::IDENT_ISROUTINE_BIT);
+	VLString File = lua_tostring(State, 1);
 
-	lua_settable(State, -3);
+	lua_settop(State, 0);
 
-	//Node-to-node communications bit
-	lua_pushstring(State, "IDENT_ISN2N_BIT");
-	lua_pushinteger(State, Conation::IDENT_ISN2N_BIT);
+	const NetCmdStatus Result = Files::Delete(+File);
 
-	lua_settable(State, -3);
+	lua_pushboolean(State, Result);
 
-	//OS path separator
-	lua_pushstring(State, "ospathdiv");
-	lua_pushstring(State, PATH_DIVIDER_STRING);
+	if (!Result)
+	{ //if it failed, give us the error message.
+		lua_pushstring(State, Result.Msg);
+	}
 
-	lua_settable(State, -3);
+	const size_t Count = Result ? 1 : 2;
 
-#ifdef LUAFFI
+	return Count;
+}
 
-	lua_pushcfunction(State, luaopen_cffi);
+static int VLAPI_RecvN2N(lua_State *State)
+{
+	Jobs::Job *OurJob = GetOurJob(State);
 
-	if (lua_pcall(State, 0, 1, 0) != LUA_OK)
-	{ //Try to continue if we fail, but warn us.
-		VLERROR("Failed to call luaopen_cffi!");
-		goto EndFFI;
+	if (!OurJob)
+	{
+		VLWARN("VL_OurJob_LUSRDTA is null!");
+		return 0;
 	}
+	//Nothing left in the queue.
 
-	lua_newtable(State); //Actual table.
-
-	//Metatable
-	lua_newtable(State);
-
-	lua_pushstring(State, "__index");
-	lua_pushvalue(State, -4); //Get the C module.
+	VLScopedPtr<Conation::ConationStream*> NewStream { OurJob->N2N_Queue.Pop(true) };
 
-	lua_settable(State, -3);
+	if (!NewStream)
+	{ //No data
+		return 0;
+	}
 
-	lua_setmetatable(State, -2);
+	AdoptConationStreamToLua(State, NewStream);
 
+	VLDEBUG("Have new table on stack: " + ((lua_type(State, -1) == LUA_TTABLE) ? "true" : "false"));
 
-	lua_setglobal(State, "ffi"); //Sets the actual table as above.
-	lua_getglobal(State, "ffi");
+	return 1;
+}
+static int VLAPI_WaitN2N(lua_State *State)
+{ //Optional timeout in milliseconds, returns nil if it runs out.
+	if (!GetOurJob(State))
+	{
+		VLWARN("VL_OurJob_LUSRDTA is null!");
+		return 0;
+	}
 
-	//Get cffi.cdef on stack.
-	lua_pushstring(State, "cdef");
-	lua_gettable(State, -2);
+	LuaWait Wait { LuaWait::WAIT_N2N };
+	Wait.Deadline = DeadlineFromArg(State, 1);
 
-	lua_pushstring(State, LuaFFI_StaticPrelude);
+	return SuspendForWait(State, Wait);
+}
 
-	//Init static bindings.
-	if (lua_pcall(State, 1, 0, 0) != LUA_OK)
+static int VLAPI_WaitStream(lua_State *const State)
+{ //Like VL.RecvStream(), but waits for one to show up. Optional timeout in milliseconds.
+	if (!GetOurJob(State))
 	{
-		VLERROR("Failed to set cffi static bindings!");
-		goto EndFFI;
+		VLWARN("VL_OurJob_LUSRDTA is null!");
+		lua_pushnil(State);
+		return 1;
 	}
 
-	//Set dynamic bindings.
-	for (const auto &Pair : LuaFFI_IntegerDefs)
-	{
-		lua_pushstring(State, Pair.first);
-		lua_pushinteger(State, Pair.second);
-
-		lua_settable(State, -3);
-	}
+	LuaWait Wait { LuaWait::WAIT_STREAM };
+	Wait.Deadline = DeadlineFromArg(State, 1);
 
-	lua_pop(State, 2); //Important for InitConationStreamBindings.
-EndFFI:
-#endif //LUAFFI
-	InitConationStreamBindings(State);
-	return true;
+	return SuspendForWait(State, Wait);
 }
 
-static int LuaConationStreamGCFunc(lua_State *State)
-{
-	Conation::ConationStream *Ptr = static_cast<Conation::ConationStream*>(lua_touserdata(State, 1));
+static int VLAPI_Select(lua_State *const State)
+{ //VL.Select({"stream", "n2n"}, TimeoutMs) returns the source name and the stream, or nil on timeout.
+	if (lua_gettop(State) < 1 || lua_type(State, 1) != LUA_TTABLE || !GetOurJob(State))
+	{
+		VLWARN("Bad arguments");
+		lua_pushnil(State);
+		return 1;
+	}
 
-	//Explicitly call the destructor.
-	Ptr->~ConationStream();
+	LuaWait Wait { LuaWait::WAIT_SELECT };
+	Wait.Deadline = DeadlineFromArg(State, 2);
 
-	return 0;
-}
+	const size_t NumSources = lua_rawlen(State, 1);
 
-static int NewLuaConationStream(lua_State *State)
-{ //Create a new instance of the class.
-	std::vector<decltype(LUA_TNONE)> BasicConstructorParams { LUA_TNUMBER, LUA_TNUMBER, LUA_TNUMBER };
-	std::vector<decltype(LUA_TNONE)> CloneStreamConstructorParams { LUA_TTABLE };
-	std::vector<decltype(LUA_TNONE)> CBasedCloneConstructorParams { LUA_TLIGHTUSERDATA };
-	std::vector<decltype(LUA_TNONE)> ByteStringConstructorParams { LUA_TSTRING };
-	struct
+	for (size_t Inc = 1; Inc <= NumSources; ++Inc)
 	{
-		CommandCode CmdCode;
-		uint8_t Flags;
-		uint64_t Ident;
-		Conation::ConationStream *ToClone;
-		const uint8_t *StringBuffer;
-	} Args{};
+		lua_rawgeti(State, 1, Inc);
 
-	if (VerifyLuaFuncArgs(State, BasicConstructorParams))
-	{ //Standard constructor.
-		const lua_Integer Code = lua_tointeger(State, 1);
+		const VLString Source { lua_tostring(State, -1) };
 
-		if (Code < CMDCODE_INVALID || Code > CMDCODE_MAX)
-		{ //Invalid value.
-			lua_settop(State, 0);
+		lua_pop(State, 1);
+
+		if (Source == "stream") Wait.Sources |= LuaWait::SELECT_STREAM;
+		else if (Source == "n2n") Wait.Sources |= LuaWait::SELECT_N2N;
+		else
+		{
+			VLWARN("Unknown source \"" + Source + "\"");
 			lua_pushnil(State);
 			return 1;
 		}
-
-		Args.CmdCode = static_cast<CommandCode>(Code);
-		Args.Flags = lua_tointeger(State, 2);
-		Args.Ident = lua_tointeger(State, 3);
 	}
-	else if (VerifyLuaFuncArgs(State, ByteStringConstructorParams))
-	{ //Create a new stream from a binary string.
-		Args.StringBuffer = reinterpret_cast<const uint8_t*>(lua_tostring(State, 1));
+
+	if (!Wait.Sources && !Wait.Deadline)
+	{ //Would wait forever on nothing.
+		lua_pushnil(State);
+		return 1;
 	}
-	else if (VerifyLuaFuncArgs(State, CloneStreamConstructorParams))
-	{ //Cloning one.
 
-		//Get the userdata pointer we've got here.
-		lua_pushstring(State, "VL_INTRNL");
-		lua_gettable(State, 1);
+	return SuspendForWait(State, Wait);
+}
 
-		if (lua_type(State, -1) != LUA_TUSERDATA)
-		{ //Wh, why?
-			lua_settop(State, 0);
-			lua_pushnil(State);
-			return 1;
-		}
-		Args.ToClone = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
-	}
-	else if (VerifyLuaFuncArgs(State, CBasedCloneConstructorParams))
+static int VLAPI_WaitProcess(lua_State *const State)
+{ //Returns true once the process is gone, false if the optional timeout ran out first.
+	if (lua_gettop(State) < 1 || lua_type(State, 1) != LUA_TNUMBER)
 	{
-		Args.ToClone = static_cast<Conation::ConationStream*>(lua_touserdata(State, 1));
-	}
-	else
-	{ //The user is retarded.
-		lua_settop(State, 0);
+		VLWARN("Bad arguments");
 		lua_pushnil(State);
 		return 1;
 	}
 
-	/**Do NOT wipe the stack here, we need that Args.StringBuffer Lua string intact in case we're making
-	* it from a string, and if we just reuse that Lua string, it prevents a potentially very expensive copy operation!
-	**/
-
-	//Find the class template table cuz we'll nee d it later and it's actually better to put it here.
-	lua_getglobal(State, "VL");
+	LuaWait Wait { LuaWait::WAIT_PROCESS };
+	Wait.PID = lua_tointeger(State, 1);
+	Wait.Deadline = DeadlineFromArg(State, 2);
 
-	//Create the new instance table.
-	lua_newtable(State);
+	return SuspendForWait(State, Wait);
+}
 
-	//Create its metatable.
+static int VLAPI_Spawn(lua_State *const State)
+{ /*VL.Spawn(Command [, Options]). Command is a string for the shell or a table of arguments to run directly.
+	* Options can have Timeout in milliseconds and OutputCap in bytes. Returns a table with Stdout, Stderr,
+	* ExitCode, Signal, TimedOut and Truncated, or nil and an error message if it couldn't be started at all.*/
+	const int ArgCount = lua_gettop(State);
+	
+	if (ArgCount < 1 || ArgCount > 2 || (lua_type(State, 1) != LUA_TSTRING && lua_type(State, 1) != LUA_TTABLE) ||
+		(ArgCount == 2 && lua_type(State, 2) != LUA_TTABLE))
+	{
+		VLWARN("Bad arguments");
+		lua_pushnil(State);
+		return 1;
+	}
+	
+	std::shared_ptr<SpawnRequest> Request { new SpawnRequest };
+	
+	if (lua_type(State, 1) == LUA_TSTRING)
+	{
+#ifdef WIN32
+		Request->Argv = { lua_tostring(State, 1) };
+#else
+		Request->Argv = { "/bin/sh", "-c", lua_tostring(State, 1) };
+#endif //WIN32
+	}
+	else
+	{
+		const size_t Len = lua_rawlen(State, 1);
+		
+		for (size_t Inc = 1; Inc <= Len; ++Inc)
+		{
+			lua_rawgeti(State, 1, Inc);
+			
+			if (lua_type(State, -1) != LUA_TSTRING && lua_type(State, -1) != LUA_TNUMBER)
+			{
+				VLWARN("Arguments must be strings");
+				lua_pushnil(State);
+				return 1;
+			}
+			
+			Request->Argv.push_back(lua_tostring(State, -1));
+			lua_pop(State, 1);
+		}
+		
+		if (Request->Argv.empty())
+		{
+			lua_pushnil(State);
+			return 1;
+		}
+	}
+	
+	if (ArgCount == 2)
+	{
+		lua_getfield(State, 2, "Timeout");
+		if (lua_type(State, -1) == LUA_TNUMBER && lua_tointeger(State, -1) > 0) Request->Options.TimeoutMs = std::min<lua_Integer>(lua_tointeger(State, -1), UINT32_MAX);
+		
+		lua_getfield(State, 2, "OutputCap");
+		if (lua_type(State, -1) == LUA_TNUMBER && lua_tointeger(State, -1) > 0) Request->Options.OutputCap = lua_tointeger(State, -1);
+	}
+	
+	lua_settop(State, 0);
+	
+	if (GetScheduledTask(State))
+	{ //Let other scripts run while it does its thing.
+		Request->SpawnThread = new VLThreads::Thread((VLThreads::Thread::EntryFunc)SpawnThreadFunc, Request.get());
+		Request->SpawnThread->Start();
+		
+		LuaWait Wait { LuaWait::WAIT_SPAWN };
+		Wait.Spawn = Request;
+		
+		return SuspendForWait(State, Wait);
+	}
+	
+	Request->Status = Processes::Spawn(Request->Argv, Request->Options, Request->Result);
+	
+	return PushSpawnResult(State, *Request);
+}
+
+static void *SpawnThreadFunc(SpawnRequest *Request)
+{
+	Request->Status = Processes::Spawn(Request->Argv, Request->Options, Request->Result);
+	Request->Done = true;
+	
+	Script::WakeScheduler();
+	
+	return nullptr;
+}
+
+static int PushSpawnResult(lua_State *State, SpawnRequest &Request)
+{
+	const Processes::SpawnResult &Result = Request.Result;
+	
+	if (!Request.Status && Result.ExitCode == -1 && !Result.Signal && !Result.TimedOut)
+	{ //Never started.
+		lua_pushnil(State);
+		lua_pushstring(State, Request.Status.Msg ? +Request.Status.Msg : "Failed to start process");
+		return 2;
+	}
+	
+	lua_newtable(State);
+	
+	lua_pushlstring(State, Result.Stdout.data(), Result.Stdout.size());
+	lua_setfield(State, -2, "Stdout");
+	
+	lua_pushlstring(State, Result.Stderr.data(), Result.Stderr.size());
+	lua_setfield(State, -2, "Stderr");
+	
+	lua_pushinteger(State, Result.ExitCode);
+	lua_setfield(State, -2, "ExitCode");
+	
+	lua_pushinteger(State, Result.Signal);
+	lua_setfield(State, -2, "Signal");
+	
+	lua_pushboolean(State, Result.TimedOut);
+	lua_setfield(State, -2, "TimedOut");
+	
+	lua_pushboolean(State, Result.Truncated);
+	lua_setfield(State, -2, "Truncated");
+	
+	return 1;
+}
+
+static int VLAPI_RecvStream(lua_State *State)
+{
+	const size_t ArgCount = lua_gettop(State);
+
+	bool PopAfterwards = true;
+	Jobs::Job *OurJob = nullptr;
+
+	if (ArgCount > 1 || (ArgCount == 1 && lua_type(State, 1) != LUA_TBOOLEAN))
+	{
+#ifdef DEBUG
+		puts("VLAPI_RecvStream(): Arguments mismatch, aborting.");
+#endif
+
+		goto EasyFail;
+
+	}
+
+	if (ArgCount) //They want to specify the boolean.
+	{
+		PopAfterwards = lua_toboolean(State, 1);
+	}
+
+	lua_getfield(State, LUA_REGISTRYINDEX, "VL_OrderStream");
+
+	if (lua_type(State, -1) == LUA_TTABLE)
+	{ //The order that started us. It's at the front of the line, same as when it sat in the read queue, but it's the same table our function got.
+		if (PopAfterwards)
+		{
+			lua_pushnil(State);
+			lua_setfield(State, LUA_REGISTRYINDEX, "VL_OrderStream");
+		}
+
+		lua_getfield(State, -1, "VL_INTRNL");
+
+		Conation::ConationStream *const Order = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
+
+		lua_pop(State, 1);
+
+		if (Order) Order->Rewind();
+
+		return 1;
+	}
+
+	lua_pop(State, 1);
+
+	OurJob = GetOurJob(State);
+
+	if (!OurJob)
+	{
+#ifdef DEBUG
+		puts("VLAPI_RecvStream(): No job to receive from, aborting.");
+#endif
+	EasyFail:
+		lua_pushnil(State);
+		return 1;
+	}
+	//Nothing left in the queue.
+
+	VLScopedPtr<Conation::ConationStream*> NewStream { OurJob->Read_Queue.Pop(PopAfterwards) };
+
+	if (!NewStream)
+	{
+#ifdef DEBUG
+		puts("VLAPI_RecvStream(): Failed to pop from read queue! Aborting.");
+#endif
+		goto EasyFail;
+	}
+
+	//Popped or not, NewStream is our own copy, so Lua can just have its buffer.
+	AdoptConationStreamToLua(State, NewStream);
+
+#ifdef DEBUG
+	puts(VLString("VLAPI_RecvStream(): Have table on stack: ") + ((lua_type(State, -1) == LUA_TTABLE) ? "true" : "false"));
+#endif
+
+	return 1;
+}
+
+static int VLAPI_SendStream(lua_State *State)
+{ /*By default the write queue takes the stream's buffer and the Lua stream is left with just its header, no arguments.
+	* Pass true as the second argument if you still need the contents afterwards, and you'll pay for a copy.*/
+	const size_t ArgCount = lua_gettop(State);
+
+	if (ArgCount < 1 || ArgCount > 2 || lua_type(State, 1) != LUA_TTABLE || (ArgCount == 2 && lua_type(State, 2) != LUA_TBOOLEAN))
+	{
+	EasyFail:
+		lua_settop(State, 0);
+		lua_pushboolean(State, false);
+		return 1;
+	}
+
+	lua_getfield(State, 1, "VL_INTRNL");
+
+	if (lua_type(State, -1) != LUA_TUSERDATA) goto EasyFail;
+
+	Conation::ConationStream *Stream = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
+
+	if (!Stream) goto EasyFail;
+
+	if (ArgCount == 2 && lua_toboolean(State, 2))
+	{
+		Main::PushStreamToWriteQueue(*Stream);
+	}
+	else
+	{
+		Conation::ConationStream::StreamHeader Hdr { Stream->GetHeader() };
+		Hdr.StreamArgsSize = 0;
+		
+		Main::PushStreamToWriteQueue(new Conation::ConationStream(std::move(*Stream)));
+		
+		//Leave something valid behind for the garbage collector and anybody who keeps using it.
+		Stream->~ConationStream();
+		new (Stream) Conation::ConationStream(Hdr, nullptr);
+	}
+
+	lua_pushboolean(State, true);
+	return 1;
+}
+
+static bool CloneConationStreamToLua(lua_State *State, Conation::ConationStream *Stream)
+{
+	lua_pushcfunction(State, NewLuaConationStream);
+	lua_pushlightuserdata(State, Stream);
+
+	if (lua_pcall(State, 1, 1, 0) != LUA_OK)
+	{ //Call NewLuaConationStream() to get a new copy for arguments. Whoever owns the state closes it.
+		return false;
+	}
+
+#ifdef DEBUG
+	puts(VLString("CloneConationStreamToLua(): Result is table: ") + ((lua_type(State, -1) == LUA_TTABLE) ? "true" : "false"));
+#endif
+
+	return lua_type(State, -1) == LUA_TTABLE;
+}
+
+static bool AdoptConationStreamToLua(lua_State *State, Conation::ConationStream *Stream)
+{ //Like CloneConationStreamToLua(), but moves the buffer into Lua instead of copying it.
+	//Stream is left empty on success, the caller still deletes it.
+	lua_pushcfunction(State, NewLuaConationStream);
+	lua_pushlightuserdata(State, Stream);
+	lua_pushboolean(State, true);
+
+	if (lua_pcall(State, 2, 1, 0) != LUA_OK)
+	{
+		return false;
+	}
+
+	return lua_type(State, -1) == LUA_TTABLE;
+}
+
+#ifndef NOCURL
+static int VLAPI_GetHTTP(lua_State *State)
+{
+	const size_t NumArgs = lua_gettop(State);
+
+	if (NumArgs < 1 || lua_type(State, 1) != LUA_TSTRING) //We at least need a URL.
+	{
+		lua_pushnil(State);
+		return 1;
+	}
+
+	std::shared_ptr<HTTPRequest> Request { new HTTPRequest };
+
+	Request->URL = lua_tostring(State, 1);
+
+	if (NumArgs >= 2 && lua_type(State, 2) == LUA_TNUMBER)
+	{ //Set number of attempts.
+		Request->Attempts = lua_tointeger(State, 2);
+	}
+
+	if (NumArgs >= 3 && lua_type(State, 3) == LUA_TSTRING)
+	{
+		Request->UserAgent = lua_tostring(State, 3);
+	}
+
+	if (NumArgs >= 4 && lua_type(State, 4) == LUA_TSTRING)
+	{
+		Request->Referrer = lua_tostring(State, 4);
+	}
+
+	if (NumArgs >= 5 && lua_type(State, 5) == LUA_TBOOLEAN)
+	{
+		Request->ReturnBlob = lua_toboolean(State, 5);
+	}
+
+	if (NumArgs >= 6 && lua_type(State, 6) == LUA_TBOOLEAN)
+	{ //Implies ReturnBlob.
+		Request->ReturnBuffer = lua_toboolean(State, 6);
+		Request->ReturnBlob |= Request->ReturnBuffer;
+	}
+
+	if (NumArgs >= 7 && lua_type(State, 7) == LUA_TNUMBER && lua_tointeger(State, 7) > 0)
+	{ //Parallel range requests for big stuff.
+		Request->Streams = lua_tointeger(State, 7);
+	}
+
+	if (NumArgs >= 8 && lua_type(State, 8) == LUA_TSTRING)
+	{ //SHA-512 to verify against.
+		Request->Sha512 = lua_tostring(State, 8);
+	}
+
+	lua_settop(State, 0);
+
+	if (GetScheduledTask(State))
+	{ //Fetch it on the side and let other scripts run in the meantime.
+		Request->FetchThread = new VLThreads::Thread((VLThreads::Thread::EntryFunc)HTTPFetchThreadFunc, Request.get());
+		Request->FetchThread->Start();
+
+		LuaWait Wait { LuaWait::WAIT_HTTP };
+		Wait.HTTP = Request;
+
+		return SuspendForWait(State, Wait);
+	}
+
+	Request->Result = PerformHTTPRequest(*Request);
+
+	return PushHTTPResult(State, *Request);
+}
+
+static bool PerformHTTPRequest(HTTPRequest &Request)
+{
+	Web::FetchOptions Options;
+	
+	Options.NumAttempts = Request.Attempts;
+	Options.UserAgent = Request.UserAgent ? +Request.UserAgent : nullptr;
+	Options.Referrer = Request.Referrer ? +Request.Referrer : nullptr;
+	Options.Streams = Request.Streams;
+	Options.Sha512 = Request.Sha512 ? +Request.Sha512 : nullptr;
+	Options.Cancel = &Request.Cancel;
+	
+	if (Request.ReturnBlob) return Web::GetHTTPToMemory(Request.URL, Request.Blob, Options);
+	
+	return Web::GetHTTP(Request.URL, &Request.FilePath, Options);
+}
+
+static void *HTTPFetchThreadFunc(HTTPRequest *Request)
+{
+	Request->Result = PerformHTTPRequest(*Request);
+	Request->Done = true;
+
+	Script::WakeScheduler();
+
+	return nullptr;
+}
+
+static int PushHTTPResult(lua_State *State, HTTPRequest &Request)
+{
+	if (Request.Result && (Request.ReturnBlob || Request.FilePath))
+	{
+		VLDEBUG("Succeeded in call to Web::GetHTTP().");
+
+		if (Request.ReturnBlob)
+		{
+			if (Request.ReturnBuffer) PushLuaBuffer(State, std::move(Request.Blob));
+			else lua_pushlstring(State, (const char*)Request.Blob.data(), Request.Blob.size());
+
+			return 1;
+		}
+
+		lua_pushstring(State, Request.FilePath);
+
+		return 1;
+	}
+
+	VLWARN("Failed in call to Web::GetHTTP()!");
+
+	return 0;
+}
+#endif //NOCURL
+
+static bool LoadVLAPI(lua_State *State)
+{
+#ifdef DEBUG
+	puts("Entered LoadVLAPI()");
+#endif
+
+	//First create the global API table.
+	lua_newtable(State);
+
+	VLString TableName("VL");
+
+	lua_setglobal(State, TableName);
+	lua_getglobal(State, TableName); //Cuz lua_setglobal popped it right off again.
+
+	/**All three of these things I'm registering probably belong in InitConationStreamBindings(),
+	 * but I didn't put them there because that's too much typing.
+	 * Would you prefer to type VL.ConationStream.STATUS_OK, or VL.STATUS_OK?
+	 **/
+#ifdef DEBUG
+	puts("LoadVLAPI(): Registering status codes");
+#endif
+	//Register status codes.
+	lua_pushstring(State, StatusCodeToString(STATUS_INVALID));
+	lua_pushinteger(State, STATUS_INVALID);
+	lua_settable(State, -3);
+
+#ifdef DEBUG
+	puts("LoadVLAPI(): Registered STATUS_INVALID");
+#endif
+
+	for (uint8_t Inc = 1; Inc && Inc <= STATUS_MAXPOPULATED; Inc <<= 1)
+	{
+		lua_pushstring(State, StatusCodeToString(static_cast<StatusCode>(Inc)));
+		lua_pushinteger(State, Inc);
+		lua_settable(State, -3);
+#ifdef DEBUG
+		puts("LoadVLAPI(): Ending status registration loop iteration");
+#endif
+
+	}
+
+#ifdef DEBUG
+	puts("LoadVLAPI(): Registering command codes");
+#endif
+	//Register command codes.
+	for (uint8_t Inc = 0; Inc < CMDCODE_MAX; ++Inc)
+	{
+		lua_pushstring(State, CommandCodeToString(static_cast<CommandCode>(Inc)));
+		lua_pushinteger(State, Inc);
+		lua_settable(State, -3);
+	}
+
+#ifdef DEBUG
+	puts("LoadVLAPI(): Registering conation argument types");
+#endif
+	//Register argument types.
+	lua_pushstring(State, ArgTypeToString(Conation::ARGTYPE_NONE));
+	lua_pushinteger(State, Conation::ARGTYPE_NONE);
+	lua_settable(State, -3);
+	for (Conation::ArgTypeUint Inc = 1; Inc && Inc <= Conation::ARGTYPE_MAXPOPULATED; Inc <<= 1)
+	{
+		lua_pushstring(State, ArgTypeToString(static_cast<Conation::ArgType>(Inc)));
+		lua_pushinteger(State, Inc);
+		lua_settable(State, -3);
+	}
+
+#ifdef DEBUG
+	puts("LoadVLAPI(): Registering API functions");
+#endif
+	//Register all API functions
+	for (const auto &Pair : VLAPIFuncs)
+	{
+		lua_pushcfunction(State, Pair.second);
+		lua_setfield(State, -2, Pair.first);
+	}
+
+#ifdef DEBUG
+	puts("LoadVLAPI(): made it past primary bindings, attempting to initialize conation stream bindings.");
+#endif
+
+	for (const auto &Pair : IntNameMap)
+	{
+		lua_pushinteger(State, Pair.first);
+		lua_setfield(State, -2, Pair.second);
+	}
+	
+	for (const auto &Pair : JobTypeMap)
+	{
+		lua_pushinteger(State, Pair.first);
+		lua_setfield(State, -2, Pair.second);
+	}
+
+	///Some constants we want. Technically belong in VL.ConationStream, but again, too much typing.
+	//Report bit
+	lua_pushstring(State, "IDENT_ISREPORT_BIT");
+	lua_pushinteger(State, Conation::IDENT_ISREPORT_BIT);
+
+	lua_settable(State, -3);
+
+	//Routine bit
+	lua_pushstring(State, "IDENT_ISROUTINE_BIT");
+	lua_pushinteger(State, Conation::IDENT_ISROUTINE_BIT);
+
+	lua_settable(State, -3);
+
+	//Node-to-node communications bit
+	lua_pushstring(State, "IDENT_ISN2N_BIT");
+	lua_pushinteger(State, Conation::IDENT_ISN2N_BIT);
+
+	lua_settable(State, -3);
+
+	//OS path separator
+	lua_pushstring(State, "ospathdiv");
+	lua_pushstring(State, PATH_DIVIDER_STRING);
+
+	lua_settable(State, -3);
+
+#ifdef LUAFFI
+
+	lua_pushcfunction(State, luaopen_cffi);
+
+	if (lua_pcall(State, 0, 1, 0) != LUA_OK)
+	{ //Try to continue if we fail, but warn us.
+		VLERROR("Failed to call luaopen_cffi!");
+		goto EndFFI;
+	}
+
+	lua_newtable(State); //Actual table.
+
+	//Metatable
+	lua_newtable(State);
+
+	lua_pushstring(State, "__index");
+	lua_pushvalue(State, -4); //Get the C module.
+
+	lua_settable(State, -3);
+
+	lua_setmetatable(State, -2);
+
+
+	lua_setglobal(State, "ffi"); //Sets the actual table as above.
+	lua_getglobal(State, "ffi");
+
+	//Get cffi.cdef on stack.
+	lua_pushstring(State, "cdef");
+	lua_gettable(State, -2);
+
+	lua_pushstring(State, LuaFFI_StaticPrelude);
+
+	//Init static bindings.
+	if (lua_pcall(State, 1, 0, 0) != LUA_OK)
+	{
+		VLERROR("Failed to set cffi static bindings!");
+		goto EndFFI;
+	}
+
+	//Set dynamic bindings.
+	for (const auto &Pair : LuaFFI_IntegerDefs)
+	{
+		lua_pushstring(State, Pair.first);
+		lua_pushinteger(State, Pair.second);
+
+		lua_settable(State, -3);
+	}
+
+	lua_pop(State, 2); //Important for InitConationStreamBindings.
+EndFFI:
+#endif //LUAFFI
+	InitConationStreamBindings(State);
+	InitBufferBindings(State);
+	return true;
+}
+
+static int LuaConationStreamGCFunc(lua_State *State)
+{
+	Conation::ConationStream *Ptr = static_cast<Conation::ConationStream*>(lua_touserdata(State, 1));
+
+	//Explicitly call the destructor.
+	Ptr->~ConationStream();
+
+	return 0;
+}
+
+static int NewLuaConationStream(lua_State *State)
+{ //Create a new instance of the class.
+	std::vector<decltype(LUA_TNONE)> BasicConstructorParams { LUA_TNUMBER, LUA_TNUMBER, LUA_TNUMBER };
+	std::vector<decltype(LUA_TNONE)> CloneStreamConstructorParams { LUA_TTABLE };
+	std::vector<decltype(LUA_TNONE)> CBasedCloneConstructorParams { LUA_TLIGHTUSERDATA };
+	std::vector<decltype(LUA_TNONE)> CBasedAdoptConstructorParams { LUA_TLIGHTUSERDATA, LUA_TBOOLEAN };
+	std::vector<decltype(LUA_TNONE)> ByteStringConstructorParams { LUA_TSTRING };
+	struct
+	{
+		CommandCode CmdCode;
+		uint8_t Flags;
+		uint64_t Ident;
+		Conation::ConationStream *ToClone;
+		Conation::ConationStream *ToAdopt;
+		const uint8_t *StringBuffer;
+	} Args{};
+
+	if (VerifyLuaFuncArgs(State, BasicConstructorParams))
+	{ //Standard constructor.
+		const lua_Integer Code = lua_tointeger(State, 1);
+
+		if (Code < CMDCODE_INVALID || Code > CMDCODE_MAX)
+		{ //Invalid value.
+			lua_settop(State, 0);
+			lua_pushnil(State);
+			return 1;
+		}
+
+		Args.CmdCode = static_cast<CommandCode>(Code);
+		Args.Flags = lua_tointeger(State, 2);
+		Args.Ident = lua_tointeger(State, 3);
+	}
+	else if (VerifyLuaFuncArgs(State, ByteStringConstructorParams))
+	{ //Create a new stream from a binary string.
+		Args.StringBuffer = reinterpret_cast<const uint8_t*>(lua_tostring(State, 1));
+	}
+	else if (VerifyLuaFuncArgs(State, CloneStreamConstructorParams))
+	{ //Cloning one.
+
+		//Get the userdata pointer we've got here.
+		lua_pushstring(State, "VL_INTRNL");
+		lua_gettable(State, 1);
+
+		if (lua_type(State, -1) != LUA_TUSERDATA)
+		{ //Wh, why?
+			lua_settop(State, 0);
+			lua_pushnil(State);
+			return 1;
+		}
+		Args.ToClone = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
+	}
+	else if (VerifyLuaFuncArgs(State, CBasedCloneConstructorParams))
+	{
+		Args.ToClone = static_cast<Conation::ConationStream*>(lua_touserdata(State, 1));
+	}
+	else if (VerifyLuaFuncArgs(State, CBasedAdoptConstructorParams) && lua_toboolean(State, 2))
+	{ //AdoptConationStreamToLua() uses this. We steal the buffer instead of copying it.
+		Args.ToAdopt = static_cast<Conation::ConationStream*>(lua_touserdata(State, 1));
+	}
+	else
+	{ //The user is retarded.
+		lua_settop(State, 0);
+		lua_pushnil(State);
+		return 1;
+	}
+
+	/**Do NOT wipe the stack here, we need that Args.StringBuffer Lua string intact in case we're making
+	* it from a string, and if we just reuse that Lua string, it prevents a potentially very expensive copy operation!
+	**/
+
+	//Find the class template table cuz we'll nee d it later and it's actually better to put it here.
+	lua_getglobal(State, "VL");
+
+	//Create the new instance table.
+	lua_newtable(State);
+
+	//Create its metatable.
+	lua_newtable(State);
+
+	///Populate the metatable.
+
+	//Index metamethod.
+	lua_pushstring(State, "__index");
+	//Puts the class template table on the stack.
+	lua_pushstring(State, "ConationStream");
+	lua_gettable(State, -5); ///Goes all the way up to that getglobal wayyy up there.
+	//Set the __index metamethod.
+	lua_settable(State, -3);
+
+	//Length operator support, get number of arguments.
+	lua_pushstring(State, "__len");
+	lua_pushcfunction(State, CountCSArgsLua);
+
+	lua_settable(State, -3);
+
+	///Now set the metatable. This pops the metatable afterwards.
+	lua_setmetatable(State, -2);
+
+	//Finally. This metatable code hurt to write.
+
+	Conation::ConationStream *Stream = static_cast<Conation::ConationStream*>(lua_newuserdata(State, sizeof(Conation::ConationStream)));
+
+	//We check which are defined in the Args struct to see what we need to do.
+	if (Args.StringBuffer)
+	{
+		try
+		{
+			new (Stream) Conation::ConationStream(Args.StringBuffer);
+			VLDEBUG("Successfully allocated ConationStream from Lua string with command code"
+					+ Stream->GetCommandCode());
+		}
+		catch (const Conation::ConationStream::Err_Base &)
+		{
+			VLWARN("Failed to allocate ConationStream from Lua string!");
+			return 0;
+		}
+	}
+	else if (Args.ToClone)
+	{
+		new (Stream) Conation::ConationStream(Args.ToClone->GetHeader(), Args.ToClone->GetArgData());
+	}
+	else if (Args.ToAdopt)
+	{ //Rewind first so it reads the same as a clone would.
+		Args.ToAdopt->Rewind();
+		new (Stream) Conation::ConationStream(std::move(*Args.ToAdopt));
+	}
+	else
+	{
+		new (Stream) Conation::ConationStream(Args.CmdCode, Args.Flags, Args.Ident);
+	}
+
+
+	//Setting the internal userdata now.
+	lua_pushstring(State, "VL_INTRNL");
+	lua_pushvalue(State, -2);
+	lua_settable(State, -4);
+
+	//Userdata's metatable.
+	lua_newtable(State);
+
+	//Garbage collection function for metatable.
+	lua_pushstring(State, "__gc");
+	lua_pushcfunction(State, LuaConationStreamGCFunc);
+	lua_settable(State, -3);
+
+	///Setting the userdata's metatable finally.
+	lua_setmetatable(State, -2);
+
+	lua_pop(State, 1); //Now that we've stored the userdata, get rid of it so we return only the instance table.
+	return 1;
+}
+
+static int BuildCSResponse_Lua(lua_State *State)
+{
+	if (!VerifyLuaFuncArgs(State, { LUA_TTABLE }))
+	{
+		return 0;
+	}
+
+	lua_getfield(State, -1, "VL_INTRNL");
+
+	if (lua_type(State, -1) != LUA_TUSERDATA) return 0;
+
+	const Conation::ConationStream *const OriginalPtr = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
+
+	if (!OriginalPtr) return 0;
+
+	Conation::ConationStream::StreamHeader Hdr { OriginalPtr->GetHeader() };
+
+	Conation::ConationStream Original { Hdr, OriginalPtr->GetArgData() };
+
+	//Make it into a report
+	Hdr.CmdIdentFlags |= Conation::IDENT_ISREPORT_BIT;
+	Hdr.StreamArgsSize = 0;
+
+	//New stream we're gonna use.
+	Conation::ConationStream New { Hdr };
+
+	lua_settop(State, 0);
+
+	VLScopedPtr<Conation::ConationStream::BaseArg*> Arg { Original.PopArgument(true) }; //Peek only
+
+	if (Arg && Arg->Type == Conation::ARGTYPE_ODHEADER)
+	{
+		Conation::ConationStream::ODHeaderArg *ODArg = static_cast<Conation::ConationStream::ODHeaderArg*>(+Arg);
+		//Invert origin/destination
+		New.Push_ODHeader(ODArg->Hdr.Destination, ODArg->Hdr.Origin);
+		VLDEBUG("Using OD Destination " +ODArg->Hdr.Destination + " and origin " + +ODArg->Hdr.Origin);
+	}
+
+	AdoptConationStreamToLua(State, &New);
+
+	return 1;
+}
+
+static int GetCSHeader_Lua(lua_State *State)
+{
+	if (!VerifyLuaFuncArgs(State, { LUA_TTABLE}))
+	{
+	EasyFail:
+		lua_settop(State, 0);
+		lua_pushnil(State);
+		return 1;
+	}
+
+	lua_pushstring(State, "VL_INTRNL");
+	lua_gettable(State, 1);
+
+	if (lua_type(State, -1) != LUA_TUSERDATA) goto EasyFail;
+
+	Conation::ConationStream *Stream = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
+
+	if (!Stream) goto EasyFail;
+
+	lua_settop(State, 0);
+
+	const Conation::ConationStream::StreamHeader Hdr = Stream->GetHeader();
+
+	//We return this in a table.
+	lua_newtable(State);
+
+	lua_pushstring(State, "ArgsSize");
+	lua_pushinteger(State, Hdr.StreamArgsSize);
+	lua_settable(State, -3);
+
+	lua_pushstring(State, "Flags");
+	lua_pushinteger(State, Hdr.CmdIdentFlags);
+	lua_settable(State, -3);
+
+	lua_pushstring(State, "Ident");
+	lua_pushinteger(State, Hdr.CmdIdent);
+	lua_settable(State, -3);
+
+	lua_pushstring(State, "CmdCode");
+	lua_pushinteger(State, Hdr.CmdCode);
+	lua_settable(State, -3);
+
+	return 1;
+}
+
+static int GetCSArgsList_Lua(lua_State *State)
+{
+	const size_t ArgCount = lua_gettop(State);
+
+	if (ArgCount != 1 || lua_type(State, 1) != LUA_TTABLE)
+	{
+	EasyFail:
+		lua_settop(State, 0);
+		lua_pushnil(State);
+		return 1;
+	}
+
+	lua_pushstring(State, "VL_INTRNL");
+	lua_gettable(State, 1);
+
+	if (lua_type(State, -1) != LUA_TUSERDATA) goto EasyFail;
+
+	Conation::ConationStream *Stream = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
+
+	if (!Stream) goto EasyFail;
+
+	lua_settop(State, 0); //We don't need anything else on the stack now.
+
+	lua_newtable(State);
+
+	VLScopedPtr<std::vector<Conation::ArgType>* > Args { Stream->GetArgTypes() };
+
+	for (size_t Inc = 0; Inc < Args->size(); ++Inc)
+	{
+		lua_pushinteger(State, Inc + 1);
+		lua_pushinteger(State, Args->at(Inc));
+		lua_settable(State, 1);
+	}
+
+	return 1;
+}
+
+static int PushArg_LuaConationStream(lua_State *State)
+{
+	const size_t ArgCount = lua_gettop(State);
+
+	/* First argument is our implicit self parameter that should be a table,
+	 * second argument is an integer mapping to an ArgType specifying the argument type,
+	 * third argument is the value. We can have more than 3 for some argument types.
+	 */
+	if (ArgCount < 3 || lua_type(State, 1) != LUA_TTABLE ||
+		lua_type(State, 2) != LUA_TNUMBER)
+	{
+	EasyFail:
+		lua_settop(State, 0);
+		lua_pushboolean(State, false);
+		return 1;
+	}
+
+	lua_pushstring(State, "VL_INTRNL");
+	lua_gettable(State, 1); //Get the userdata from our implicit self argument.
+
+	if (lua_type(State, -1) != LUA_TUSERDATA) goto EasyFail;
+
+	Conation::ConationStream *Stream = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
+
+	lua_pop(State, 1); //We got what we need, pop the userdata off.
+
+	if (lua_tointeger(State, 2) < 0 || lua_tointeger(State, 2) > Conation::ARGTYPE_MAXPOPULATED) goto EasyFail; //Wrong kind of integer.
+
+	Conation::ArgType Type = static_cast<Conation::ArgType>(lua_tointeger(State, 2));
+
+	switch (Type)
+	{
+		case Conation::ARGTYPE_NETCMDSTATUS:
+		{
+
+			if (lua_tointeger(State, 3) < 0 || lua_tointeger(State, 3) > STATUS_MAXPOPULATED) goto EasyFail;
+
+			const StatusCode Code = static_cast<StatusCode>(lua_tointeger(State, 3));
+
+			VLString Msg;
+			if (ArgCount == 4) //We have a message string specified.
+			{
+				if (lua_type(State, 4) != LUA_TSTRING) goto EasyFail; //The user is 'special'.
+				Msg = lua_tostring(State, 4);
+			}
+			else if (ArgCount > 4) goto EasyFail;
+
+			NetCmdStatus Status(Code == STATUS_OK || Code == STATUS_WARN, Code, Msg ? +Msg : nullptr);
+
+			Stream->Push_NetCmdStatus(Status);
+			break;
+		}
+		case Conation::ARGTYPE_BOOL:
+		{
+			if (ArgCount > 3 || lua_type(State, 3) != LUA_TBOOLEAN) goto EasyFail;
+
+			Stream->Push_Bool(lua_toboolean(State, 3));
+			break;
+		}
+		case Conation::ARGTYPE_STRING:
+		{
+			if (ArgCount > 3 || lua_type(State, 3) != LUA_TSTRING) goto EasyFail;
+
+			Stream->Push_String(lua_tostring(State, 3));
+			break;
+		}
+		case Conation::ARGTYPE_SCRIPT:
+		{
+			if (ArgCount > 3 || lua_type(State, 3) != LUA_TSTRING) goto EasyFail;
+
+			Stream->Push_Script(lua_tostring(State, 3));
+			break;
+		}
+		case Conation::ARGTYPE_FILEPATH:
+		{
+			if (ArgCount > 3 || lua_type(State, 3) != LUA_TSTRING) goto EasyFail;
+
+			Stream->Push_FilePath(lua_tostring(State, 3));
+			break;
+		}
+		case Conation::ARGTYPE_INT32:
+		{
+			if (ArgCount > 3 || lua_type(State, 3) != LUA_TNUMBER) goto EasyFail;
+
+			Stream->Push_Int32(lua_tointeger(State, 3));
+			break;
+		}
+		case Conation::ARGTYPE_UINT32:
+		{
+			if (ArgCount > 3 || lua_type(State, 3) != LUA_TNUMBER) goto EasyFail;
+
+			Stream->Push_Uint32(lua_tointeger(State, 3));
+			break;
+		}
+		case Conation::ARGTYPE_INT64:
+		{
+			if (ArgCount > 3 || lua_type(State, 3) != LUA_TNUMBER) goto EasyFail;
+
+			Stream->Push_Int64(lua_tointeger(State, 3));
+			break;
+		}
+		case Conation::ARGTYPE_UINT64:
+		{
+			if (ArgCount > 3 || lua_type(State, 3) != LUA_TNUMBER) goto EasyFail;
+
+			Stream->Push_Uint64(lua_tointeger(State, 3));
+			break;
+		}
+		case Conation::ARGTYPE_ODHEADER:
+		{
+			if (ArgCount != 4 || lua_type(State, 3) != LUA_TSTRING || lua_type(State, 4) != LUA_TSTRING) goto EasyFail;
+
+			Stream->Push_ODHeader(lua_tostring(State, 3), lua_tostring(State, 4));
+			break;
+		}
+		case Conation::ARGTYPE_FILE:
+		{
+			if (ArgCount == 3)
+			{ //It's a file path.
+				if (lua_type(State, 3) != LUA_TSTRING) goto EasyFail;
+
+				Stream->Push_File(lua_tostring(State, 3));
+			}
+			else if (ArgCount == 4)
+			{ //Data can be a string, a VL.Buffer or a view from Stream:PopView().
+				size_t BytestreamSize = 0;
+				const uint8_t *Bytestream = GetLuaBytes(State, 4, &BytestreamSize);
+
+				if (lua_type(State, 3) != LUA_TSTRING || !Bytestream) goto EasyFail;
+
+				VLString Filename = lua_tostring(State, 3);
+
+				Stream->Push_File(Filename, Bytestream, BytestreamSize);
+			}
+			else goto EasyFail;
+			break;
+		}
+		case Conation::ARGTYPE_BINSTREAM:
+		{
+			size_t BinStreamLength = 0;
+
+			const void *BinStream = GetLuaBytes(State, 3, &BinStreamLength);
+
+			if (ArgCount > 3 || !BinStream) goto EasyFail;
+
+			Stream->Push_BinStream(BinStream, BinStreamLength);
+			break;
+		}
+		default:
+			goto EasyFail; //Invalid value.
+	}
+
+	lua_settop(State, 0);
+	lua_pushboolean(State, true);
+#ifdef DEBUG
+	puts(VLString("PushArg_LuaConationStream(): Push successful for value of type ") + ArgTypeToString(Type));
+#endif
+	return 1;
+}
+
+static int PopArg_LuaConationStream(lua_State *State)
+{
+	return PopArg_Subfunction(State, POPARG_STRING);
+}
+
+static int PopArgView_LuaConationStream(lua_State *State)
+{ //Same as Pop, but FILE and BINSTREAM data comes back as a view into the stream instead of a fresh Lua string.
+	return PopArg_Subfunction(State, POPARG_VIEW);
+}
+
+static int PopArgBuffer_LuaConationStream(lua_State *State)
+{ //Same as Pop, but FILE and BINSTREAM data comes back as a VL.Buffer you can modify.
+	return PopArg_Subfunction(State, POPARG_BUFFER);
+}
+
+static int PopArg_Subfunction(lua_State *State, const PopArgMode Mode)
+{
+	const size_t OldStackTop = lua_gettop(State);
+
+	if (lua_type(State, -1) != LUA_TTABLE)
+	{
+		VLDEBUG("Invalid first argument is not a table");
+	EasyFail:
+		lua_settop(State, OldStackTop);
+		return 0;
+	}
+
+	//Get the userdata.
+	lua_getfield(State, -1, "VL_INTRNL");
+
+	if (lua_type(State, -1) != LUA_TUSERDATA)
+	{
+		VLDEBUG("No userdata found");
+		goto EasyFail;
+	}
+
+	Conation::ConationStream *Stream = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
+
+	lua_settop(State, OldStackTop);
+
+	if (!Stream)
+	{
+		VLDEBUG("Failed to decode userdata");
+		goto EasyFail;
+	}
+
+	//No arguments.
+	if (!Stream->CountArguments())
+	{
+		VLDEBUG("No arguments in stream at all, rewound or otherwise");
+		goto EasyFail;
+	}
+
+	VLScopedPtr<Conation::ConationStream::BaseArg*> Arg { Stream->PopArgument() };
+
+	if (!Arg)
+	{
+		VLDEBUG("No arguments left");
+		goto EasyFail;
+	}
+
+	//We also need to return the string name of the argument type for our first return value.
+	lua_pushinteger(State, Arg->Type);
+
+	switch (Arg->Type)
+	{
+		case Conation::ARGTYPE_BOOL:
+		{
+			lua_pushboolean(State, Arg->ReadAs<Conation::ConationStream::BoolArg>().Value);
+			break;
+		}
+		case Conation::ARGTYPE_FILE:
+		{
+			const Conation::ConationStream::FileArg *File = &Arg->ReadAs<Conation::ConationStream::FileArg>();
+
+			lua_pushstring(State, File->Filename);
+			
+			if (Mode == POPARG_VIEW && !File->MustFree)
+			{ //Data points right into the stream's buffer, so just hand out where it is.
+				lua_getfield(State, OldStackTop, "VL_INTRNL");
+				PushStreamView(State, lua_gettop(State), File->Data - Stream->GetData().data(), File->DataSize);
+				lua_remove(State, -2);
+			}
+			else if (Mode == POPARG_BUFFER)
+			{
+				PushLuaBuffer(State, std::vector<uint8_t>(File->Data, File->Data + File->DataSize));
+			}
+			else lua_pushlstring(State, (const char*)File->Data, File->DataSize);
+
+			break;
+		}
+		case Conation::ARGTYPE_BINSTREAM:
+		{
+			const Conation::ConationStream::BinStreamArg *BinStream = &Arg->ReadAs<Conation::ConationStream::BinStreamArg>();
+
+			if (Mode == POPARG_VIEW && !BinStream->MustFree)
+			{
+				lua_getfield(State, OldStackTop, "VL_INTRNL");
+				PushStreamView(State, lua_gettop(State), BinStream->Data - Stream->GetData().data(), BinStream->DataSize);
+				lua_remove(State, -2);
+			}
+			else if (Mode == POPARG_BUFFER)
+			{
+				PushLuaBuffer(State, std::vector<uint8_t>(BinStream->Data, BinStream->Data + BinStream->DataSize));
+			}
+			else lua_pushlstring(State, (const char*)BinStream->Data, BinStream->DataSize);
+			break;
+		}
+		case Conation::ARGTYPE_FILEPATH:
+		{
+			lua_pushstring(State, Arg->ReadAs<Conation::ConationStream::FilePathArg>().Path);
+			break;
+		}
+		case Conation::ARGTYPE_STRING:
+		{
+			lua_pushstring(State, Arg->ReadAs<Conation::ConationStream::StringArg>().String);
+			break;
+		}
+		case Conation::ARGTYPE_SCRIPT:
+		{
+			lua_pushstring(State, Arg->ReadAs<Conation::ConationStream::ScriptArg>().String);
+			break;
+		}
+		case Conation::ARGTYPE_INT32:
+		{
+			lua_pushinteger(State, Arg->ReadAs<Conation::ConationStream::Int32Arg>().Value);
+			break;
+		}
+		case Conation::ARGTYPE_UINT32:
+		{
+			lua_pushinteger(State, Arg->ReadAs<Conation::ConationStream::Uint32Arg>().Value);
+			break;
+		}
+		case Conation::ARGTYPE_INT64:
+		case Conation::ARGTYPE_UINT64: //Because Lua's only integer type is 64-bit signed, we just have to hope it fits.
+		{
+			lua_pushinteger(State, Arg->ReadAs<Conation::ConationStream::Int64Arg>().Value);
+			break;
+		}
+		case Conation::ARGTYPE_NETCMDSTATUS:
+		{
+			const Conation::ConationStream::NetCmdStatusArg *Status = &Arg->ReadAs<Conation::ConationStream::NetCmdStatusArg>();
+
+			lua_pushboolean(State, Status->Code == STATUS_OK || Status->Code == STATUS_WARN); //Cuz sometimes we just wanna know if it worked.
+			lua_pushinteger(State, Status->Code);
+			lua_pushstring(State, Status->Msg);
+			break;
+		}
+		case Conation::ARGTYPE_ODHEADER:
+		{
+			const Conation::ConationStream::ODHeader &Hdr = Arg->ReadAs<Conation::ConationStream::ODHeaderArg>().Hdr;
+
+			lua_pushstring(State, Hdr.Origin);
+			lua_pushstring(State, Hdr.Destination);
+			break;
+		}
+		default:
+			//Unknown value type.
+			VLDEBUG("Unknown value type " + VLString::IntToString(Arg->Type));
+			goto EasyFail;
+	}
+
+	VLDEBUG("Success, returning");
+	//Aaaand this is why the stack needs to be empty before we start returning arguments.
+	return lua_gettop(State) - OldStackTop;
+
+}
+
+static int PushStreamView(lua_State *State, const int ParentIndex, const size_t Offset, const size_t Length)
+{ //ParentIndex must be an absolute stack index of a ConationStream userdata (VL_INTRNL).
+	LuaStreamView *View = static_cast<LuaStreamView*>(lua_newuserdata(State, sizeof(LuaStreamView)));
+
+	View->Offset = Offset;
+	View->Length = Length;
+
+	//Keep the parent alive for as long as we are.
+	lua_newtable(State);
+	lua_pushvalue(State, ParentIndex);
+	lua_rawseti(State, -2, 1);
+	lua_setuservalue(State, -2);
+
+	if (luaL_newmetatable(State, LUA_STREAMVIEW_METATABLE))
+	{ //First view for this state, populate the metatable.
+		lua_newtable(State);
+
+		lua_pushcfunction(State, StreamView_Length);
+		lua_setfield(State, -2, "Length");
+
+		lua_pushcfunction(State, StreamView_Slice);
+		lua_setfield(State, -2, "Slice");
+
+		lua_pushcfunction(State, StreamView_ToString);
+		lua_setfield(State, -2, "ToString");
+
+		lua_pushcfunction(State, StreamView_Byte);
+		lua_setfield(State, -2, "Byte");
+
+		lua_pushcfunction(State, StreamView_WriteFile);
+		lua_setfield(State, -2, "WriteFile");
+
+		lua_pushcfunction(State, StreamView_ToBuffer);
+		lua_setfield(State, -2, "ToBuffer");
+
+		lua_setfield(State, -2, "__index");
+
+		lua_pushcfunction(State, StreamView_Length);
+		lua_setfield(State, -2, "__len");
+
+		lua_pushcfunction(State, StreamView_ToString);
+		lua_setfield(State, -2, "__tostring");
+	}
+
+	lua_setmetatable(State, -2);
+
+	return 1;
+}
+
+static const uint8_t *GetStreamViewData(lua_State *State, const int Index, size_t *LengthOut)
+{ //Returns nullptr if it's not a view, or if the parent stream got sent off or shrunk since.
+	if (lua_type(State, Index) != LUA_TUSERDATA || !lua_getmetatable(State, Index)) return nullptr;
+
+	luaL_getmetatable(State, LUA_STREAMVIEW_METATABLE);
+
+	const bool IsView = lua_rawequal(State, -1, -2);
+
+	lua_pop(State, 2);
+
+	if (!IsView) return nullptr;
+
+	const LuaStreamView *View = static_cast<const LuaStreamView*>(lua_touserdata(State, Index));
+
+	lua_getuservalue(State, Index);
+	lua_rawgeti(State, -1, 1);
+
+	const Conation::ConationStream *Parent = static_cast<const Conation::ConationStream*>(lua_touserdata(State, -1));
+
+	lua_pop(State, 2);
+
+	if (!Parent) return nullptr;
+
+	const std::vector<uint8_t> &Bytes = Parent->GetData();
+
+	if (View->Offset > Bytes.size() || View->Length > Bytes.size() - View->Offset)
+	{
+		VLDEBUG("Stream view no longer fits its parent");
+		return nullptr;
+	}
+
+	if (LengthOut) *LengthOut = View->Length;
+
+	return Bytes.data() + View->Offset;
+}
+
+static int StreamView_Length(lua_State *State)
+{
+	size_t Length = 0;
+
+	if (!GetStreamViewData(State, 1, &Length)) return 0;
+
+	lua_pushinteger(State, Length);
+	return 1;
+}
+
+static int StreamView_Slice(lua_State *State)
+{ //view:Slice(Start, [Length]), Start is one-based like string.sub(). No copying, you just get a smaller view.
+	size_t Length = 0;
+
+	if (!GetStreamViewData(State, 1, &Length) || lua_type(State, 2) != LUA_TNUMBER ||
+		(lua_gettop(State) > 2 && lua_type(State, 3) != LUA_TNUMBER))
+	{
+		lua_pushnil(State);
+		return 1;
+	}
+
+	const lua_Integer Start = lua_tointeger(State, 2);
+
+	if (Start < 1 || static_cast<size_t>(Start) > Length + 1)
+	{
+		lua_pushnil(State);
+		return 1;
+	}
+
+	size_t SliceLength = Length - (Start - 1);
+
+	if (lua_gettop(State) > 2)
+	{
+		const lua_Integer Wanted = lua_tointeger(State, 3);
+
+		if (Wanted < 0)
+		{
+			lua_pushnil(State);
+			return 1;
+		}
+
+		if (static_cast<size_t>(Wanted) < SliceLength) SliceLength = Wanted;
+	}
+
+	const LuaStreamView *View = static_cast<const LuaStreamView*>(lua_touserdata(State, 1));
+
+	lua_getuservalue(State, 1);
+	lua_rawgeti(State, -1, 1);
+
+	PushStreamView(State, lua_gettop(State), View->Offset + (Start - 1), SliceLength);
+
+	return 1;
+}
+
+static int StreamView_ToString(lua_State *State)
+{ //The one place you pay for a copy, so only do it if you actually need a string.
+	size_t Length = 0;
+
+	const uint8_t *Data = GetStreamViewData(State, 1, &Length);
+
+	if (!Data) return 0;
+
+	lua_pushlstring(State, (const char*)Data, Length);
+	return 1;
+}
+
+static int StreamView_Byte(lua_State *State)
+{ //view:Byte(Position), one-based.
+	size_t Length = 0;
+
+	const uint8_t *Data = GetStreamViewData(State, 1, &Length);
+
+	if (!Data || lua_type(State, 2) != LUA_TNUMBER) return 0;
+
+	const lua_Integer Position = lua_tointeger(State, 2);
+
+	if (Position < 1 || static_cast<size_t>(Position) > Length) return 0;
+
+	lua_pushinteger(State, Data[Position - 1]);
+	return 1;
+}
+
+static int StreamView_WriteFile(lua_State *State)
+{ //view:WriteFile(Path), straight from the stream's buffer to disk.
+	size_t Length = 0;
+
+	const uint8_t *Data = GetStreamViewData(State, 1, &Length);
+
+	if (!Data || lua_type(State, 2) != LUA_TSTRING)
+	{
+		lua_pushboolean(State, false);
+		return 1;
+	}
+
+	lua_pushboolean(State, Utils::WriteFile(lua_tostring(State, 2), Data, Length));
+	return 1;
+}
+
+static int StreamView_ToBuffer(lua_State *State)
+{ //Copies the view into a VL.Buffer you can modify.
+	size_t Length = 0;
+
+	const uint8_t *Data = GetStreamViewData(State, 1, &Length);
+
+	if (!Data) return 0;
+
+	PushLuaBuffer(State, std::vector<uint8_t>(Data, Data + Length));
+	return 1;
+}
+
+static void InitBufferBindings(lua_State *State)
+{ //Expects the VL table on top of the stack, same as InitConationStreamBindings().
+	lua_newtable(State);
+
+	lua_pushcfunction(State, Buffer_New);
+	lua_setfield(State, -2, "New");
+
+	lua_setfield(State, -2, "Buffer");
+}
+
+static std::vector<uint8_t> *PushLuaBuffer(lua_State *State, std::vector<uint8_t> &&Data)
+{ //Pushes a new VL.Buffer that takes Data's storage, and returns where it lives so you can fill it in.
+	std::vector<uint8_t> *Buffer = static_cast<std::vector<uint8_t>*>(lua_newuserdata(State, sizeof(std::vector<uint8_t>)));
+
+	new (Buffer) std::vector<uint8_t>(std::move(Data));
+	
+	//It's already allocated, so this can't fail. If it puts us over, the script's next allocation will.
+	ChargeLuaBuffer(State, 0, Buffer->size(), true);
+
+	if (luaL_newmetatable(State, LUA_BUFFER_METATABLE))
+	{ //First buffer for this state, populate the metatable.
+		static const std::pair<const char*, lua_CFunction> Methods[] =
+		{
+			{ "Length", Buffer_Length },
+			{ "Sub", Buffer_Sub },
+			{ "Write", Buffer_Write },
+			{ "Append", Buffer_Append },
+			{ "Resize", Buffer_Resize },
+			{ "Find", Buffer_Find },
+			{ "Byte", Buffer_Byte },
+			{ "SetByte", Buffer_SetByte },
+			{ "Pack", Buffer_Pack },
+			{ "Unpack", Buffer_Unpack },
+			{ "ToString", Buffer_ToString },
+		};
+
+		lua_newtable(State);
+
+		for (const auto &Pair : Methods)
+		{
+			lua_pushcfunction(State, Pair.second);
+			lua_setfield(State, -2, Pair.first);
+		}
+
+		lua_setfield(State, -2, "__index");
+
+		lua_pushcfunction(State, Buffer_Length);
+		lua_setfield(State, -2, "__len");
+
+		lua_pushcfunction(State, Buffer_ToString);
+		lua_setfield(State, -2, "__tostring");
+
+		lua_pushcfunction(State, LuaBufferGCFunc);
+		lua_setfield(State, -2, "__gc");
+	}
+
+	lua_setmetatable(State, -2);
+
+	return Buffer;
+}
+
+static std::vector<uint8_t> *GetLuaBuffer(lua_State *State, const int Index)
+{ //nullptr if it's not a VL.Buffer.
+	if (lua_type(State, Index) != LUA_TUSERDATA || !lua_getmetatable(State, Index)) return nullptr;
+
+	luaL_getmetatable(State, LUA_BUFFER_METATABLE);
+
+	const bool IsBuffer = lua_rawequal(State, -1, -2);
+
+	lua_pop(State, 2);
+
+	return IsBuffer ? static_cast<std::vector<uint8_t>*>(lua_touserdata(State, Index)) : nullptr;
+}
+
+static const uint8_t *GetLuaBytes(lua_State *State, const int Index, size_t *LengthOut)
+{ //Anything we accept as binary data: strings, VL.Buffer objects and stream views. Nothing gets copied.
+	if (lua_type(State, Index) == LUA_TSTRING)
+	{
+		return reinterpret_cast<const uint8_t*>(lua_tolstring(State, Index, LengthOut));
+	}
+
+	if (const std::vector<uint8_t> *Buffer = GetLuaBuffer(State, Index))
+	{
+		static const uint8_t Empty = 0; //So an empty buffer isn't mistaken for a failure.
+
+		*LengthOut = Buffer->size();
+		return Buffer->empty() ? &Empty : Buffer->data();
+	}
+
+	return GetStreamViewData(State, Index, LengthOut);
+}
+
+static int LuaBufferGCFunc(lua_State *State)
+{
+	std::vector<uint8_t> *Buffer = static_cast<std::vector<uint8_t>*>(lua_touserdata(State, 1));
+
+	ChargeLuaBuffer(State, Buffer->size(), 0, true);
+	
+	typedef std::vector<uint8_t> ByteVector;
+	Buffer->~ByteVector();
+
+	return 0;
+}
+
+static bool ResizeLuaBuffer(lua_State *State, std::vector<uint8_t> &Buffer, const uint64_t NewSize)
+{ /*False if it'd be too big, go over the state's memory limit, or we're out of memory.
+	* Never throws, since an exception can't get back out through Lua, so callers luaL_error() instead.
+	* Buffer has to be one that belongs to State, since it's charged to State's arena.*/
+	if (NewSize > LUA_BUFFER_MAX_SIZE) return false;
+
+	const uint64_t OldSize = Buffer.size();
+
+	if (!ChargeLuaBuffer(State, OldSize, NewSize)) return false;
+
+	try
+	{
+		Buffer.resize(NewSize);
+	}
+	catch (const std::bad_alloc &)
+	{
+		ChargeLuaBuffer(State, NewSize, OldSize, true);
+		return false;
+	}
+	catch (const std::length_error &)
+	{
+		ChargeLuaBuffer(State, NewSize, OldSize, true);
+		return false;
+	}
+
+	return true;
+}
+
+static int Buffer_New(lua_State *State)
+{ //VL.Buffer.New([SizeOrData]), a number gets you that many zeroes, anything GetLuaBytes() takes gets copied.
+	if (!lua_gettop(State))
+	{
+		PushLuaBuffer(State, std::vector<uint8_t>());
+		return 1;
+	}
+
+	//Pushed empty first and grown in place, so it's charged to us like any other resize.
+	if (lua_type(State, 1) == LUA_TNUMBER)
+	{
+		const lua_Integer Size = lua_tointeger(State, 1);
+
+		if (Size < 0) return 0;
+
+		std::vector<uint8_t> *NewBuffer = PushLuaBuffer(State, std::vector<uint8_t>());
+
+		if (!ResizeLuaBuffer(State, *NewBuffer, Size)) return luaL_error(State, "Buffer would be too big, or we're out of memory");
+
+		return 1;
+	}
+
+	size_t Length = 0;
+	const uint8_t *Data = GetLuaBytes(State, 1, &Length);
+
+	if (!Data) return 0;
+
+	std::vector<uint8_t> *NewBuffer = PushLuaBuffer(State, std::vector<uint8_t>());
+
+	if (!ResizeLuaBuffer(State, *NewBuffer, Length)) return luaL_error(State, "Buffer would be too big, or we're out of memory");
+
+	if (Length) memcpy(NewBuffer->data(), Data, Length);
+
+	return 1;
+}
+
+static int Buffer_Length(lua_State *State)
+{
+	const std::vector<uint8_t> *Buffer = GetLuaBuffer(State, 1);
+
+	if (!Buffer) return 0;
+
+	lua_pushinteger(State, Buffer->size());
+	return 1;
+}
+
+static int Buffer_Sub(lua_State *State)
+{ //buf:Sub(Start, [End]), same rules as string.sub(), negative positions count from the end. Returns a new buffer.
+	const std::vector<uint8_t> *Buffer = GetLuaBuffer(State, 1);
+
+	if (!Buffer || lua_type(State, 2) != LUA_TNUMBER) return 0;
+
+	const lua_Integer Length = Buffer->size();
+
+	lua_Integer Start = lua_tointeger(State, 2);
+	lua_Integer End = lua_type(State, 3) == LUA_TNUMBER ? lua_tointeger(State, 3) : -1;
+
+	if (Start < 0) Start += Length + 1;
+	if (End < 0) End += Length + 1;
+
+	if (Start < 1) Start = 1;
+	if (End > Length) End = Length;
+
+	if (Start > End)
+	{
+		PushLuaBuffer(State, std::vector<uint8_t>());
+		return 1;
+	}
+
+	PushLuaBuffer(State, std::vector<uint8_t>(Buffer->begin() + (Start - 1), Buffer->begin() + End));
+	return 1;
+}
+
+static int Buffer_Write(lua_State *State)
+{ //buf:Write(Position, Data), overwrites in place starting at the one-based Position. Grows the buffer if it has to.
+	std::vector<uint8_t> *Buffer = GetLuaBuffer(State, 1);
+
+	size_t Length = 0;
+	const uint8_t *Data = GetLuaBytes(State, 3, &Length);
+
+	if (!Buffer || !Data || lua_type(State, 2) != LUA_TNUMBER || lua_tointeger(State, 2) < 1)
+	{
+		lua_pushboolean(State, false);
+		return 1;
+	}
+
+	const uint64_t Offset = lua_tointeger(State, 2) - 1;
+
+	if (Offset + Length > Buffer->size())
+	{
+		if (!ResizeLuaBuffer(State, *Buffer, Offset + Length)) return luaL_error(State, "Buffer would be too big, or we're out of memory");
+
+		if (GetLuaBuffer(State, 3) == Buffer) Data = Buffer->data(); //Writing it into itself, and resize() may have moved it.
+	}
+
+	memmove(Buffer->data() + Offset, Data, Length); //Might be writing a buffer into itself.
+
+	lua_pushboolean(State, true);
+	return 1;
+}
+
+static int Buffer_Append(lua_State *State)
+{
+	std::vector<uint8_t> *Buffer = GetLuaBuffer(State, 1);
+
+	size_t Length = 0;
+	const uint8_t *Data = GetLuaBytes(State, 2, &Length);
+
+	if (!Buffer || !Data)
+	{
+		lua_pushboolean(State, false);
+		return 1;
+	}
+
+	const size_t OldSize = Buffer->size();
+
+	if (!ResizeLuaBuffer(State, *Buffer, (uint64_t)OldSize + Length)) return luaL_error(State, "Buffer would be too big, or we're out of memory");
+
+	if (GetLuaBuffer(State, 2) == Buffer) Data = Buffer->data(); //Appending to itself, and resize() may have moved it.
+
+	memmove(Buffer->data() + OldSize, Data, Length);
+
+	lua_pushboolean(State, true);
+	return 1;
+}
+
+static int Buffer_Resize(lua_State *State)
+{ //New bytes are zeroed.
+	std::vector<uint8_t> *Buffer = GetLuaBuffer(State, 1);
+
+	if (!Buffer || lua_type(State, 2) != LUA_TNUMBER || lua_tointeger(State, 2) < 0)
+	{
+		lua_pushboolean(State, false);
+		return 1;
+	}
+
+	if (!ResizeLuaBuffer(State, *Buffer, lua_tointeger(State, 2))) return luaL_error(State, "Buffer would be too big, or we're out of memory");
+
+	lua_pushboolean(State, true);
+	return 1;
+}
+
+static int Buffer_Find(lua_State *State)
+{ //buf:Find(Needle, [Init]), plain search only, no patterns. Returns the one-based start and end, or nil.
+	const std::vector<uint8_t> *Buffer = GetLuaBuffer(State, 1);
+
+	size_t NeedleLength = 0;
+	const uint8_t *Needle = GetLuaBytes(State, 2, &NeedleLength);
+
+	if (!Buffer || !Needle) return 0;
+
+	lua_Integer Init = lua_type(State, 3) == LUA_TNUMBER ? lua_tointeger(State, 3) : 1;
+
+	if (Init < 0) Init += Buffer->size() + 1;
+	if (Init < 1) Init = 1;
+
+	if (static_cast<size_t>(Init - 1) + NeedleLength > Buffer->size()) return 0;
+
+	auto Iter = std::search(Buffer->begin() + (Init - 1), Buffer->end(), Needle, Needle + NeedleLength);
+
+	if (Iter == Buffer->end() && NeedleLength) return 0;
+
+	const size_t Position = (Iter - Buffer->begin()) + 1;
+
+	lua_pushinteger(State, Position);
+	lua_pushinteger(State, Position + NeedleLength - 1);
+	return 2;
+}
+
+static int Buffer_Byte(lua_State *State)
+{ //buf:Byte(Position), one-based.
+	const std::vector<uint8_t> *Buffer = GetLuaBuffer(State, 1);
+
+	if (!Buffer || lua_type(State, 2) != LUA_TNUMBER) return 0;
+
+	const lua_Integer Position = lua_tointeger(State, 2);
+
+	if (Position < 1 || static_cast<size_t>(Position) > Buffer->size()) return 0;
+
+	lua_pushinteger(State, (*Buffer)[Position - 1]);
+	return 1;
+}
+
+static int Buffer_SetByte(lua_State *State)
+{ //buf:SetByte(Position, Value), one-based, and it doesn't grow the buffer.
+	std::vector<uint8_t> *Buffer = GetLuaBuffer(State, 1);
+
+	if (!Buffer || lua_type(State, 2) != LUA_TNUMBER || lua_type(State, 3) != LUA_TNUMBER)
+	{
+		lua_pushboolean(State, false);
+		return 1;
+	}
+
+	const lua_Integer Position = lua_tointeger(State, 2);
+
+	if (Position < 1 || static_cast<size_t>(Position) > Buffer->size())
+	{
+		lua_pushboolean(State, false);
+		return 1;
+	}
+
+	(*Buffer)[Position - 1] = static_cast<uint8_t>(lua_tointeger(State, 3));
+
+	lua_pushboolean(State, true);
+	return 1;
+}
+
+static int Buffer_Pack(lua_State *State)
+{ //buf:Pack(Position, Width, Value, [BigEndian]), Width is 1, 2, 4 or 8 bytes. Little endian unless you say otherwise.
+	std::vector<uint8_t> *Buffer = GetLuaBuffer(State, 1);
+
+	if (!Buffer || (!VerifyLuaFuncArgs(State, { LUA_TUSERDATA, LUA_TNUMBER, LUA_TNUMBER, LUA_TNUMBER }) &&
+		!VerifyLuaFuncArgs(State, { LUA_TUSERDATA, LUA_TNUMBER, LUA_TNUMBER, LUA_TNUMBER, LUA_TBOOLEAN })))
+	{
+	EasyFail:
+		lua_settop(State, 0);
+		lua_pushboolean(State, false);
+		return 1;
+	}
+
+	const lua_Integer Position = lua_tointeger(State, 2);
+	const lua_Integer Width = lua_tointeger(State, 3);
+	const uint64_t Value = static_cast<uint64_t>(lua_tointeger(State, 4));
+	const bool BigEndian = lua_toboolean(State, 5);
+
+	if (Position < 1 || (Width != 1 && Width != 2 && Width != 4 && Width != 8)) goto EasyFail;
+
+	const uint64_t Offset = Position - 1;
+
+	if (Offset + Width > Buffer->size() && !ResizeLuaBuffer(State, *Buffer, Offset + Width))
+	{
+		return luaL_error(State, "Buffer would be too big, or we're out of memory");
+	}
+
+	for (lua_Integer Inc = 0; Inc < Width; ++Inc)
+	{
+		const uint8_t Byte = static_cast<uint8_t>(Value >> (Inc * 8));
+
+		(*Buffer)[Offset + (BigEndian ? Width - 1 - Inc : Inc)] = Byte;
+	}
+
+	lua_pushboolean(State, true);
+	return 1;
+}
+
+static int Buffer_Unpack(lua_State *State)
+{ //buf:Unpack(Position, Width, [Signed], [BigEndian]), the other half of Pack().
+	const std::vector<uint8_t> *Buffer = GetLuaBuffer(State, 1);
+
+	if (!Buffer || lua_type(State, 2) != LUA_TNUMBER || lua_type(State, 3) != LUA_TNUMBER) return 0;
+
+	const lua_Integer Position = lua_tointeger(State, 2);
+	const lua_Integer Width = lua_tointeger(State, 3);
+	const bool Signed = lua_toboolean(State, 4);
+	const bool BigEndian = lua_toboolean(State, 5);
+
+	if (Position < 1 || (Width != 1 && Width != 2 && Width != 4 && Width != 8)) return 0;
+
+	const size_t Offset = Position - 1;
+
+	if (Offset + Width > Buffer->size()) return 0;
+
+	uint64_t Value = 0;
+
+	for (lua_Integer Inc = 0; Inc < Width; ++Inc)
+	{
+		const uint64_t Byte = (*Buffer)[Offset + (BigEndian ? Width - 1 - Inc : Inc)];
+
+		Value |= Byte << (Inc * 8);
+	}
+
+	if (Signed && Width < 8 && (Value & (1ull << (Width * 8 - 1))))
+	{ //Sign extend.
+		Value |= ~0ull << (Width * 8);
+	}
+
+	lua_pushinteger(State, static_cast<lua_Integer>(Value));
+	return 1;
+}
+
+static int Buffer_ToString(lua_State *State)
+{ //Costs a copy, so only when you actually need a string.
+	const std::vector<uint8_t> *Buffer = GetLuaBuffer(State, 1);
+
+	if (!Buffer) return 0;
+
+	lua_pushlstring(State, (const char*)Buffer->data(), Buffer->size());
+	return 1;
+}
+
+static int CountCSArgsLua(lua_State *State)
+{
+	if (lua_type(State, -1) != LUA_TTABLE)
+	{
+		return 0;
+	}
+
+	lua_pushstring(State, "VL_INTRNL");
+	lua_gettable(State, -2);
+
+	if (lua_type(State, -1) != LUA_TUSERDATA) return 0;
+
+	Conation::ConationStream *Stream = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
+
+	lua_pushinteger(State, Stream->CountArguments());
+	return 1;
+}
+
+static int VerifyCSArgsLua_Subfunction(lua_State *State, decltype(&Conation::ConationStream::VerifyArgTypes) MemberFunc)
+{
+	size_t ArgCount = lua_gettop(State);
+
+	if (!ArgCount || lua_type(State, 1) != LUA_TTABLE)
+	{
+		VLDEBUG("Incorrect arguments passed, count is " + VLString::UintToString(ArgCount));
+	EasyFail:
+		lua_settop(State, 0);
+		lua_pushboolean(State, false);
+		return 1;
+	}
+
+	lua_pushstring(State, "VL_INTRNL");
+	lua_gettable(State, 1);
+
+	if (lua_type(State, -1) != LUA_TUSERDATA)
+	{
+		VLDEBUG("Is not a userdata");
+
+		goto EasyFail;
+	}
+
+	Conation::ConationStream *Stream = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
+
+	size_t Inc = 2; //Cuz 1 is the 'self' argument.
+
+	std::vector<Conation::ArgType> ToCheck;
+	ToCheck.reserve(ArgCount - 1);
+
+	for (; Inc <= ArgCount; ++Inc)
+	{
+		if (lua_type(State, Inc) != LUA_TNUMBER)
+		{
+			VLDEBUG("Passed argument " + VLString::UintToString(Inc) + " is not an integer");
+			goto EasyFail;
+		}
+
+		const lua_Integer Num = lua_tointeger(State, Inc);
+
+		if (Num < 0 || Num > Conation::ARGTYPE_MAXPOPULATED)
+		{
+			VLDEBUG("Range error, got value " + VLString::UintToString(Num) + " for argument #" + VLString::UintToString(Inc));
+			goto EasyFail;
+		}
+
+		ToCheck.push_back(static_cast<Conation::ArgType>(Num));
+	}
+
+
+	const bool Result = (Stream->*MemberFunc)(ToCheck);
+
+	lua_settop(State, 0);
+
+	lua_pushboolean(State, Result);
+
+	return 1;
+}
+
+
+static int VerifyCSArgsLua(lua_State *State)
+{
+	return VerifyCSArgsLua_Subfunction(State, &Conation::ConationStream::VerifyArgTypes);
+}
+
+static int VerifyCSArgsLuaStartWith(lua_State *State)
+{
+	return VerifyCSArgsLua_Subfunction(State, &Conation::ConationStream::VerifyArgTypesStartWith);
+}
+
+static void InitConationStreamBindings(lua_State *State)
+{
+	///Create the class template table.
+	lua_pushstring(State, "ConationStream");
 	lua_newtable(State);
 
-	///Populate the metatable.
+	lua_settable(State, -3);
+
+	///Get the class template table back onto the stack since lua_settable() popped it.
+	lua_pushstring(State, "ConationStream");
+	lua_gettable(State, -2);
+
+	///Populate the class template table.
+
+	//The new instance function.
+	lua_pushstring(State, "New");
+	lua_pushcfunction(State, NewLuaConationStream);
+
+	lua_settable(State, -3);
+
+	//Argument pushing
+	lua_pushstring(State, "Push");
+	lua_pushcfunction(State, PushArg_LuaConationStream);
+
+	lua_settable(State, -3);
+
+	//Argument popping
+	lua_pushstring(State, "Pop");
+	lua_pushcfunction(State, PopArg_LuaConationStream);
+
+	lua_settable(State, -3);
+
+	//Argument popping, but big blobs come back as views into the stream.
+	lua_pushstring(State, "PopView");
+	lua_pushcfunction(State, PopArgView_LuaConationStream);
 
-	//Index metamethod.
-	lua_pushstring(State, "__index");
-	//Puts the class template table on the stack.
-	lua_pushstring(State, "ConationStream");
-	lua_gettable(State, -5); ///Goes all the way up to that getglobal wayyy up there.
-	//Set the __index metamethod.
 	lua_settable(State, -3);
 
-	//Length operator support, get number of arguments.
-	lua_pushstring(State, "__len");
+	//Argument popping, but big blobs come back as VL.Buffer objects.
+	lua_pushstring(State, "PopBuffer");
+	lua_pushcfunction(State, PopArgBuffer_LuaConationStream);
+
+	lua_settable(State, -3);
+
+	//Verification of argument types.
+	lua_pushstring(State, "VerifyArgTypes");
+	lua_pushcfunction(State, VerifyCSArgsLua);
+
+	lua_settable(State, -3);
+
+	//More verification of argument types.
+	lua_pushstring(State, "VerifyArgTypesStartWith");
+	lua_pushcfunction(State, VerifyCSArgsLuaStartWith);
+
+	lua_settable(State, -3);
+
+
+	//Argument counting.
+	lua_pushstring(State, "CountArguments");
 	lua_pushcfunction(State, CountCSArgsLua);
 
 	lua_settable(State, -3);
 
-	///Now set the metatable. This pops the metatable afterwards.
-	lua_setmetatable(State, -2);
+	//Returns a table of argument types.
+	lua_pushstring(State, "GetArgTypes");
+	lua_pushcfunction(State, GetCSArgsList_Lua);
 
-	//Finally. This metatable code hurt to write.
+	lua_settable(State, -3);
 
-	Conation::ConationStream *Stream = static_cast<Conation::ConationStream*>(lua_newuserdata(State, sizeof(Conation::ConationStream)));
+	//Returns a table containing the headers for our job that usually get prepended to a stream.
+	lua_pushstring(State, "PopJobArguments");
+	lua_pushcfunction(State, PopCSJobArgs);
 
-	//We check which are defined in the Args struct to see what we need to do.
-	if (Args.StringBuffer)
+	lua_settable(State, -3);
+
+	//When we want a string containing the full raw data.
+	lua_pushstring(State, "GetData");
+	lua_pushcfunction(State, GetCSData_Lua);
+
+	lua_settable(State, -3);
+
+	//When we want a string just containing the argument data, minus the header.
+	lua_pushstring(State, "GetArgData");
+	lua_pushcfunction(State, GetCSArgData_Lua);
+
+	lua_settable(State, -3);
+
+	//Get the header info for the stream.
+	lua_pushstring(State, "GetHeader");
+	lua_pushcfunction(State, GetCSHeader_Lua);
+
+	lua_settable(State, -3);
+
+	//Build an otherwise empty, ODHeader-inverted, report-flagged response message from the original's stream headers.
+	lua_pushstring(State, "BuildResponse");
+	lua_pushcfunction(State, BuildCSResponse_Lua);
+
+	lua_settable(State, -3);
+
+	//Iterate over stream arguments
+	lua_pushstring(State, "Iter");
+	lua_pushcfunction(State, GetCSIter);
+
+	lua_settable(State, -3);
+
+	//Rewind stream
+	lua_pushstring(State, "Rewind");
+	lua_pushcfunction(State, RewindCS_Lua);
+
+	lua_settable(State, -3);
+
+	//Pop ConationStream from the stack before we return, for the next binding functions.
+	///This is important!
+	lua_pop(State, 1);
+}
+
+static int GetCSData_Lua(lua_State *State)
+{
+	size_t ArgCount = lua_gettop(State);
+
+	if (ArgCount != 1 || lua_type(State, 1) != LUA_TTABLE)
 	{
-		try
+	EasyFail:
+		lua_settop(State, 0);
+		lua_pushboolean(State, false);
+		return 1;
+	}
+
+	lua_pushstring(State, "VL_INTRNL");
+	lua_gettable(State, 1);
+
+	if (lua_type(State, -1) != LUA_TUSERDATA) goto EasyFail;
+
+	Conation::ConationStream *Stream = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
+
+	if (!Stream) goto EasyFail;
+
+	lua_pushlstring(State, (const char*)Stream->GetData().data(), Stream->GetData().size());
+
+	return 1;
+}
+static int GetCSArgData_Lua(lua_State *State)
+{
+	size_t ArgCount = lua_gettop(State);
+
+	if (ArgCount != 1 || lua_type(State, 1) != LUA_TTABLE)
+	{
+	EasyFail:
+		lua_settop(State, 0);
+		lua_pushboolean(State, false);
+		return 1;
+	}
+
+	lua_pushstring(State, "VL_INTRNL");
+	lua_gettable(State, 1);
+
+	if (lua_type(State, -1) != LUA_TUSERDATA) goto EasyFail;
+
+	Conation::ConationStream *Stream = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
+
+	if (!Stream) goto EasyFail;
+
+	lua_pushlstring(State, (const char*)Stream->GetArgData(), Stream->GetHeader().StreamArgsSize);
+
+	return 1;
+}
+
+static int BytecodeWriter(lua_State *State, const void *Data, size_t Size, void *Out)
+{
+	std::vector<uint8_t> *const Bytecode = static_cast<std::vector<uint8_t>*>(Out);
+	
+	Bytecode->insert(Bytecode->end(), (const uint8_t*)Data, (const uint8_t*)Data + Size);
+	
+	return 0;
+}
+
+static std::shared_ptr<const CompiledScript> CompileScript(const VLString &Source, const bool Persist, VLString *ErrorOut)
+{ //Persist means it's worth keeping on disk too, i.e. loaded scripts and the startup script, not one-off snippets.
+	const VLString &Hash { Utils::GetSha512(Source) };
+	
+	std::shared_ptr<const CompiledScript> Cached { LookupCompiledScript(Hash) };
+	
+	if (Cached) return Cached;
+	
+	std::shared_ptr<CompiledScript> New { new CompiledScript{ Hash, Source, {}, ScriptWantsResident(Source) } };
+	
+	{ //Compile it once here, so executing a function doesn't have to parse the whole thing again. Bare state is fine for that.
+		VLScopedPtr<lua_State*, decltype(&lua_close)> State { luaL_newstate(), &lua_close };
+		
+		if (luaL_loadbuffer(State, Source, Source.Length(), "VLLUA") != LUA_OK)
 		{
-			new (Stream) Conation::ConationStream(Args.StringBuffer);
-			VLDEBUG("Successfully allocated ConationStream from Lua string with command code"
-					+ Stream->GetCommandCode());
+			if (ErrorOut) *ErrorOut = lua_tostring(State, -1);
+			return nullptr;
 		}
-		catch (const Conation::ConationStream::Err_Base &)
+		
+		//Stripped, since nothing reads debug info off these and it's a good chunk of the size.
+		if (VL_lua_dump(State, BytecodeWriter, &New->Bytecode, 1) != 0)
+		{ //Not fatal, we can still run it from source.
+			VLWARN("Failed to dump bytecode for script with hash " + Hash);
+			New->Bytecode.clear();
+		}
+		else New->Source = VLString(); //Don't need two copies hanging around.
+	}
+	
+	if (Persist && !New->Bytecode.empty() && !SaveCompiledChunk(*New))
+	{
+		VLWARN("Failed to write compiled chunk to " + GetChunkCachePath(Hash));
+	}
+	
+	CacheCompiledScript(New);
+	
+	return New;
+}
+
+static std::shared_ptr<const CompiledScript> LookupCompiledScript(const VLString &Hash)
+{
+	VLThreads::MutexKeeper Keeper { &ChunkCache.Mutex };
+	
+	auto Iter = ChunkCache.Chunks.find(Hash);
+	
+	if (Iter != ChunkCache.Chunks.end()) return Iter->second;
+	
+	Keeper.Unlock();
+	
+	std::shared_ptr<const CompiledScript> Loaded { LoadCompiledChunk(Hash) };
+	
+	if (Loaded) CacheCompiledScript(Loaded);
+	
+	return Loaded;
+}
+
+static void CacheCompiledScript(const std::shared_ptr<const CompiledScript> &Compiled)
+{
+	const VLThreads::MutexKeeper Keeper { &ChunkCache.Mutex };
+	
+	if (ChunkCache.Chunks.count(Compiled->Hash)) return;
+	
+	ChunkCache.Chunks[Compiled->Hash] = Compiled;
+	ChunkCache.Order.push_back(Compiled->Hash);
+	
+	while (ChunkCache.Order.size() > LUA_CHUNK_CACHE_MAX)
+	{ //Anybody still running an evicted chunk holds their own reference.
+		ChunkCache.Chunks.erase(ChunkCache.Order.front());
+		ChunkCache.Order.pop_front();
+	}
+}
+
+static VLString GetChunkCachePath(const VLString &Hash)
+{ //Bytecode is only good for the same Lua version and number sizes it came from, so that goes in the name.
+	const VLString &ABITag { VLString::UintToString(LUA_VERSION_NUM) + '_' + VLString::UintToString(sizeof(void*) * 8)
+								+ '_' + VLString::UintToString(sizeof(lua_Integer)) + '_' + VLString::UintToString(sizeof(lua_Number)) };
+	
+	return Utils::GetTempDirectory() + LUA_CHUNK_FILE_PREFIX + ABITag + '_' + Hash;
+}
+
+static bool SaveCompiledChunk(const CompiledScript &Compiled)
+{ //Layout is the SHA-512 of everything after it, then the resident flag, then the bytecode.
+	std::vector<uint8_t> Payload;
+	
+	Payload.reserve(Compiled.Bytecode.size() + 1);
+	Payload.push_back(Compiled.Resident);
+	Payload.insert(Payload.end(), Compiled.Bytecode.begin(), Compiled.Bytecode.end());
+	
+	const VLString &PayloadHash { Utils::GetSha512(Payload.data(), Payload.size()) };
+	
+	std::vector<uint8_t> File;
+	
+	File.reserve(PayloadHash.Length() + Payload.size());
+	File.insert(File.end(), (const uint8_t*)+PayloadHash, (const uint8_t*)+PayloadHash + PayloadHash.Length());
+	File.insert(File.end(), Payload.begin(), Payload.end());
+	
+	static std::atomic_uint32_t Counter;
+	
+	const VLString &Path { GetChunkCachePath(Compiled.Hash) };
+	const VLString &TempPath { Path + ".tmp" + VLString::UintToString(~time(nullptr) << 1) + '_' + VLString::UintToString(++Counter) };
+	
+	//Write then rename, so a reader never sees half a chunk.
+	if (!Utils::WriteFile(TempPath, File.data(), File.size())) return false;
+	
+	if (rename(TempPath, Path) != 0)
+	{
+		remove(TempPath);
+		return Utils::FileExists(Path); //Somebody else already wrote it.
+	}
+	
+	PruneChunkDiskCache();
+	
+	return true;
+}
+
+static void PruneChunkDiskCache(void)
+{ //Every script anybody ever sent us would pile up in the temp directory otherwise. Loading a chunk bumps its mtime, so the least recently used go first.
+	struct ChunkFile
+	{
+		VLString Path;
+		time_t ModTime;
+		uint64_t Size;
+	};
+	
+	const VLString &TempDir { Utils::GetTempDirectory() };
+	
+	VLScopedPtr<DIR*, decltype(&closedir)> Dir { opendir(TempDir), closedir };
+	
+	if (!Dir) return;
+	
+	std::vector<ChunkFile> Chunks;
+	uint64_t Total = 0;
+	const time_t Now = time(nullptr);
+	
+	struct dirent *Ent = nullptr;
+	
+	while ((Ent = readdir(Dir)))
+	{
+		if (strncmp(Ent->d_name, LUA_CHUNK_FILE_PREFIX, sizeof LUA_CHUNK_FILE_PREFIX - 1) != 0) continue;
+		
+		const VLString &Path { TempDir + (const char*)Ent->d_name };
+		
+		struct stat FileStat{};
+		
+		if (stat(Path, &FileStat) != 0 || !S_ISREG(FileStat.st_mode)) continue;
+#ifndef WIN32
+		if (FileStat.st_uid != geteuid()) continue; //Not ours to clean up.
+#endif //WIN32
+		
+		if (Now - FileStat.st_mtime > LUA_CHUNK_DISK_MAX_AGE)
+		{ //Includes temp files left behind by a write that never finished.
+			remove(Path);
+			continue;
+		}
+		
+		if (strstr(Ent->d_name, ".tmp")) continue; //Somebody might be writing it right now.
+		
+		Total += FileStat.st_size;
+		Chunks.push_back({ Path, FileStat.st_mtime, (uint64_t)FileStat.st_size });
+	}
+	
+	if (Total <= LUA_CHUNK_DISK_MAX_BYTES) return;
+	
+	std::sort(Chunks.begin(), Chunks.end(), [] (const ChunkFile &A, const ChunkFile &B) { return A.ModTime < B.ModTime; });
+	
+	for (const ChunkFile &Chunk : Chunks)
+	{
+		if (Total <= LUA_CHUNK_DISK_MAX_BYTES) break;
+		
+		if (remove(Chunk.Path) == 0) Total -= Chunk.Size;
+	}
+}
+
+static std::shared_ptr<const CompiledScript> LoadCompiledChunk(const VLString &Hash)
+{
+	//The hash can come straight off the wire and it's going in a path.
+	if (Hash.Length() != 128 || strspn(Hash, "0123456789abcdef") != Hash.Length()) return nullptr;
+	
+	const VLString &Path { GetChunkCachePath(Hash) };
+	
+#ifndef WIN32
+	struct stat FileStat{};
+	
+	//It's in the temp directory, so make sure nobody else could have put it there. Lua trusts bytecode blindly.
+	if (stat(Path, &FileStat) != 0 || FileStat.st_uid != geteuid() || (FileStat.st_mode & (S_IWGRP | S_IWOTH))) return nullptr;
+#endif //WIN32
+	
+	VLScopedPtr<std::vector<uint8_t>*> File { Utils::Slurp(Path, true) };
+	
+	const size_t HashLength = Hash.Length();
+	
+	if (!File || File->size() <= HashLength + 1) return nullptr;
+	
+	const uint8_t *const Payload = File->data() + HashLength;
+	const size_t PayloadSize = File->size() - HashLength;
+	
+	if (memcmp(+Utils::GetSha512(Payload, PayloadSize), File->data(), HashLength) != 0)
+	{
+		VLWARN("Compiled chunk " + Path + " is corrupt, deleting it");
+		remove(Path);
+		return nullptr;
+	}
+	
+#ifndef WIN32
+	utime(Path, nullptr); //So the pruning knows it's still wanted.
+#endif //WIN32
+	
+	return std::shared_ptr<const CompiledScript> { new CompiledScript{ Hash, {}, std::vector<uint8_t>(Payload + 1, Payload + PayloadSize), *Payload != 0 } };
+}
+
+bool Script::LoadScript(const char *ScriptBuffer, const char *ScriptName, const bool OverwritePermissible)
+{
+	VLString Error;
+	
+	const std::shared_ptr<const CompiledScript> New { CompileScript(ScriptBuffer, true, &Error) };
+	
+	if (!New)
+	{
+		VLWARN(VLString("Failed to compile script \"") + ScriptName + "\", got error from Lua interpreter: \"" + Error + "\"");
+		return false;
+	}
+	
+	return InstallScript(ScriptName, New, OverwritePermissible);
+}
+
+bool Script::HaveCompiledScript(const char *Hash)
+{
+	return LookupCompiledScript(Hash) != nullptr;
+}
+
+bool Script::LoadCompiledScript(const char *Hash, const char *ScriptName, const bool OverwritePermissible)
+{ //Control sends just the hash first, and only sends the text if we say we don't have it.
+	const std::shared_ptr<const CompiledScript> New { LookupCompiledScript(Hash) };
+	
+	if (!New) return false;
+	
+	return InstallScript(ScriptName, New, OverwritePermissible);
+}
+
+static bool InstallScript(const char *ScriptName, const std::shared_ptr<const CompiledScript> &New, const bool OverwritePermissible)
+{
+	VLThreads::MutexKeeper Keeper { &LoadedScripts.Mutex };
+	
+	if (!OverwritePermissible && LoadedScripts.Scripts.count(ScriptName) != 0) return false;
+	
+	Keeper.Unlock();
+	
+	VLScopedPtr<ResidentScript*> Resident;
+	
+	if (New->Resident)
+	{ //Bring it up before we publish anything, so a script that dies in its body doesn't get loaded at all.
+		Resident = new ResidentScript(ScriptName, New);
+		
+		if (!Resident->Start())
 		{
-			VLWARN("Failed to allocate ConationStream from Lua string!");
-			return 0;
+			VLWARN(VLString("Resident script \"") + ScriptName + "\" failed to start");
+			return false;
 		}
 	}
-	else if (Args.ToClone)
-	{
-		new (Stream) Conation::ConationStream(Args.ToClone->GetHeader(), Args.ToClone->GetArgData());
+	
+	Keeper.Lock();
+	
+	if (!OverwritePermissible && LoadedScripts.Scripts.count(ScriptName) != 0)
+	{ //Somebody beat us to it.
+		Keeper.Unlock();
+		
+		if (Resident) Resident->Stop();
+		return false;
 	}
-	else
+	
+	LoadedScripts.Scripts[ScriptName] = New;
+	
+	VLScopedPtr<ResidentScript*> Old;
+	
+	auto Iter = LoadedScripts.Residents.find(ScriptName);
+	
+	if (Iter != LoadedScripts.Residents.end())
 	{
-		new (Stream) Conation::ConationStream(Args.CmdCode, Args.Flags, Args.Ident);
+		Old = Iter->second;
+		LoadedScripts.Residents.erase(Iter);
 	}
-
-
-	//Setting the internal userdata now.
-	lua_pushstring(State, "VL_INTRNL");
-	lua_pushvalue(State, -2);
-	lua_settable(State, -4);
-
-	//Userdata's metatable.
-	lua_newtable(State);
-
-	//Garbage collection function for metatable.
-	lua_pushstring(State, "__gc");
-	lua_pushcfunction(State, LuaConationStreamGCFunc);
-	lua_settable(State, -3);
-
-	///Setting the userdata's metatable finally.
-	lua_setmetatable(State, -2);
-
-	lua_pop(State, 1); //Now that we've stored the userdata, get rid of it so we return only the instance table.
-	return 1;
+	
+	if (Resident) LoadedScripts.Residents[ScriptName] = Resident.Forget();
+	
+	Keeper.Unlock();
+	
+	if (Old) Old->Stop();
+	
+	return true;
 }
 
-static int BuildCSResponse_Lua(lua_State *State)
+bool Script::UnloadScript(const char *ScriptName)
 {
-	if (!VerifyLuaFuncArgs(State, { LUA_TTABLE }))
+	VLThreads::MutexKeeper Keeper { &LoadedScripts.Mutex };
+	
+	//Jobs already running it hold their own reference, so this is safe.
+	const bool Found = LoadedScripts.Scripts.erase(ScriptName) != 0;
+	
+	VLScopedPtr<ResidentScript*> Resident;
+	
+	auto Iter = LoadedScripts.Residents.find(ScriptName);
+	
+	if (Iter != LoadedScripts.Residents.end())
 	{
-		return 0;
+		Resident = Iter->second;
+		LoadedScripts.Residents.erase(Iter);
 	}
+	
+	Keeper.Unlock();
+	
+	if (Resident) Resident->Stop();
+	
+	return Found;
+}
 
-	lua_getfield(State, -1, "VL_INTRNL");
-
-	if (lua_type(State, -1) != LUA_TUSERDATA) return 0;
-
-	const Conation::ConationStream *const OriginalPtr = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
-
-	if (!OriginalPtr) return 0;
-
-	Conation::ConationStream::StreamHeader Hdr { OriginalPtr->GetHeader() };
-
-	Conation::ConationStream Original { Hdr, OriginalPtr->GetArgData() };
-
-	//Make it into a report
-	Hdr.CmdIdentFlags |= Conation::IDENT_ISREPORT_BIT;
-	Hdr.StreamArgsSize = 0;
-
-	//New stream we're gonna use.
-	Conation::ConationStream New { Hdr };
-
-	lua_settop(State, 0);
+bool Script::ScriptIsLoaded(const char *ScriptName)
+{
+	const VLThreads::MutexKeeper Keeper { &LoadedScripts.Mutex };
+	
+	return LoadedScripts.Scripts.count(ScriptName);
+}
 
-	VLScopedPtr<Conation::ConationStream::BaseArg*> Arg { Original.PopArgument(true) }; //Peek only
+bool Script::DispatchToResident(const char *ScriptName, const char *FunctionName, Conation::ConationStream *Stream, Jobs::Job *OurJob)
+{
+	const VLThreads::MutexKeeper Keeper { &LoadedScripts.Mutex };
+	
+	auto Iter = LoadedScripts.Residents.find(ScriptName);
+	
+	if (Iter == LoadedScripts.Residents.end()) return false;
+	
+	Iter->second->PushEvent(new ResidentEvent{ ResidentEvent::EVENT_EXECFUNC, FunctionName, new Conation::ConationStream(std::move(*Stream)) });
+	
+	return true;
+}
 
-	if (Arg && Arg->Type == Conation::ARGTYPE_ODHEADER)
+void Script::ForwardN2NToResidents(const Conation::ConationStream *Stream)
+{
+	const VLThreads::MutexKeeper Keeper { &LoadedScripts.Mutex };
+	
+	for (auto &Pair : LoadedScripts.Residents)
 	{
-		Conation::ConationStream::ODHeaderArg *ODArg = static_cast<Conation::ConationStream::ODHeaderArg*>(+Arg);
-		//Invert origin/destination
-		New.Push_ODHeader(ODArg->Hdr.Destination, ODArg->Hdr.Origin);
-		VLDEBUG("Using OD Destination " +ODArg->Hdr.Destination + " and origin " + +ODArg->Hdr.Origin);
+		if (!Pair.second->HandlesN2N) continue;
+		
+		Pair.second->PushEvent(new ResidentEvent{ ResidentEvent::EVENT_N2N, {}, new Conation::ConationStream(*Stream) });
 	}
-
-	CloneConationStreamToLua(State, &New);
-
-	return 1;
 }
 
-static int GetCSHeader_Lua(lua_State *State)
+void Script::StopAllResidents(void)
 {
-	if (!VerifyLuaFuncArgs(State, { LUA_TTABLE}))
+	VLThreads::MutexKeeper Keeper { &LoadedScripts.Mutex };
+	
+	std::map<VLString, ResidentScript*> Residents;
+	
+	Residents.swap(LoadedScripts.Residents);
+	
+	Keeper.Unlock();
+	
+	for (auto &Pair : Residents)
 	{
-	EasyFail:
-		lua_settop(State, 0);
-		lua_pushnil(State);
-		return 1;
+		Pair.second->Stop();
+		delete Pair.second;
 	}
+}
 
-	lua_pushstring(State, "VL_INTRNL");
-	lua_gettable(State, 1);
-
-	if (lua_type(State, -1) != LUA_TUSERDATA) goto EasyFail;
-
-	Conation::ConationStream *Stream = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
-
-	if (!Stream) goto EasyFail;
+static bool ScriptWantsResident(const char *Source)
+{ //Looks for "scriptresident::true" in the VLSI spec header, same one the control panel reads.
+	const char *const SpecBegin = strstr(Source, RESIDENT_SPEC_BEGIN);
+	
+	if (!SpecBegin) return false;
+	
+	const char *const SpecEnd = strstr(SpecBegin, RESIDENT_SPEC_END);
+	
+	const char *Worker = strstr(SpecBegin, RESIDENT_SPECIFIER);
+	
+	if (!Worker || (SpecEnd && Worker > SpecEnd)) return false;
+	
+	Worker += sizeof RESIDENT_SPECIFIER - 1;
+	
+	return !strncmp(Worker, "true", sizeof "true" - 1);
+}
 
-	lua_settop(State, 0);
+static void PushScriptFunction(lua_State *State, const char *FunctionName, Conation::ConationStream *Stream, const bool Adopt, const bool AsOrder)
+{ //Leaves the global function and a Lua-ified copy of Stream on top of the stack, ready to call.
+	//If Adopt is set, the Lua stream takes Stream's buffer instead and Stream is left empty.
+	//If AsOrder is set, Stream is the order that started us, and VL.RecvStream() hands out the same table instead of a second copy.
+	
+	///All this is to create a duplicated Lua-ified ConationStream for the argument to FunctionName.
 
-	const Conation::ConationStream::StreamHeader Hdr = Stream->GetHeader();
+	if (!(Adopt ? AdoptConationStreamToLua(State, Stream) : CloneConationStreamToLua(State, Stream)))
+	{ //Call the Lua function VL.ConationStream:New() to get a new copy for arguments. Pushes the Lua ConationStream onto the stack.
+		throw ScriptError { FunctionName
+						, "Failed to lua_pcall() required C prerequesite function NewLuaConationStream()."
+						};
+	}
 
-	//We return this in a table.
-	lua_newtable(State);
+	if (lua_type(State, -1) != LUA_TTABLE)
+	{ //NewLuaConationStream() should return a table (a lua ConationStream)
+		throw ScriptError { FunctionName
 
-	lua_pushstring(State, "ArgsSize");
-	lua_pushinteger(State, Hdr.StreamArgsSize);
-	lua_settable(State, -3);
+						, "C prerequesite function NewLuaConationStream() did not return a Lua ConationStream."
+						};
+	}
 
-	lua_pushstring(State, "Flags");
-	lua_pushinteger(State, Hdr.CmdIdentFlags);
-	lua_settable(State, -3);
+	///Now we have the Lua-ified ConationStream on the stack, and we're gonna use it as the only argument to our script function.
+	//Find our function.
+	lua_getglobal(State, FunctionName);
 
-	lua_pushstring(State, "Ident");
-	lua_pushinteger(State, Hdr.CmdIdent);
-	lua_settable(State, -3);
+	if (lua_type(State, -1) != LUA_TFUNCTION)
+	{
+		throw ScriptError { FunctionName
+						, "Requested Lua script function is not actually a function or does not exist."
+						};
+	}
 
-	lua_pushstring(State, "CmdCode");
-	lua_pushinteger(State, Hdr.CmdCode);
-	lua_settable(State, -3);
+	if (AsOrder)
+	{
+		lua_pushvalue(State, -2);
+		lua_setfield(State, LUA_REGISTRYINDEX, "VL_OrderStream");
+	}
 
-	return 1;
+	lua_pushvalue(State, -2);
 }
 
-static int GetCSArgsList_Lua(lua_State *State)
-{
-	const size_t ArgCount = lua_gettop(State);
+static void CallScriptFunction(lua_State *State, const char *FunctionName, Conation::ConationStream *Stream, const bool Adopt, const bool AsOrder)
+{ //Calls a global function with a Lua-ified copy of Stream as its only argument. Leaves the return value on the stack.
+	PushScriptFunction(State, FunctionName, Stream, Adopt, AsOrder);
 
-	if (ArgCount != 1 || lua_type(State, 1) != LUA_TTABLE)
+	//Call the script function.
+	if (lua_pcall(State, 1, 1, 0) != LUA_OK)
 	{
-	EasyFail:
-		lua_settop(State, 0);
-		lua_pushnil(State);
-		return 1;
-	}
-
-	lua_pushstring(State, "VL_INTRNL");
-	lua_gettable(State, 1);
-
-	if (lua_type(State, -1) != LUA_TUSERDATA) goto EasyFail;
+		luaL_traceback(State, State, nullptr, 1);
 
-	Conation::ConationStream *Stream = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
+		const VLString Traceback { lua_tostring(State, -1) };
 
-	if (!Stream) goto EasyFail;
+		VLDEBUG("FAILURE IN SCRIPTING CORE, got traceback: " + Traceback);
 
-	lua_settop(State, 0); //We don't need anything else on the stack now.
+		throw ScriptError { FunctionName
+						, VLString("Lua error while calling lua_pcall() for function: ") + Traceback
+						};
+	}
+}
 
-	lua_newtable(State);
+static Jobs::Job *GetOurJob(lua_State *State)
+{ //Once a scheduled job's been killed its Job can be gone at any moment, so it doesn't get one anymore.
+	ScheduledTask *const Task = GetScheduledTask(State, true);
+	
+	if (Task && Task->Cancelled) return nullptr;
+	
+	lua_getglobal(State, "VL_OurJob_LUSRDTA");
 
-	VLScopedPtr<std::vector<Conation::ArgType>* > Args { Stream->GetArgTypes() };
+	Jobs::Job *const OurJob = lua_type(State, -1) == LUA_TLIGHTUSERDATA ? static_cast<Jobs::Job*>(lua_touserdata(State, -1)) : nullptr;
 
-	for (size_t Inc = 0; Inc < Args->size(); ++Inc)
-	{
-		lua_pushinteger(State, Inc + 1);
-		lua_pushinteger(State, Args->at(Inc));
-		lua_settable(State, 1);
-	}
+	lua_pop(State, 1);
 
-	return 1;
+	return OurJob;
 }
 
-static int PushArg_LuaConationStream(lua_State *State)
-{
-	const size_t ArgCount = lua_gettop(State);
-
-	/* First argument is our implicit self parameter that should be a table,
-	 * second argument is an integer mapping to an ArgType specifying the argument type,
-	 * third argument is the value. We can have more than 3 for some argument types.
-	 */
-	if (ArgCount < 3 || lua_type(State, 1) != LUA_TTABLE ||
-		lua_type(State, 2) != LUA_TNUMBER)
-	{
-	EasyFail:
-		lua_settop(State, 0);
-		lua_pushboolean(State, false);
-		return 1;
-	}
+static uint64_t DeadlineFromArg(lua_State *State, const int Index)
+{ //Turns an optional millisecond timeout argument into a monotonic deadline. Zero means wait forever.
+	if (lua_gettop(State) < Index || lua_type(State, Index) != LUA_TNUMBER) return 0;
 
-	lua_pushstring(State, "VL_INTRNL");
-	lua_gettable(State, 1); //Get the userdata from our implicit self argument.
+	const lua_Integer Milliseconds = lua_tointeger(State, Index);
 
-	if (lua_type(State, -1) != LUA_TUSERDATA) goto EasyFail;
+	return Utils::GetMonotonicMs() + (Milliseconds > 0 ? Milliseconds : 0);
+}
 
-	Conation::ConationStream *Stream = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
+static ScheduledTask *GetScheduledTask(lua_State *State, const bool AnyThread)
+{ //Only returns the task when State is its coroutine, since that's the only thing we can safely yield.
+	lua_getfield(State, LUA_REGISTRYINDEX, "VL_SchedTask");
 
-	lua_pop(State, 1); //We got what we need, pop the userdata off.
+	ScheduledTask *const Task = static_cast<ScheduledTask*>(lua_touserdata(State, -1));
 
-	if (lua_tointeger(State, 2) < 0 || lua_tointeger(State, 2) > Conation::ARGTYPE_MAXPOPULATED) goto EasyFail; //Wrong kind of integer.
+	lua_pop(State, 1);
 
-	Conation::ArgType Type = static_cast<Conation::ArgType>(lua_tointeger(State, 2));
+	if (!Task || (!AnyThread && Task->Thread != State)) return nullptr;
 
-	switch (Type)
-	{
-		case Conation::ARGTYPE_NETCMDSTATUS:
-		{
+	return Task;
+}
 
-			if (lua_tointeger(State, 3) < 0 || lua_tointeger(State, 3) > STATUS_MAXPOPULATED) goto EasyFail;
+static int SuspendForWait(lua_State *State, const LuaWait &Wait)
+{ //Yields to the scheduler if we're one of its tasks, otherwise blocks the calling thread like we always have.
+	ScheduledTask *const Task = GetScheduledTask(State);
 
-			const StatusCode Code = static_cast<StatusCode>(lua_tointeger(State, 3));
+	if (Task && VL_lua_isyieldable(State))
+	{ //The scheduler pushes our results with PushWaitResults() when it resumes us.
+		Task->Wait = Wait;
+		return lua_yield(State, 0);
+	}
 
-			VLString Msg;
-			if (ArgCount == 4) //We have a message string specified.
-			{
-				if (lua_type(State, 4) != LUA_TSTRING) goto EasyFail; //The user is 'special'.
-				Msg = lua_tostring(State, 4);
-			}
-			else if (ArgCount > 4) goto EasyFail;
+	//Inside a sort comparator, a metamethod, a gsub callback or such, we can't yield, so a task blocks its scheduler thread like anything else.
+	Jobs::Job *const OurJob = GetOurJob(State);
 
-			NetCmdStatus Status(Code == STATUS_OK || Code == STATUS_WARN, Code, Msg ? +Msg : nullptr);
+	lua_settop(State, 0);
 
-			Stream->Push_NetCmdStatus(Status);
-			break;
-		}
-		case Conation::ARGTYPE_BOOL:
-		{
-			if (ArgCount > 3 || lua_type(State, 3) != LUA_TBOOLEAN) goto EasyFail;
+	{ //Scoped so it's gone before luaL_error() longjmps past it.
+		LuaWait Local { Wait };
 
-			Stream->Push_Bool(lua_toboolean(State, 3));
-			break;
-		}
-		case Conation::ARGTYPE_STRING:
+		if (Local.Type == LuaWait::WAIT_SLEEP)
 		{
-			if (ArgCount > 3 || lua_type(State, 3) != LUA_TSTRING) goto EasyFail;
+			for (uint64_t Now = Utils::GetMonotonicMs(); Local.Deadline > Now && !(Task && Task->Cancelled); Now = Utils::GetMonotonicMs())
+			{
+				Utils::vl_sleep(Task ? std::min<uint64_t>(Local.Deadline - Now, LUA_WAIT_POLL_MS) : Local.Deadline - Now);
+			}
 
-			Stream->Push_String(lua_tostring(State, 3));
-			break;
+			if (!(Task && Task->Cancelled)) return 0;
 		}
-		case Conation::ARGTYPE_SCRIPT:
+		else
 		{
-			if (ArgCount > 3 || lua_type(State, 3) != LUA_TSTRING) goto EasyFail;
+			while (!WaitIsReady(Local, OurJob, Utils::GetMonotonicMs()) && !(Task && Task->Cancelled))
+			{
+				Utils::vl_sleep(LUA_WAIT_POLL_MS);
+			}
 
-			Stream->Push_Script(lua_tostring(State, 3));
-			break;
-		}
-		case Conation::ARGTYPE_FILEPATH:
-		{
-			if (ArgCount > 3 || lua_type(State, 3) != LUA_TSTRING) goto EasyFail;
+			if (!(Task && Task->Cancelled)) return PushWaitResults(State, Local, OurJob);
 
-			Stream->Push_FilePath(lua_tostring(State, 3));
-			break;
+			AbandonWait(Local);
 		}
-		case Conation::ARGTYPE_INT32:
-		{
-			if (ArgCount > 3 || lua_type(State, 3) != LUA_TNUMBER) goto EasyFail;
+	}
 
-			Stream->Push_Int32(lua_tointeger(State, 3));
-			break;
-		}
-		case Conation::ARGTYPE_UINT32:
-		{
-			if (ArgCount > 3 || lua_type(State, 3) != LUA_TNUMBER) goto EasyFail;
+	return luaL_error(State, "Job was killed");
+}
 
-			Stream->Push_Uint32(lua_tointeger(State, 3));
-			break;
-		}
-		case Conation::ARGTYPE_INT64:
-		{
-			if (ArgCount > 3 || lua_type(State, 3) != LUA_TNUMBER) goto EasyFail;
+static void AbandonWait(LuaWait &Wait)
+{ //Stops and joins whatever side thread a wait was on, for when the task waiting on it gets killed.
+	if (Wait.Spawn && Wait.Spawn->SpawnThread)
+	{ //Don't kill the thread, it has the child to clean up after. It'll come back quick once it's cancelled.
+		Wait.Spawn->Cancel = true;
+		Wait.Spawn->SpawnThread->Join();
+		Wait.Spawn->SpawnThread = nullptr;
+	}
+	
+#ifndef NOCURL
+	if (Wait.HTTP && Wait.HTTP->FetchThread)
+	{ //Same deal, it might be holding libcurl's locks or its temp file, so let it clean up and leave on its own.
+		Wait.HTTP->Cancel = true;
+		Wait.HTTP->FetchThread->Join();
+		Wait.HTTP->FetchThread = nullptr;
+	}
+#endif //NOCURL
+	
+	if (Wait.HashTree && Wait.HashTree->HashThread)
+	{
+		Wait.HashTree->Cancel = true;
+		Wait.HashTree->HashThread->Join();
+		Wait.HashTree->HashThread = nullptr;
+	}
+}
 
-			Stream->Push_Int64(lua_tointeger(State, 3));
-			break;
-		}
-		case Conation::ARGTYPE_UINT64:
-		{
-			if (ArgCount > 3 || lua_type(State, 3) != LUA_TNUMBER) goto EasyFail;
+static bool WaitIsReady(const LuaWait &Wait, Jobs::Job *OurJob, const uint64_t Now)
+{
+	if (Wait.Deadline && Now >= Wait.Deadline) return true;
 
-			Stream->Push_Uint64(lua_tointeger(State, 3));
-			break;
-		}
-		case Conation::ARGTYPE_ODHEADER:
+	switch (Wait.Type)
+	{
+		case LuaWait::WAIT_NONE:
+			return true;
+		case LuaWait::WAIT_SLEEP:
+			return false;
+		case LuaWait::WAIT_STREAM:
+			return !OurJob || OurJob->Read_Queue.HasItems();
+		case LuaWait::WAIT_N2N:
+			return !OurJob || OurJob->N2N_Queue.HasItems();
+		case LuaWait::WAIT_SELECT:
+			if (!OurJob) return true;
+
+			return ((Wait.Sources & LuaWait::SELECT_STREAM) && OurJob->Read_Queue.HasItems()) ||
+					((Wait.Sources & LuaWait::SELECT_N2N) && OurJob->N2N_Queue.HasItems());
+		case LuaWait::WAIT_PROCESS:
+			return !Processes::ProcessExists(Wait.PID);
+#ifndef NOCURL
+		case LuaWait::WAIT_HTTP:
+			return Wait.HTTP->Done;
+#endif //NOCURL
+		case LuaWait::WAIT_CHANNEL:
 		{
-			if (ArgCount != 4 || lua_type(State, 3) != LUA_TSTRING || lua_type(State, 4) != LUA_TSTRING) goto EasyFail;
+			const VLThreads::MutexKeeper Keeper { &Wait.Channel->Mutex };
+			
+			return Wait.Channel->Closed || !Wait.Channel->Messages.empty();
+		}
+		case LuaWait::WAIT_PARALLEL:
+			return !Wait.Parallel->Remaining;
+		case LuaWait::WAIT_SPAWN:
+			return Wait.Spawn->Done;
+		case LuaWait::WAIT_HASHTREE:
+			return Wait.HashTree->Done;
+		default:
+			return true;
+	}
+}
 
-			Stream->Push_ODHeader(lua_tostring(State, 3), lua_tostring(State, 4));
+static int PushWaitResults(lua_State *State, LuaWait &Wait, Jobs::Job *OurJob)
+{ //Pushes whatever the waiting VLAPI function should return now that the wait's over. Returns how many values.
+	Conation::ConationQueue *Queue = nullptr;
+	const char *SourceName = nullptr;
+
+	switch (Wait.Type)
+	{
+		case LuaWait::WAIT_STREAM:
+			Queue = OurJob ? &OurJob->Read_Queue : nullptr;
 			break;
-		}
-		case Conation::ARGTYPE_FILE:
-		{
-			if (ArgCount == 3)
-			{ //It's a file path.
-				if (lua_type(State, 3) != LUA_TSTRING) goto EasyFail;
+		case LuaWait::WAIT_N2N:
+			Queue = OurJob ? &OurJob->N2N_Queue : nullptr;
+			break;
+		case LuaWait::WAIT_SELECT:
+			if (!OurJob) break;
 
-				Stream->Push_File(lua_tostring(State, 3));
+			if ((Wait.Sources & LuaWait::SELECT_STREAM) && OurJob->Read_Queue.HasItems())
+			{
+				Queue = &OurJob->Read_Queue;
+				SourceName = "stream";
 			}
-			else if (ArgCount == 4)
+			else if ((Wait.Sources & LuaWait::SELECT_N2N) && OurJob->N2N_Queue.HasItems())
 			{
-				if (lua_type(State, 3) != LUA_TSTRING || lua_type(State, 4)) goto EasyFail;
-
-				VLString Filename = lua_tostring(State, 3);
-
-				size_t BytestreamSize = 0;
-				const uint8_t *Bytestream = (const uint8_t*)lua_tolstring(State, 4, &BytestreamSize);
-
-				Stream->Push_File(Filename, Bytestream, BytestreamSize);
+				Queue = &OurJob->N2N_Queue;
+				SourceName = "n2n";
 			}
-			else goto EasyFail;
 			break;
-		}
-		case Conation::ARGTYPE_BINSTREAM:
+		case LuaWait::WAIT_PROCESS:
+			lua_pushboolean(State, !Processes::ProcessExists(Wait.PID));
+			return 1;
+#ifndef NOCURL
+		case LuaWait::WAIT_HTTP:
+			Wait.HTTP->FetchThread->Join();
+			Wait.HTTP->FetchThread = nullptr;
+			return PushHTTPResult(State, *Wait.HTTP);
+#endif //NOCURL
+		case LuaWait::WAIT_CHANNEL:
+			if (!PopChannelMessage(State, *Wait.Channel)) lua_pushnil(State);
+			return 1;
+		case LuaWait::WAIT_PARALLEL:
 		{
-			if (ArgCount > 3 || lua_type(State, 3) != LUA_TSTRING) goto EasyFail;
-
-			size_t BinStreamLength = 0;
-
-			const void *BinStream = lua_tolstring(State, 3, &BinStreamLength);
-
-			Stream->Push_BinStream(BinStream, BinStreamLength);
-			break;
+			LuaParallelJob &Job = *Wait.Parallel;
+			
+			lua_createtable(State, Job.Results.size(), 0);
+			
+			for (size_t Inc = 0; Inc < Job.Results.size(); ++Inc)
+			{
+				PushLuaMessageValue(State, std::move(Job.Results[Inc]));
+				lua_rawseti(State, -2, Inc + 1);
+			}
+			
+			if (!Job.Error) return 1;
+			
+			lua_pushstring(State, Job.Error);
+			return 2;
 		}
+		case LuaWait::WAIT_SPAWN:
+			Wait.Spawn->SpawnThread->Join();
+			Wait.Spawn->SpawnThread = nullptr;
+			return PushSpawnResult(State, *Wait.Spawn);
+		case LuaWait::WAIT_HASHTREE:
+			Wait.HashTree->HashThread->Join();
+			Wait.HashTree->HashThread = nullptr;
+			return PushHashTreeResult(State, *Wait.HashTree);
 		default:
-			goto EasyFail; //Invalid value.
+			return 0;
 	}
 
-	lua_settop(State, 0);
-	lua_pushboolean(State, true);
-#ifdef DEBUG
-	puts(VLString("PushArg_LuaConationStream(): Push successful for value of type ") + ArgTypeToString(Type));
-#endif
-	return 1;
-}
-
-static int PopArg_LuaConationStream(lua_State *State)
-{
-	const size_t OldStackTop = lua_gettop(State);
+	VLScopedPtr<Conation::ConationStream*> Stream { Queue ? Queue->Pop() : nullptr };
 
-	if (lua_type(State, -1) != LUA_TTABLE)
-	{
-		VLDEBUG("Invalid first argument is not a table");
-	EasyFail:
-		lua_settop(State, OldStackTop);
-		return 0;
+	if (!Stream)
+	{ //Timed out.
+		lua_pushnil(State);
+		return 1;
 	}
 
-	//Get the userdata.
-	lua_getfield(State, -1, "VL_INTRNL");
+	if (SourceName) lua_pushstring(State, SourceName);
 
-	if (lua_type(State, -1) != LUA_TUSERDATA)
+	if (!AdoptConationStreamToLua(State, Stream))
 	{
-		VLDEBUG("No userdata found");
-		goto EasyFail;
+		lua_pop(State, 1);
+		lua_pushnil(State);
 	}
 
-	Conation::ConationStream *Stream = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
+	return SourceName ? 2 : 1;
+}
 
-	lua_settop(State, OldStackTop);
+static void SchedulerHook(lua_State *State, lua_Debug *)
+{ //Lets us kill runaway scripts, and stops a busy one from hogging a scheduler thread.
+	ScheduledTask *const Task = GetScheduledTask(State, true);
 
-	if (!Stream)
-	{
-		VLDEBUG("Failed to decode userdata");
-		goto EasyFail;
-	}
+	if (!Task) return;
 
-	//No arguments.
-	if (!Stream->CountArguments())
+	if (Task->Cancelled)
 	{
-		VLDEBUG("No arguments in stream at all, rewound or otherwise");
-		goto EasyFail;
+		luaL_error(State, "Job was killed");
+		return;
 	}
 
-	VLScopedPtr<Conation::ConationStream::BaseArg*> Arg { Stream->PopArgument() };
+	//Scripts that make their own coroutines inherit the hook, but we can only yield our own.
+	if (Task->Thread != State || Utils::GetMonotonicMs() - Task->SliceStart < LUA_SCHEDULER_SLICE_MS) return;
 
-	if (!Arg)
+	//Somewhere under a C function, like a sort comparator or a metamethod. We'll get another shot once it's back in plain Lua.
+	if (!VL_lua_isyieldable(State)) return;
+
+	Task->Wait = LuaWait{};
+	lua_yield(State, 0);
+}
+
+static void SpawnSchedulerThreads(void)
+{ //Scheduler mutex must be held.
+	while (Scheduler.Threads.size() < LUA_SCHEDULER_THREADS)
 	{
-		VLDEBUG("No arguments left");
-		goto EasyFail;
+		Scheduler.Threads.emplace_back();
+
+		SchedulerThread &New = Scheduler.Threads.back();
+
+		New.ThreadObj = new VLThreads::Thread((VLThreads::Thread::EntryFunc)SchedulerThreadFunc, &New);
+		New.ThreadObj->Start();
 	}
+}
 
-	//We also need to return the string name of the argument type for our first return value.
-	lua_pushinteger(State, Arg->Type);
+static void *SchedulerThreadFunc(SchedulerThread *Us)
+{
+	VLThreads::MutexKeeper Keeper { &Scheduler.Mutex };
 
-	switch (Arg->Type)
+	while (!Us->Doomed)
 	{
-		case Conation::ARGTYPE_BOOL:
-		{
-			lua_pushboolean(State, Arg->ReadAs<Conation::ConationStream::BoolArg>().Value);
-			break;
-		}
-		case Conation::ARGTYPE_FILE:
-		{
-			const Conation::ConationStream::FileArg *File = &Arg->ReadAs<Conation::ConationStream::FileArg>();
+		const uint64_t Now = Utils::GetMonotonicMs();
 
-			lua_pushstring(State, File->Filename);
-			lua_pushlstring(State, (const char*)File->Data, File->DataSize);
+		ScheduledTask *Next = nullptr;
+		bool MoreReady = false;
+		uint64_t SleepMs = UINT64_MAX;
 
-			break;
-		}
-		case Conation::ARGTYPE_BINSTREAM:
+		for (auto Iter = Scheduler.Tasks.begin(); Iter != Scheduler.Tasks.end();)
 		{
-			const Conation::ConationStream::BinStreamArg *BinStream = &Arg->ReadAs<Conation::ConationStream::BinStreamArg>();
+			ScheduledTask *const Task = *Iter;
 
-			lua_pushlstring(State, (const char*)BinStream->Data, BinStream->DataSize);
-			break;
-		}
-		case Conation::ARGTYPE_FILEPATH:
-		{
-			lua_pushstring(State, Arg->ReadAs<Conation::ConationStream::FilePathArg>().Path);
-			break;
-		}
-		case Conation::ARGTYPE_STRING:
-		{
-			lua_pushstring(State, Arg->ReadAs<Conation::ConationStream::StringArg>().String);
-			break;
-		}
-		case Conation::ARGTYPE_SCRIPT:
-		{
-			lua_pushstring(State, Arg->ReadAs<Conation::ConationStream::ScriptArg>().String);
-			break;
-		}
-		case Conation::ARGTYPE_INT32:
-		{
-			lua_pushinteger(State, Arg->ReadAs<Conation::ConationStream::Int32Arg>().Value);
-			break;
+			if (WaitIsReady(Task->Wait, Task->OurJob, Now))
+			{
+				if (Next)
+				{
+					MoreReady = true;
+					break;
+				}
+
+				Next = Task;
+				Iter = Scheduler.Tasks.erase(Iter);
+				continue;
+			}
+
+			if (Task->Wait.Deadline && Task->Wait.Deadline - Now < SleepMs) SleepMs = Task->Wait.Deadline - Now;
+
+			if (Task->Wait.Type == LuaWait::WAIT_PROCESS && SleepMs > LUA_WAIT_POLL_MS) SleepMs = LUA_WAIT_POLL_MS;
+
+			++Iter;
 		}
-		case Conation::ARGTYPE_UINT32:
+
+		if (!Next)
 		{
-			lua_pushinteger(State, Arg->ReadAs<Conation::ConationStream::Uint32Arg>().Value);
-			break;
+			Keeper.Unlock();
+
+			if (SleepMs == UINT64_MAX) Scheduler.Wakeup.Wait();
+			else Scheduler.Wakeup.TimedWait(SleepMs);
+
+			Keeper.Lock();
+			continue;
 		}
-		case Conation::ARGTYPE_INT64:
-		case Conation::ARGTYPE_UINT64: //Because Lua's only integer type is 64-bit signed, we just have to hope it fits.
+
+		if (MoreReady) Scheduler.Wakeup.Post(); //Get a sibling going on the rest.
+
+		Us->Running = Next;
+
+		Keeper.Unlock();
+
+		NetCmdStatus Result { false };
+		const bool Finished = RunScheduledTask(Next, Result);
+
+		Keeper.Lock();
+
+		if (Us->Doomed) return nullptr; //StopScheduler() gave up on us and owns the task now.
+
+		if (!Finished && !Next->Cancelled)
 		{
-			lua_pushinteger(State, Arg->ReadAs<Conation::ConationStream::Int64Arg>().Value);
-			break;
+			Scheduler.Tasks.push_back(Next); //Back of the line, so everyone gets a turn.
+			Us->Running = nullptr;
+			continue;
 		}
-		case Conation::ARGTYPE_NETCMDSTATUS:
-		{
-			const Conation::ConationStream::NetCmdStatusArg *Status = &Arg->ReadAs<Conation::ConationStream::NetCmdStatusArg>();
 
-			lua_pushboolean(State, Status->Code == STATUS_OK || Status->Code == STATUS_WARN); //Cuz sometimes we just wanna know if it worked.
-			lua_pushinteger(State, Status->Code);
-			lua_pushstring(State, Status->Msg);
-			break;
-		}
-		case Conation::ARGTYPE_ODHEADER:
-		{
-			const Conation::ConationStream::ODHeader &Hdr = Arg->ReadAs<Conation::ConationStream::ODHeaderArg>().Hdr;
+		//Under the lock, so a concurrent kill either beats this and we skip it, or it finds nothing to cancel.
+		if (!Next->Cancelled) Next->OnFinish(Next->OurJob, Result);
 
-			lua_pushstring(State, Hdr.Origin);
-			lua_pushstring(State, Hdr.Destination);
-			break;
-		}
-		default:
-			//Unknown value type.
-			VLDEBUG("Unknown value type " + VLString::IntToString(Arg->Type));
-			goto EasyFail;
+		Us->Running = nullptr;
+
+		Keeper.Unlock();
+
+		DestroyScheduledTask(Next, !Next->Cancelled);
+
+		Keeper.Lock();
+	}
+
+	return nullptr;
+}
+
+static bool RunScheduledTask(ScheduledTask *Task, NetCmdStatus &ResultOut)
+{ //Resumes the coroutine until it yields or finishes. Returns true if it finished.
+	int NumArgs = Task->StartArgs;
+
+	Task->StartArgs = 0;
+
+	if (Task->Wait.Type != LuaWait::WAIT_NONE)
+	{ //Build results on the main state, you can't call into a suspended coroutine.
+		NumArgs = PushWaitResults(Task->State, Task->Wait, Task->OurJob);
+		lua_xmove(Task->State, Task->Thread, NumArgs);
 	}
 
-	VLDEBUG("Success, returning");
-	//Aaaand this is why the stack needs to be empty before we start returning arguments.
-	return lua_gettop(State) - OldStackTop;
+	Task->Wait = LuaWait{};
+	Task->SliceStart = Utils::GetMonotonicMs();
+
+	const int Status = VL_lua_resume(Task->Thread, Task->State, NumArgs);
 
-}
+	if (Status == LUA_YIELD)
+	{ //Nothing we want in whatever it yielded.
+		lua_settop(Task->Thread, 0);
+		return false;
+	}
 
-static int CountCSArgsLua(lua_State *State)
-{
-	if (lua_type(State, -1) != LUA_TTABLE)
+	if (Status == LUA_OK)
 	{
-		return 0;
+		//If it returns some weird value, I guess just assume it worked.
+		ResultOut = lua_gettop(Task->Thread) > 0 && lua_type(Task->Thread, -1) == LUA_TBOOLEAN ? (bool)lua_toboolean(Task->Thread, -1) : true;
+		return true;
 	}
 
-	lua_pushstring(State, "VL_INTRNL");
-	lua_gettable(State, -2);
+	luaL_traceback(Task->State, Task->Thread, lua_tostring(Task->Thread, -1), 0);
 
-	if (lua_type(State, -1) != LUA_TUSERDATA) return 0;
+	const VLString Traceback { lua_tostring(Task->State, -1) };
 
-	Conation::ConationStream *Stream = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
+	VLDEBUG("FAILURE IN SCHEDULED SCRIPT, got traceback: " + Traceback);
 
-	lua_pushinteger(State, Stream->CountArguments());
-	return 1;
+	ResultOut = NetCmdStatus(false, STATUS_IERR, VLString("Lua error while running script function: ") + Traceback);
+
+	return true;
 }
 
-static int VerifyCSArgsLua_Subfunction(lua_State *State, decltype(&Conation::ConationStream::VerifyArgTypes) MemberFunc)
+static void DestroyScheduledTask(ScheduledTask *Task, const bool ReuseState)
 {
-	size_t ArgCount = lua_gettop(State);
+	AbandonWait(Task->Wait);
 
-	if (!ArgCount || lua_type(State, 1) != LUA_TTABLE)
-	{
-		VLDEBUG("Incorrect arguments passed, count is " + VLString::UintToString(ArgCount));
-	EasyFail:
-		lua_settop(State, 0);
-		lua_pushboolean(State, false);
-		return 1;
-	}
+	luaL_unref(Task->State, LUA_REGISTRYINDEX, Task->ThreadRef);
 
-	lua_pushstring(State, "VL_INTRNL");
-	lua_gettable(State, 1);
+	lua_pushnil(Task->State);
+	lua_setfield(Task->State, LUA_REGISTRYINDEX, "VL_SchedTask");
 
-	if (lua_type(State, -1) != LUA_TUSERDATA)
-	{
-		VLDEBUG("Is not a userdata");
+	lua_settop(Task->State, 0);
 
-		goto EasyFail;
-	}
+	//A coroutine we abandoned halfway might have left anything lying around, so don't recycle those.
+	if (ReuseState) ReleaseState(Task->State);
+	else CloseState(Task->State);
 
-	Conation::ConationStream *Stream = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
+	VLThreads::MutexKeeper Keeper { &Scheduler.Mutex };
 
-	size_t Inc = 2; //Cuz 1 is the 'self' argument.
+	--Scheduler.TaskCount; //Same lock as the task list, so the two never disagree.
 
-	std::vector<Conation::ArgType> ToCheck;
-	ToCheck.reserve(ArgCount - 1);
+	Keeper.Unlock();
 
-	for (; Inc <= ArgCount; ++Inc)
-	{
-		if (lua_type(State, Inc) != LUA_TNUMBER)
-		{
-			VLDEBUG("Passed argument " + VLString::UintToString(Inc) + " is not an integer");
-			goto EasyFail;
-		}
+	delete Task;
+}
 
-		const lua_Integer Num = lua_tointeger(State, Inc);
+void Script::ScheduleLoadedScriptFunction(const char *ScriptName, const char *FunctionName, Conation::ConationStream *Stream, Jobs::Job *OurJob, ScheduledJobCallback OnFinish)
+{
+	VLThreads::MutexKeeper Keeper { &LoadedScripts.Mutex };
 
-		if (Num < 0 || Num > Conation::ARGTYPE_MAXPOPULATED)
-		{
-			VLDEBUG("Range error, got value " + VLString::UintToString(Num) + " for argument #" + VLString::UintToString(Inc));
-			goto EasyFail;
-		}
+	auto Iter = LoadedScripts.Scripts.find(ScriptName);
 
-		ToCheck.push_back(static_cast<Conation::ArgType>(Num));
+	if (Iter == LoadedScripts.Scripts.end())
+	{
+		throw ScriptError { FunctionName, VLString("Script \"") + ScriptName + "\" is not loaded" };
 	}
 
+	const std::shared_ptr<const CompiledScript> Compiled { Iter->second };
 
-	const bool Result = (Stream->*MemberFunc)(ToCheck);
-
-	lua_settop(State, 0);
+	Keeper.Unlock();
 
-	lua_pushboolean(State, Result);
+	VLScopedPtr<lua_State*, void (*)(lua_State*)> State { AcquireState(), ReleaseState };
 
-	return 1;
-}
+	SetStateJob(State, OurJob);
 
+	//The script body runs here on the job worker, only the function itself goes on the scheduler.
+	if (!InitScript(LUAJOB_JOB, Compiled, State))
+	{
+		throw ScriptError	{
+								FunctionName,
+								VLString{"Failed to call InitScript() for script, got Lua error \""} + lua_tostring(State, -1) + "\""
+							};
+	}
 
-static int VerifyCSArgsLua(lua_State *State)
-{
-	return VerifyCSArgsLua_Subfunction(State, &Conation::ConationStream::VerifyArgTypes);
-}
+	PushScriptFunction(State, FunctionName, Stream, true, true);
 
-static int VerifyCSArgsLuaStartWith(lua_State *State)
-{
-	return VerifyCSArgsLua_Subfunction(State, &Conation::ConationStream::VerifyArgTypesStartWith);
-}
+	lua_State *const Thread = lua_newthread(State);
+	const int ThreadRef = luaL_ref(State, LUA_REGISTRYINDEX);
 
-static void InitConationStreamBindings(lua_State *State)
-{
-	///Create the class template table.
-	lua_pushstring(State, "ConationStream");
-	lua_newtable(State);
+	lua_xmove(State, Thread, 2); //Function and argument.
+	lua_settop(State, 0);
 
-	lua_settable(State, -3);
+	lua_sethook(Thread, SchedulerHook, LUA_MASKCOUNT, LUA_SCHEDULER_HOOK_COUNT);
 
-	///Get the class template table back onto the stack since lua_settable() popped it.
-	lua_pushstring(State, "ConationStream");
-	lua_gettable(State, -2);
+	ScheduledTask *const Task = new ScheduledTask(OurJob, State.Forget(), Thread, ThreadRef, OnFinish);
 
-	///Populate the class template table.
+	lua_pushlightuserdata(Task->State, Task);
+	lua_setfield(Task->State, LUA_REGISTRYINDEX, "VL_SchedTask");
 
-	//The new instance function.
-	lua_pushstring(State, "New");
-	lua_pushcfunction(State, NewLuaConationStream);
+	VLThreads::MutexKeeper SchedKeeper { &Scheduler.Mutex };
 
-	lua_settable(State, -3);
+	SpawnSchedulerThreads();
 
-	//Argument pushing
-	lua_pushstring(State, "Push");
-	lua_pushcfunction(State, PushArg_LuaConationStream);
+	Scheduler.Tasks.push_back(Task);
+	++Scheduler.TaskCount;
 
-	lua_settable(State, -3);
+	SchedKeeper.Unlock();
 
-	//Argument popping
-	lua_pushstring(State, "Pop");
-	lua_pushcfunction(State, PopArg_LuaConationStream);
+	Scheduler.Wakeup.Post();
+}
 
-	lua_settable(State, -3);
+void Script::CancelScheduledJob(Jobs::Job *OurJob)
+{ /*Once this returns, nothing on the scheduler will touch OurJob again. The one exception is a C function
+	* that was already blocking when we gave up, which still has whatever it looked up before.*/
+	VLThreads::MutexKeeper Keeper { &Scheduler.Mutex };
 
-	//Verification of argument types.
-	lua_pushstring(State, "VerifyArgTypes");
-	lua_pushcfunction(State, VerifyCSArgsLua);
+	for (auto Iter = Scheduler.Tasks.begin(); Iter != Scheduler.Tasks.end(); ++Iter)
+	{
+		ScheduledTask *const Task = *Iter;
 
-	lua_settable(State, -3);
+		if (Task->OurJob != OurJob) continue;
 
-	//More verification of argument types.
-	lua_pushstring(State, "VerifyArgTypesStartWith");
-	lua_pushcfunction(State, VerifyCSArgsLuaStartWith);
+		Scheduler.Tasks.erase(Iter);
 
-	lua_settable(State, -3);
+		Keeper.Unlock();
 
+		DestroyScheduledTask(Task, false);
+		return;
+	}
 
-	//Argument counting.
-	lua_pushstring(State, "CountArguments");
-	lua_pushcfunction(State, CountCSArgsLua);
+	auto Runner = std::find_if(Scheduler.Threads.begin(), Scheduler.Threads.end(),
+								[OurJob] (const SchedulerThread &Ref) { return Ref.Running && Ref.Running->OurJob == OurJob; });
 
-	lua_settable(State, -3);
+	if (Runner == Scheduler.Threads.end()) return;
 
-	//Returns a table of argument types.
-	lua_pushstring(State, "GetArgTypes");
-	lua_pushcfunction(State, GetCSArgsList_Lua);
+	ScheduledTask *const Task = Runner->Running;
 
-	lua_settable(State, -3);
+	//The hook errors out of Lua code, and anything blocking in C gets noticed when it returns.
+	Task->Cancelled = true;
 
-	//Returns a table containing the headers for our job that usually get prepended to a stream.
-	lua_pushstring(State, "PopJobArguments");
-	lua_pushcfunction(State, PopCSJobArgs);
+	//Fire on the very next instruction or call instead of waiting out the count. lua_sethook() is safe to call from another thread.
+	lua_sethook(Task->Thread, SchedulerHook, LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, 1);
 
-	lua_settable(State, -3);
+	for (uint64_t Waited = 0; Waited < LUA_SCHEDULER_CANCEL_TIMEOUT_MS; Waited += LUA_WAIT_POLL_MS)
+	{
+		Keeper.Unlock();
 
-	//When we want a string containing the full raw data.
-	lua_pushstring(State, "GetData");
-	lua_pushcfunction(State, GetCSData_Lua);
+		Utils::vl_sleep(LUA_WAIT_POLL_MS);
 
-	lua_settable(State, -3);
+		Keeper.Lock();
 
-	//When we want a string just containing the argument data, minus the header.
-	lua_pushstring(State, "GetArgData");
-	lua_pushcfunction(State, GetCSArgData_Lua);
+		if (Runner->Running != Task) return; //Its scheduler thread cleaned it up.
+	}
 
-	lua_settable(State, -3);
+	/*Still stuck in C code somewhere. Killing the scheduler thread would take every other state on it down too,
+	* so we just cut the task loose from the job. It errors out as soon as it's back in Lua,
+	* and its scheduler thread throws the state away like any other cancelled task.*/
+	if (LuaArena *const Arena = GetStateArena(Task->State)) Arena->Owner = nullptr;
 
-	//Get the header info for the stream.
-	lua_pushstring(State, "GetHeader");
-	lua_pushcfunction(State, GetCSHeader_Lua);
+	VLWARN("Scheduled job stuck in a C call, leaving it to die when it returns.");
+}
 
-	lua_settable(State, -3);
+void Script::WakeScheduler(void)
+{ //Call after pushing something a scheduled job might be waiting on.
+	if (Scheduler.TaskCount) Scheduler.Wakeup.Post();
+}
 
-	//Build an otherwise empty, ODHeader-inverted, report-flagged response message from the original's stream headers.
-	lua_pushstring(State, "BuildResponse");
-	lua_pushcfunction(State, BuildCSResponse_Lua);
+void Script::StopScheduler(void)
+{
+	VLThreads::MutexKeeper Keeper { &Scheduler.Mutex };
 
-	lua_settable(State, -3);
+	std::list<SchedulerThread> Threads;
+	std::list<ScheduledTask*> Tasks;
 
-	//Iterate over stream arguments
-	lua_pushstring(State, "Iter");
-	lua_pushcfunction(State, GetCSIter);
+	Threads.swap(Scheduler.Threads);
+	Tasks.swap(Scheduler.Tasks);
 
-	lua_settable(State, -3);
+	for (SchedulerThread &Ref : Threads) Ref.Doomed = true;
 
-	//Rewind stream
-	lua_pushstring(State, "Rewind");
-	lua_pushcfunction(State, RewindCS_Lua);
+	Keeper.Unlock();
 
-	lua_settable(State, -3);
+	for (SchedulerThread &Ref : Threads)
+	{
+		Ref.ThreadObj->Kill();
+		Ref.ThreadObj->Join();
+	}
 
-	//Pop ConationStream from the stack before we return, for the next binding functions.
-	///This is important!
-	lua_pop(State, 1);
+	for (ScheduledTask *Task : Tasks) DestroyScheduledTask(Task, false);
 }
 
-static int GetCSData_Lua(lua_State *State)
+void Script::StopWorkerPool(void)
 {
-	size_t ArgCount = lua_gettop(State);
+	VLThreads::MutexKeeper Keeper { &WorkerPool.Mutex };
 
-	if (ArgCount != 1 || lua_type(State, 1) != LUA_TTABLE)
+	std::list<LuaPoolThread> Threads;
+
+	Threads.swap(WorkerPool.Threads);
+	WorkerPool.Jobs.clear();
+
+	for (LuaPoolThread &Ref : Threads) Ref.Doomed = true;
+
+	Keeper.Unlock();
+
+	for (LuaPoolThread &Ref : Threads)
 	{
-	EasyFail:
-		lua_settop(State, 0);
-		lua_pushboolean(State, false);
-		return 1;
+		Ref.ThreadObj->Kill();
+		Ref.ThreadObj->Join();
 	}
+}
 
-	lua_pushstring(State, "VL_INTRNL");
-	lua_gettable(State, 1);
+static void SnapshotTable(lua_State *State, const int Baseline, const int Target)
+{ //Baseline[Target] = shallow copy of Target. Both indices must be absolute.
+	lua_pushvalue(State, Target);
+	lua_newtable(State);
+	
+	lua_pushnil(State);
+	
+	while (lua_next(State, Target) != 0)
+	{
+		lua_pushvalue(State, -2);
+		lua_insert(State, -2);
+		lua_rawset(State, -4);
+	}
+	
+	lua_rawset(State, Baseline);
+}
 
-	if (lua_type(State, -1) != LUA_TUSERDATA) goto EasyFail;
+static void SnapshotTree(lua_State *State, const int Baseline, const int Target, const int Depth)
+{ //SnapshotTable() for Target and every table under it, Depth levels down. Each table only once, _G and package.loaded point back at each other.
+	lua_checkstack(State, 8);
+	
+	lua_pushvalue(State, Target);
+	lua_rawget(State, Baseline);
+	
+	const bool Seen = !lua_isnil(State, -1);
+	
+	lua_pop(State, 1);
+	
+	if (Seen) return;
+	
+	SnapshotTable(State, Baseline, Target);
+	
+	if (Depth <= 0) return;
+	
+	lua_pushnil(State);
+	
+	while (lua_next(State, Target) != 0)
+	{
+		if (lua_type(State, -1) == LUA_TTABLE) SnapshotTree(State, Baseline, lua_gettop(State), Depth - 1);
+		
+		lua_pop(State, 1);
+	}
+}
 
-	Conation::ConationStream *Stream = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
+static int RestoreBaseline(lua_State *State)
+{ //Puts every snapshotted table back the way it was right after warmup. Run protected, since rawset can throw on OOM.
+	//setmetatable(_G, ...) and messing with the string metatable don't show up in any table's contents.
+	lua_pushglobaltable(State);
+	lua_getfield(State, LUA_REGISTRYINDEX, "VL_GlobalsMeta");
+	lua_setmetatable(State, -2);
+	lua_pop(State, 1);
+	
+	lua_pushliteral(State, "");
+	lua_getfield(State, LUA_REGISTRYINDEX, "VL_StringMeta");
+	lua_setmetatable(State, -2);
+	lua_pop(State, 1);
+	
+	lua_getfield(State, LUA_REGISTRYINDEX, "VL_Baseline");
+	
+	const int Baseline = lua_gettop(State);
+	
+	lua_pushnil(State);
+	
+	while (lua_next(State, Baseline) != 0)
+	{ //Key is the live table, value is our copy of it.
+		const int Target = lua_gettop(State) - 1;
+		const int Copy = lua_gettop(State);
+		
+		//Drop anything the script added.
+		lua_pushnil(State);
+		
+		while (lua_next(State, Target) != 0)
+		{
+			lua_pop(State, 1);
+			
+			lua_pushvalue(State, -1);
+			lua_rawget(State, Copy);
+			
+			const bool Added = lua_isnil(State, -1);
+			
+			lua_pop(State, 1);
+			
+			if (!Added) continue;
+			
+			lua_pushvalue(State, -1);
+			lua_pushnil(State);
+			lua_rawset(State, Target); //Clearing an existing field mid-traversal is allowed.
+		}
+		
+		//Put back anything it changed or removed.
+		lua_pushnil(State);
+		
+		while (lua_next(State, Copy) != 0)
+		{
+			lua_pushvalue(State, -2);
+			lua_insert(State, -2);
+			lua_rawset(State, Target);
+		}
+		
+		lua_pop(State, 1);
+	}
+	
+	return 0;
+}
 
-	if (!Stream) goto EasyFail;
+static void LuaArenaCharge(LuaArena *Arena, const uint64_t NewCurrent)
+{
+	Arena->Current.store(NewCurrent, std::memory_order_relaxed);
+	
+	if (NewCurrent > Arena->Peak.load(std::memory_order_relaxed)) Arena->Peak.store(NewCurrent, std::memory_order_relaxed);
+	
+	Jobs::Job *const Owner = Arena->Owner.load(std::memory_order_relaxed);
+	
+	if (!Owner) return;
+	
+	Owner->LuaMemCurrent.store(NewCurrent, std::memory_order_relaxed);
+	
+	if (NewCurrent > Owner->LuaMemPeak.load(std::memory_order_relaxed)) Owner->LuaMemPeak.store(NewCurrent, std::memory_order_relaxed);
+}
 
-	lua_pushlstring(State, (const char*)Stream->GetData().data(), Stream->GetData().size());
+static bool ChargeLuaBuffer(lua_State *State, const uint64_t OldSize, const uint64_t NewSize, const bool Force)
+{ //VL.Buffer contents come from malloc() rather than Lua, but they count against the same limit. Force is for memory that's already been allocated or freed.
+	LuaArena *const Arena = GetStateArena(State);
+	
+	if (!Arena) return true;
+	
+	const uint64_t Current = Arena->Current.load(std::memory_order_relaxed);
+	
+	if (!Force && NewSize > OldSize && Current - OldSize + NewSize + Arena->Parked->load(std::memory_order_relaxed) > Arena->Limit) return false;
+	
+	LuaArenaCharge(Arena, Current - OldSize + NewSize);
+	
+	return true;
+}
 
-	return 1;
+static void *LuaArenaGetBlock(LuaArena *Arena, const size_t Size)
+{
+	if (Size > LUA_ARENA_MAX_SMALL) return malloc(Size);
+	
+	const size_t Class = (Size - 1) / LUA_ARENA_GRANULE;
+	
+	if (Arena->FreeLists[Class])
+	{ //Freed blocks keep the next pointer in their first bytes.
+		void *const Block = Arena->FreeLists[Class];
+		
+		Arena->FreeLists[Class] = *static_cast<void**>(Block);
+		
+		return Block;
+	}
+	
+	const size_t BlockSize = (Class + 1) * LUA_ARENA_GRANULE;
+	
+	if ((size_t)(Arena->SlabEnd - Arena->SlabCursor) < BlockSize)
+	{ //Whatever's left in the old slab is too small to bother with.
+		uint8_t *const Slab = static_cast<uint8_t*>(malloc(LUA_ARENA_SLAB_SIZE));
+		
+		if (!Slab) return nullptr;
+		
+		Arena->Slabs.push_back(Slab);
+		
+		Arena->SlabCursor = Slab;
+		Arena->SlabEnd = Slab + LUA_ARENA_SLAB_SIZE;
+	}
+	
+	void *const Block = Arena->SlabCursor;
+	
+	Arena->SlabCursor += BlockSize;
+	
+	return Block;
 }
-static int GetCSArgData_Lua(lua_State *State)
-{
-	size_t ArgCount = lua_gettop(State);
 
-	if (ArgCount != 1 || lua_type(State, 1) != LUA_TTABLE)
+static void LuaArenaPutBlock(LuaArena *Arena, void *Ptr, const size_t Size)
+{
+	if (Size > LUA_ARENA_MAX_SMALL)
 	{
-	EasyFail:
-		lua_settop(State, 0);
-		lua_pushboolean(State, false);
-		return 1;
+		free(Ptr);
+		return;
 	}
+	
+	const size_t Class = (Size - 1) / LUA_ARENA_GRANULE;
+	
+	*static_cast<void**>(Ptr) = Arena->FreeLists[Class];
+	Arena->FreeLists[Class] = Ptr;
+}
 
-	lua_pushstring(State, "VL_INTRNL");
-	lua_gettable(State, 1);
+static void *LuaArenaAlloc(void *UserData, void *Ptr, size_t OldSize, size_t NewSize)
+{ //Lua always tells us the old size, so blocks don't need headers.
+	LuaArena *const Arena = static_cast<LuaArena*>(UserData);
+	
+	if (!Ptr) OldSize = 0; //5.4 puts the object type in here for new blocks.
+	
+	const uint64_t Current = Arena->Current.load(std::memory_order_relaxed);
+	
+	if (NewSize == 0)
+	{
+		if (Ptr) LuaArenaPutBlock(Arena, Ptr, OldSize);
+		
+		LuaArenaCharge(Arena, Current - OldSize);
+		return nullptr;
+	}
+	
+	//Only growing can fail. Returning null here is what makes Lua raise a memory error in the script.
+	if (NewSize > OldSize && Current - OldSize + NewSize + Arena->Parked->load(std::memory_order_relaxed) > Arena->Limit) return nullptr;
+	
+	void *Block = nullptr;
+	
+	if (Ptr && OldSize > LUA_ARENA_MAX_SMALL && NewSize > LUA_ARENA_MAX_SMALL)
+	{
+		Block = realloc(Ptr, NewSize);
+		
+		if (!Block && NewSize > OldSize) return nullptr;
+		
+		if (!Block) Block = Ptr; //Lua assumes shrinking never fails, so keep the bigger block.
+	}
+	else if (Ptr && OldSize <= LUA_ARENA_MAX_SMALL && NewSize <= LUA_ARENA_MAX_SMALL
+			&& (OldSize - 1) / LUA_ARENA_GRANULE == (NewSize - 1) / LUA_ARENA_GRANULE)
+	{ //Still fits the same size class.
+		Block = Ptr;
+	}
+	else if (Ptr && NewSize < OldSize && NewSize <= LUA_ARENA_MAX_SMALL && !Arena->FreeLists[(NewSize - 1) / LUA_ARENA_GRANULE])
+	{ //Shrinking into a smaller class with nothing free there. Carving a new slab could fail, and shrinks aren't allowed to, so it just stays a bit roomy.
+		if (OldSize > LUA_ARENA_MAX_SMALL)
+		{ //It's from malloc(), but from now on it gets treated like a slab block, so remember to free it ourselves.
+			try
+			{
+				Arena->Strays.push_back(Ptr);
+			}
+			catch (...)
+			{ //Then it leaks. Still better than failing a shrink.
+			}
+		}
+		
+		Block = Ptr;
+	}
+	else
+	{
+		Block = LuaArenaGetBlock(Arena, NewSize);
+		
+		if (!Block) return nullptr;
+		
+		if (Ptr)
+		{
+			memcpy(Block, Ptr, std::min(OldSize, NewSize));
+			LuaArenaPutBlock(Arena, Ptr, OldSize);
+		}
+	}
+	
+	LuaArenaCharge(Arena, Current - OldSize + NewSize);
+	
+	return Block;
+}
 
-	if (lua_type(State, -1) != LUA_TUSERDATA) goto EasyFail;
+static int LuaArenaPanic(lua_State *State)
+{ //Same as what luaL_newstate() would have given us.
+	VLWARN(VLString("Unprotected error in Lua state: ") + (lua_type(State, -1) == LUA_TSTRING ? lua_tostring(State, -1) : "(error object is not a string)"));
+	return 0;
+}
 
-	Conation::ConationStream *Stream = static_cast<Conation::ConationStream*>(lua_touserdata(State, -1));
+static lua_State *NewArenaState(void)
+{
+	LuaArena *const Arena = new LuaArena;
+	
+	lua_State *const State = lua_newstate(LuaArenaAlloc, Arena);
+	
+	if (!State)
+	{
+		delete Arena;
+		return nullptr;
+	}
+	
+	lua_atpanic(State, LuaArenaPanic);
+	
+	return State;
+}
 
-	if (!Stream) goto EasyFail;
+static LuaArena *GetStateArena(lua_State *State)
+{
+	void *UserData = nullptr;
+	
+	return lua_getallocf(State, &UserData) == LuaArenaAlloc ? static_cast<LuaArena*>(UserData) : nullptr;
+}
 
-	lua_pushlstring(State, (const char*)Stream->GetArgData(), Stream->GetHeader().StreamArgsSize);
+static void CloseState(lua_State *State)
+{ //lua_close() hands every block back to the arena, then the slabs all go in one shot.
+	LuaArena *const Arena = GetStateArena(State);
+	
+	if (Arena) Arena->Owner = nullptr;
+	
+	lua_close(State);
+	
+	delete Arena;
+}
 
-	return 1;
+static void SetStateJob(lua_State *State, Jobs::Job *OurJob)
+{ //Store our job pointer for C/C++ functions that want it, and start charging memory usage to it.
+	lua_pushlightuserdata(State, OurJob);
+	lua_setglobal(State, "VL_OurJob_LUSRDTA");
+	
+	LuaArena *const Arena = GetStateArena(State);
+	
+	if (!Arena) return;
+	
+	Arena->Owner = OurJob;
+	
+	if (!OurJob) return;
+	
+	Arena->Peak = Arena->Current.load();
+	
+	OurJob->LuaMemCurrent = Arena->Current.load();
+	OurJob->LuaMemPeak = Arena->Current.load();
 }
 
-bool Script::LoadScript(const char *ScriptBuffer, const char *ScriptName, const bool OverwritePermissible)
+static lua_State *CreateWarmState(void)
 {
-	if (!OverwritePermissible && LoadedScripts.count(ScriptName) != 0) return false;
-
-	LoadedScripts[ScriptName] = ScriptBuffer;
-	return true;
+	lua_State *const State = NewArenaState();
+	
+	if (!State) return nullptr;
+	
+	//Load standard Lua libraries.
+	luaL_openlibs(State);
+	
+	//Load VLAPI functions
+	LoadVLAPI(State);
+	
+	VLDEBUG("Created warm Lua state");
+	
+	lua_settop(State, 0);
+	
+	/*Remember what the globals, the library tables and whatever's nested in them look like, so we can undo whatever a job does to them.
+	* package.loaded is in there too, so require() from one job doesn't stick around for the next.*/
+	lua_newtable(State);
+	lua_pushglobaltable(State);
+	
+	SnapshotTree(State, 1, 2, LUA_BASELINE_DEPTH);
+	
+	if (lua_getmetatable(State, 2)) SnapshotTree(State, 1, lua_gettop(State), LUA_BASELINE_DEPTH);
+	else lua_pushnil(State);
+	
+	lua_setfield(State, LUA_REGISTRYINDEX, "VL_GlobalsMeta");
+	
+	lua_pushliteral(State, "");
+	
+	if (lua_getmetatable(State, -1)) SnapshotTree(State, 1, lua_gettop(State), LUA_BASELINE_DEPTH);
+	else lua_pushnil(State);
+	
+	lua_setfield(State, LUA_REGISTRYINDEX, "VL_StringMeta");
+	
+	lua_settop(State, 1);
+	
+	lua_pushvalue(State, 1);
+	lua_setfield(State, LUA_REGISTRYINDEX, "VL_Baseline");
+	
+	//Last, so it has everything above. Whatever a job refs or stashes in there goes too.
+	lua_pushvalue(State, LUA_REGISTRYINDEX);
+	
+	SnapshotTable(State, 1, 2);
+	
+	lua_settop(State, 0);
+	
+	return State;
 }
 
-bool Script::UnloadScript(const char *ScriptName)
+static lua_State *AcquireState(void)
 {
-	if (!LoadedScripts.count(ScriptName)) return false;
-
-	LoadedScripts.erase(ScriptName);
-	return true;
+	VLThreads::MutexKeeper Keeper { &WarmStates.Mutex };
+	
+	if (!WarmStates.Idle.empty())
+	{
+		lua_State *const State = WarmStates.Idle.back();
+		WarmStates.Idle.pop_back();
+		return State;
+	}
+	
+	Keeper.Unlock();
+	
+	return CreateWarmState();
 }
 
-bool Script::ScriptIsLoaded(const char *ScriptName)
+static void ReleaseState(lua_State *State)
 {
-	return LoadedScripts.count(ScriptName);
+	LuaArena *const Arena = GetStateArena(State);
+	
+	if (Arena)
+	{ //Whatever job we were charging is on its way out. Anything it left sitting in channels stays its problem, not the next job's.
+		Arena->Owner = nullptr;
+		Arena->Limit = LUA_MEMORY_LIMIT_DEFAULT;
+		Arena->Parked = std::make_shared<std::atomic<uint64_t> >();
+	}
+	
+	lua_Debug Info{};
+	
+	//If something is still on the call stack, we're being unwound by a killed job thread. Don't trust that state.
+	bool Reusable = lua_getstack(State, 0, &Info) == 0;
+	
+	lua_Integer Uses = 0;
+	
+	if (Reusable)
+	{
+		lua_getfield(State, LUA_REGISTRYINDEX, "VL_StateUses");
+		
+		Uses = lua_tointeger(State, -1) + 1;
+		
+		lua_pop(State, 1);
+		
+		Reusable = Uses < LUA_WARM_STATE_MAX_USES;
+	}
+	
+	if (Reusable)
+	{
+		lua_settop(State, 0);
+		
+		//debug.sethook() would otherwise follow the state into the next job.
+		lua_sethook(State, nullptr, 0, 0);
+		
+		//Takes the registry back too, VL_OrderStream and all, so the count goes back in afterwards.
+		lua_pushcfunction(State, RestoreBaseline);
+		
+		Reusable = lua_pcall(State, 0, 0, 0) == LUA_OK;
+		
+		lua_settop(State, 0);
+		
+		if (Reusable)
+		{
+			lua_pushinteger(State, Uses);
+			lua_setfield(State, LUA_REGISTRYINDEX, "VL_StateUses");
+		}
+		
+		if (Reusable) lua_gc(State, LUA_GCCOLLECT, 0);
+		
+		//A job that went big leaves its slabs behind, and those only come back when the state goes.
+		if (Arena && Arena->Slabs.size() > LUA_ARENA_KEEP_SLABS) Reusable = false;
+	}
+	
+	if (Reusable)
+	{
+		const VLThreads::MutexKeeper Keeper { &WarmStates.Mutex };
+		
+		if (WarmStates.Idle.size() < LUA_WARM_STATES_MAX)
+		{
+			WarmStates.Idle.push_back(State);
+			return;
+		}
+	}
+	
+	CloseState(State);
 }
 
-static lua_State *InitScript(const Script::LuaJobType Type, const VLString &ScriptData, lua_State *const InState)
-{
+static lua_State *InitScript(const Script::LuaJobType Type, const std::shared_ptr<const CompiledScript> &Compiled, lua_State *const InState)
+{ //Expects a state from AcquireState(), which already has the standard libraries and VLAPI loaded.
 	VLDEBUG("Entered");
 
-	lua_State *const State = InState ? InState : luaL_newstate();
-	VLScopedPtr<lua_State *, decltype(&lua_close)> StateGuard { State, &lua_close };
+	lua_State *const State = InState ? InState : AcquireState();
+	VLScopedPtr<lua_State *, void (*)(lua_State*)> StateGuard { State, ReleaseState };
 
 	if (InState) StateGuard.Forget();
 
 	VLDEBUG("Entered with custom state: " + (InState ? "true" : "false"));
 
-	//Load standard Lua libraries.
-	luaL_openlibs(State);
-
-#ifdef DEBUG
-	puts("luaL_openlibs() succeeded");
-#endif
-	//Load VLAPI functions
-	LoadVLAPI(State);
-
-#ifdef DEBUG
-	puts("LoadVLAPI() succeeded");
-#endif
-
-	const bool Success = luaL_loadbuffer(State, ScriptData, ScriptData.Length(), "VLLUA") == LUA_OK;
+	const bool Success = !Compiled->Bytecode.empty() ?
+							luaL_loadbuffer(State, (const char*)Compiled->Bytecode.data(), Compiled->Bytecode.size(), "VLLUA") == LUA_OK :
+							luaL_loadbuffer(State, Compiled->Source, Compiled->Source.Length(), "VLLUA") == LUA_OK;
 
 	if (!Success)
 	{
@@ -2893,9 +6918,12 @@ static lua_State *InitScript(const Script::LuaJobType Type, const VLString &Scri
 	puts("luaL_loadbuffer() succeeded");
 #endif
 
-	//We store our own source for various purposes.
-	lua_pushstring(State, ScriptData);
-	lua_setglobal(State, "VL_LuaSource");
+	//Workers and VL.ParallelMap() start their states from the same chunk we did.
+	PushCompiledScript(State, Compiled);
+	lua_setglobal(State, "VL_CompiledScript");
+	
+	lua_pushstring(State, Compiled->Hash);
+	lua_setglobal(State, "VL_ScriptHash");
 	
 	//Set this BEFORE we call the initial script startup.
 	lua_pushinteger(State, Type);
@@ -2914,10 +6942,61 @@ static lua_State *InitScript(const Script::LuaJobType Type, const VLString &Scri
 
 	lua_settop(State, 0); //Make sure the stack is clean afterwards.
 
+	StateGuard.Forget();
+	
 	return State;
 
 }
 
+static void PushCompiledScript(lua_State *State, const std::shared_ptr<const CompiledScript> &Compiled)
+{
+	typedef std::shared_ptr<const CompiledScript> CompiledPtr;
+	
+	CompiledPtr *Handle = static_cast<CompiledPtr*>(lua_newuserdata(State, sizeof(CompiledPtr)));
+	
+	new (Handle) CompiledPtr(Compiled);
+	
+	if (luaL_newmetatable(State, LUA_COMPILED_METATABLE))
+	{
+		lua_pushcfunction(State, CompiledScriptGCFunc);
+		lua_setfield(State, -2, "__gc");
+	}
+	
+	lua_setmetatable(State, -2);
+}
+
+static std::shared_ptr<const CompiledScript> GetStateScript(lua_State *State)
+{ //Whatever InitScript() ran in this state.
+	lua_getglobal(State, "VL_CompiledScript");
+	
+	if (lua_type(State, -1) != LUA_TUSERDATA || !lua_getmetatable(State, -1))
+	{
+		lua_pop(State, 1);
+		return nullptr;
+	}
+	
+	luaL_getmetatable(State, LUA_COMPILED_METATABLE);
+	
+	const bool IsCompiled = lua_rawequal(State, -1, -2);
+	
+	std::shared_ptr<const CompiledScript> RetVal;
+	
+	if (IsCompiled) RetVal = *static_cast<std::shared_ptr<const CompiledScript>*>(lua_touserdata(State, -3));
+	
+	lua_pop(State, 3);
+	
+	return RetVal;
+}
+
+static int CompiledScriptGCFunc(lua_State *State)
+{
+	typedef std::shared_ptr<const CompiledScript> CompiledPtr;
+	
+	static_cast<CompiledPtr*>(lua_touserdata(State, 1))->~CompiledPtr();
+	
+	return 0;
+}
+
 bool Script::ExecuteScriptFunction(	const Script::LuaJobType Type,
 									const char *ScriptData,
 									const char *FunctionName,
@@ -2925,15 +7004,45 @@ bool Script::ExecuteScriptFunction(	const Script::LuaJobType Type,
 									Jobs::Job *OurJob)
 
 {
-	VLScopedPtr<lua_State*, decltype(&lua_close)> State { luaL_newstate(), &lua_close };
+	VLString Error;
+	
+	const std::shared_ptr<const CompiledScript> Compiled { CompileScript(ScriptData, false, &Error) };
+	
+	if (!Compiled)
+	{
+		throw ScriptError { FunctionName, VLString{"Failed to compile script, got Lua error \""} + Error + "\"" };
+	}
+	
+	return RunScriptFunction(Type, Compiled, FunctionName, Stream, OurJob);
+}
 
-	if (OurJob != nullptr)
-	{ //Store our job pointer for C/C++ functions that want it.
-		lua_pushlightuserdata(State, OurJob);
-		lua_setglobal(State, "VL_OurJob_LUSRDTA");
+bool Script::ExecuteLoadedScriptFunction(const char *ScriptName, const char *FunctionName, Conation::ConationStream *Stream, Jobs::Job *OurJob)
+{
+	VLThreads::MutexKeeper Keeper { &LoadedScripts.Mutex };
+	
+	auto Iter = LoadedScripts.Scripts.find(ScriptName);
+	
+	if (Iter == LoadedScripts.Scripts.end())
+	{
+		throw ScriptError { FunctionName, VLString("Script \"") + ScriptName + "\" is not loaded" };
 	}
+	
+	//Hold our own reference so an unload while we're running doesn't pull the rug out.
+	const std::shared_ptr<const CompiledScript> Compiled { Iter->second };
+	
+	Keeper.Unlock();
+	
+	return RunScriptFunction(LUAJOB_JOB, Compiled, FunctionName, Stream, OurJob);
+}
+
+static bool RunScriptFunction(const Script::LuaJobType Type, const std::shared_ptr<const CompiledScript> &Compiled,
+								const char *FunctionName, Conation::ConationStream *Stream, Jobs::Job *OurJob)
+{
+	VLScopedPtr<lua_State*, void (*)(lua_State*)> State { AcquireState(), ReleaseState };
+
+	if (OurJob != nullptr) SetStateJob(State, OurJob);
 
-	lua_State *const RetState = InitScript(Type, ScriptData, State);
+	lua_State *const RetState = InitScript(Type, Compiled, State);
 
 	if (!RetState)
 	{
@@ -2953,49 +7062,7 @@ bool Script::ExecuteScriptFunction(	const Script::LuaJobType Type,
 	}
 
 
-	///All this is to create a duplicated Lua-ified ConationStream for the argument to FunctionName.
-
-	if (!CloneConationStreamToLua(State, Stream))
-	{ //Call the Lua function VL.ConationStream:New() to get a new copy for arguments. Pushes the Lua ConationStream onto the stack.
-		throw ScriptError { FunctionName
-						, "Failed to lua_pcall() required C prerequesite function NewLuaConationStream()."
-						};
-	}
-
-	if (lua_type(State, -1) != LUA_TTABLE)
-	{ //NewLuaConationStream() should return a table (a lua ConationStream)
-		throw ScriptError { FunctionName
-
-						, "C prerequesite function NewLuaConationStream() did not return a Lua ConationStream."
-						};
-	}
-
-	///Now we have the Lua-ified ConationStream on the stack, and we're gonna use it as the only argument to our script function.
-	//Find our function.
-	lua_getglobal(State, FunctionName);
-
-	if (lua_type(State, -1) != LUA_TFUNCTION)
-	{
-		throw ScriptError { FunctionName
-						, "Requested Lua script function is not actually a function or does not exist."
-						};
-	}
-
-	lua_pushvalue(State, -2);
-
-	//Call the script function.
-	if (lua_pcall(State, 1, 1, 0) != LUA_OK)
-	{
-		luaL_traceback(State, State, nullptr, 1);
-
-		const VLString Traceback { lua_tostring(State, -1) };
-
-		VLDEBUG("FAILURE IN SCRIPTING CORE, got traceback: " + Traceback);
-
-		throw ScriptError { FunctionName
-						, VLString("Lua error while calling lua_pcall() for function: ") + Traceback
-						};
-	}
+	CallScriptFunction(State, FunctionName, Stream);
 
 	//If it returns some weird value, I guess just assume it worked.
 	const bool FinalResult = lua_type(State, -1) == LUA_TBOOLEAN ? lua_toboolean(State, -1) : true;
@@ -3007,13 +7074,9 @@ void Script::ExecuteStartupScript(Jobs::Job *const OurJob)
 { //The job object we get is kinda butchered and limited compared to what we get via executing a script function
 	if (!IdentityModule::GetStartupScript()) return;
 
-	VLScopedPtr<lua_State*, decltype(&lua_close)> State { luaL_newstate(), &lua_close };
+	VLScopedPtr<lua_State*, void (*)(lua_State*)> State { AcquireState(), ReleaseState };
 
-	if (OurJob != nullptr)
-	{ //Store our job pointer for C/C++ functions that want it.
-		lua_pushlightuserdata(State, OurJob);
-		lua_setglobal(State, "VL_OurJob_LUSRDTA");
-	}
+	if (OurJob != nullptr) SetStateJob(State, OurJob);
 
 	const VLString &StartupScript { IdentityModule::GetStartupScript() };
 
@@ -3022,7 +7085,14 @@ void Script::ExecuteStartupScript(Jobs::Job *const OurJob)
 		return;
 	}
 
-	lua_State *const RetState = InitScript(LUAJOB_STARTUP, StartupScript, State);
+	//Same script every boot, so after the first one this comes straight off disk without parsing.
+	VLString Error;
+	
+	const std::shared_ptr<const CompiledScript> Compiled { CompileScript(StartupScript, true, &Error) };
+	
+	if (!Compiled) throw ScriptError { {}, VLString{"Failed to compile startup script, got Lua error \""} + Error + "\"" };
+	
+	lua_State *const RetState = InitScript(LUAJOB_STARTUP, Compiled, State);
 
 	if (!RetState) throw ScriptError { {}, "Failed to call InitScript() for startup script?" };
 
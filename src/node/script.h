@@ -32,7 +32,8 @@ namespace Script
 		LUAJOB_STARTUP	= 1 << 1,
 		LUAJOB_SNIPPET	= 1 << 2,
 		LUAJOB_WORKER	= 1 << 3,
-		LUAJOB_MAXVALUE = LUAJOB_WORKER
+		LUAJOB_RESIDENT	= 1 << 4,
+		LUAJOB_MAXVALUE = LUAJOB_RESIDENT
 	};
 	
 	struct ScriptError
@@ -41,13 +42,32 @@ namespace Script
 		VLString Msg;
 	};
 	
+	//Called from a scheduler thread when a scheduled script function returns. The job is still alive at that point.
+	typedef void (*ScheduledJobCallback)(Jobs::Job *OurJob, const NetCmdStatus &Result);
+	
 	bool LoadScript(const char *ScriptBuffer, const char *ScriptName, const bool OverwritePermissible = false);
+	bool HaveCompiledScript(const char *Hash);
+	bool LoadCompiledScript(const char *Hash, const char *ScriptName, const bool OverwritePermissible = false);
 	bool UnloadScript(const char *ScriptName);
 	bool ScriptIsLoaded(const char *ScriptName);
 	void ExecuteStartupScript(Jobs::Job *const OurJob);
 	bool ExecuteScriptFunction(const LuaJobType Type, const char *ScriptData, const char *FunctionName, Conation::ConationStream *Stream, Jobs::Job *OurJob);
+	bool ExecuteLoadedScriptFunction(const char *ScriptName, const char *FunctionName, Conation::ConationStream *Stream, Jobs::Job *OurJob);
+	
+	/*Resident scripts, the ones with scriptresident::true in their spec. DispatchToResident() takes Stream's buffer if it returns true.
+	* The job's done as soon as the call's queued, so KILLJOBID can't cancel it. Unloading the script can,
+	* but a call that won't return in time gets its thread killed and its Lua state leaked.*/
+	bool DispatchToResident(const char *ScriptName, const char *FunctionName, Conation::ConationStream *Stream, Jobs::Job *OurJob);
+	void ForwardN2NToResidents(const Conation::ConationStream *Stream);
+	void StopAllResidents(void);
 	
-	extern std::map<VLString, VLString> LoadedScripts;
+	//Script jobs run as coroutines on a few scheduler threads, so waiting on something doesn't cost a whole thread.
+	//The script takes Stream's buffer, so don't expect anything left in it afterwards.
+	void ScheduleLoadedScriptFunction(const char *ScriptName, const char *FunctionName, Conation::ConationStream *Stream, Jobs::Job *OurJob, ScheduledJobCallback OnFinish);
+	void CancelScheduledJob(Jobs::Job *OurJob);
+	void WakeScheduler(void);
+	void StopScheduler(void);
+	void StopWorkerPool(void);
 }
 
 #endif //_VL_NODE_SCRIPT_H_
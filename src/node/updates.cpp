@@ -20,6 +20,8 @@
 #include "../libvolition/include/utils.h"
 #include "../libvolition/include/netcore.h"
 #include "../libvolition/include/conation.h"
+#include "../libvolition/include/brander.h"
+#include "../libvolition/include/bindelta.h"
 #include "jobs.h"
 #include "files.h"
 #include "main.h"
@@ -36,6 +38,7 @@
 #include "updates.h"
 
 #include <vector>
+#include <map>
 
 //Types
 enum RecoveryMode : int { UPDATE_X_STAGE1, UPDATE_X_STAGE2 };
@@ -280,6 +283,52 @@ static void InitStage2(const VLString &OriginalBinaryPath, const VLString &TempB
 	VLCRITICAL("Landed after execlp()!");
 }
 
+NetCmdStatus Updates::RebuildFromPatch(const Conation::ConationStream::BinStreamArg &Patch, const VLString &Sha512, std::vector<uint8_t> &BinaryOut)
+{ //Doesn't touch the connection or our threads, so if this fails we just ask for the whole binary.
+	const VLString &SelfBinaryPath = Utils::GetSelfBinaryPath();
+	uint64_t SelfSize = 0;
+	
+	if (!SelfBinaryPath || !Utils::GetFileSize(SelfBinaryPath, &SelfSize))
+	{
+		return NetCmdStatus(false, STATUS_MISSING, "Unable to find our own binary to patch against!");
+	}
+	
+	std::vector<uint8_t> Self(SelfSize);
+	
+	if (!Utils::Slurp(SelfBinaryPath, Self.data(), Self.size()))
+	{
+		return NetCmdStatus(false, STATUS_ACCESSDENIED, VLString("Unable to read our own binary at \"") + SelfBinaryPath + "\"!");
+	}
+	
+	//The server diffs against the binary with our identity and auth token blanked out, since it's the same patch for everybody.
+	if (!Brander::UnbrandPerNodeAttributes(Self.data(), Self.size()) ||
+		!BinDelta::Apply(Self.data(), Self.size(), Patch.Data, Patch.DataSize, BinaryOut))
+	{
+		return NetCmdStatus(false, STATUS_FAILED, "Update patch doesn't apply to our binary.");
+	}
+	
+	Self.clear();
+	Self.shrink_to_fit();
+	
+	if (Utils::GetSha512(BinaryOut.data(), BinaryOut.size()) != Sha512)
+	{
+		BinaryOut.clear();
+		return NetCmdStatus(false, STATUS_FAILED, "Binary rebuilt from update patch failed verification.");
+	}
+	
+	std::map<Brander::AttributeTypes, Brander::AttrValue> Values;
+	Values.emplace(Brander::AttributeTypes::IDENTITY, IdentityModule::GetNodeIdentity());
+	Values.emplace(Brander::AttributeTypes::AUTHTOKEN, IdentityModule::GetNodeAuthToken());
+	
+	if (!Brander::BrandBinaryViaBuffer(BinaryOut.data(), BinaryOut.size(), Values))
+	{
+		BinaryOut.clear();
+		return NetCmdStatus(false, STATUS_IERR, "Failed to brand binary rebuilt from update patch!");
+	}
+	
+	return NetCmdStatus(true);
+}
+
 NetCmdStatus Updates::AttemptUpdate(const Conation::ConationStream::FileArg &File)
 { //Regardless of what we return, it's gonna be failure, cuz this shouldn't return at all.
 	VLDEBUG("Attempting update");
@@ -299,7 +348,7 @@ NetCmdStatus Updates::AttemptUpdate(const Conation::ConationStream::FileArg &Fil
 	const NetCmdStatus WhatFailed = InitStage1(File); //If this returns, we failed.
 
 
-	while (!((*(Net::ClientDescriptor*)Main::GetSocketDescriptor()) = Interface::Establish(IdentityModule::GetServerAddr() ) ).Internal ) Utils::vl_sleep(1000);
+	*(Net::ClientDescriptor*)Main::GetSocketDescriptor() = Interface::EstablishWithBackoff(IdentityModule::GetServerAddr());
 
 	//Now get the old update command off the top of the queue and discard it.
 	Main::GetReadQueue().Head_Acquire();
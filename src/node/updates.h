@@ -27,6 +27,7 @@
 namespace Updates
 {
 	NetCmdStatus AttemptUpdate(const Conation::ConationStream::FileArg &File);
+	NetCmdStatus RebuildFromPatch(const Conation::ConationStream::BinStreamArg &Patch, const VLString &Sha512, std::vector<uint8_t> &BinaryOut);
 	void HandleUpdateRecovery(void);
 }
 #endif //_VL_NODE_UPDATES_H_
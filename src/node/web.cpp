@@ -18,34 +18,230 @@
 
 #include "../libvolition/include/common.h"
 #include "../libvolition/include/utils.h"
+#include "../libvolition/include/vlthreads.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <algorithm>
 
 #include <curl/curl.h>
 
 #include "files.h"
 #include "web.h"
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+#define WEB_POOL_MAX 8 //Idle easy handles we keep around for their connections.
+#define WEB_MAX_STREAMS 16
+#define WEB_RANGE_MIN_PART (1024ull * 1024ull * 4ull) //Smaller than this and a range isn't worth its own connection.
+#define WEB_RANGE_MEMORY_MAX (1024ull * 1024ull * 1024ull) //Most Content-Length we'll trust enough to preallocate for.
+#define WEB_MAX_FILE_SIZE (1024ull * 1024ull * 1024ull * 1024ull)
+#define WEB_TEMP_NAME_MAX 64
+
 //Types
+struct Target
+{ //Where a body goes. Exactly one of these is set.
+	int Desc;
+	std::vector<uint8_t> *Mem;
+	Web::SinkFunc Sink;
+	void *UserData;
+	
+	Target(void) : Desc(-1), Mem(), Sink(), UserData() {}
+};
+
+struct StreamCtx
+{ //A plain single stream, in order.
+	Target *Out;
+	uint64_t Written;
+	Utils::Sha512Hasher *Hasher;
+};
+
+struct RangePart
+{ //One slice of a parallel download.
+	Target *Out;
+	uint64_t Start;
+	uint64_t End; //Inclusive, same as the Range header.
+	uint64_t Cursor; //Where the next byte goes. A retry resumes from here.
+	int AttemptsRemaining;
+	CURL *Curl;
+};
+
+static struct
+{
+	VLThreads::Mutex InitLock;
+	bool Initialized;
+	CURLSH *Share; //DNS, TLS sessions and connections, for every handle in the process.
+	VLThreads::Mutex ShareLocks[CURL_LOCK_DATA_LAST];
+	VLThreads::Mutex PoolLock;
+	std::vector<CURL*> Pool;
+	std::atomic<uint32_t> TempCounter;
+} State;
 
 //Prototypes
-static size_t Writer(void *InStream, size_t SizePerUnit, size_t NumMembers, FILE *Descriptor);
+static bool Init(void);
+static void ShareLock(CURL *Curl, curl_lock_data Data, curl_lock_access Access, void *UserData);
+static void ShareUnlock(CURL *Curl, curl_lock_data Data, void *UserData);
+static bool IsCancelled(const Web::FetchOptions &Options);
+static int CancelChecker(void *UserData, curl_off_t, curl_off_t, curl_off_t, curl_off_t);
+static CURL *AcquireHandle(const VLString &URL, const Web::FetchOptions &Options);
+static void ReleaseHandle(CURL *Curl);
+static VLString FixURL(const char *URL);
+static int MakeTempFile(const VLString &URL, VLString &PathOut);
+static bool WriteAt(const int Desc, const void *Data, size_t Size, uint64_t Offset);
+static bool ResetTarget(Target &Out, const uint64_t Written);
+static bool DigestMatches(const VLString &Digest, const char *Expected);
+static size_t StreamWriter(void *InStream, size_t SizePerUnit, size_t NumMembers, StreamCtx *Ctx);
+static size_t RangeWriter(void *InStream, size_t SizePerUnit, size_t NumMembers, RangePart *Part);
+static size_t RangeHeaderScanner(char *Line, size_t SizePerUnit, size_t NumMembers, bool *AcceptsRanges);
+static bool ProbeRanges(const VLString &URL, const Web::FetchOptions &Options, uint64_t &SizeOut, VLString &EffectiveURLOut);
+static bool StartRange(CURLM *Multi, const VLString &URL, RangePart &Part, const Web::FetchOptions &Options);
+static bool FetchRanged(const VLString &URL, Target &Out, const uint64_t Size, const unsigned Streams, const Web::FetchOptions &Options);
+static bool FetchSingle(const VLString &URL, Target &Out, const Web::FetchOptions &Options);
+static bool Fetch(const char *URL_, Target &Out, const Web::FetchOptions &Options, const char *Path);
 
 //Function definitions.
-static size_t Writer(void *InStream, size_t SizePerUnit, size_t NumMembers, FILE *Descriptor)
-{	
-	const size_t MembersWritten = fwrite(InStream, SizePerUnit, NumMembers, Descriptor);
+static bool Init(void)
+{
+	VLThreads::MutexKeeper Keeper { &State.InitLock };
+	
+	if (State.Initialized) return true;
+	
+	if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK) return false;
+	
+	State.Initialized = true;
+	
+	//If we can't get a share, every handle just keeps its own caches like before.
+	if (!(State.Share = curl_share_init())) return true;
 	
-	return SizePerUnit * MembersWritten;
+	curl_share_setopt(State.Share, CURLSHOPT_LOCKFUNC, ShareLock);
+	curl_share_setopt(State.Share, CURLSHOPT_UNLOCKFUNC, ShareUnlock);
+	curl_share_setopt(State.Share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(State.Share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+	curl_share_setopt(State.Share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+	return true;
+}
+
+static void ShareLock(CURL *, curl_lock_data Data, curl_lock_access, void *)
+{ //Shared and exclusive both get the same mutex, the critical sections are tiny.
+	State.ShareLocks[Data].Lock();
+}
+
+static void ShareUnlock(CURL *, curl_lock_data Data, void *)
+{
+	State.ShareLocks[Data].Unlock();
 }
 
-bool Web::GetHTTP(const char *URL_, VLString *FilePathOut, const int NumAttempts, const char *UserAgent, const char *Referrer) //This is using chars and pointers instead of VLStrings and references so it works in the C API.
+static bool IsCancelled(const Web::FetchOptions &Options)
+{
+	return Options.Cancel && *Options.Cancel;
+}
+
+static int CancelChecker(void *UserData, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+{ //libcurl calls this about once a second even when nothing's moving, and nonzero aborts the transfer.
+	return *static_cast<const std::atomic_bool*>(UserData);
+}
+
+#if LIBCURL_VERSION_NUM < 0x072000
+static int OldCancelChecker(void *UserData, double, double, double, double)
+{
+	return CancelChecker(UserData, 0, 0, 0, 0);
+}
+#endif
+
+static CURL *AcquireHandle(const VLString &URL, const Web::FetchOptions &Options)
 {
-	int AttemptsRemaining = NumAttempts;
-	CURLcode Code;
 	CURL *Curl = nullptr;
+	
+	State.PoolLock.Lock();
+	
+	if (!State.Pool.empty())
+	{
+		Curl = State.Pool.back();
+		State.Pool.pop_back();
+	}
+	
+	State.PoolLock.Unlock();
+	
+	if (!Curl && !(Curl = curl_easy_init())) return nullptr;
+	
+	if (State.Share) curl_easy_setopt(Curl, CURLOPT_SHARE, State.Share);
+	
+	curl_easy_setopt(Curl, CURLOPT_URL, +URL);
+	
+	curl_easy_setopt(Curl, CURLOPT_SSL_VERIFYPEER, 0L);
+	
+	/*Follow paths that redirect.*/
+	curl_easy_setopt(Curl, CURLOPT_FOLLOWLOCATION, 1L);
+	
+	/*No progress bar on stdout please.*/
+	curl_easy_setopt(Curl, CURLOPT_NOPROGRESS, 1L);
+	
+	if (Options.Cancel)
+	{ //Lets us back out cleanly, rather than having our thread killed while it's holding the share or pool locks.
+		curl_easy_setopt(Curl, CURLOPT_NOPROGRESS, 0L);
+#if LIBCURL_VERSION_NUM >= 0x072000
+		curl_easy_setopt(Curl, CURLOPT_XFERINFOFUNCTION, CancelChecker);
+		curl_easy_setopt(Curl, CURLOPT_XFERINFODATA, (void*)Options.Cancel);
+#else
+		curl_easy_setopt(Curl, CURLOPT_PROGRESSFUNCTION, OldCancelChecker);
+		curl_easy_setopt(Curl, CURLOPT_PROGRESSDATA, (void*)Options.Cancel);
+#endif
+	}
+	
+	//We're always on some thread other than main, and signals for DNS timeouts don't mix with that.
+	curl_easy_setopt(Curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(Curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	
+	if (Options.UserAgent) curl_easy_setopt(Curl, CURLOPT_USERAGENT, Options.UserAgent);
+	if (Options.Referrer) curl_easy_setopt(Curl, CURLOPT_REFERER, Options.Referrer);
+	
+	/*Request maximum 5 second timeout for each try of the operation.*/
+	curl_easy_setopt(Curl, CURLOPT_CONNECTTIMEOUT, 5L); /*This will not save us in some cases.*/
+	
+	//Set the maximum possible max file size.
+	curl_easy_setopt(Curl, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t)WEB_MAX_FILE_SIZE);
+#ifdef DEBUG
+	curl_easy_setopt(Curl, CURLOPT_VERBOSE, 1l);
+#else
+	curl_easy_setopt(Curl, CURLOPT_VERBOSE, 0L); /*No verbose please.*/
+#endif
+	return Curl;
+}
+
+static void ReleaseHandle(CURL *Curl)
+{ //Resetting keeps the handle's live connections and caches, which is the whole point of keeping it.
+	curl_easy_reset(Curl);
+	
+	VLThreads::MutexKeeper Keeper { &State.PoolLock };
+	
+	if (State.Pool.size() < WEB_POOL_MAX)
+	{
+		State.Pool.push_back(Curl);
+		return;
+	}
+	
+	Keeper.Unlock();
+	
+	curl_easy_cleanup(Curl);
+}
 
+static VLString FixURL(const char *URL_)
+{
 	VLString URL = URL_;
 	
 	/*Get the correct URL.*/
@@ -55,71 +251,476 @@ bool Web::GetHTTP(const char *URL_, VLString *FilePathOut, const int NumAttempts
 		URL = VLString("http://") + URL;
 	}
 	
-#ifdef DEBUG
-	puts(VLString("Web::GetHTTP(): URL is ") + URL);
-#endif
+	return URL;
+}
 
-	VLString FilePath = Utils::GetTempDirectory() + Utils::StripPathFromFilename(URL);
+static int MakeTempFile(const VLString &URL, VLString &PathOut)
+{ //Keeps the URL's filename on the end so scripts can still go by the extension, but never hands two fetches the same path.
+	const VLString Name = Utils::StripPathFromFilename(URL);
 	
-#ifdef DEBUG
-	puts(VLString("Web::GetHTTP(): Temporary file path is ") + FilePath);
+	char Base[WEB_TEMP_NAME_MAX + 1];
+	size_t Inc = 0;
+	
+	for (const char *Iter = Name; *Iter && *Iter != '?' && *Iter != '#' && Inc < WEB_TEMP_NAME_MAX; ++Iter)
+	{
+		Base[Inc++] = isalnum((unsigned char)*Iter) || strchr("._-", *Iter) ? *Iter : '_';
+	}
+	
+	Base[Inc] = '\0';
+	
+	for (int Try = 0; Try < 100; ++Try)
+	{
+		VLString Path = Utils::GetTempDirectory() + "vlhttp_" + VLString::UintToString(getpid()) + '_' + VLString::UintToString(State.TempCounter++);
+		
+		if (*Base) Path = Path + '_' + (const char*)Base;
+		
+		const int Desc = open(Path, O_WRONLY | O_CREAT | O_EXCL | O_BINARY | O_CLOEXEC, 0600);
+		
+		if (Desc != -1)
+		{
+			PathOut = Path;
+			return Desc;
+		}
+		
+		if (errno != EEXIST) break;
+	}
+	
+	return -1;
+}
+
+static bool WriteAt(const int Desc, const void *Data, size_t Size, uint64_t Offset)
+{
+	const uint8_t *Iter = static_cast<const uint8_t*>(Data);
+	
+	while (Size > 0)
+	{
+#ifdef LINUX
+		const ssize_t Written = pwrite(Desc, Iter, Size, Offset);
+#else //Only the transfer thread writes, so seeking first is safe enough.
+		const ssize_t Written = lseek64(Desc, Offset, SEEK_SET) == -1 ? -1 : write(Desc, Iter, Size);
 #endif
+		if (Written <= 0)
+		{
+			if (Written == -1 && errno == EINTR) continue;
+			return false;
+		}
+		
+		Iter += Written;
+		Size -= Written;
+		Offset += Written;
+	}
+	
+	return true;
+}
 
-	do
+static bool ResetTarget(Target &Out, const uint64_t Written)
+{ //Before another attempt. A sink can't take back what it already got.
+	if (Out.Sink) return Written == 0;
+	
+	if (Out.Mem)
 	{
-		Files::Delete(FilePath);
+		Out.Mem->clear();
+		return true;
+	}
+	
+	return ftruncate(Out.Desc, 0) == 0;
+}
+
+static bool DigestMatches(const VLString &Digest, const char *Expected)
+{
+	if (!Expected || !*Expected) return true;
+	
+	const bool Matches = Digest && !strcasecmp(Digest, Expected);
+	
+	if (!Matches) VLWARN("SHA-512 mismatch on download, wanted " + VLString(Expected) + " but got " + Digest);
+	
+	return Matches;
+}
+
+static size_t StreamWriter(void *InStream, size_t SizePerUnit, size_t NumMembers, StreamCtx *Ctx)
+{
+	const size_t Size = SizePerUnit * NumMembers;
+	Target *const Out = Ctx->Out;
+	
+	if (Out->Sink)
+	{
+		if (Out->Sink(InStream, Size, Out->UserData) != Size) return 0;
+	}
+	else if (Out->Mem)
+	{
+		const uint8_t *const Data = static_cast<const uint8_t*>(InStream);
 		
-		FILE *Descriptor = fopen(FilePath, "wb");
+		Out->Mem->insert(Out->Mem->end(), Data, Data + Size);
+	}
+	else if (!WriteAt(Out->Desc, InStream, Size, Ctx->Written)) return 0;
+	
+	if (Ctx->Hasher) Ctx->Hasher->Update(InStream, Size);
+	
+	Ctx->Written += Size;
+	
+	return Size;
+}
+
+static size_t RangeWriter(void *InStream, size_t SizePerUnit, size_t NumMembers, RangePart *Part)
+{
+	const size_t Size = SizePerUnit * NumMembers;
+	
+	//Server's sending more than we asked for, probably ignored the range. Bail before we trample the next part.
+	if (Part->Cursor + Size > Part->End + 1) return 0;
+	
+	if (Part->Out->Mem) memcpy(Part->Out->Mem->data() + Part->Cursor, InStream, Size);
+	else if (!WriteAt(Part->Out->Desc, InStream, Size, Part->Cursor)) return 0;
+	
+	Part->Cursor += Size;
+	
+	return Size;
+}
+
+static size_t RangeHeaderScanner(char *Line, size_t SizePerUnit, size_t NumMembers, bool *AcceptsRanges)
+{ //Header lines aren't null terminated.
+	const size_t Size = SizePerUnit * NumMembers;
+	static const char Status[] = "HTTP/";
+	static const char Header[] = "Accept-Ranges:";
+	
+	if (Size >= sizeof Status - 1 && !strncmp(Line, Status, sizeof Status - 1))
+	{ //New response, probably after a redirect. Only the last one counts.
+		*AcceptsRanges = false;
+		return Size;
+	}
+	
+	if (Size < sizeof Header - 1 || strncasecmp(Line, Header, sizeof Header - 1) != 0) return Size;
+	
+	const char *Iter = Line + sizeof Header - 1;
+	const char *const End = Line + Size;
+	
+	while (Iter < End && (*Iter == ' ' || *Iter == '\t')) ++Iter;
+	
+	*AcceptsRanges = End - Iter >= 5 && !strncasecmp(Iter, "bytes", 5);
+	
+	return Size;
+}
+
+static bool ProbeRanges(const VLString &URL, const Web::FetchOptions &Options, uint64_t &SizeOut, VLString &EffectiveURLOut)
+{ //HEAD it to see how big it is and whether the server will hand it out in pieces.
+	CURL *Curl = AcquireHandle(URL, Options);
+	
+	if (!Curl) return false;
+	
+	bool AcceptsRanges = false;
+	
+	curl_easy_setopt(Curl, CURLOPT_NOBODY, 1L);
+	curl_easy_setopt(Curl, CURLOPT_HEADERFUNCTION, RangeHeaderScanner);
+	curl_easy_setopt(Curl, CURLOPT_HEADERDATA, &AcceptsRanges);
+	
+	const CURLcode Code = curl_easy_perform(Curl);
+	
+	curl_off_t Length = -1;
+	long Status = 0;
+	char *EffectiveURL = nullptr;
+	
+	if (Code == CURLE_OK)
+	{
+		curl_easy_getinfo(Curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &Length);
+		curl_easy_getinfo(Curl, CURLINFO_RESPONSE_CODE, &Status);
+		curl_easy_getinfo(Curl, CURLINFO_EFFECTIVE_URL, &EffectiveURL);
+	}
+	
+	const bool Usable = Code == CURLE_OK && Status == 200 && AcceptsRanges && Length > 0;
+	
+	if (Usable)
+	{ //Pin the redirect target so the parts don't each chase it down again.
+		SizeOut = Length;
+		EffectiveURLOut = EffectiveURL ? VLString(EffectiveURL) : URL;
+	}
+	
+	ReleaseHandle(Curl);
+	
+	return Usable;
+}
+
+static bool StartRange(CURLM *Multi, const VLString &URL, RangePart &Part, const Web::FetchOptions &Options)
+{
+	if (!(Part.Curl = AcquireHandle(URL, Options))) return false;
+	
+	const VLString Range = VLString::UintToString(Part.Cursor) + '-' + VLString::UintToString(Part.End);
+	
+	curl_easy_setopt(Part.Curl, CURLOPT_RANGE, +Range); //libcurl copies it.
+	curl_easy_setopt(Part.Curl, CURLOPT_WRITEFUNCTION, RangeWriter);
+	curl_easy_setopt(Part.Curl, CURLOPT_WRITEDATA, &Part);
+	curl_easy_setopt(Part.Curl, CURLOPT_PRIVATE, &Part);
+	
+	if (curl_multi_add_handle(Multi, Part.Curl) != CURLM_OK)
+	{
+		ReleaseHandle(Part.Curl);
+		Part.Curl = nullptr;
+		return false;
+	}
+	
+	return true;
+}
+
+static bool FetchRanged(const VLString &URL, Target &Out, const uint64_t Size, const unsigned Streams, const Web::FetchOptions &Options)
+{ //One multi handle drives every part from this thread, so the writers never race each other.
+	CURLM *Multi = curl_multi_init();
+	
+	if (!Multi) return false;
+	
+	std::vector<RangePart> Parts(Streams);
+	const uint64_t PartSize = Size / Streams;
+	size_t Active = 0;
+	bool Failed = false;
+	
+	for (unsigned Inc = 0; Inc < Streams; ++Inc)
+	{
+		RangePart &Part = Parts[Inc];
 		
-		if (!Descriptor) return false;
+		Part.Out = &Out;
+		Part.Start = PartSize * Inc;
+		Part.End = Inc + 1 == Streams ? Size - 1 : Part.Start + PartSize - 1;
+		Part.Cursor = Part.Start;
+		Part.AttemptsRemaining = std::max(Options.NumAttempts, 1);
+		Part.Curl = nullptr;
 		
-		Curl = curl_easy_init(); /*Fire up curl.*/
+		if (!StartRange(Multi, URL, Part, Options))
+		{
+			Failed = true;
+			break;
+		}
 		
-		/*Add the URL*/
-		curl_easy_setopt(Curl, CURLOPT_URL, +URL);
+		++Active;
+	}
+	
+	while (!Failed && Active > 0)
+	{
+		if (IsCancelled(Options))
+		{
+			Failed = true;
+			break;
+		}
 		
-		curl_easy_setopt(Curl, CURLOPT_SSL_VERIFYPEER, 0L);
+		int StillRunning = 0;
 		
-		/*Follow paths that redirect.*/
-		curl_easy_setopt(Curl, CURLOPT_FOLLOWLOCATION, 1L);
+		if (curl_multi_perform(Multi, &StillRunning) != CURLM_OK)
+		{
+			Failed = true;
+			break;
+		}
 		
-		/*No progress bar on stdout please.*/
-		curl_easy_setopt(Curl, CURLOPT_NOPROGRESS, 1L);
+		CURLMsg *Msg = nullptr;
+		int Queued = 0;
 		
-		if (UserAgent) curl_easy_setopt(Curl, CURLOPT_USERAGENT, +UserAgent);
-		if (Referrer) curl_easy_setopt(Curl, CURLOPT_REFERER, +Referrer);
+		while (!Failed && (Msg = curl_multi_info_read(Multi, &Queued)))
+		{
+			if (Msg->msg != CURLMSG_DONE) continue;
+			
+			//Grab everything now, the message goes away with the handle.
+			CURL *const Curl = Msg->easy_handle;
+			const CURLcode Code = Msg->data.result;
+			void *Private = nullptr;
+			long Status = 0;
+			
+			curl_easy_getinfo(Curl, CURLINFO_PRIVATE, &Private);
+			curl_easy_getinfo(Curl, CURLINFO_RESPONSE_CODE, &Status);
+			
+			RangePart &Part = *static_cast<RangePart*>(Private);
+			
+			curl_multi_remove_handle(Multi, Curl);
+			ReleaseHandle(Curl);
+			Part.Curl = nullptr;
+			--Active;
+			
+			if (Code == CURLE_OK && Status == 206 && Part.Cursor == Part.End + 1) continue;
+			
+			//A 200 means it ignored the range, so no sense asking again. Anything else, pick up where this part left off.
+			if (Status == 200 || --Part.AttemptsRemaining <= 0 || !StartRange(Multi, URL, Part, Options))
+			{
+				Failed = true;
+				break;
+			}
+			
+			++Active;
+		}
 		
-		curl_easy_setopt(Curl, CURLOPT_WRITEFUNCTION, Writer);
-		curl_easy_setopt(Curl, CURLOPT_WRITEDATA, Descriptor);
-		curl_easy_setopt(Curl, CURLOPT_VERBOSE, 0L); /*No verbose please.*/
+		if (Failed || !Active) break;
 		
-		/*Request maximum 5 second timeout for each try of the operation.*/
-		curl_easy_setopt(Curl, CURLOPT_CONNECTTIMEOUT, 5L); /*This will not save us in some cases.*/
+		curl_multi_wait(Multi, nullptr, 0, 1000, nullptr);
+	}
+	
+	for (RangePart &Part : Parts)
+	{
+		if (!Part.Curl) continue;
+		
+		curl_multi_remove_handle(Multi, Part.Curl);
+		ReleaseHandle(Part.Curl);
+	}
+	
+	curl_multi_cleanup(Multi);
+	
+	return !Failed;
+}
 
-		//Set the maximum possible max file size.
-		curl_easy_setopt(Curl, CURLOPT_MAXFILESIZE_LARGE, (1024ul * 1024ul * 1024ul * 1024ul));
-#ifdef DEBUG
-		curl_easy_setopt(Curl, CURLOPT_VERBOSE, 1l);
-#endif
+static bool FetchSingle(const VLString &URL, Target &Out, const Web::FetchOptions &Options)
+{
+	int AttemptsRemaining = Options.NumAttempts;
+	CURLcode Code = CURLE_FAILED_INIT;
+	StreamCtx Ctx {};
+	VLString Digest;
+	
+	do
+	{
+		if (!ResetTarget(Out, Ctx.Written)) break;
+		
+		CURL *Curl = AcquireHandle(URL, Options);
+		
+		if (!Curl) break;
+		
+		Utils::Sha512Hasher Hasher;
+		
+		Ctx.Out = &Out;
+		Ctx.Written = 0;
+		Ctx.Hasher = Options.Sha512 ? &Hasher : nullptr;
+		
+		curl_easy_setopt(Curl, CURLOPT_WRITEFUNCTION, StreamWriter);
+		curl_easy_setopt(Curl, CURLOPT_WRITEDATA, &Ctx);
+		
 		Code = curl_easy_perform(Curl);
 		
-		curl_easy_cleanup(Curl);
+		ReleaseHandle(Curl);
 		
-		fclose(Descriptor);
+		if (Code == CURLE_OK && Ctx.Hasher) Digest = Hasher.Finish();
 		
-	} while (--AttemptsRemaining, (Code != CURLE_OK && AttemptsRemaining > 0));
+	} while (--AttemptsRemaining, (Code != CURLE_OK && AttemptsRemaining > 0 && !IsCancelled(Options)));
 	
-	if (Code == CURLE_OK)
+	if (Code != CURLE_OK) return false;
+	
+	return Options.Sha512 ? DigestMatches(Digest, Options.Sha512) : true;
+}
+
+static bool Fetch(const char *URL_, Target &Out, const Web::FetchOptions &Options, const char *Path)
+{
+	if (!Init()) return false;
+	
+	const VLString URL = FixURL(URL_);
+	
+#ifdef DEBUG
+	puts(VLString("Web::Fetch(): URL is ") + URL);
+#endif
+
+	unsigned Streams = std::min<unsigned>(Options.Streams, WEB_MAX_STREAMS);
+	uint64_t Size = 0;
+	VLString EffectiveURL;
+	
+	//Ranges land out of order, and a sink wants them in order.
+	if (Streams > 1 && !Out.Sink && ProbeRanges(URL, Options, Size, EffectiveURL))
 	{
-		*FilePathOut = FilePath;
+		Streams = std::min<uint64_t>(Streams, Size / WEB_RANGE_MIN_PART);
+		
+		if (Out.Mem && Size > WEB_RANGE_MEMORY_MAX) Streams = 0;
+		
+		if (Streams > 1)
+		{
+			bool Ready = true;
+			
+			if (Out.Mem) Out.Mem->resize(Size);
+			else Ready = ftruncate(Out.Desc, Size) == 0;
+			
+			if (Ready && FetchRanged(EffectiveURL, Out, Size, Streams, Options))
+			{
+				if (!Options.Sha512) return true;
+				
+				const VLString Digest = Out.Mem ? Utils::GetSha512(Out.Mem->data(), Out.Mem->size()) : Utils::GetFileSha512(Path);
+				
+				return DigestMatches(Digest, Options.Sha512);
+			}
+			
+			if (IsCancelled(Options)) return false;
+			
+			VLWARN("Parallel ranged download of " + URL + " failed, falling back to a single stream.");
+		}
 	}
+	
+	if (IsCancelled(Options)) return false;
+	
+	const bool Result = FetchSingle(URL, Out, Options);
 
 #ifdef DEBUG
-	else puts("Web::GetHTTP(): All attempts failed!");
+	if (!Result) puts("Web::Fetch(): All attempts failed!");
 #endif
+
+	return Result;
+}
+
+bool Web::GetHTTP(const char *URL, VLString *FilePathOut, const int NumAttempts, const char *UserAgent, const char *Referrer) //This is using chars and pointers instead of VLStrings and references so it works in the C API.
+{
+	FetchOptions Options;
 	
-	return Code == CURLE_OK;
-		
+	Options.NumAttempts = NumAttempts;
+	Options.UserAgent = UserAgent;
+	Options.Referrer = Referrer;
+	
+	return GetHTTP(URL, FilePathOut, Options);
+}
+
+bool Web::GetHTTP(const char *URL, VLString *FilePathOut, const FetchOptions &Options)
+{
+	VLString FilePath;
+	Target Out;
+	
+	if ((Out.Desc = MakeTempFile(URL, FilePath)) == -1) return false;
+	
+#ifdef DEBUG
+	puts(VLString("Web::GetHTTP(): Temporary file path is ") + FilePath);
+#endif
+
+	const bool Result = Fetch(URL, Out, Options, FilePath);
+	
+	close(Out.Desc);
+	
+	if (!Result)
+	{
+		Files::Delete(FilePath);
+		return false;
+	}
+	
+	*FilePathOut = FilePath;
+	
+	return true;
 }
 
+bool Web::GetHTTPToFile(const char *URL, const char *Path, const FetchOptions &Options)
+{
+	Target Out;
+	
+	if ((Out.Desc = open(Path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY | O_CLOEXEC, 0666)) == -1) return false;
+	
+	const bool Result = Fetch(URL, Out, Options, Path);
+	
+	close(Out.Desc);
+	
+	if (!Result) Files::Delete(Path);
+	
+	return Result;
+}
+
+bool Web::GetHTTPToMemory(const char *URL, std::vector<uint8_t> &Out_, const FetchOptions &Options)
+{
+	Target Out;
+	
+	Out.Mem = &Out_;
+	
+	const bool Result = Fetch(URL, Out, Options, nullptr);
+	
+	if (!Result) Out_.clear();
+	
+	return Result;
+}
 
+bool Web::GetHTTPToSink(const char *URL, SinkFunc Sink, void *UserData, const FetchOptions &Options)
+{
+	Target Out;
+	
+	Out.Sink = Sink;
+	Out.UserData = UserData;
+	
+	return Fetch(URL, Out, Options, nullptr);
+}
@@ -21,10 +21,30 @@
 
 #include "../libvolition/include/common.h"
 
+#include <vector>
+#include <atomic>
+
 namespace Web
 {
+	typedef size_t (*SinkFunc)(const void *Data, const size_t Size, void *UserData); //Return anything but Size to abort the transfer.
+	
+	struct FetchOptions
+	{
+		int NumAttempts;
+		const char *UserAgent;
+		const char *Referrer;
+		unsigned Streams; //Parallel range requests for big objects. 0 or 1 means a plain single stream.
+		const char *Sha512; //Expected digest in hex. The fetch fails if what we got doesn't match.
+		const std::atomic_bool *Cancel; //Set it from another thread to abort the transfer. It fails within about a second, having cleaned up after itself.
+		
+		FetchOptions(void) : NumAttempts(3), UserAgent(), Referrer(), Streams(), Sha512(), Cancel() {}
+	};
+	
 	bool GetHTTP(const char *URL, VLString *FilePathOut, const int NumAttempts = 3,
 				const char *UserAgent = nullptr, const char *Referrer = nullptr);
+	bool GetHTTP(const char *URL, VLString *FilePathOut, const FetchOptions &Options); //Lands in a fresh temp file, caller deletes it.
+	bool GetHTTPToFile(const char *URL, const char *Path, const FetchOptions &Options);
+	bool GetHTTPToMemory(const char *URL, std::vector<uint8_t> &Out, const FetchOptions &Options);
+	bool GetHTTPToSink(const char *URL, SinkFunc Sink, void *UserData, const FetchOptions &Options); //Always a single stream, so data arrives in order.
 }
 #endif //_VL_NODE_WEB_H_
-
@@ -27,6 +27,7 @@
 #include "nodeupdates.h"
 #include "logger.h"
 #include "routines.h"
+#include "fleethealth.h"
 
 #include <fcntl.h>
 #include <list>
@@ -36,6 +37,37 @@
 #include <time.h>
 #include <sys/time.h>
 #include <assert.h>
+
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+#define RESUME_TICKET_SIZE 32
+#define RESUME_TICKET_LIFETIME_SECS 600 //Counted from when the node drops, not from when we issued it.
+#define RESUME_TICKET_PRUNE_SECS 60
+#define RETRY_AFTER_DUPLICATE_MS 5000 //Long enough for a dead connection to ping out, usually.
+#define RETRY_AFTER_MAX_MS (5 * 60 * 1000)
+
+struct ResumeTicket
+{ //What a node would otherwise send again on every reconnect.
+	std::vector<uint8_t> Secret;
+	VLString AuthToken;
+	VLString PlatformString;
+	VLString NodeRevision;
+	time_t Expires; //Zero while the node is still connected.
+};
+
+static std::map<VLString, ResumeTicket> ResumeTickets;
+
+static struct
+{ //Spaces out full node logins. Nodes we turn away still take a slot, so they come back spread out instead of all at once.
+	uint32_t Rate; //Per second, zero for no limit.
+	uint64_t NextSlot; //Monotonic milliseconds.
+} AcceptPacing;
+
+static uint32_t GetNodeAdmitDelay(void);
+static void RejectNode(const Net::ClientDescriptor &ClientDesc, const NetCmdStatus &Status, const uint32_t RetryAfterMs);
+static bool CheckResumeTicket(const VLString &ID, const Conation::ConationStream::BinStreamArg &Ticket);
+static std::vector<uint8_t> IssueResumeTicket(const Clients::ClientObj *Client);
 std::map<VLString, VLScopedPtr<Clients::ClientObj*> > Clients::ClientMap;
 static Clients::ClientObj *CurrentAdmin;
 
@@ -153,14 +185,23 @@ Clients::ClientObj *Clients::AcceptClient_Auth(const Net::ServerDescriptor &Desc
 	Stream->GetCommandIdent(&Flags, &Ident);
 
 	//We determine what kind of client they are by what argument sequence they send us.
-	const bool IsNodeArgSequence = Stream->VerifyArgTypes({Conation::ARGTYPE_INT32, Conation::ARGTYPE_STRING,
+	//Newer nodes tack a bool on the end to ask for a resumption ticket.
+	bool WantsTicket = Stream->VerifyArgTypes({Conation::ARGTYPE_INT32, Conation::ARGTYPE_STRING,
+														Conation::ARGTYPE_STRING, Conation::ARGTYPE_STRING,
+														Conation::ARGTYPE_STRING, Conation::ARGTYPE_BOOL});
+	
+	const bool IsNodeArgSequence = WantsTicket || Stream->VerifyArgTypes({Conation::ARGTYPE_INT32, Conation::ARGTYPE_STRING,
 														Conation::ARGTYPE_STRING, Conation::ARGTYPE_STRING,
 														Conation::ARGTYPE_STRING});
+	
+	//Reconnecting with a ticket, just the ID and the ticket itself.
+	const bool IsResumeArgSequence = Stream->VerifyArgTypes({Conation::ARGTYPE_INT32, Conation::ARGTYPE_STRING,
+														Conation::ARGTYPE_BINSTREAM});
 														
 	const bool IsAdminArgSequence = Stream->VerifyArgTypes({Conation::ARGTYPE_INT32, Conation::ARGTYPE_STRING,
 														Conation::ARGTYPE_STRING});
 
-	if ((!IsAdminArgSequence && !IsNodeArgSequence) ||
+	if ((!IsAdminArgSequence && !IsNodeArgSequence && !IsResumeArgSequence) ||
 		Stream->GetCommandCode() != CMDCODE_B2S_AUTH || (Flags & Conation::IDENT_ISREPORT_BIT) || Ident != 0)
 	{
 		Logger::WriteLogLine(Logger::LOGITEM_SYSWARN, VLString("Stream failed integrity test, client at ") + NewClient->IPAddr);
@@ -180,7 +221,39 @@ Clients::ClientObj *Clients::AcceptClient_Auth(const Net::ServerDescriptor &Desc
 	
 	//Are they a node or an admin?
 
-	if (IsNodeArgSequence)
+	if (IsResumeArgSequence)
+	{
+		const VLString ID = Stream->Pop_String();
+		
+		if (!CheckResumeTicket(ID, Stream->Pop_BinStream()))
+		{ //They'll log in the long way, straight away.
+			Logger::WriteLogLine(Logger::LOGITEM_CONN, VLString("Node \"") + ID + "\"::" + NewClient->IPAddr + " presented an invalid or expired resumption ticket.", ID);
+			
+			RejectNode(ClientDesc, NetCmdStatus(false, STATUS_MISSING, "Resumption ticket not valid, log in normally."), 0);
+			goto EasyError;
+		}
+		
+		if (ClientObj *Existing = Clients::LookupClient(ID))
+		{ //The ticket proves it's really them, so the old connection is dead and just hasn't pinged out yet.
+			Logger::WriteLogLine(Logger::LOGITEM_CONN, VLString("Node \"") + ID + "\" resumed from IP " + NewClient->IPAddr + ", dropping its stale connection.", ID);
+			
+			Clients::ProcessNodeDisconnect(Existing, Clients::NODE_DEAUTH_CONNBREAK);
+		}
+		
+		auto Iter = ResumeTickets.find(ID);
+		
+		NewClient->ID = ID;
+		NewClient->AuthToken = Iter->second.AuthToken;
+		NewClient->PlatformString = Iter->second.PlatformString;
+		NewClient->NodeRevision = Iter->second.NodeRevision;
+		
+		ResumeTickets.erase(Iter); //Single use, they get a fresh one below.
+		
+		WantsTicket = true;
+		
+		Logger::WriteLogLine(Logger::LOGITEM_CONN, VLString("Accepted node \"") + NewClient->ID + "\" at IP " + NewClient->IPAddr + " by resumption ticket.", NewClient->ID);
+	}
+	else if (IsNodeArgSequence)
 	{
 		const VLString ID = Stream->Pop_String();
 
@@ -194,9 +267,21 @@ Clients::ClientObj *Clients::AcceptClient_Auth(const Net::ServerDescriptor &Desc
 		{
 			VLString Buf(1024);
 			snprintf(Buf.GetBuffer(), Buf.GetCapacity(), "Node \"%s\" trying to connect twice, this attempt from IP %s. Disallowed. Aborting authentication.\n", +ID, +NewClient->GetIPAddr());
-			Logger::WriteLogLine(Logger::LOGITEM_CONN, Buf);
+			Logger::WriteLogLine(Logger::LOGITEM_CONN, Buf, ID);
+			
+			//Most likely the old connection died and we haven't noticed yet.
+			RejectNode(ClientDesc, NetCmdStatus(false, STATUS_FAILED, "Already connected."), RETRY_AFTER_DUPLICATE_MS);
+			goto EasyError;
+		}
+		
+		if (const uint32_t Delay = GetNodeAdmitDelay())
+		{
+			Logger::WriteLogLine(Logger::LOGITEM_CONN, VLString("Deferring node \"") + ID + "\" at IP " + NewClient->IPAddr + " for " + VLString::UintToString(Delay) + " ms, too many logins at once.", ID);
+			
+			RejectNode(ClientDesc, NetCmdStatus(false, STATUS_FAILED, "Server busy, try again later."), Delay);
 			goto EasyError;
 		}
+		
 		//Get the client ID
 		NewClient->ID = ID;
 
@@ -207,7 +292,7 @@ Clients::ClientObj *Clients::AcceptClient_Auth(const Net::ServerDescriptor &Desc
 		
 		if (!TokenLookup) ///DISALLOWED!!! Token either bogus or we revoked it. We're just gonna close the connection.
 		{
-			Logger::WriteLogLine(Logger::LOGITEM_PERMS, VLString("Node \"") + ID + "\"::" + NewClient->IPAddr + " provided invalid authentication token \"" + NewClient->AuthToken + "\".");
+			Logger::WriteLogLine(Logger::LOGITEM_PERMS, VLString("Node \"") + ID + "\"::" + NewClient->IPAddr + " provided invalid authentication token \"" + NewClient->AuthToken + "\".", ID);
 
 			Clients::ProcessNodeDisconnect(NewClient, Clients::NODE_DEAUTH_BADAUTHTOKEN);
 			
@@ -220,7 +305,7 @@ Clients::ClientObj *Clients::AcceptClient_Auth(const Net::ServerDescriptor &Desc
 		//Get node revision
 		NewClient->NodeRevision = Stream->Pop_String();
 
-		Logger::WriteLogLine(Logger::LOGITEM_CONN, VLString("Accepted node \"") + NewClient->ID + "\" at IP " + NewClient->IPAddr + " using authentication token \"" + NewClient->AuthToken + "\".");
+		Logger::WriteLogLine(Logger::LOGITEM_CONN, VLString("Accepted node \"") + NewClient->ID + "\" at IP " + NewClient->IPAddr + " using authentication token \"" + NewClient->AuthToken + "\".", NewClient->ID);
 	} //we need a password if we're an admin.
 	else
 	{
@@ -257,6 +342,13 @@ Clients::ClientObj *Clients::AcceptClient_Auth(const Net::ServerDescriptor &Desc
 													"Welcome, volition administrator. Please use volition responsibly."
 													: VLString("Greetings, node ") + NewClient->ID + ". Your presence is now registered.")); //Yes, they're allowed in.
 	
+	if (WantsTicket)
+	{ //Only for nodes that asked, older ones won't accept anything after the status.
+		const std::vector<uint8_t> &Ticket = IssueResumeTicket(NewClient);
+		
+		if (!Ticket.empty()) Response->Push_BinStream(Ticket.data(), Ticket.size());
+	}
+	
 	///Send our response to the client
 	NewClient->SendStream(Response);
 	
@@ -297,11 +389,11 @@ Clients::ClientObj *Clients::AcceptClient_Auth(const Net::ServerDescriptor &Desc
 			StoredClient->Group = Lookup->Group;
 			if (StoredClient->Group)
 			{
-				Logger::WriteLogLine(Logger::LOGITEM_INFO, VLString("Merged node \"") + StoredClient->GetID() + "\" into assigned group \"" + StoredClient->Group + "\".");
+				Logger::WriteLogLine(Logger::LOGITEM_INFO, VLString("Merged node \"") + StoredClient->GetID() + "\" into assigned group \"" + StoredClient->Group + "\".", StoredClient->GetID());
 			}
 			else
 			{
-				Logger::WriteLogLine(Logger::LOGITEM_INFO, VLString("Node \"") + StoredClient->GetID() + "\" has no group, merging into the unsorted group.");
+				Logger::WriteLogLine(Logger::LOGITEM_INFO, VLString("Node \"") + StoredClient->GetID() + "\" has no group, merging into the unsorted group.", StoredClient->GetID());
 			}
 		}
 		
@@ -309,7 +401,7 @@ Clients::ClientObj *Clients::AcceptClient_Auth(const Net::ServerDescriptor &Desc
 		if (!DB::UpdateNodeDB(StoredClient->GetID(), StoredClient->GetPlatformString(), StoredClient->GetNodeRevision(),
 								StoredClient->GetGroup(), StoredClient->GetConnectedTime()))
 		{
-			Logger::WriteLogLine(Logger::LOGITEM_SYSERROR, VLString("Failed to update database for connecting node \"") + StoredClient->GetID() + "\"!");
+			Logger::WriteLogLine(Logger::LOGITEM_SYSERROR, VLString("Failed to update database for connecting node \"") + StoredClient->GetID() + "\"!", StoredClient->GetID());
 		}
 
 		//Notify Admin of new node connecting.
@@ -334,6 +426,92 @@ Clients::ClientObj *Clients::AcceptClient_Auth(const Net::ServerDescriptor &Desc
 	
 }
 
+static uint32_t GetNodeAdmitDelay(void)
+{ //Zero if a node can log in right now, otherwise how long it should wait. Up to a second's worth of logins can come in at once.
+	if (!AcceptPacing.Rate) return 0;
+	
+	const uint64_t Now = Utils::GetMonotonicMs();
+	const uint64_t Interval = AcceptPacing.Rate < 1000 ? 1000 / AcceptPacing.Rate : 1;
+	
+	if (AcceptPacing.NextSlot < Now) AcceptPacing.NextSlot = Now;
+	
+	const uint64_t Wait = AcceptPacing.NextSlot - Now;
+	
+	if (Wait < RETRY_AFTER_MAX_MS) AcceptPacing.NextSlot += Interval;
+	
+	if (Wait < 1000) return 0;
+	
+	return Wait < RETRY_AFTER_MAX_MS ? Wait : RETRY_AFTER_MAX_MS;
+}
+
+static void RejectNode(const Net::ClientDescriptor &ClientDesc, const NetCmdStatus &Status, const uint32_t RetryAfterMs)
+{ //Sent directly, since the client's queues never got started. Older nodes ignore the retry hint and fall back to their own timing.
+	Conation::ConationStream Response(CMDCODE_B2S_AUTH, Conation::IDENT_ISREPORT_BIT, 0u);
+	
+	Response.Push_NetCmdStatus(Status);
+	
+	if (RetryAfterMs) Response.Push_Uint32(RetryAfterMs);
+	
+	Response.Transmit(ClientDesc);
+}
+
+static bool CheckResumeTicket(const VLString &ID, const Conation::ConationStream::BinStreamArg &Ticket)
+{
+	auto Iter = ResumeTickets.find(ID);
+	
+	if (Iter == ResumeTickets.end()) return false;
+	
+	const ResumeTicket &Stored = Iter->second;
+	
+	const bool Valid = Ticket.DataSize == Stored.Secret.size()
+						&& CRYPTO_memcmp(Ticket.Data, Stored.Secret.data(), Stored.Secret.size()) == 0
+						&& (!Stored.Expires || Stored.Expires > time(nullptr));
+	
+	if (!Valid) return false;
+	
+	//Might have been revoked since we issued it.
+	VLScopedPtr<DB::AuthTokensDBEntry*> TokenLookup { DB::LookupAuthToken(Stored.AuthToken) };
+	
+	if (!TokenLookup)
+	{
+		ResumeTickets.erase(Iter);
+		return false;
+	}
+	
+	return true;
+}
+
+static std::vector<uint8_t> IssueResumeTicket(const Clients::ClientObj *Client)
+{
+	static time_t LastPrune;
+	
+	const time_t Now = time(nullptr);
+	
+	if (Now - LastPrune >= RESUME_TICKET_PRUNE_SECS)
+	{
+		for (auto Iter = ResumeTickets.begin(); Iter != ResumeTickets.end();)
+		{
+			if (Iter->second.Expires && Iter->second.Expires <= Now) Iter = ResumeTickets.erase(Iter);
+			else ++Iter;
+		}
+		
+		LastPrune = Now;
+	}
+	
+	std::vector<uint8_t> Secret(RESUME_TICKET_SIZE);
+	
+	if (RAND_bytes(Secret.data(), Secret.size()) != 1) return {};
+	
+	ResumeTickets[Client->GetID()] = ResumeTicket{ Secret, Client->GetAuthToken(), Client->GetPlatformString(), Client->GetNodeRevision(), 0 };
+	
+	return Secret;
+}
+
+void Clients::SetNodeAcceptRate(const uint32_t PerSecond)
+{
+	AcceptPacing.Rate = PerSecond;
+}
+
 bool Clients::ClientObj::SendStream(Conation::ConationStream *Stream)
 {
 	this->ClientWriteQueue->Push(Stream);
@@ -379,6 +557,10 @@ bool Clients::ClientObj::SendPing(void)
 	if (this->Ping.Waiting) return false; //Don't let us double up.
 	
 	Conation::ConationStream *ToSend = new Conation::ConationStream(CMDCODE_ANY_PING, false, 0u);
+	
+	uint32_t TelemetryInterval = 0;
+	
+	if (this != CurrentAdmin && FleetHealth::GetInterval(TelemetryInterval)) ToSend->Push_Uint32(TelemetryInterval);
 
 #ifdef DEBUG
 	puts(VLString("Clients::ClientObj::SendPing(): Sending ping to client \"") + (this == CurrentAdmin ? "ADMIN" : this->GetID()) + "\".");
@@ -483,7 +665,7 @@ bool Clients::ProcessNodeDisconnect(ClientObj *Client, const NodeDeauthType Type
 	LogEntry += VLString(" (") + Client->GetIPAddr() + ") has disconnected. Reason: " + NodeDeauthTypeText[Type];
 	LogEntry.ShrinkToFit();
 	
-	Logger::WriteLogLine(Logger::LOGITEM_CONN, LogEntry);
+	Logger::WriteLogLine(Logger::LOGITEM_CONN, LogEntry, Client == CurrentAdmin ? nullptr : +Client->GetID());
 	
 	if (Client == CurrentAdmin)
 	{
@@ -492,6 +674,14 @@ bool Clients::ProcessNodeDisconnect(ClientObj *Client, const NodeDeauthType Type
 	else
 	{
 		CmdHandling::NotifyAdmin_NodeChange(Client->GetID(), false);
+		
+		auto Iter = ResumeTickets.find(Client->GetID());
+		
+		if (Iter != ResumeTickets.end())
+		{ //Only a node that lost its link gets to skip the login next time.
+			if (Type == NODE_DEAUTH_CONNBREAK || Type == NODE_DEAUTH_PINGOUT) Iter->second.Expires = time(nullptr) + RESUME_TICKET_LIFETIME_SECS;
+			else ResumeTickets.erase(Iter);
+		}
 	}
 
 	//Give them a chance to finish sending data before we close their socket.
@@ -142,6 +142,7 @@ namespace Clients
 	bool HandleClientInterface(Clients::ClientObj *Client, Conation::ConationStream *Stream);
 	void FlushAll(void);
 	ClientObj *AcceptClient_Auth(const Net::ServerDescriptor &ServerDesc);
+	void SetNodeAcceptRate(const uint32_t PerSecond); //Full node logins per second before we start telling them to come back later.
 	void CheckPingsAndQueues(void);
 	ClientObj *LookupCurAdmin(void);
 
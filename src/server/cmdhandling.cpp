@@ -28,11 +28,14 @@
 #include "core.h"
 #include "logger.h"
 #include "nodeupdates.h"
+#include "fleethealth.h"
 
 #include <map>
 #include <list>
 #include <time.h>
 
+#define VAULT_MAX_CHUNK_SIZE (4 * 1024 * 1024)
+
 //Globals
 
 //Prototypes for static functions
@@ -73,6 +76,17 @@ void CmdHandling::HandleReport(Clients::ClientObj *Client, Conation::ConationStr
 			if (Client != Clients::LookupCurAdmin())
 			{
 				NotifyAdmin_NodeChange(Client->GetID(), true);
+				
+				//Nodes echo back whatever we pinged them with, plus a telemetry batch if they have one.
+				if (Stream->VerifyArgTypes({Conation::ARGTYPE_UINT32, Conation::ARGTYPE_BINSTREAM})) Stream->Pop_Uint32();
+				else if (!Stream->VerifyArgTypes({Conation::ARGTYPE_BINSTREAM})) break;
+				
+				const Conation::ConationStream::BinStreamArg &Batch = Stream->Pop_BinStream();
+				
+				if (!FleetHealth::AddBatch(Client->GetID(), Batch.Data, Batch.DataSize))
+				{
+					Logger::WriteLogLine(Logger::LOGITEM_SYSWARN, "Discarded malformed telemetry batch.", Client->GetID());
+				}
 			}
 			break;
 		}
@@ -105,9 +119,12 @@ void CmdHandling::HandleReport(Clients::ClientObj *Client, Conation::ConationStr
 #ifdef DEBUG
 				puts(VLString("CmdHandling::HandleReport(): Report specifies failure with node update."));
 #endif //DEBUG
+				NodeUpdates::HandleUpdateReport(Client, false); //Falls back to the full binary if it was a patch that failed.
 				break;
 			}
 			
+			NodeUpdates::HandleUpdateReport(Client, true);
+			
 			if (ArgTypes->size() != 2 || ArgTypes->at(1) != Conation::ARGTYPE_STRING)
 			{ //We were expecting a string afterwards. O.o
 #ifdef DEBUG
@@ -169,7 +186,7 @@ void CmdHandling::HandleReport(Clients::ClientObj *Client, Conation::ConationStr
 				
 				Stream->Rewind();
 				
-				Logger::WriteLogLine(Logger::LOGITEM_INFO, Msg);
+				Logger::WriteLogLine(Logger::LOGITEM_INFO, Msg, Client->GetID());
 				break;
 			}
 			
@@ -409,6 +426,8 @@ void CmdHandling::HandleRequest(Clients::ClientObj *Client, Conation::ConationSt
 			
 			const bool Result = (File.Data && File.DataSize) ? DB::UpdatePlatformBinaryDB(PlatformString, Revision, File.Data, File.DataSize) : false; 
 			
+			if (Result) NodeUpdates::ForgetPatches(PlatformString);
+			
 			Conation::ConationStream Response(CMDCODE_A2S_PROVIDEUPDATE, Conation::IDENT_ISREPORT_BIT, Stream->GetCmdIdentOnly());
 			
 			Response.Push_NetCmdStatus(Result);
@@ -529,22 +548,23 @@ void CmdHandling::HandleRequest(Clients::ClientObj *Client, Conation::ConationSt
 
 			const VLString &ItemName = Stream->Pop_String();
 			
-			VLScopedPtr<DB::VaultDBEntry*> Entry { DB::LookupVaultDBEntry(ItemName, "OriginNode") };
+			DB::VaultItemMeta Meta{};
 			
-			if (!Entry)
+			if (!DB::LookupVaultItemMeta(ItemName, &Meta))
 			{
 				Response->Push_NetCmdStatus(false); //We don't want anyone to know whether this key exists or not.
 				Client->SendStream(Response);
 				break;
 			}
 			
-			const bool BelongsToNode = Entry->OriginNode == Client->GetID();
+			const bool BelongsToNode = Meta.OriginNode == Client->GetID();
 			
-			Entry = DB::LookupVaultDBEntry(ItemName); //Now get all of it.
+			std::vector<uint8_t> Data;
 			
-			if (IsAdmin || (BelongsToNode && (NodePermissions & DB::ATP_VAULT_READ_OUR)) || (NodePermissions & DB::ATP_VAULT_READ_ANY))
+			if ((IsAdmin || (BelongsToNode && (NodePermissions & DB::ATP_VAULT_READ_OUR)) || (NodePermissions & DB::ATP_VAULT_READ_ANY)) &&
+				(Data.resize(Meta.Size), DB::ReadVaultBlob(Meta.RowID, 0, Data.data(), Data.size())))
 			{
-				Response->Push_File(Entry->Key, Entry->Binary.data(), Entry->Binary.size());
+				Response->Push_File(ItemName, Data.data(), Data.size());
 			}
 			else
 			{
@@ -555,6 +575,150 @@ void CmdHandling::HandleRequest(Clients::ClientObj *Client, Conation::ConationSt
 			
 			break;
 		}
+		case CMDCODE_B2S_VAULT_GETCHUNK:
+		{ //Chunked version of VAULT_FETCH. Client asks for whatever offset it wants, so resuming is just asking again.
+			Conation::ConationStream *Response = new Conation::ConationStream(Stream->GetCommandCode(), Conation::IDENT_ISREPORT_BIT, Stream->GetCmdIdentOnly());
+			
+			if (!Stream->VerifyArgTypes({Conation::ARGTYPE_STRING, Conation::ARGTYPE_UINT64, Conation::ARGTYPE_UINT32}))
+			{
+				Response->Push_NetCmdStatus({false, STATUS_MISUSED, "Takes key, offset, and max chunk size"});
+				Client->SendStream(Response);
+				break;
+			}
+			
+			const VLString &ItemName = Stream->Pop_String();
+			const uint64_t Offset = Stream->Pop_Uint64();
+			uint32_t ChunkSize = Stream->Pop_Uint32();
+			
+			if (!ChunkSize || ChunkSize > VAULT_MAX_CHUNK_SIZE) ChunkSize = VAULT_MAX_CHUNK_SIZE;
+			
+			DB::VaultItemMeta Meta{};
+			
+			if (!DB::LookupVaultItemMeta(ItemName, &Meta))
+			{
+				Response->Push_NetCmdStatus(false);
+				Client->SendStream(Response);
+				break;
+			}
+			
+			const bool BelongsToNode = Meta.OriginNode == Client->GetID();
+			
+			if ((!IsAdmin && !(BelongsToNode && (NodePermissions & DB::ATP_VAULT_READ_OUR)) && !(NodePermissions & DB::ATP_VAULT_READ_ANY)) ||
+				Offset > Meta.Size)
+			{
+				Response->Push_NetCmdStatus(false);
+				Client->SendStream(Response);
+				break;
+			}
+			
+			std::vector<uint8_t> Data(Meta.Size - Offset < ChunkSize ? Meta.Size - Offset : ChunkSize);
+			
+			if (!DB::ReadVaultBlob(Meta.RowID, Offset, Data.data(), Data.size()))
+			{
+				Response->Push_NetCmdStatus({false, STATUS_IERR, "Failed to read vault blob"});
+				Client->SendStream(Response);
+				break;
+			}
+			
+			Response->Push_File(ItemName, Data.data(), Data.size());
+			Response->Push_Uint64(Offset);
+			Response->Push_Uint64(Meta.Size);
+			
+			Client->SendStream(Response);
+			break;
+		}
+		case CMDCODE_B2S_VAULT_PUTCHUNK:
+		{ //Chunked version of VAULT_ADD/VAULT_UPDATE. Offset zero starts an upload, the last chunk commits it to the vault.
+			Conation::ConationStream *Response = new Conation::ConationStream(Stream->GetCommandCode(), Conation::IDENT_ISREPORT_BIT, Stream->GetCmdIdentOnly());
+			
+			if (!Stream->VerifyArgTypes({Conation::ARGTYPE_STRING, Conation::ARGTYPE_UINT64, Conation::ARGTYPE_UINT64, Conation::ARGTYPE_BINSTREAM}))
+			{
+				Response->Push_NetCmdStatus({false, STATUS_MISUSED, "Takes key, total size, offset, and chunk data"});
+				Client->SendStream(Response);
+				break;
+			}
+			
+			const VLString &Key = Stream->Pop_String();
+			const uint64_t TotalSize = Stream->Pop_Uint64();
+			const uint64_t Offset = Stream->Pop_Uint64();
+			const Conation::ConationStream::BinStreamArg &Chunk = Stream->Pop_BinStream();
+			
+			const VLString &OurID = IsAdmin ? VLString("ADMIN") : Client->GetID();
+			
+			DB::VaultUploadState State{};
+			
+			if (Offset == 0)
+			{ //New upload, so check permissions the same way VAULT_ADD and VAULT_UPDATE do.
+				DB::VaultItemMeta Meta{};
+				bool Allowed = false;
+				
+				if (DB::LookupVaultItemMeta(Key, &Meta))
+				{
+					const bool BelongsToNode = Meta.OriginNode == Client->GetID();
+					
+					Allowed = IsAdmin || (BelongsToNode && (NodePermissions & DB::ATP_VAULT_CHG_OUR)) || (NodePermissions & DB::ATP_VAULT_CHG_ANY);
+				}
+				else
+				{
+					Allowed = IsAdmin || (NodePermissions & DB::ATP_VAULT_ADD);
+				}
+				
+				if (!Allowed)
+				{
+					Response->Push_NetCmdStatus(false);
+					Response->Push_Uint64(0);
+					Client->SendStream(Response);
+					break;
+				}
+				
+				if (!DB::BeginVaultUpload(Key, OurID, TotalSize))
+				{
+					Response->Push_NetCmdStatus({false, STATUS_IERR, "Failed to start upload, it may be bigger than the database can hold"});
+					Response->Push_Uint64(0);
+					Client->SendStream(Response);
+					break;
+				}
+			}
+			
+			if (!DB::LookupVaultUpload(Key, &State) || State.OriginNode != OurID || State.TotalSize != TotalSize)
+			{ //Not one of ours, or they're trying to resume something that isn't there anymore.
+				Response->Push_NetCmdStatus(false);
+				Response->Push_Uint64(0);
+				Client->SendStream(Response);
+				break;
+			}
+			
+			if (Offset != State.Received)
+			{ //Tell them where to pick back up.
+				Response->Push_NetCmdStatus({false, STATUS_MISUSED, "Offset mismatch, resume from the offset provided"});
+				Response->Push_Uint64(State.Received);
+				Client->SendStream(Response);
+				break;
+			}
+			
+			if (!DB::WriteVaultUploadChunk(Key, &State, Chunk.Data, Chunk.DataSize))
+			{
+				Response->Push_NetCmdStatus({false, STATUS_IERR, "Failed to write chunk"});
+				Response->Push_Uint64(State.Received);
+				Client->SendStream(Response);
+				break;
+			}
+			
+			if (State.Received == State.TotalSize)
+			{
+				const bool Result = DB::FinishVaultUpload(Key);
+				
+				Response->Push_NetCmdStatus({Result, Result ? STATUS_OK : STATUS_IERR, Result ? "Upload complete" : "Failed to commit upload to vault"});
+			}
+			else
+			{
+				Response->Push_NetCmdStatus(true);
+			}
+			
+			Response->Push_Uint64(State.Received);
+			Client->SendStream(Response);
+			break;
+		}
 		case CMDCODE_B2S_VAULT_UPDATE:
 		{
 			Conation::ConationStream *Response = new Conation::ConationStream(Stream->GetCommandCode(), Conation::IDENT_ISREPORT_BIT, Stream->GetCmdIdentOnly());
@@ -802,6 +966,8 @@ void CmdHandling::HandleRequest(Clients::ClientObj *Client, Conation::ConationSt
 			}
 
 			const bool Result = DB::DeleteNode(NodeID);
+			
+			FleetHealth::ForgetNode(NodeID);
 
 			Response->Push_NetCmdStatus(Result);
 			Client->SendStream(Response);
@@ -827,7 +993,11 @@ void CmdHandling::HandleRequest(Clients::ClientObj *Client, Conation::ConationSt
 				break;
 			}
 
-			const bool Result = DB::DeletePlatformBinaryEntry(Stream->Pop_String());
+			const VLString &PlatformString = Stream->Pop_String();
+			
+			const bool Result = DB::DeletePlatformBinaryEntry(PlatformString);
+			
+			NodeUpdates::ForgetPatches(PlatformString);
 
 			Response->Push_NetCmdStatus(Result);
 			Client->SendStream(Response);
@@ -1085,6 +1255,7 @@ void CmdHandling::HandleRequest(Clients::ClientObj *Client, Conation::ConationSt
 			}
 
 			Response->Push_Uint64(Logger::GetLogSize());
+			Response->Push_String(Logger::StatsToText());
 			Client->SendStream(Response);
 			break;
 		}
@@ -1109,6 +1280,71 @@ void CmdHandling::HandleRequest(Clients::ClientObj *Client, Conation::ConationSt
 			Client->SendStream(Response);
 			break;
 		}
+		case CMDCODE_A2S_SRVLOG_QUERY:
+		{
+			if (!IsAdmin)
+			{
+				Clients::ProcessNodeDisconnect(Client, Clients::NODE_DEAUTH_EVIL);
+				break;
+			}
+			
+			Conation::ConationStream *Response = new Conation::ConationStream(Stream->GetCommandCode(), Conation::IDENT_ISREPORT_BIT, Stream->GetCmdIdentOnly());
+
+			//Event type name, node ID, seconds back, max lines. Empty strings and zeroes mean "don't care".
+			if (!Stream->VerifyArgTypes({Conation::ARGTYPE_STRING, Conation::ARGTYPE_STRING, Conation::ARGTYPE_UINT32, Conation::ARGTYPE_UINT32}))
+			{
+				Response->Push_NetCmdStatus({false, STATUS_MISUSED });
+				Client->SendStream(Response);
+				break;
+			}
+
+			const VLString &TypeName = Stream->Pop_String();
+			const VLString &NodeID = Stream->Pop_String();
+			const uint32_t SecondsBack = Stream->Pop_Uint32();
+			const uint32_t MaxLines = Stream->Pop_Uint32();
+			
+			const Logger::ItemType Type = Logger::StringToItemType(TypeName);
+			
+			if (!TypeName.Empty() && Type == Logger::LOGITEM_INVALID)
+			{
+				Response->Push_NetCmdStatus({false, STATUS_MISUSED, "Unknown log event type" });
+				Client->SendStream(Response);
+				break;
+			}
+			
+			const time_t Since = SecondsBack ? time(nullptr) - SecondsBack : 0;
+			
+			Response->Push_String(Logger::QueryLog(Type, NodeID, Since, MaxLines));
+			Client->SendStream(Response);
+			break;
+		}
+		case CMDCODE_A2S_TELEMETRY:
+		{
+			if (!IsAdmin)
+			{
+				Clients::ProcessNodeDisconnect(Client, Clients::NODE_DEAUTH_EVIL);
+				break;
+			}
+			
+			Conation::ConationStream *Response = new Conation::ConationStream(Stream->GetCommandCode(), Conation::IDENT_ISREPORT_BIT, Stream->GetCmdIdentOnly());
+
+			//Node ID and seconds back. Empty node ID means every node, zero seconds means everything we kept.
+			if (!Stream->VerifyArgTypes({Conation::ARGTYPE_STRING, Conation::ARGTYPE_UINT32}))
+			{
+				Response->Push_NetCmdStatus({false, STATUS_MISUSED });
+				Client->SendStream(Response);
+				break;
+			}
+			
+			const VLString &NodeID = Stream->Pop_String();
+			const uint32_t SecondsBack = Stream->Pop_Uint32();
+			
+			const time_t Since = SecondsBack ? time(nullptr) - SecondsBack : 0;
+			
+			Response->Push_String(FleetHealth::Summarize(NodeID, Since));
+			Client->SendStream(Response);
+			break;
+		}
 		case CMDCODE_A2S_ROUTINE_ADD:
 		{
 			if (!IsAdmin)
@@ -1515,7 +1751,7 @@ void CmdHandling::HandleN2N(Clients::ClientObj *Client, Conation::ConationStream
 	
 	if (!Types || Types->at(0) != Conation::ARGTYPE_ODHEADER)
 	{
-		Logger::WriteLogLine(Logger::LOGITEM_SECUREWARN, VLString{"Invalid node-to-node message sent from node "} + Client->GetID());
+		Logger::WriteLogLine(Logger::LOGITEM_SECUREWARN, VLString{"Invalid node-to-node message sent from node "} + Client->GetID(), Client->GetID());
 		
 		return;
 	}
@@ -1524,7 +1760,7 @@ void CmdHandling::HandleN2N(Clients::ClientObj *Client, Conation::ConationStream
 	
 	if (ODObj.Origin != Client->GetID())
 	{ ///If you *really* want to, I see no reason not to let you send shit to yourself, so there's no checks for that here.
-		Logger::WriteLogLine(Logger::LOGITEM_SECUREERROR, VLString{"Node "} + Client->GetID() + " attempted to masquerade as node \"" + ODObj.Origin + "\". Killing node.");
+		Logger::WriteLogLine(Logger::LOGITEM_SECUREERROR, VLString{"Node "} + Client->GetID() + " attempted to masquerade as node \"" + ODObj.Origin + "\". Killing node.", Client->GetID());
 		ProcessNodeDisconnect(Client, Clients::NODE_DEAUTH_EVIL);
 		return;
 	}
@@ -1551,7 +1787,7 @@ void CmdHandling::HandleN2N(Clients::ClientObj *Client, Conation::ConationStream
 		Logger::WriteLogLine(Logger::LOGITEM_SECUREWARN,
 							VLString{"Node "} + ODObj.Origin +
 							" attempted to send an N2N to " + ODObj.Destination +
-							" but they lack the required permissions.");
+							" but they lack the required permissions.", ODObj.Origin);
 		return;
 	}
 	
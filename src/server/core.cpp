@@ -23,6 +23,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <time.h>
+#include <signal.h>
 
 #include "../libvolition/include/common.h"
 #include "../libvolition/include/netcore.h"
@@ -32,6 +33,7 @@
 #include "db.h"
 #include "logger.h"
 #include "routines.h"
+#include "fleethealth.h"
 
 #include <map>
 
@@ -47,12 +49,18 @@ static bool SkipHeadRelease;
 static bool ResetLoopAfter;
 static bool InsideHandleInterface;
 static Clients::ClientObj *ActiveClient;
+static volatile sig_atomic_t ShutdownRequested;
 
 //External globals
 Net::ServerDescriptor ServerDesc;
 
 //Prototypes
 static void MasterLoop(void);
+static void LoadLoggerConfig(void);
+static void LoadClientsConfig(void);
+static void InstallSignalHandlers(void);
+static void ShutdownSignalHandler(const int Signal);
+static void FatalSignalHandler(const int Signal);
 
 //Function definitions
 bool Core::ValidServerAdminLogin(const char *const Username, const char *const Password)
@@ -132,6 +140,10 @@ int main(const int argc, const char **argv)
 
 	Net::InitNetcore(true);
 
+	Logger::Init();
+	atexit(Logger::Shutdown);
+	InstallSignalHandlers();
+	
 	puts(VLString("Volition server -- Binary compatible with r") + VLString::IntToString(Conation::PROTOCOL_VERSION) + " series.\nStarting up...");
 	Logger::WriteLogLine(Logger::LOGITEM_INFO, VLString("Volition server for Conation protocol version r") + VLString::IntToString(Conation::PROTOCOL_VERSION) + " starting up.");
 	
@@ -144,6 +156,15 @@ int main(const int argc, const char **argv)
 			exit(1);
 		}
 	}
+	else if (!DB::UpgradeDB())
+	{
+		fputs("Failed to add new tables to database file \"" SERVER_DBFILE "\"!\n"
+				"Cannot continue.\n", stderr);
+		exit(1);
+	}
+	
+	LoadLoggerConfig();
+	LoadClientsConfig();
 	
 	//Load known routines into memory so we can monitor them more efficiently than constantly polling the database.
 	Routines::ScanRoutineDB();
@@ -157,9 +178,71 @@ int main(const int argc, const char **argv)
 	
 	printf("Listening on port %d, startup complete.\n", MASTER_PORT);
 
-	while (1) MasterLoop();
+	while (!ShutdownRequested) MasterLoop();
+	
+	Logger::WriteLogLine(Logger::LOGITEM_INFO, "Volition server shutting down on signal.");
+	
+	return 0; //atexit() handles flushing the log.
+}
+
+static void LoadLoggerConfig(void)
+{ //All optional. Sizes in bytes, interval in seconds, zero means never.
+	uint64_t MaxBytes = 0;
+	uint64_t MaxAgeSecs = 0;
+	size_t KeepCount = 5;
+	
+	VLScopedPtr<DB::GlobalConfigDBEntry*> Lookup { DB::LookupGlobalConfigDBEntry("LogRotateSize") };
+	
+	if (Lookup) MaxBytes = VLString::StringToUint(Lookup->Value);
+	
+	Lookup.Encase(DB::LookupGlobalConfigDBEntry("LogRotateInterval"));
+	
+	if (Lookup) MaxAgeSecs = VLString::StringToUint(Lookup->Value);
+	
+	Lookup.Encase(DB::LookupGlobalConfigDBEntry("LogRotateKeep"));
+	
+	if (Lookup) KeepCount = VLString::StringToUint(Lookup->Value);
+	
+	Logger::SetRotation(MaxBytes, MaxAgeSecs, KeepCount);
+}
+
+static void LoadClientsConfig(void)
+{ //Optional. Full node logins allowed per second, zero or unset means no limit.
+	VLScopedPtr<DB::GlobalConfigDBEntry*> Lookup { DB::LookupGlobalConfigDBEntry("NodeAcceptRate") };
+	
+	if (Lookup) Clients::SetNodeAcceptRate(VLString::StringToUint(Lookup->Value));
 	
-	return 0;
+	//Telemetry sample interval in seconds we hand nodes with each ping. Zero turns their samplers off, unset leaves them at their default.
+	Lookup.Encase(DB::LookupGlobalConfigDBEntry("TelemetryInterval"));
+	
+	if (Lookup) FleetHealth::SetInterval(VLString::StringToUint(Lookup->Value));
+}
+
+static void ShutdownSignalHandler(const int Signal)
+{ //Let the master loop finish its iteration and fall out of main() normally.
+	ShutdownRequested = true;
+}
+
+static void FatalSignalHandler(const int Signal)
+{ //We're dying anyway, so at least get whatever's still in the log ring onto disk.
+	Logger::EmergencyFlush();
+	
+	signal(Signal, SIG_DFL);
+	raise(Signal);
+}
+
+static void InstallSignalHandlers(void)
+{
+	signal(SIGINT, ShutdownSignalHandler);
+	signal(SIGTERM, ShutdownSignalHandler);
+	
+	signal(SIGSEGV, FatalSignalHandler);
+	signal(SIGABRT, FatalSignalHandler);
+	signal(SIGFPE, FatalSignalHandler);
+	signal(SIGILL, FatalSignalHandler);
+#ifndef WIN32
+	signal(SIGBUS, FatalSignalHandler);
+#endif //WIN32
 }
 
 static void MasterLoop(void)
@@ -120,8 +120,26 @@ static const VLString DBSchema[] = 	{
 										"Schedule text not null,\n"
 										"Flags int not null,\n"
 										"Targets text not null);\n",
+										
+										//Chunked vault uploads in progress. Added later, so UpgradeDB() creates it for older databases.
+										"create table if not exists vaultuploads (\n"
+										"Key text not null unique,\n"
+										"Binary blob not null,\n"
+										"TotalSize int not null,\n"
+										"Received int not null,\n"
+										"OriginNode text not null);\n",
+										
+										//Platform binaries that got replaced, so nodes still running them can be sent a patch instead of the whole thing.
+										"create table if not exists pastbinaries (\n"
+										"PlatformString text not null,\n"
+										"Revision text not null,\n"
+										"Binary blob not null,\n"
+										"unique (PlatformString, Revision));\n",
 									};
 
+#define VAULT_BLOB_COPY_SIZE (1024 * 1024)
+#define PAST_BINARIES_MAX 4 //Per platform. Nodes more than a few revisions behind just get the whole binary.
+
 
 //Prototypes
 static bool SaveNewNode(const DB::NodeDBEntry *Entry);
@@ -139,6 +157,7 @@ static void LoadGlobalConfigDBColumn(sqlite3_stmt *const Statement, DB::GlobalCo
 static bool SaveNewPlatformBinaryEntry(const DB::PlatformBinaryEntry *Entry);
 static bool UpdateExistingPlatformBinaryEntry(const DB::PlatformBinaryEntry *Entry);
 static void LoadPlatformBinaryColumn(sqlite3_stmt *const Statement, DB::PlatformBinaryEntry *const Out, const int Index);
+static bool ArchivePlatformBinary(const char *PlatformString);
 
 static bool SaveNewAuthTokensDBEntry(const DB::AuthTokensDBEntry *Entry);
 static bool UpdateExistingAuthTokensDBEntry(const DB::AuthTokensDBEntry *Entry);
@@ -149,6 +168,7 @@ static bool SaveNewRoutineDBEntry(const DB::RoutineDBEntry *Entry);
 static void LoadRoutineColumn(sqlite3_stmt *const Statement, DB::RoutineDBEntry *const Out, const int Index);
 
 static bool InitDBSub(sqlite3 *Handle, const char *TableSchema);
+static bool ExecSimpleSQL(sqlite3 *Handle, const char *SQL);
 
 //Function definitions
 bool DB::InitializeEmptyDB(void)
@@ -183,6 +203,38 @@ bool DB::InitializeEmptyDB(void)
 	return RetVal;
 }
 
+bool DB::UpgradeDB(void)
+{ //Tables added after the original schema use "if not exists", so we can just run them against any database.
+	sqlite3 *Handle = nullptr;
+
+	if (sqlite3_open(SERVER_DBFILE, &Handle) != 0)
+	{
+		return false;
+	}
+	
+	bool RetVal = true;
+	
+	for (size_t Inc = 0u; Inc < sizeof DBSchema / sizeof *DBSchema; ++Inc)
+	{
+		if (!DBSchema[Inc].Contains("if not exists")) continue;
+		
+		if (!InitDBSub(Handle, DBSchema[Inc]))
+		{
+			RetVal = false;
+			break;
+		}
+	}
+	
+	sqlite3_close(Handle);
+	
+	return RetVal;
+}
+
+static bool ExecSimpleSQL(sqlite3 *Handle, const char *SQL)
+{
+	return sqlite3_exec(Handle, SQL, nullptr, nullptr, nullptr) == SQLITE_OK;
+}
+
 static bool InitDBSub(sqlite3 *Handle, const char *TableSchema)
 {
 	sqlite3_stmt *Statement = nullptr;
@@ -688,8 +740,98 @@ static bool SaveNewPlatformBinaryEntry(const DB::PlatformBinaryEntry *Entry)
 	return true;
 }
 
+static bool ArchivePlatformBinary(const char *PlatformString)
+{ //Copies the current binary for a platform into pastbinaries, and drops the oldest ones past PAST_BINARIES_MAX.
+	sqlite3 *Handle = nullptr;
+
+	if (sqlite3_open(SERVER_DBFILE, &Handle) != 0)
+	{
+		return false;
+	}
+	
+	const VLString SQL[] =	{
+								"insert or replace into pastbinaries (PlatformString, Revision, Binary) "
+								"select PlatformString, Revision, Binary from platformbinaries where PlatformString = ?;",
+								
+								VLString("delete from pastbinaries where PlatformString = ? and rowid not in "
+								"(select rowid from pastbinaries where PlatformString = ? order by rowid desc limit ") + VLString::IntToString(PAST_BINARIES_MAX) + ");",
+							};
+	
+	for (const VLString &Query : SQL)
+	{
+		sqlite3_stmt *Statement = nullptr;
+		const char *Tail = nullptr;
+
+		if (sqlite3_prepare(Handle, Query, Query.Length(), &Statement, &Tail) != SQLITE_OK)
+		{
+			sqlite3_close(Handle);
+			return false;
+		}
+		
+		for (int Inc = 1; Inc <= sqlite3_bind_parameter_count(Statement); ++Inc)
+		{
+			sqlite3_bind_text(Statement, Inc, PlatformString, strlen(PlatformString), SQLITE_STATIC);
+		}
+		
+		const int Code = sqlite3_step(Statement);
+		
+		sqlite3_finalize(Statement);
+		
+		if (Code != SQLITE_DONE)
+		{
+			sqlite3_close(Handle);
+			return false;
+		}
+	}
+	
+	sqlite3_close(Handle);
+	
+	return true;
+}
+
+bool DB::LookupPastPlatformBinary(const char *PlatformString, const char *Revision, std::vector<uint8_t> &BinaryOut)
+{
+	sqlite3 *Handle = nullptr;
+
+	if (sqlite3_open(SERVER_DBFILE, &Handle) != 0)
+	{
+		return false;
+	}
+
+	sqlite3_stmt *Statement = nullptr;
+	const char *Tail = nullptr;
+
+	const char SQL[] = "select Binary from pastbinaries where PlatformString = ? and Revision = ? limit 1;";
+
+	if (sqlite3_prepare(Handle, SQL, sizeof SQL - 1, &Statement, &Tail) != SQLITE_OK)
+	{
+		sqlite3_close(Handle);
+		return false;
+	}
+
+	sqlite3_bind_text(Statement, 1, PlatformString, strlen(PlatformString), SQLITE_STATIC);
+	sqlite3_bind_text(Statement, 2, Revision, strlen(Revision), SQLITE_STATIC);
+	
+	const bool Found = sqlite3_step(Statement) == SQLITE_ROW;
+	
+	if (Found)
+	{
+		const uint8_t *Data = static_cast<const uint8_t*>(sqlite3_column_blob(Statement, 0));
+		
+		BinaryOut.assign(Data, Data + sqlite3_column_bytes(Statement, 0));
+	}
+	
+	sqlite3_finalize(Statement);
+	sqlite3_close(Handle);
+
+	return Found;
+}
+
 bool DB::DeletePlatformBinaryEntry(const char *PlatformString)
 {
+	//Nodes might still be running it, so it's still good to diff against.
+	ArchivePlatformBinary(PlatformString);
+	
 	sqlite3 *Handle = nullptr;
 
 	if (sqlite3_open(SERVER_DBFILE, &Handle) != 0)
@@ -1255,6 +1397,11 @@ bool DB::UpdatePlatformBinaryDB(const char *PlatformString, const char *Revision
 	
 	memcpy(Entry.Binary.data(), BinaryData, BinarySize);
 	
+	if (Lookup && Lookup->Revision != Entry.Revision && !ArchivePlatformBinary(PlatformString))
+	{ //Not fatal, nodes on the old revision just get the whole binary.
+		VLWARN(VLString("Failed to archive previous binary for platform ") + PlatformString);
+	}
+	
 	const bool RetVal = Lookup ? UpdateExistingPlatformBinaryEntry(&Entry) : SaveNewPlatformBinaryEntry(&Entry);
 	
 #ifdef DEBUG
@@ -1702,3 +1849,315 @@ std::vector<DB::VaultDBEntry> *DB::GetVaultItemsInfo(void)
 	return RetVal;
 }
 
+bool DB::LookupVaultItemMeta(const char *Key, VaultItemMeta *Out)
+{ //Doesn't touch the blob itself, so it's cheap to check permissions before we commit to reading anything.
+	sqlite3 *Handle = nullptr;
+
+	if (sqlite3_open(SERVER_DBFILE, &Handle) != 0)
+	{
+		return false;
+	}
+
+	sqlite3_stmt *Statement = nullptr;
+	const char *Tail = nullptr;
+
+	const char SQL[] = "select rowid, OriginNode, length(Binary) from vaultdb where Key = ? limit 1;";
+
+	if (sqlite3_prepare(Handle, SQL, sizeof SQL - 1, &Statement, &Tail) != SQLITE_OK)
+	{
+		sqlite3_close(Handle);
+		return false;
+	}
+
+	sqlite3_bind_text(Statement, 1, Key, strlen(Key), SQLITE_STATIC);
+	
+	if (sqlite3_step(Statement) != SQLITE_ROW)
+	{ //Not found, or something worse.
+		sqlite3_finalize(Statement);
+		sqlite3_close(Handle);
+		return false;
+	}
+	
+	Out->RowID = sqlite3_column_int64(Statement, 0);
+	Out->OriginNode = (const char*)sqlite3_column_text(Statement, 1);
+	Out->Size = sqlite3_column_int64(Statement, 2);
+	
+	sqlite3_finalize(Statement);
+	sqlite3_close(Handle);
+	
+	return true;
+}
+
+bool DB::ReadVaultBlob(const int64_t RowID, const uint64_t Offset, void *Out, const size_t Length)
+{
+	sqlite3 *Handle = nullptr;
+
+	if (sqlite3_open(SERVER_DBFILE, &Handle) != 0)
+	{
+		return false;
+	}
+	
+	sqlite3_blob *Blob = nullptr;
+	
+	if (sqlite3_blob_open(Handle, "main", "vaultdb", "Binary", RowID, 0, &Blob) != SQLITE_OK)
+	{
+		sqlite3_close(Handle);
+		return false;
+	}
+	
+	const bool RetVal = Offset + Length <= (uint64_t)sqlite3_blob_bytes(Blob) &&
+						sqlite3_blob_read(Blob, Out, Length, Offset) == SQLITE_OK;
+	
+	sqlite3_blob_close(Blob);
+	sqlite3_close(Handle);
+	
+	return RetVal;
+}
+
+bool DB::BeginVaultUpload(const char *Key, const char *OriginNode, const uint64_t TotalSize)
+{ //Starts over from scratch if there's already one going for this key.
+	sqlite3 *Handle = nullptr;
+
+	if (sqlite3_open(SERVER_DBFILE, &Handle) != 0)
+	{
+		return false;
+	}
+
+	//zeroblob() would fail on anything bigger anyways, but a size that doesn't fit in an int64 would wrap around to something it accepts.
+	const int MaxLength = sqlite3_limit(Handle, SQLITE_LIMIT_LENGTH, -1);
+	
+	if (MaxLength < 0 || TotalSize > (uint64_t)MaxLength)
+	{
+		sqlite3_close(Handle);
+		return false;
+	}
+	
+	sqlite3_stmt *Statement = nullptr;
+	const char *Tail = nullptr;
+
+	const char SQL[] = "insert or replace into vaultuploads (Key, Binary, TotalSize, Received, OriginNode) values (?, zeroblob(?), ?, 0, ?);";
+
+	if (sqlite3_prepare(Handle, SQL, sizeof SQL - 1, &Statement, &Tail) != SQLITE_OK)
+	{
+		sqlite3_close(Handle);
+		return false;
+	}
+	
+	sqlite3_bind_text(Statement, 1, Key, strlen(Key), SQLITE_STATIC);
+	sqlite3_bind_int64(Statement, 2, TotalSize);
+	sqlite3_bind_int64(Statement, 3, TotalSize);
+	sqlite3_bind_text(Statement, 4, OriginNode, strlen(OriginNode), SQLITE_STATIC);
+	
+	const int Code = sqlite3_step(Statement);
+	
+	sqlite3_finalize(Statement);
+	sqlite3_close(Handle);
+	
+	return Code == SQLITE_DONE;
+}
+
+bool DB::LookupVaultUpload(const char *Key, VaultUploadState *Out)
+{
+	sqlite3 *Handle = nullptr;
+
+	if (sqlite3_open(SERVER_DBFILE, &Handle) != 0)
+	{
+		return false;
+	}
+
+	sqlite3_stmt *Statement = nullptr;
+	const char *Tail = nullptr;
+
+	const char SQL[] = "select rowid, OriginNode, TotalSize, Received from vaultuploads where Key = ? limit 1;";
+
+	if (sqlite3_prepare(Handle, SQL, sizeof SQL - 1, &Statement, &Tail) != SQLITE_OK)
+	{
+		sqlite3_close(Handle);
+		return false;
+	}
+
+	sqlite3_bind_text(Statement, 1, Key, strlen(Key), SQLITE_STATIC);
+	
+	if (sqlite3_step(Statement) != SQLITE_ROW)
+	{
+		sqlite3_finalize(Statement);
+		sqlite3_close(Handle);
+		return false;
+	}
+	
+	Out->RowID = sqlite3_column_int64(Statement, 0);
+	Out->OriginNode = (const char*)sqlite3_column_text(Statement, 1);
+	Out->TotalSize = sqlite3_column_int64(Statement, 2);
+	Out->Received = sqlite3_column_int64(Statement, 3);
+	
+	sqlite3_finalize(Statement);
+	sqlite3_close(Handle);
+	
+	return true;
+}
+
+bool DB::WriteVaultUploadChunk(const char *Key, VaultUploadState *State, const void *Data, const size_t Length)
+{ //Writes at State->Received and bumps it on success. Chunks have to arrive in order.
+	if (State->Received + Length > State->TotalSize) return false;
+	
+	sqlite3 *Handle = nullptr;
+
+	if (sqlite3_open(SERVER_DBFILE, &Handle) != 0)
+	{
+		return false;
+	}
+	
+	sqlite3_blob *Blob = nullptr;
+	sqlite3_stmt *Statement = nullptr;
+	const char *Tail = nullptr;
+	
+	const char SQL[] = "update vaultuploads set Received = ? where Key = ?;";
+	
+	ExecSimpleSQL(Handle, "begin;");
+	
+	if (sqlite3_blob_open(Handle, "main", "vaultuploads", "Binary", State->RowID, 1, &Blob) != SQLITE_OK)
+	{
+		goto EasyFail;
+	}
+	
+	if (Length && sqlite3_blob_write(Blob, Data, Length, State->Received) != SQLITE_OK)
+	{
+		sqlite3_blob_close(Blob);
+		goto EasyFail;
+	}
+	
+	sqlite3_blob_close(Blob);
+	
+	if (sqlite3_prepare(Handle, SQL, sizeof SQL - 1, &Statement, &Tail) != SQLITE_OK)
+	{
+		goto EasyFail;
+	}
+	
+	sqlite3_bind_int64(Statement, 1, State->Received + Length);
+	sqlite3_bind_text(Statement, 2, Key, strlen(Key), SQLITE_STATIC);
+	
+	if (sqlite3_step(Statement) != SQLITE_DONE)
+	{
+		sqlite3_finalize(Statement);
+		goto EasyFail;
+	}
+	
+	sqlite3_finalize(Statement);
+	
+	if (!ExecSimpleSQL(Handle, "commit;")) goto EasyFail;
+	
+	sqlite3_close(Handle);
+	
+	State->Received += Length;
+	return true;
+	
+EasyFail:
+	ExecSimpleSQL(Handle, "rollback;");
+	sqlite3_close(Handle);
+	return false;
+}
+
+bool DB::FinishVaultUpload(const char *Key)
+{ //Moves a completed upload into the vault, replacing any existing item. Copies blob to blob so we never hold the whole thing.
+	VaultUploadState State{};
+	
+	if (!LookupVaultUpload(Key, &State) || State.Received != State.TotalSize) return false;
+	
+	sqlite3 *Handle = nullptr;
+
+	if (sqlite3_open(SERVER_DBFILE, &Handle) != 0)
+	{
+		return false;
+	}
+
+	sqlite3_stmt *Statement = nullptr;
+	const char *Tail = nullptr;
+	sqlite3_blob *Source = nullptr;
+	sqlite3_blob *Dest = nullptr;
+	int64_t DestRowID = 0;
+	std::vector<uint8_t> Buffer;
+	
+	const char DeleteSQL[] = "delete from vaultdb where Key = ?;";
+	const char InsertSQL[] = "insert into vaultdb (Key, Binary, StoredTime, OriginNode) values (?, zeroblob(?), ?, ?);";
+	const char DropSQL[] = "delete from vaultuploads where Key = ?;";
+	
+	ExecSimpleSQL(Handle, "begin;");
+	
+	if (sqlite3_prepare(Handle, DeleteSQL, sizeof DeleteSQL - 1, &Statement, &Tail) != SQLITE_OK) goto EasyFail;
+	
+	sqlite3_bind_text(Statement, 1, Key, strlen(Key), SQLITE_STATIC);
+	
+	if (sqlite3_step(Statement) != SQLITE_DONE)
+	{
+		sqlite3_finalize(Statement);
+		goto EasyFail;
+	}
+	
+	sqlite3_finalize(Statement);
+	
+	if (sqlite3_prepare(Handle, InsertSQL, sizeof InsertSQL - 1, &Statement, &Tail) != SQLITE_OK) goto EasyFail;
+
+	sqlite3_bind_text(Statement, 1, Key, strlen(Key), SQLITE_STATIC);
+	sqlite3_bind_int64(Statement, 2, State.TotalSize);
+	sqlite3_bind_int64(Statement, 3, time(nullptr));
+	sqlite3_bind_text(Statement, 4, State.OriginNode, State.OriginNode.Length(), SQLITE_STATIC);
+	
+	if (sqlite3_step(Statement) != SQLITE_DONE)
+	{
+		sqlite3_finalize(Statement);
+		goto EasyFail;
+	}
+	
+	sqlite3_finalize(Statement);
+	
+	DestRowID = sqlite3_last_insert_rowid(Handle);
+	
+	if (sqlite3_blob_open(Handle, "main", "vaultuploads", "Binary", State.RowID, 0, &Source) != SQLITE_OK) goto EasyFail;
+	
+	if (sqlite3_blob_open(Handle, "main", "vaultdb", "Binary", DestRowID, 1, &Dest) != SQLITE_OK)
+	{
+		sqlite3_blob_close(Source);
+		goto EasyFail;
+	}
+	
+	Buffer.resize(State.TotalSize < VAULT_BLOB_COPY_SIZE ? State.TotalSize : VAULT_BLOB_COPY_SIZE);
+	
+	for (uint64_t Offset = 0; Offset < State.TotalSize; Offset += Buffer.size())
+	{
+		const size_t Chunk = State.TotalSize - Offset < Buffer.size() ? State.TotalSize - Offset : Buffer.size();
+		
+		if (sqlite3_blob_read(Source, Buffer.data(), Chunk, Offset) != SQLITE_OK ||
+			sqlite3_blob_write(Dest, Buffer.data(), Chunk, Offset) != SQLITE_OK)
+		{
+			sqlite3_blob_close(Source);
+			sqlite3_blob_close(Dest);
+			goto EasyFail;
+		}
+	}
+	
+	sqlite3_blob_close(Source);
+	sqlite3_blob_close(Dest);
+	
+	if (sqlite3_prepare(Handle, DropSQL, sizeof DropSQL - 1, &Statement, &Tail) != SQLITE_OK) goto EasyFail;
+	
+	sqlite3_bind_text(Statement, 1, Key, strlen(Key), SQLITE_STATIC);
+	
+	if (sqlite3_step(Statement) != SQLITE_DONE)
+	{
+		sqlite3_finalize(Statement);
+		goto EasyFail;
+	}
+	
+	sqlite3_finalize(Statement);
+	
+	if (!ExecSimpleSQL(Handle, "commit;")) goto EasyFail;
+	
+	sqlite3_close(Handle);
+	return true;
+	
+EasyFail:
+	ExecSimpleSQL(Handle, "rollback;");
+	sqlite3_close(Handle);
+	return false;
+}
+
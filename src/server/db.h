@@ -72,6 +72,21 @@ namespace DB
 		time_t StoredTime;
 	};
 	
+	struct VaultItemMeta
+	{ //What we need to know about a vault item without loading the whole thing.
+		int64_t RowID;
+		VLString OriginNode;
+		uint64_t Size;
+	};
+	
+	struct VaultUploadState
+	{
+		int64_t RowID;
+		VLString OriginNode;
+		uint64_t TotalSize;
+		uint64_t Received;
+	};
+	
 	struct GlobalConfigDBEntry
 	{
 		VLString Key;
@@ -92,6 +107,7 @@ namespace DB
 	
 	//Stuff for all DBs
 	bool InitializeEmptyDB(void);
+	bool UpgradeDB(void);
 	
 	//Node DB
 	bool UpdateNodeDB(const char *ID, const char *PlatformString, const char *NodeRevision, const char *Group, const time_t ConnectedTime = 0);
@@ -103,6 +119,7 @@ namespace DB
 	PlatformBinaryEntry *LookupPlatformBinaryEntry(const char *PlatformString, const char *SQLFields = "*");
 	bool UpdatePlatformBinaryDB(const char *PlatformString, const char *Revision, const void *BinaryData, const size_t BinarySize);
 	bool DeletePlatformBinaryEntry(const char *PlatformString);
+	bool LookupPastPlatformBinary(const char *PlatformString, const char *Revision, std::vector<uint8_t> &BinaryOut);
 	bool NodeBinaryNeedsUpdate(Clients::ClientObj *Client, std::vector<uint8_t> *NewBinaryOut = nullptr, VLString *NewRevisionOut = nullptr);
 	
 	//Vault database
@@ -110,6 +127,14 @@ namespace DB
 	bool UpdateVaultDB(const VaultDBEntry *Entry);
 	bool DeleteVaultDBEntry(const char *Key);
 	std::vector<VaultDBEntry> *GetVaultItemsInfo(void);
+	bool LookupVaultItemMeta(const char *Key, VaultItemMeta *Out);
+	bool ReadVaultBlob(const int64_t RowID, const uint64_t Offset, void *Out, const size_t Length);
+	
+	//Chunked vault uploads, staged in their own table until the last chunk arrives.
+	bool BeginVaultUpload(const char *Key, const char *OriginNode, const uint64_t TotalSize);
+	bool LookupVaultUpload(const char *Key, VaultUploadState *Out);
+	bool WriteVaultUploadChunk(const char *Key, VaultUploadState *State, const void *Data, const size_t Length);
+	bool FinishVaultUpload(const char *Key);
 
 	//Global config table
 	GlobalConfigDBEntry *LookupGlobalConfigDBEntry(const char *Key);
@@ -0,0 +1,171 @@
+/**
+* This file is part of Volition.
+
+* Volition is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+
+* Volition is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+
+* You should have received a copy of the GNU General Public License
+* along with Volition.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+
+#include "../libvolition/include/common.h"
+#include "../libvolition/include/utils.h"
+#include "../libvolition/include/telemetry.h"
+
+#include "fleethealth.h"
+
+#include <time.h>
+#include <stdio.h>
+#include <map>
+#include <deque>
+
+#define FLEETHEALTH_HISTORY_MAX 720 //Two hours at the default ten second interval.
+
+typedef std::deque<Telemetry::Sample> NodeHistory;
+
+static std::map<VLString, NodeHistory> History;
+static bool HaveInterval;
+static uint32_t IntervalSecs;
+
+static VLString SummarizeNode(const VLString &NodeID, const NodeHistory &Samples, const time_t Since);
+static VLString FormatRate(const int64_t Bytes, const int64_t Secs);
+
+//Function definitions
+void FleetHealth::SetInterval(const uint32_t Secs)
+{
+	IntervalSecs = Secs;
+	HaveInterval = true;
+}
+
+bool FleetHealth::GetInterval(uint32_t &SecsOut)
+{
+	SecsOut = IntervalSecs;
+	return HaveInterval;
+}
+
+bool FleetHealth::AddBatch(const char *NodeID, const uint8_t *Data, const size_t Length)
+{
+	std::vector<Telemetry::Sample> Samples;
+	
+	if (!Telemetry::DecodeBatch(Data, Length, Samples)) return false;
+	
+	if (Samples.empty()) return true;
+	
+	NodeHistory &Node = History[NodeID];
+	
+	for (const Telemetry::Sample &Item : Samples)
+	{ //Nodes only send what they haven't sent before, but a clock that jumps back would wreck our rates, so drop anything out of order.
+		if (!Node.empty() && Item.Values[Telemetry::FIELD_TIME] <= Node.back().Values[Telemetry::FIELD_TIME]) continue;
+		
+		Node.push_back(Item);
+	}
+	
+	while (Node.size() > FLEETHEALTH_HISTORY_MAX) Node.pop_front();
+	
+	return true;
+}
+
+void FleetHealth::ForgetNode(const char *NodeID)
+{
+	History.erase(NodeID);
+}
+
+VLString FleetHealth::Summarize(const char *NodeID, const time_t Since)
+{
+	VLString RetVal(4096);
+	
+	if (NodeID && *NodeID)
+	{
+		auto Iter = History.find(NodeID);
+		
+		if (Iter == History.end()) return VLString("No telemetry for node ") + NodeID + ".\n";
+		
+		return SummarizeNode(Iter->first, Iter->second, Since);
+	}
+	
+	RetVal = VLString::UintToString(History.size()) + " nodes with telemetry.\n----\n";
+	
+	for (auto Iter = History.begin(); Iter != History.end(); ++Iter)
+	{
+		RetVal += SummarizeNode(Iter->first, Iter->second, Since);
+	}
+	
+	return RetVal;
+}
+
+static VLString FormatRate(const int64_t Bytes, const int64_t Secs)
+{
+	if (Secs <= 0 || Bytes < 0) return "n/a"; //Counters go backwards when the host reboots.
+	
+	char Buf[64];
+	
+	snprintf(Buf, sizeof Buf, "%.1f KiB/s", (double)Bytes / 1024.0 / (double)Secs);
+	
+	return Buf;
+}
+
+static VLString SummarizeNode(const VLString &NodeID, const NodeHistory &Samples, const time_t Since)
+{
+	using namespace Telemetry;
+	
+	const Sample *First = nullptr;
+	const Sample *Last = nullptr;
+	int64_t CPUTotal = 0;
+	int64_t CPUPeak = 0;
+	size_t Count = 0;
+	
+	for (const Sample &Item : Samples)
+	{
+		if (Item.Values[FIELD_TIME] < Since) continue;
+		
+		if (!First) First = &Item;
+		Last = &Item;
+		
+		CPUTotal += Item.Values[FIELD_CPU_BUSY];
+		if (Item.Values[FIELD_CPU_BUSY] > CPUPeak) CPUPeak = Item.Values[FIELD_CPU_BUSY];
+		++Count;
+	}
+	
+	if (!Count) return NodeID + ": no samples in range.\n";
+	
+	const int64_t Span = Last->Values[FIELD_TIME] - First->Values[FIELD_TIME];
+	const int64_t MemTotal = Last->Values[FIELD_MEM_TOTAL];
+	const int64_t MemUsed = MemTotal - Last->Values[FIELD_MEM_AVAILABLE];
+	const int64_t SwapUsed = Last->Values[FIELD_SWAP_TOTAL] - Last->Values[FIELD_SWAP_FREE];
+	
+	const time_t LastTime = Last->Values[FIELD_TIME];
+	char TimeBuf[64];
+	struct tm TimeStruct = *localtime(&LastTime);
+	
+	strftime(TimeBuf, sizeof TimeBuf, "%Y-%m-%d %I:%M:%S %p", &TimeStruct);
+	
+	char Buf[1024];
+	
+	snprintf(Buf, sizeof Buf,
+			"%s: %zu samples over %llds, latest %s\n"
+			"\tCPU %.1f%% (avg %.1f%%, peak %.1f%%), load %.2f %.2f %.2f, %lld running\n"
+			"\tMemory %lld/%lld MiB (%.1f%%), swap %lld/%lld MiB\n",
+			+NodeID, Count, (long long)Span, TimeBuf,
+			Last->Values[FIELD_CPU_BUSY] / 10.0, CPUTotal / 10.0 / Count, CPUPeak / 10.0,
+			Last->Values[FIELD_LOAD1] / 100.0, Last->Values[FIELD_LOAD5] / 100.0, Last->Values[FIELD_LOAD15] / 100.0,
+			(long long)Last->Values[FIELD_PROCS_RUNNING],
+			(long long)(MemUsed / 1024), (long long)(MemTotal / 1024), MemTotal ? MemUsed * 100.0 / MemTotal : 0.0,
+			(long long)(SwapUsed / 1024), (long long)(Last->Values[FIELD_SWAP_TOTAL] / 1024));
+	
+	VLString RetVal = Buf;
+	
+	RetVal += VLString("\tDisk read ") + FormatRate(Last->Values[FIELD_DISK_READ] - First->Values[FIELD_DISK_READ], Span) +
+			", written " + FormatRate(Last->Values[FIELD_DISK_WRITTEN] - First->Values[FIELD_DISK_WRITTEN], Span) +
+			"; net in " + FormatRate(Last->Values[FIELD_NET_RX] - First->Values[FIELD_NET_RX], Span) +
+			", out " + FormatRate(Last->Values[FIELD_NET_TX] - First->Values[FIELD_NET_TX], Span) + '\n';
+	
+	return RetVal;
+}
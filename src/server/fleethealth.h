@@ -0,0 +1,35 @@
+/**
+* This file is part of Volition.
+
+* Volition is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+
+* Volition is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+
+* You should have received a copy of the GNU General Public License
+* along with Volition.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+
+#ifndef _VL_SERVER_FLEETHEALTH_H_
+#define _VL_SERVER_FLEETHEALTH_H_
+
+#include <time.h>
+
+#include "../libvolition/include/common.h"
+
+namespace FleetHealth
+{ //Recent telemetry for every node, fed by the batches they tack onto their ping replies.
+	void SetInterval(const uint32_t Secs);
+	bool GetInterval(uint32_t &SecsOut); //False if we don't have one configured, so nodes keep their own.
+	bool AddBatch(const char *NodeID, const uint8_t *Data, const size_t Length);
+	void ForgetNode(const char *NodeID);
+	VLString Summarize(const char *NodeID, const time_t Since); //Empty or null NodeID means all of them.
+}
+
+#endif //_VL_SERVER_FLEETHEALTH_H_
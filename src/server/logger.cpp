@@ -17,6 +17,7 @@
 
 #include "../libvolition/include/common.h"
 #include "../libvolition/include/utils.h"
+#include "../libvolition/include/vlthreads.h"
 
 #include "logger.h"
 
@@ -24,7 +25,72 @@
 #include <string.h>
 #include <time.h>
 #include <map>
+#include <list>
+#include <vector>
 
+#ifndef WIN32
+#include <unistd.h>
+#endif //WIN32
+
+/*
+ * Lines get formatted on whatever thread logs them and dropped into a fixed ring of slots.
+ * The writer thread wakes up, waits a moment for stragglers, then drains the ring into one big
+ * write on a descriptor that stays open. If the ring is full we drop the line and count it
+ * instead of blocking, because nothing is worth stalling the master loop over a log line.
+ *
+ * Every line written also gets a fixed size record in server.log.idx, so queries can binary search
+ * by time and only ever read the bytes of the lines they actually want.
+ *
+ * Readers never flush. They see what the writer has already put out, which is at most LOG_COALESCE_MS
+ * behind, and that's a lot better than making the dispatch thread wait on disk I/O.
+ */
+
+#define LOG_RING_SLOTS 8192 //Must be a power of two.
+#define LOG_BATCH_SIZE (1024 * 256)
+#define LOG_COALESCE_MS 50
+#define LOG_READ_BLOCK_SIZE (1024 * 64)
+#define LOG_QUERY_MAX_LINES 10000
+
+struct LogEntry
+{
+	VLString Line;
+	time_t Time;
+	Logger::ItemType Type;
+	uint64_t NodeHash;
+};
+
+struct LogSlot
+{
+	std::atomic<size_t> Sequence;
+	LogEntry *Entry;
+};
+
+struct LogIndexRecord
+{ //Native endian, it never leaves this machine.
+	uint64_t Offset;
+	int64_t Time;
+	uint64_t NodeHash; //Zero if no node was involved.
+	uint32_t Length;
+	uint32_t Type;
+};
+
+static struct LogRingObj
+{
+	LogSlot Slots[LOG_RING_SLOTS];
+	std::atomic<size_t> Head; //Next slot to be filled.
+	std::atomic<size_t> Tail; //Next slot to be drained.
+
+	LogRingObj(void) : Slots(), Head(), Tail()
+	{
+		for (size_t Inc = 0; Inc < LOG_RING_SLOTS; ++Inc)
+		{
+			Slots[Inc].Sequence = Inc;
+			Slots[Inc].Entry = nullptr;
+		}
+	}
+} LogRing;
+
+//Static globals
 static const std::map<Logger::ItemType, VLString> ItemTypeNames
 {
 	{ Logger::LOGITEM_INVALID, "(undefined event type)" },
@@ -40,54 +106,831 @@ static const std::map<Logger::ItemType, VLString> ItemTypeNames
 };
 
 const char LOG_FILENAME[] = "server.log";
+const char LOG_INDEX_SUFFIX[] = ".idx";
 
-bool Logger::WriteLogLine(const Logger::ItemType Type, const char *Text)
+static VLThreads::Mutex DescriptorLock; //Guards everything below that isn't atomic.
+static FILE *LogDescriptor;
+static FILE *IndexDescriptor;
+static uint64_t LogFileSize;
+static time_t LogOpenedTime;
+static uint64_t RotateMaxBytes;
+static uint64_t RotateMaxAgeSecs;
+static size_t RotateKeepCount = 5;
+static char BatchBuffer[LOG_BATCH_SIZE];
+static size_t BatchLength;
+static std::vector<LogIndexRecord> IndexBatch;
+
+static VLThreads::Thread *WriterThread;
+static VLThreads::Semaphore WriterWake;
+static std::atomic_bool WriterIdle;
+static std::atomic_bool WriterShouldDie;
+
+static std::atomic<uint64_t> StatLinesQueued;
+static std::atomic<uint64_t> StatLinesWritten;
+static std::atomic<uint64_t> StatLinesDropped;
+static std::atomic<uint64_t> StatBytesWritten;
+static std::atomic<uint64_t> StatFlushes;
+static std::atomic<uint64_t> StatRotations;
+static std::atomic<uint64_t> StatWriteErrors;
+static std::atomic<uint64_t> StatRingHighWater;
+static std::atomic<uint64_t> DroppedSinceLastFlush;
+static std::atomic<uint64_t> FlushedLogSize; //How much of the live log is whole lines on disk. Readers stop here.
+
+//Prototypes
+static VLString BuildLogLine(const Logger::ItemType Type, const char *Text, const time_t CurrentTime, const char *NodeID);
+static uint64_t HashNodeID(const char *NodeID);
+static bool SeekTo(FILE *Desc, const uint64_t Offset);
+static VLString RotatedName(const size_t Num);
+static bool RingPush(LogEntry *Entry);
+static LogEntry *RingPop(void);
+static bool RingHasData(void);
+static void *WriterThreadFunc(void*);
+static bool OpenLogDescriptor(void);
+static void CloseLogDescriptor(void);
+static bool ParseLogLine(const char *Line, const size_t Length, time_t *TimeOut, Logger::ItemType *TypeOut, uint64_t *NodeHashOut);
+static void CatchUpIndex(void);
+static bool RotationDue(const size_t IncomingBytes);
+static void Rotate(void);
+static void WriteIndexBatch(void);
+static void WriteBatch(void);
+static void AppendToBatch(const char *Data, const size_t Length, const time_t Time, const Logger::ItemType Type, const uint64_t NodeHash);
+static void DrainRing(void);
+static void QueryLogFile(const VLString &LogPath, const Logger::ItemType Type, const uint64_t NodeHash, const time_t Since, const size_t MaxLines, std::list<VLString> &Results);
+
+//Function definitions
+static VLString BuildLogLine(const Logger::ItemType Type, const char *Text, const time_t CurrentTime, const char *NodeID)
 {
-	FILE *Descriptor = fopen(LOG_FILENAME, "ab");
-	
-	if (!Descriptor) return false;
-	
 	VLString String(128);
 	
-	const time_t CurrentTime = time(nullptr);
+	struct tm TimeStruct{};
 	
-	struct tm TimeStruct = *localtime(&CurrentTime);
+	//We can get called from the writer thread too, so no plain localtime().
+#ifdef WIN32
+	localtime_s(&TimeStruct, &CurrentTime);
+#else
+	localtime_r(&CurrentTime, &TimeStruct);
+#endif //WIN32
 	
 	strftime(String.GetBuffer(), String.GetCapacity(), "[%a %Y-%m-%d | %I:%M:%S %p] ", &TimeStruct);
 
-	String += ItemTypeNames.at(ItemTypeNames.count(Type) ? Type : LOGITEM_INVALID) + ": ";
+	String += ItemTypeNames.at(ItemTypeNames.count(Type) ? Type : Logger::LOGITEM_INVALID);
+	
+	//So the index can get the node back out of the text if it ever has to be rebuilt.
+	if (NodeID && *NodeID) String += VLString(" <") + NodeID + ">";
+	
+	String += ": ";
 	String += Text;
 	String += '\n';
 
+	return String;
+}
+
+static uint64_t HashNodeID(const char *NodeID)
+{ //FNV-1a. Plenty for telling node IDs apart in the index.
+	if (!NodeID || !*NodeID) return 0;
+
+	uint64_t Hash = 0xcbf29ce484222325ull;
+
+	for (; *NodeID; ++NodeID)
+	{
+		Hash ^= (uint8_t)*NodeID;
+		Hash *= 0x100000001b3ull;
+	}
+
+	return Hash;
+}
+
+static bool SeekTo(FILE *Desc, const uint64_t Offset)
+{
+#ifdef WIN32
+	return !_fseeki64(Desc, Offset, SEEK_SET);
+#else
+	return !fseeko(Desc, Offset, SEEK_SET);
+#endif //WIN32
+}
+
+static VLString RotatedName(const size_t Num)
+{ //Zero is the live log.
+	if (!Num) return LOG_FILENAME;
+
+	return VLString(LOG_FILENAME) + "." + VLString::UintToString(Num);
+}
+
+static bool RingPush(LogEntry *Entry)
+{ //Bounded multi-producer ring. Never blocks, just tells you no when it's full.
+	size_t Pos = LogRing.Head.load(std::memory_order_relaxed);
+	LogSlot *Slot = nullptr;
+
+	while (true)
+	{
+		Slot = &LogRing.Slots[Pos & (LOG_RING_SLOTS - 1)];
+
+		const size_t Seq = Slot->Sequence.load(std::memory_order_acquire);
+		const intptr_t Diff = (intptr_t)Seq - (intptr_t)Pos;
+
+		if (Diff == 0)
+		{
+			if (LogRing.Head.compare_exchange_weak(Pos, Pos + 1, std::memory_order_relaxed)) break;
+		}
+		else if (Diff < 0)
+		{ //Full.
+			return false;
+		}
+		else
+		{
+			Pos = LogRing.Head.load(std::memory_order_relaxed);
+		}
+	}
+
+	Slot->Entry = Entry;
+	Slot->Sequence.store(Pos + 1, std::memory_order_release);
+
+	//Track how deep the ring has gotten, it tells you whether LOG_RING_SLOTS is sane.
+	const uint64_t Depth = Pos + 1 - LogRing.Tail.load(std::memory_order_relaxed);
+	uint64_t HighWater = StatRingHighWater.load(std::memory_order_relaxed);
+
+	while (Depth > HighWater && !StatRingHighWater.compare_exchange_weak(HighWater, Depth, std::memory_order_relaxed));
+
+	return true;
+}
+
+static LogEntry *RingPop(void)
+{ //Lock-free too, which matters for EmergencyFlush(). Everybody else only calls this with DescriptorLock held.
+	size_t Pos = LogRing.Tail.load(std::memory_order_relaxed);
+	LogSlot *Slot = nullptr;
+
+	while (true)
+	{
+		Slot = &LogRing.Slots[Pos & (LOG_RING_SLOTS - 1)];
+
+		const size_t Seq = Slot->Sequence.load(std::memory_order_acquire);
+		const intptr_t Diff = (intptr_t)Seq - (intptr_t)(Pos + 1);
+
+		if (Diff == 0)
+		{
+			if (LogRing.Tail.compare_exchange_weak(Pos, Pos + 1, std::memory_order_relaxed)) break;
+		}
+		else if (Diff < 0)
+		{ //Empty.
+			return nullptr;
+		}
+		else
+		{
+			Pos = LogRing.Tail.load(std::memory_order_relaxed);
+		}
+	}
+
+	LogEntry *const RetVal = Slot->Entry;
+
+	Slot->Entry = nullptr;
+	Slot->Sequence.store(Pos + LOG_RING_SLOTS, std::memory_order_release);
+
+	return RetVal;
+}
+
+static bool RingHasData(void)
+{
+	const size_t Pos = LogRing.Tail.load(std::memory_order_relaxed);
+
+	return LogRing.Slots[Pos & (LOG_RING_SLOTS - 1)].Sequence.load(std::memory_order_acquire) == Pos + 1;
+}
+
+static bool OpenLogDescriptor(void)
+{
+	if (LogDescriptor) return true;
+
+	LogDescriptor = fopen(LOG_FILENAME, "ab");
+
+	if (!LogDescriptor) return false;
+
+	//We do our own batching, and unbuffered means EmergencyFlush() never has to care about stdio's buffer.
+	setvbuf(LogDescriptor, nullptr, _IONBF, 0);
+
+	uint64_t Size = 0;
+	Utils::GetFileSize(LOG_FILENAME, &Size);
+
+	LogFileSize = Size;
+	FlushedLogSize = Size;
+	LogOpenedTime = time(nullptr);
+
+	CatchUpIndex();
+
+	return true;
+}
+
+static void CloseLogDescriptor(void)
+{
+	if (IndexDescriptor)
+	{
+		fclose(IndexDescriptor);
+		IndexDescriptor = nullptr;
+	}
+
+	if (!LogDescriptor) return;
+
+	fclose(LogDescriptor);
+	LogDescriptor = nullptr;
+}
+
+static bool ParseLogLine(const char *Line, const size_t Length, time_t *TimeOut, Logger::ItemType *TypeOut, uint64_t *NodeHashOut)
+{ //Recovers what we can from a line's text, for when the index is missing or got cut short by a crash.
+	char Prefix[128]{};
+
+	memcpy(Prefix, Line, Length < sizeof Prefix - 1 ? Length : sizeof Prefix - 1);
+
+	struct tm TimeStruct{};
+	char AMPM[3]{};
+
+	if (sscanf(Prefix, "[%*s %d-%d-%d | %d:%d:%d %2s]", &TimeStruct.tm_year, &TimeStruct.tm_mon, &TimeStruct.tm_mday,
+				&TimeStruct.tm_hour, &TimeStruct.tm_min, &TimeStruct.tm_sec, AMPM) != 7)
+	{
+		return false;
+	}
+
+	TimeStruct.tm_year -= 1900;
+	TimeStruct.tm_mon -= 1;
+	TimeStruct.tm_isdst = -1;
+
+	if (TimeStruct.tm_hour == 12) TimeStruct.tm_hour = 0;
+	if (AMPM[0] == 'P') TimeStruct.tm_hour += 12;
+
+	*TimeOut = mktime(&TimeStruct);
+	*TypeOut = Logger::LOGITEM_INVALID;
+	*NodeHashOut = 0;
+
+	const char *TypeBegin = strstr(Prefix, "] ");
+
+	if (!TypeBegin) return true;
+
+	TypeBegin += sizeof "] " - 1;
+
+	for (auto Iter = ItemTypeNames.begin(); Iter != ItemTypeNames.end(); ++Iter)
+	{
+		const size_t NameLen = Iter->second.Length();
+
+		if (strncmp(TypeBegin, Iter->second, NameLen) != 0) continue;
+		
+		if (TypeBegin[NameLen] == ':')
+		{
+			*TypeOut = Iter->first;
+			break;
+		}
+		
+		if (TypeBegin[NameLen] != ' ' || TypeBegin[NameLen + 1] != '<') continue;
+		
+		*TypeOut = Iter->first;
+		
+		//The node ID can run past Prefix, so go back to the whole line for it.
+		const char *const IDBegin = Line + (TypeBegin - Prefix) + NameLen + sizeof " <" - 1;
+		const char *const LineEnd = Line + Length;
+		
+		for (const char *IDEnd = IDBegin; IDEnd + 1 < LineEnd; ++IDEnd)
+		{
+			if (IDEnd[0] != '>' || IDEnd[1] != ':') continue;
+			
+			*NodeHashOut = HashNodeID(std::string(IDBegin, IDEnd - IDBegin).c_str());
+			break;
+		}
+		
+		break;
+	}
+
+	return true;
+}
+
+static void CatchUpIndex(void)
+{ //Make sure every complete line in the live log has an index record, then open the index for appending.
+	const VLString IndexPath = VLString(LOG_FILENAME) + LOG_INDEX_SUFFIX;
+
+	uint64_t IndexSize = 0;
+	uint64_t IndexedEnd = 0;
+
+	if (Utils::GetFileSize(IndexPath, &IndexSize) && IndexSize)
+	{
+		LogIndexRecord Last{};
+
+		VLScopedPtr<FILE*, int(*)(FILE*)> Desc { fopen(IndexPath, "rb"), fclose };
+
+		if (IndexSize % sizeof(LogIndexRecord) || !Desc ||
+			!SeekTo(Desc, IndexSize - sizeof Last) || fread(&Last, sizeof Last, 1, Desc) != 1 ||
+			Last.Offset + Last.Length > LogFileSize)
+		{ //Doesn't belong to this log anymore. Start over.
+			Desc.Release();
+			remove(IndexPath);
+		}
+		else
+		{
+			IndexedEnd = Last.Offset + Last.Length;
+		}
+	}
+
+	IndexDescriptor = fopen(IndexPath, "ab");
+
+	if (!IndexDescriptor) return;
+
+	setvbuf(IndexDescriptor, nullptr, _IONBF, 0);
+
+	if (IndexedEnd >= LogFileSize) return;
+
+	VLScopedPtr<FILE*, int(*)(FILE*)> LogDesc { fopen(LOG_FILENAME, "rb"), fclose };
+
+	if (!LogDesc || !SeekTo(LogDesc, IndexedEnd)) return;
+
+	std::vector<char> Block(LOG_READ_BLOCK_SIZE);
+	std::vector<char> Partial;
+	std::vector<LogIndexRecord> Records;
+	uint64_t LineStart = IndexedEnd;
+	size_t Read = 0;
+
+	while ((Read = fread(Block.data(), 1, Block.size(), LogDesc)) > 0)
+	{
+		for (size_t Inc = 0; Inc < Read; ++Inc)
+		{
+			Partial.push_back(Block[Inc]);
+
+			if (Block[Inc] != '\n') continue;
+
+			LogIndexRecord Record{};
+			time_t Time = 0;
+			Logger::ItemType Type = Logger::LOGITEM_INVALID;
+			uint64_t NodeHash = 0;
+
+			ParseLogLine(Partial.data(), Partial.size(), &Time, &Type, &NodeHash);
+
+			Record.Offset = LineStart;
+			Record.Length = Partial.size();
+			Record.Time = Time;
+			Record.Type = Type;
+			Record.NodeHash = NodeHash;
+
+			Records.push_back(Record);
+
+			LineStart += Partial.size();
+			Partial.clear();
+		}
+
+		if (Records.size() >= 4096)
+		{
+			fwrite(Records.data(), sizeof(LogIndexRecord), Records.size(), IndexDescriptor);
+			Records.clear();
+		}
+	}
+
+	//A half-written line at the end from a crash just doesn't get a record. It's unreachable by query but still there for tail.
+	if (!Records.empty()) fwrite(Records.data(), sizeof(LogIndexRecord), Records.size(), IndexDescriptor);
+}
+
+static bool RotationDue(const size_t IncomingBytes)
+{
+	if (!LogFileSize && !BatchLength) return false;
+
+	const bool TooBig = RotateMaxBytes && LogFileSize + BatchLength + IncomingBytes > RotateMaxBytes;
+	const bool TooOld = RotateMaxAgeSecs && (uint64_t)(time(nullptr) - LogOpenedTime) >= RotateMaxAgeSecs;
+
+	return TooBig || TooOld;
+}
+
+static void Rotate(void)
+{
+	CloseLogDescriptor();
+
+	if (RotateKeepCount)
+	{ //Shuffle server.log.1 -> server.log.2 and so on, oldest falls off the end. Indexes go along for the ride.
+		for (size_t Inc = RotateKeepCount; Inc > 0; --Inc)
+		{
+			const VLString &Older = RotatedName(Inc);
+			const VLString &Newer = RotatedName(Inc - 1);
+
+			remove(Older);
+			remove(Older + LOG_INDEX_SUFFIX);
+
+			rename(Newer, Older);
+			rename(Newer + LOG_INDEX_SUFFIX, Older + LOG_INDEX_SUFFIX);
+		}
+	}
+	else
+	{
+		remove(LOG_FILENAME);
+		remove(VLString(LOG_FILENAME) + LOG_INDEX_SUFFIX);
+	}
+
+	++StatRotations;
+
+	OpenLogDescriptor();
+}
+
+static void WriteIndexBatch(void)
+{
+	if (IndexBatch.empty()) return;
+
+	if (IndexDescriptor) fwrite(IndexBatch.data(), sizeof(LogIndexRecord), IndexBatch.size(), IndexDescriptor);
+
+	IndexBatch.clear();
+}
+
+static void WriteBatch(void)
+{
+	if (!BatchLength) return;
+
+	if (!LogDescriptor && !OpenLogDescriptor())
+	{
+		++StatWriteErrors;
+		BatchLength = 0;
+		IndexBatch.clear();
+		return;
+	}
+
+	const size_t Written = fwrite(BatchBuffer, 1, BatchLength, LogDescriptor);
+
+	if (Written != BatchLength)
+	{ //Offsets in the pending records are wrong now, so they're no good to anyone.
+		++StatWriteErrors;
+		IndexBatch.clear();
+	}
+
+	WriteIndexBatch();
+
+	LogFileSize += Written;
+	FlushedLogSize = LogFileSize;
+	StatBytesWritten += Written;
+	++StatFlushes;
+
+	BatchLength = 0;
+}
+
+static void AppendToBatch(const char *Data, const size_t Length, const time_t Time, const Logger::ItemType Type, const uint64_t NodeHash)
+{
+	if (BatchLength + Length > sizeof BatchBuffer) WriteBatch();
+
+	if (RotationDue(Length))
+	{
+		WriteBatch();
+		Rotate();
+	}
+
+	if (!LogDescriptor && !OpenLogDescriptor())
+	{
+		++StatWriteErrors;
+		return;
+	}
+
+	const LogIndexRecord Record { LogFileSize + BatchLength, (int64_t)Time, NodeHash, (uint32_t)Length, (uint32_t)Type };
+
+	if (Length > sizeof BatchBuffer)
+	{ //Some enormous line. Just send it straight out.
+		const size_t Written = fwrite(Data, 1, Length, LogDescriptor);
+
+		if (Written == Length) IndexBatch.push_back(Record);
+		else ++StatWriteErrors;
+
+		WriteIndexBatch();
+
+		LogFileSize += Written;
+		FlushedLogSize = LogFileSize;
+		StatBytesWritten += Written;
+		++StatFlushes;
+		return;
+	}
+
+	IndexBatch.push_back(Record);
+
+	memcpy(BatchBuffer + BatchLength, Data, Length);
+	BatchLength += Length;
+}
+
+static void DrainRing(void)
+{ //Call with DescriptorLock held.
+	LogEntry *Entry = nullptr;
+
+	while ((Entry = RingPop()))
+	{
+		AppendToBatch(Entry->Line, Entry->Line.Length(), Entry->Time, Entry->Type, Entry->NodeHash);
+		delete Entry;
+
+		++StatLinesWritten;
+	}
+
+	const uint64_t Dropped = DroppedSinceLastFlush.exchange(0);
+
+	if (Dropped)
+	{
+		const time_t CurrentTime = time(nullptr);
+		const VLString &Warning = BuildLogLine(Logger::LOGITEM_SYSWARN, VLString("Log ring buffer overflowed, dropped ") + VLString::UintToString(Dropped) + " lines.", CurrentTime, nullptr);
+
+		AppendToBatch(Warning, Warning.Length(), CurrentTime, Logger::LOGITEM_SYSWARN, 0);
+	}
+
+	WriteBatch();
+}
+
+static void *WriterThreadFunc(void*)
+{
+	while (!WriterShouldDie)
+	{
+		WriterIdle = true;
+
+		if (!RingHasData() || !WriterIdle.exchange(false))
+		{ //Either nothing to do, or somebody already posted for us and we need to eat that post.
+			WriterWake.Wait();
+		}
+
+		if (WriterShouldDie) break;
+
+		//Give the master loop a moment to pile up more lines so we write them all at once.
+		Utils::vl_sleep(LOG_COALESCE_MS);
+
+		Logger::Flush();
+	}
+
+	return nullptr;
+}
+
+void Logger::Init(void)
+{
+	if (WriterThread) return;
+
+	{
+		VLThreads::MutexKeeper Keeper { &DescriptorLock };
+		OpenLogDescriptor();
+	}
+
+	WriterShouldDie = false;
+	WriterThread = new VLThreads::Thread(WriterThreadFunc, nullptr);
+	WriterThread->Start();
+}
+
+void Logger::Shutdown(void)
+{
+	if (WriterThread)
+	{
+		WriterShouldDie = true;
+		WriterIdle = false;
+		WriterWake.Post();
+
+		WriterThread->Join();
+
+		delete WriterThread;
+		WriterThread = nullptr;
+	}
+
+	VLThreads::MutexKeeper Keeper { &DescriptorLock };
+
+	DrainRing();
+	CloseLogDescriptor();
+}
+
+void Logger::Flush(void)
+{
+	VLThreads::MutexKeeper Keeper { &DescriptorLock };
+
+	DrainRing();
+}
+
+void Logger::EmergencyFlush(void)
+{ //For fatal signal handlers. No locks, no allocations, just raw write() of whatever's left, and we leak the entries.
+	//The index catches up on these from the text next time we start.
+#ifndef WIN32
+	FILE *const Desc = LogDescriptor;
+
+	if (!Desc) return;
+
+	const int FD = fileno(Desc);
+
+	LogEntry *Entry = nullptr;
+
+	while ((Entry = RingPop()))
+	{
+		if (write(FD, Entry->Line.GetBuffer(), Entry->Line.Length()) < 0) break;
+	}
+#endif //WIN32
+}
+
+void Logger::SetRotation(const uint64_t MaxBytes, const uint64_t MaxAgeSecs, const size_t KeepCount)
+{
+	VLThreads::MutexKeeper Keeper { &DescriptorLock };
+
+	RotateMaxBytes = MaxBytes;
+	RotateMaxAgeSecs = MaxAgeSecs;
+	RotateKeepCount = KeepCount;
+}
+
+Logger::LogStats Logger::GetStats(void)
+{
+	LogStats RetVal{};
+
+	RetVal.LinesQueued = StatLinesQueued;
+	RetVal.LinesWritten = StatLinesWritten;
+	RetVal.LinesDropped = StatLinesDropped;
+	RetVal.BytesWritten = StatBytesWritten;
+	RetVal.Flushes = StatFlushes;
+	RetVal.Rotations = StatRotations;
+	RetVal.WriteErrors = StatWriteErrors;
+	RetVal.RingHighWater = StatRingHighWater;
+
+	return RetVal;
+}
+
+VLString Logger::StatsToText(void)
+{
+	const LogStats &Stats = GetStats();
+
+	return VLString("Lines queued: ") + VLString::UintToString(Stats.LinesQueued)
+		+ ", written: " + VLString::UintToString(Stats.LinesWritten)
+		+ ", dropped: " + VLString::UintToString(Stats.LinesDropped)
+		+ ". Bytes written: " + VLString::UintToString(Stats.BytesWritten)
+		+ ", flushes: " + VLString::UintToString(Stats.Flushes)
+		+ ", rotations: " + VLString::UintToString(Stats.Rotations)
+		+ ", write errors: " + VLString::UintToString(Stats.WriteErrors)
+		+ ". Ring high water: " + VLString::UintToString(Stats.RingHighWater) + "/" + VLString::UintToString(LOG_RING_SLOTS);
+}
+
+Logger::ItemType Logger::StringToItemType(const char *String)
+{
+	for (auto Iter = ItemTypeNames.begin(); Iter != ItemTypeNames.end(); ++Iter)
+	{
+		if (Iter->second == String) return Iter->first;
+	}
+
+	return LOGITEM_INVALID;
+}
+
+bool Logger::WriteLogLine(const Logger::ItemType Type, const char *Text, const char *NodeID)
+{
+	const time_t CurrentTime = time(nullptr);
+
+	LogEntry *Entry = new LogEntry { BuildLogLine(Type, Text, CurrentTime, NodeID), CurrentTime, Type, HashNodeID(NodeID) };
+
 #ifdef DEBUG //Debug mode, we want all log entries printed to the screen.
-	fputs(String, stdout);
+	fputs(Entry->Line, stdout);
 #endif
 
-	fwrite(String, 1, String.Length(), Descriptor);
-	fclose(Descriptor);
+	if (!RingPush(Entry))
+	{
+		delete Entry;
+
+		++StatLinesDropped;
+		++DroppedSinceLastFlush;
+		return false;
+	}
+
+	++StatLinesQueued;
+
+	if (WriterIdle.exchange(false)) WriterWake.Post();
 	
 	return true;
 }
 
 VLString Logger::TailLog(const size_t NumLinesFromLast)
-{
+{ //Walk backwards from the end in blocks until we've seen enough newlines, so the size of the log doesn't matter.
+	if (!NumLinesFromLast) return VLString();
+
 	uint64_t FileSize = 0;
 
 	if (!Utils::GetFileSize(LOG_FILENAME, &FileSize)) return VLString();
 
-	VLString RetVal(FileSize);
+	//Don't pick up half a batch the writer is in the middle of putting out.
+	if (FileSize > FlushedLogSize) FileSize = FlushedLogSize;
+
+	if (!FileSize) return VLString();
+
+	VLScopedPtr<FILE*, int(*)(FILE*)> Desc { fopen(LOG_FILENAME, "rb"), fclose };
 	
-	if (!Utils::Slurp(LOG_FILENAME, RetVal.GetBuffer(), RetVal.GetCapacity())) return VLString();
+	if (!Desc) return VLString();
 	
-	VLScopedPtr<std::vector<VLString>*> Lines { Utils::SplitTextByCharacter(RetVal, '\n') };
+	char Block[LOG_READ_BLOCK_SIZE];
+	uint64_t Pos = FileSize;
+	uint64_t Start = 0;
+	size_t NewlinesSeen = 0;
 	
-	RetVal.Wipe(false);
+	while (Pos > 0)
+	{
+		const size_t Chunk = Pos < sizeof Block ? Pos : sizeof Block;
+
+		Pos -= Chunk;
 
-	const size_t NeededLines = Lines->size() < NumLinesFromLast ? Lines->size() - 1 : NumLinesFromLast - 1;
+		if (!SeekTo(Desc, Pos) || fread(Block, 1, Chunk, Desc) != Chunk) return VLString();
 
-	for (size_t Inc = (Lines->size() - 1) - NeededLines; Inc < Lines->size(); ++Inc)
+		size_t Inc = Chunk;
+
+		for (; Inc > 0; --Inc)
+		{
+			if (Block[Inc - 1] != '\n' || Pos + Inc == FileSize) continue; //The last line's own newline doesn't count.
+
+			if (++NewlinesSeen == NumLinesFromLast) break;
+		}
+
+		if (Inc > 0)
+		{
+			Start = Pos + Inc;
+			break;
+		}
+	}
+
+	VLString RetVal(FileSize - Start + 1);
+
+	if (!SeekTo(Desc, Start) || fread(RetVal.GetBuffer(), 1, FileSize - Start, Desc) != FileSize - Start) return VLString();
+
+	return RetVal;
+}
+
+static void QueryLogFile(const VLString &LogPath, const Logger::ItemType Type, const uint64_t NodeHash, const time_t Since, const size_t MaxLines, std::list<VLString> &Results)
+{ //Appends matches to Results, keeping only the newest MaxLines overall.
+	const VLString IndexPath = LogPath + LOG_INDEX_SUFFIX;
+
+	uint64_t IndexSize = 0;
+
+	if (!Utils::GetFileSize(IndexPath, &IndexSize) || IndexSize < sizeof(LogIndexRecord)) return;
+
+	VLScopedPtr<FILE*, int(*)(FILE*)> IndexDesc { fopen(IndexPath, "rb"), fclose };
+
+	if (!IndexDesc) return;
+
+	const uint64_t NumRecords = IndexSize / sizeof(LogIndexRecord);
+
+	//Records go in roughly in time order, so binary search for the first one that's new enough.
+	uint64_t Low = 0;
+	uint64_t High = NumRecords;
+
+	while (Since && Low < High)
 	{
-		RetVal += Lines->at(Inc) + '\n';
+		const uint64_t Mid = Low + (High - Low) / 2;
+		LogIndexRecord Record{};
+
+		if (!SeekTo(IndexDesc, Mid * sizeof Record) || fread(&Record, sizeof Record, 1, IndexDesc) != 1) return;
+
+		if (Record.Time < Since) Low = Mid + 1;
+		else High = Mid;
+	}
+
+	if (Low >= NumRecords || !SeekTo(IndexDesc, Low * sizeof(LogIndexRecord))) return;
+
+	std::list<LogIndexRecord> Matches;
+	std::vector<LogIndexRecord> Records(LOG_READ_BLOCK_SIZE / sizeof(LogIndexRecord));
+	size_t Read = 0;
+
+	while ((Read = fread(Records.data(), sizeof(LogIndexRecord), Records.size(), IndexDesc)) > 0)
+	{
+		for (size_t Inc = 0; Inc < Read; ++Inc)
+		{
+			const LogIndexRecord &Record = Records[Inc];
+
+			if ((Type != Logger::LOGITEM_INVALID && Record.Type != (uint32_t)Type) ||
+				(NodeHash && Record.NodeHash != NodeHash) ||
+				Record.Time < Since)
+			{
+				continue;
+			}
+
+			Matches.push_back(Record);
+
+			if (Matches.size() > MaxLines) Matches.pop_front();
+		}
+	}
+
+	if (Matches.empty()) return;
+
+	VLScopedPtr<FILE*, int(*)(FILE*)> LogDesc { fopen(LogPath, "rb"), fclose };
+
+	if (!LogDesc) return;
+
+	for (auto Iter = Matches.begin(); Iter != Matches.end(); ++Iter)
+	{
+		VLString Line(Iter->Length + 1);
+
+		if (!SeekTo(LogDesc, Iter->Offset) || fread(Line.GetBuffer(), 1, Iter->Length, LogDesc) != Iter->Length) continue;
+
+		Results.push_back(std::move(Line));
+
+		if (Results.size() > MaxLines) Results.pop_front();
+	}
+}
+
+VLString Logger::QueryLog(const ItemType Type, const char *NodeID, const time_t Since, size_t MaxLines)
+{ //Index records only go out after the text they point at, so whatever's indexed is safe to read.
+	if (!MaxLines || MaxLines > LOG_QUERY_MAX_LINES) MaxLines = LOG_QUERY_MAX_LINES;
+
+	const uint64_t NodeHash = HashNodeID(NodeID);
+
+	std::list<VLString> Results;
+
+	size_t KeepCount = 0;
+
+	{
+		VLThreads::MutexKeeper Keeper { &DescriptorLock };
+		KeepCount = RotateKeepCount;
+	}
+
+	//Oldest rotated log first, so the results come out in order.
+	for (size_t Inc = KeepCount + 1; Inc > 0; --Inc)
+	{
+		QueryLogFile(RotatedName(Inc - 1), Type, NodeHash, Since, MaxLines, Results);
+	}
+
+	VLString RetVal(8192);
+
+	for (auto Iter = Results.begin(); Iter != Results.end(); ++Iter)
+	{
+		RetVal += *Iter;
 	}
 	
 	return RetVal;
@@ -95,7 +938,21 @@ VLString Logger::TailLog(const size_t NumLinesFromLast)
 
 bool Logger::WipeLog(void)
 {
-	return !remove(LOG_FILENAME);
+	VLThreads::MutexKeeper Keeper { &DescriptorLock };
+
+	//Anything still queued is older than the wipe, so it goes too.
+	DrainRing();
+	CloseLogDescriptor();
+
+	const bool RetVal = !remove(LOG_FILENAME);
+
+	FlushedLogSize = 0;
+
+	remove(VLString(LOG_FILENAME) + LOG_INDEX_SUFFIX);
+
+	if (WriterThread) OpenLogDescriptor();
+
+	return RetVal;
 }
 
 size_t Logger::GetLogSize(void)
@@ -104,7 +961,7 @@ size_t Logger::GetLogSize(void)
 
 	Utils::GetFileSize(LOG_FILENAME, &RetVal);
 
-	return RetVal;
+	return RetVal < FlushedLogSize ? RetVal : (uint64_t)FlushedLogSize;
 }
 
 VLString Logger::ReportArgsToText(Conation::ConationStream *Stream)
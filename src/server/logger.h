@@ -21,6 +21,8 @@
 
 /* A noble sacrifice is foolish when a noble deed would have sufficed. */
 
+#include <time.h>
+
 #include "../libvolition/include/common.h"
 #include "../libvolition/include/conation.h"
 
@@ -41,8 +43,30 @@ namespace Logger
 		LOGITEM_MAX,
 	};
 	
-	bool WriteLogLine(const ItemType Type, const char *Text);
+	struct LogStats
+	{
+		uint64_t LinesQueued;
+		uint64_t LinesWritten;
+		uint64_t LinesDropped; //Ring buffer was full, so we threw them away rather than block.
+		uint64_t BytesWritten;
+		uint64_t Flushes;
+		uint64_t Rotations;
+		uint64_t WriteErrors;
+		uint64_t RingHighWater;
+	};
+	
+	void Init(void);
+	void Shutdown(void);
+	void Flush(void);
+	void EmergencyFlush(void);
+	void SetRotation(const uint64_t MaxBytes, const uint64_t MaxAgeSecs, const size_t KeepCount);
+	LogStats GetStats(void);
+	VLString StatsToText(void);
+	ItemType StringToItemType(const char *String);
+	
+	bool WriteLogLine(const ItemType Type, const char *Text, const char *NodeID = nullptr);
 	VLString TailLog(const size_t NumLinesFromLast);
+	VLString QueryLog(const ItemType Type, const char *NodeID, const time_t Since, size_t MaxLines);
 	bool WipeLog(void);
 	size_t GetLogSize(void);
 	VLString ReportArgsToText(Conation::ConationStream *Stream);
@@ -19,14 +19,111 @@
 #include "../libvolition/include/common.h"
 #include "../libvolition/include/brander.h"
 #include "../libvolition/include/conation.h"
+#include "../libvolition/include/utils.h"
+#include "../libvolition/include/vlthreads.h"
+#include "../libvolition/include/bindelta.h"
 #include "clients.h"
 #include "nodeupdates.h"
+#include "logger.h"
 #include "db.h"
 
 #include <vector>
 #include <map>
+#include <set>
+#include <memory>
 
-void NodeUpdates::HandleUpdatesForNode(Clients::ClientObj *Client)
+#define NODEUPDATES_PATCH_CACHE_MAX 16
+#define NODEUPDATES_PATCH_MAX_PERCENT 75 //Any bigger than this and it's not worth the node's trouble.
+
+//Types
+struct UpdatePatch
+{
+	std::vector<uint8_t> Patch; //Empty if there's no patch for this pair, so we don't keep trying.
+	VLString Sha512; //Of the new binary with the per-node branding blanked.
+};
+
+//Globals
+static VLThreads::Mutex PatchLock;
+static std::map<VLString, std::shared_ptr<const UpdatePatch> > PatchCache; //Keyed by platform, old revision and new revision.
+static std::set<VLString> PatchedNodes; //Sent a patch and haven't heard back yet.
+
+//Prototypes
+static std::shared_ptr<const UpdatePatch> GetUpdatePatch(const VLString &PlatformString, const VLString &OldRevision,
+															const VLString &NewRevision, const std::vector<uint8_t> &NewBinary);
+
+//Function definitions
+static std::shared_ptr<const UpdatePatch> GetUpdatePatch(const VLString &PlatformString, const VLString &OldRevision,
+															const VLString &NewRevision, const std::vector<uint8_t> &NewBinary)
+{ //Every node on the same revision gets the same patch, so it's only computed once per revision pair.
+	const VLString Key = PlatformString + "\n" + OldRevision + "\n" + NewRevision;
+	
+	VLThreads::MutexKeeper Keeper { &PatchLock };
+	
+	auto Iter = PatchCache.find(Key);
+	
+	if (Iter != PatchCache.end())
+	{
+		return Iter->second->Patch.empty() ? nullptr : Iter->second;
+	}
+	
+	std::shared_ptr<UpdatePatch> Result { new UpdatePatch };
+	std::vector<uint8_t> OldBinary;
+	
+	if (DB::LookupPastPlatformBinary(PlatformString, OldRevision, OldBinary))
+	{
+		std::vector<uint8_t> Target { NewBinary };
+		
+		if (Brander::UnbrandPerNodeAttributes(OldBinary.data(), OldBinary.size()) &&
+			Brander::UnbrandPerNodeAttributes(Target.data(), Target.size()) &&
+			BinDelta::Create(OldBinary.data(), OldBinary.size(), Target.data(), Target.size(), Result->Patch) &&
+			Result->Patch.size() * 100 <= Target.size() * NODEUPDATES_PATCH_MAX_PERCENT)
+		{
+			Result->Sha512 = Utils::GetSha512(Target.data(), Target.size());
+			
+			VLDEBUG("Patch for " + PlatformString + " from " + OldRevision + " to " + NewRevision + " is " + VLString::UintToString(Result->Patch.size()) + " bytes");
+		}
+		else Result->Patch.clear();
+	}
+	
+	if (PatchCache.size() >= NODEUPDATES_PATCH_CACHE_MAX)
+	{ //Rollouts only ever involve a few pairs at a time, so which one goes doesn't matter much.
+		PatchCache.erase(PatchCache.begin());
+	}
+	
+	PatchCache.emplace(Key, Result);
+	
+	return Result->Patch.empty() ? nullptr : Result;
+}
+
+void NodeUpdates::ForgetPatches(const char *PlatformString)
+{ //The binary for this platform changed, so anything we worked out for it is stale.
+	const VLString Prefix = VLString(PlatformString) + "\n";
+	
+	VLThreads::MutexKeeper Keeper { &PatchLock };
+	
+	for (auto Iter = PatchCache.begin(); Iter != PatchCache.end();)
+	{
+		if (Iter->first.StartsWith(Prefix)) Iter = PatchCache.erase(Iter);
+		else ++Iter;
+	}
+}
+
+void NodeUpdates::HandleUpdateReport(Clients::ClientObj *Client, const bool Succeeded)
+{ //If a patch didn't work out for them, send the whole thing.
+	VLThreads::MutexKeeper Keeper { &PatchLock };
+	
+	const bool WasPatched = PatchedNodes.erase(Client->GetID()) > 0;
+	
+	Keeper.Unlock();
+	
+	if (Succeeded || !WasPatched) return;
+	
+	Logger::WriteLogLine(Logger::LOGITEM_SYSWARN, "Node failed to apply update patch, sending the full binary instead.", Client->GetID());
+	
+	HandleUpdatesForNode(Client, false);
+}
+
+void NodeUpdates::HandleUpdatesForNode(Clients::ClientObj *Client, const bool AllowPatch)
 {
 	assert(Client != Clients::LookupCurAdmin());
 	
@@ -65,6 +162,28 @@ void NodeUpdates::HandleUpdatesForNode(Clients::ClientObj *Client)
 									  BinServerAddr ? BinServerAddr->Get_String() : "");
 	}
 	
+	if (AllowPatch)
+	{ //Just what changed since the revision they're running, if we still have it. They brand it themselves.
+		const std::shared_ptr<const UpdatePatch> Patch = GetUpdatePatch(Client->GetPlatformString(), Client->GetNodeRevision(), NewRevision, NewBinary);
+		
+		if (Patch)
+		{
+			Conation::ConationStream Order(CMDCODE_B2C_USEUPDATE, false, 0u);
+			
+			Order.Push_BinStream(Patch->Patch.data(), Patch->Patch.size());
+			Order.Push_String(Patch->Sha512);
+			
+			PatchLock.Lock();
+			PatchedNodes.insert(Client->GetID());
+			PatchLock.Unlock();
+			
+			VLDEBUG("Sending update patch to node " + Client->GetID());
+			
+			Client->SendStream(Order);
+			return;
+		}
+	}
+	
 	//Brand the binary.
 	std::map<Brander::AttributeTypes, Brander::AttrValue> Values;
 	Values.emplace(Brander::AttributeTypes::IDENTITY, Client->GetID());
@@ -37,7 +37,9 @@ namespace NodeUpdates
 		};
 	}
 			
-	void HandleUpdatesForNode(Clients::ClientObj *Client);
+	void HandleUpdatesForNode(Clients::ClientObj *Client, const bool AllowPatch = true);
+	void HandleUpdateReport(Clients::ClientObj *Client, const bool Succeeded);
+	void ForgetPatches(const char *PlatformString);
 	bool GetNodeBinaryBrandInfo(const void *Buf, const size_t BufSize, VLString *PlatformStringOut, VLString *RevisionOut, VLString *ServerOut);
 }
 #endif //_VL_SERVER_NODEUPDATES_H_
@@ -275,7 +275,7 @@ void Routines::ProcessOnConnectRoutines(Clients::ClientObj *Node)
 
 		if (!IsTarget) continue;
 		
-		Logger::WriteLogLine(Logger::LOGITEM_INFO, VLString("On-connect activation triggered for routine ") + Iter->Name + " targeting node \"" + Node->GetID() + "\".");
+		Logger::WriteLogLine(Logger::LOGITEM_INFO, VLString("On-connect activation triggered for routine ") + Iter->Name + " targeting node \"" + Node->GetID() + "\".", Node->GetID());
 		ExecuteOnConnectRoutine(&*Iter, Node);
 	}
 }
@@ -310,11 +310,11 @@ static void ExecuteScheduledRoutine(Routines::RoutineInfo *Routine)
 		
 		if (!Node)
 		{
-			Logger::WriteLogLine(Logger::LOGITEM_ROUTINEWARNING, VLString("No node with ID \"") + Routine->Targets[Inc] + "\" was found for routine \"" + Routine->Name + "\".");
+			Logger::WriteLogLine(Logger::LOGITEM_ROUTINEWARNING, VLString("No node with ID \"") + Routine->Targets[Inc] + "\" was found for routine \"" + Routine->Name + "\".", Routine->Targets[Inc]);
 			continue;
 		}
 		
-		Logger::WriteLogLine(Logger::LOGITEM_INFO, VLString("Node \"") + Node->GetID() + "\" is a target for routine " + Routine->Name);
+		Logger::WriteLogLine(Logger::LOGITEM_INFO, VLString("Node \"") + Node->GetID() + "\" is a target for routine " + Routine->Name, Node->GetID());
 
 		Conation::ConationStream *NewStream = new Conation::ConationStream(Hdr, nullptr);
 